@@ -0,0 +1,302 @@
+#include "Busy_Poll.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Set once by busy_poll_configure() before the threads that read start, read without a lock after that
+static struct
+{
+    int enabled;
+    BusyPollOptions options;
+    uint64_t start_ns;
+    uint64_t start_cpu_ns;
+    uint64_t reads;
+    uint64_t spun;
+    uint64_t blocked;
+    uint64_t spin_ns;
+} busy = {.options = {.cpu = -1, .worker_cpu = -1}};
+
+static uint64_t busy_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t process_cpu_ns(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+           (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+void busy_poll_options_defaults(BusyPollOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->cpu = -1;
+    options->worker_cpu = -1;
+}
+
+// Parses a CPU number for -cpu and -worker-cpu. Returns -1 if it is not one.
+static int parse_cpu(const char *flag, const char *value)
+{
+    char *end = NULL;
+    long cpu = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        fprintf(stderr, "Invalid CPU for %s: %s\n", flag, value);
+        return -1;
+    }
+    return (int)cpu;
+}
+
+/**
+ * @brief Parses a busy poll flag at argv[*index], moving *index past its value.
+ *
+ * @return 1 if the flag was consumed, 0 if it is not a busy poll flag, -1 on an invalid value.
+ */
+int busy_poll_parse_arg(BusyPollOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-prefer-busy-poll") == 0)
+    {
+        options->prefer = 1;
+        return 1;
+    }
+    if (strcmp(flag, "-busy-poll") != 0 && strcmp(flag, "-spin") != 0 && strcmp(flag, "-cpu") != 0 &&
+        strcmp(flag, "-worker-cpu") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+
+    if (strcmp(flag, "-cpu") == 0)
+    {
+        options->cpu = parse_cpu(flag, value);
+        return options->cpu < 0 ? -1 : 1;
+    }
+    if (strcmp(flag, "-worker-cpu") == 0)
+    {
+        options->worker_cpu = parse_cpu(flag, value);
+        return options->worker_cpu < 0 ? -1 : 1;
+    }
+    int us = atoi(value);
+    if (us < 0 || us > BUSY_POLL_MAX_US)
+    {
+        fprintf(stderr, "%s must be between 0 and %d microseconds: %s\n", flag, BUSY_POLL_MAX_US, value);
+        return -1;
+    }
+    if (strcmp(flag, "-busy-poll") == 0)
+    {
+        options->busy_poll_us = us;
+    }
+    else
+    {
+        options->spin_us = us;
+    }
+    return 1;
+}
+
+void busy_poll_usage(FILE *out)
+{
+    fprintf(out, "Busy poll options (receive side, all off by default):\n");
+    fprintf(out, "  -spin <us>               spin on non-blocking reads this long before a read sleeps\n");
+    fprintf(out, "  -busy-poll <us>          SO_BUSY_POLL: a blocking read polls the device queue this long,\n");
+    fprintf(out, "                           above net.core.busy_read it needs CAP_NET_ADMIN\n");
+    fprintf(out, "  -prefer-busy-poll        SO_PREFER_BUSY_POLL: keep device interrupts off while polled\n");
+    fprintf(out, "  -cpu <n>                 pin the receive threads, buffers are allocated on their NUMA node\n");
+    fprintf(out, "  -worker-cpu <n>          pin the disk writer and the decompressors\n");
+}
+
+/**
+ * @brief Installs the options for the whole process and starts the CPU time accounting.
+ *
+ * Call it before any thread that reads or pins itself starts.
+ *
+ * @return 0 on success, -1 if a CPU to pin to is not one the process may run on.
+ */
+int busy_poll_configure(const BusyPollOptions *options)
+{
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        if (options->cpu >= 0 && !CPU_ISSET(options->cpu, &allowed))
+        {
+            fprintf(stderr, "CPU %d is not available to this process\n", options->cpu);
+            return -1;
+        }
+        if (options->worker_cpu >= 0 && !CPU_ISSET(options->worker_cpu, &allowed))
+        {
+            fprintf(stderr, "CPU %d is not available to this process\n", options->worker_cpu);
+            return -1;
+        }
+    }
+    busy.options = *options;
+    busy.enabled = options->busy_poll_us > 0 || options->prefer || options->spin_us > 0 || options->cpu >= 0 ||
+                   options->worker_cpu >= 0;
+    busy.start_ns = busy_now_ns();
+    busy.start_cpu_ns = process_cpu_ns();
+    return 0;
+}
+
+int busy_poll_enabled(void)
+{
+    return busy.enabled;
+}
+
+/**
+ * @brief Sets SO_BUSY_POLL and SO_PREFER_BUSY_POLL on a socket. TCP sockets accepted from a
+ * listening socket inherit them.
+ *
+ * @return 0 on success, -1 on an error.
+ */
+int busy_poll_apply(int sockfd)
+{
+    int on = 1;
+
+    if (busy.options.busy_poll_us > 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy.options.busy_poll_us, sizeof(busy.options.busy_poll_us)) < 0)
+    {
+        perror("setsockopt(SO_BUSY_POLL)");
+        return -1;
+    }
+    if (busy.options.prefer && setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0)
+    {
+        perror("setsockopt(SO_PREFER_BUSY_POLL)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pins the calling thread to the CPU of its role.
+ *
+ * Memory a thread touches first is placed on the NUMA node of the CPU it runs on, so a thread
+ * that allocates its buffers after this keeps them local without a NUMA library.
+ *
+ * @return 0 if the thread was pinned or its role has no CPU, -1 if pinning failed.
+ */
+int busy_poll_enter(BusyPollRole role)
+{
+    int cpu = role == BUSY_POLL_RECEIVE ? busy.options.cpu : busy.options.worker_cpu;
+    cpu_set_t set;
+
+    if (cpu < 0)
+    {
+        return 0;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Reads like `reader`, spinning on non-blocking reads for the configured budget before
+ * it makes the blocking read.
+ *
+ * A spinning read skips the wakeup of a sleeping thread and keeps its CPU out of idle states,
+ * at the price of a core that stays busy while nothing arrives. A MSG_WAITALL read spins on a
+ * peek, a partial non-blocking read would end it early. The blocking read keeps its socket
+ * timeout, MSG_DONTWAIT reads are passed through.
+ */
+ssize_t busy_poll_recvmsg(BusyPollReader reader, int sockfd, struct msghdr *msg, int flags)
+{
+    ssize_t bytes;
+
+    if (busy.options.spin_us > 0 && !(flags & MSG_DONTWAIT))
+    {
+        int peek = (flags & MSG_WAITALL) != 0;
+        socklen_t name_capacity = msg->msg_namelen;
+        size_t control_capacity = msg->msg_controllen;
+        struct msghdr peek_msg;
+        uint64_t start = busy_now_ns();
+        uint64_t deadline = start + (uint64_t)busy.options.spin_us * 1000ULL;
+        uint64_t now = start;
+        int found = 0;
+
+        memset(&peek_msg, 0, sizeof(peek_msg));
+        peek_msg.msg_iov = msg->msg_iov;
+        peek_msg.msg_iovlen = msg->msg_iovlen;
+        do
+        {
+            if (peek)
+            {
+                bytes = reader(sockfd, &peek_msg, (flags & ~MSG_WAITALL) | MSG_PEEK | MSG_DONTWAIT);
+            }
+            else
+            {
+                msg->msg_namelen = name_capacity;
+                msg->msg_controllen = control_capacity;
+                bytes = reader(sockfd, msg, flags | MSG_DONTWAIT);
+            }
+            found = bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            now = busy_now_ns();
+        } while (!found && now < deadline);
+
+        __atomic_fetch_add(&busy.spin_ns, now - start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(found ? &busy.spun : &busy.blocked, 1, __ATOMIC_RELAXED);
+        if (found && (!peek || bytes <= 0))
+        {
+            if (bytes > 0)
+            {
+                __atomic_fetch_add(&busy.reads, 1, __ATOMIC_RELAXED);
+            }
+            return bytes;
+        }
+        msg->msg_namelen = name_capacity;
+        msg->msg_controllen = control_capacity;
+    }
+    bytes = reader(sockfd, msg, flags);
+    if (bytes > 0 && busy.enabled)
+    {
+        __atomic_fetch_add(&busy.reads, 1, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+void busy_poll_get_stats(BusyPollStats *stats)
+{
+    stats->reads = __atomic_load_n(&busy.reads, __ATOMIC_RELAXED);
+    stats->spun = __atomic_load_n(&busy.spun, __ATOMIC_RELAXED);
+    stats->blocked = __atomic_load_n(&busy.blocked, __ATOMIC_RELAXED);
+    stats->spin_ns = __atomic_load_n(&busy.spin_ns, __ATOMIC_RELAXED);
+    stats->cpu_ns = process_cpu_ns() - busy.start_cpu_ns;
+    stats->wall_ns = busy_now_ns() - busy.start_ns;
+}
+
+/**
+ * @brief Prints what the reads did and what they cost: the CPU time of the process next to the
+ * wall time, so a lower latency can be weighed against the cores it burns.
+ */
+void busy_poll_print(FILE *out)
+{
+    BusyPollStats stats;
+
+    busy_poll_get_stats(&stats);
+    if (busy.enabled)
+    {
+        fprintf(out, "- Busy poll: Spin=%dus; SO_BUSY_POLL=%dus%s; CPU=%d; Worker CPU=%d\n", busy.options.spin_us,
+                busy.options.busy_poll_us, busy.options.prefer ? " (preferred)" : "", busy.options.cpu,
+                busy.options.worker_cpu);
+        fprintf(out, "- Busy poll reads: Reads=%llu; Found spinning=%llu; Blocked=%llu; Spinning=%.2fms\n",
+                (unsigned long long)stats.reads, (unsigned long long)stats.spun, (unsigned long long)stats.blocked,
+                stats.spin_ns / 1e6);
+    }
+    fprintf(out, "- CPU cost: %.2fms over %.2fms (%.1f%% of a core)\n", stats.cpu_ns / 1e6, stats.wall_ns / 1e6,
+            stats.wall_ns > 0 ? 100.0 * stats.cpu_ns / stats.wall_ns : 0.0);
+}
@@ -0,0 +1,56 @@
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Longest spin a receive may take before it blocks, and the longest SO_BUSY_POLL
+#define BUSY_POLL_MAX_US 1000000
+
+// The threads a receiver pins
+typedef enum
+{
+    BUSY_POLL_RECEIVE,    // reads the socket: the main thread, or the engine's RX thread
+    BUSY_POLL_WORKER      // works on what was read: the disk writer and the decompressors
+} BusyPollRole;
+
+// Receiver side: how a read waits for data and where its threads run. Everything is off by default.
+typedef struct
+{
+    int busy_poll_us;     // SO_BUSY_POLL: a blocking read polls the device queue this long before it sleeps
+    int prefer;           // SO_PREFER_BUSY_POLL: keep the device interrupts masked while the socket is busy polled
+    int spin_us;          // spin on non-blocking reads this long before a read blocks, 0 blocks at once
+    int cpu;              // CPU of the receive threads, -1 leaves them to the scheduler
+    int worker_cpu;       // CPU of the worker threads, -1 leaves them to the scheduler
+} BusyPollOptions;
+
+// What the reads did since busy_poll_configure()
+typedef struct
+{
+    uint64_t reads;       // reads that returned data
+    uint64_t spun;        // of those, reads that found their data while spinning
+    uint64_t blocked;     // reads that spun out their budget and blocked
+    uint64_t spin_ns;     // time spent spinning
+    uint64_t cpu_ns;      // CPU time of the process, user and system
+    uint64_t wall_ns;
+} BusyPollStats;
+
+/**
+ * How a busy polled read reaches the socket, recvmsg() itself or a shim with the same contract.
+ */
+typedef ssize_t (*BusyPollReader)(int sockfd, struct msghdr *msg, int flags);
+
+// Function declarations
+void busy_poll_options_defaults(BusyPollOptions *options);
+int busy_poll_parse_arg(BusyPollOptions *options, int argc, char *argv[], int *index);
+void busy_poll_usage(FILE *out);
+int busy_poll_configure(const BusyPollOptions *options);
+int busy_poll_enabled(void);
+int busy_poll_apply(int sockfd);
+int busy_poll_enter(BusyPollRole role);
+ssize_t busy_poll_recvmsg(BusyPollReader reader, int sockfd, struct msghdr *msg, int flags);
+void busy_poll_get_stats(BusyPollStats *stats);
+void busy_poll_print(FILE *out);
+
+#endif
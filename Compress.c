@@ -0,0 +1,676 @@
+#include "Compress.h"
+#include "Run_Stats.h"
+#include "Transfer.h"
+#include "Busy_Poll.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Matches are found through a table of the last position of every hashed 4-byte sequence
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// No match starts in the last bytes of a chunk, the tail is always literals
+#define LZ_END_LITERALS 12
+// Order-0 collision entropy above this many bits per byte, 2^7.5 equally likely values, is not worth compressing
+#define PROBE_ALPHABET 181
+// A frame that saves less than 1/16 of its chunk is sent raw, decompressing it would cost more than it saves
+#define STORE_MARGIN 16
+
+static const char *codec_names[] = {"none", "lz"};
+
+void compress_options_defaults(CompressOptions *options)
+{
+    options->codec = COMPRESS_NONE;
+    options->chunk_size = COMPRESS_DEFAULT_CHUNK;
+    options->threads = 0;
+}
+
+/**
+ * @brief Parses one compression option.
+ *
+ * Recognized flags: -compress <none|lz>, -compress-chunk <bytes>, -decompress-threads <n>.
+ *
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a compression flag, -1 on error.
+ */
+int compress_parse_arg(CompressOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-compress") != 0 && strcmp(flag, "-compress-chunk") != 0 && strcmp(flag, "-decompress-threads") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+
+    if (strcmp(flag, "-compress-chunk") == 0)
+    {
+        long long size = transfer_parse_size(value);
+        if (size < 1024 || size > COMPRESS_MAX_CHUNK)
+        {
+            fprintf(stderr, "Compression chunk must be between 1K and %dM: %s\n", COMPRESS_MAX_CHUNK >> 20, value);
+            return -1;
+        }
+        options->chunk_size = (size_t)size;
+        return 1;
+    }
+    if (strcmp(flag, "-decompress-threads") == 0)
+    {
+        options->threads = atoi(value);
+        if (options->threads < 1 || options->threads > COMPRESS_MAX_THREADS)
+        {
+            fprintf(stderr, "Decompression threads must be between 1 and %d\n", COMPRESS_MAX_THREADS);
+            return -1;
+        }
+        return 1;
+    }
+    for (int i = 0; i < (int)(sizeof(codec_names) / sizeof(codec_names[0])); i++)
+    {
+        if (strcmp(value, codec_names[i]) == 0)
+        {
+            options->codec = (CompressCodec)i;
+            return 1;
+        }
+    }
+    fprintf(stderr, "Unknown codec: %s\n", value);
+    return -1;
+}
+
+void compress_usage(FILE *out)
+{
+    fprintf(out, "Compression options:\n");
+    fprintf(out, "  -compress <none|lz>      compress every chunk, chunks that look incompressible are sent raw (default none)\n");
+    fprintf(out, "  -compress-chunk <bytes>  bytes per compressed frame (default %dK)\n", COMPRESS_DEFAULT_CHUNK >> 10);
+    fprintf(out, "  -decompress-threads <n>  receiver threads decompressing frames (default: online CPUs)\n");
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(value >> (24 - 8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length that did not fit in its nibble as a run of 255s and a remainder.
+static uint8_t *lz_put_length(uint8_t *op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/**
+ * @brief One sequence: a token, the literals, and unless it is the last one, a match.
+ * @return The end of the output, NULL if it would not fit before `end`.
+ */
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, size_t literal_length,
+                                size_t offset, size_t match_length)
+{
+    if ((size_t)(end - op) < 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1)
+    {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+    {
+        op = lz_put_length(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0)
+    {
+        return op;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_length -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_length < 15 ? match_length : 15);
+    if (match_length >= 15)
+    {
+        op = lz_put_length(op, match_length - 15);
+    }
+    return op;
+}
+
+/**
+ * @brief Greedy LZ77 over a 64K window, in the LZ4 block format.
+ *
+ * A miss advances faster the longer the current run of literals, so incompressible
+ * stretches cost little.
+ *
+ * @return The compressed length, 0 if it would exceed `capacity`.
+ */
+static size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *anchor = src;
+    const uint8_t *ip = src;
+    const uint8_t *end = src + length;
+    const uint8_t *limit = length > LZ_END_LITERALS ? end - LZ_END_LITERALS : src;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + capacity;
+
+    memset(table, 0, sizeof(table));
+    while (ip < limit)
+    {
+        uint32_t sequence = read32(ip);
+        uint32_t h = lz_hash(sequence);
+        const uint8_t *candidate = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET || read32(candidate) != sequence)
+        {
+            size_t step = 1 + ((size_t)(ip - anchor) >> 6);
+            if (step >= (size_t)(limit - ip))
+            {
+                break;
+            }
+            ip += step;
+            continue;
+        }
+        size_t match_length = LZ_MIN_MATCH;
+        while (ip + match_length < limit && candidate[match_length] == ip[match_length])
+        {
+            match_length++;
+        }
+        op = lz_put_sequence(op, op_end, anchor, (size_t)(ip - anchor), (size_t)(ip - candidate), match_length);
+        if (op == NULL)
+        {
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+        if (ip < limit)
+        {
+            table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+    op = lz_put_sequence(op, op_end, anchor, (size_t)(end - anchor), 0, 0);
+    return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+// Reads the rest of a length whose nibble was 15.
+static int lz_get_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+    uint8_t byte;
+    do
+    {
+        if (*ip >= end)
+        {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * @brief Decodes an LZ block, every length and offset is checked against both buffers.
+ * @return The decompressed length, -1 if the block is malformed or does not fit in `capacity`.
+ */
+static long lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + length;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + capacity;
+
+    while (ip < end)
+    {
+        uint8_t token = *ip++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && lz_get_length(&ip, end, &literal_length) < 0)
+        {
+            return -1;
+        }
+        if (literal_length > (size_t)(end - ip) || literal_length > (size_t)(op_end - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == end)
+        {
+            break;
+        }
+
+        if (end - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && lz_get_length(&ip, end, &match_length) < 0)
+        {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_length > (size_t)(op_end - op))
+        {
+            return -1;
+        }
+        const uint8_t *match = op - offset;
+        if (offset >= match_length)
+        {
+            memcpy(op, match, match_length);
+            op += match_length;
+        }
+        else
+        {
+            // Overlapping copy, a short offset repeats the last bytes
+            for (size_t i = 0; i < match_length; i++)
+            {
+                *op++ = *match++;
+            }
+        }
+    }
+    return (long)(op - dst);
+}
+
+/**
+ * @brief Entropy probe: whether a chunk looks compressible from a sample of its bytes.
+ *
+ * Up to COMPRESS_PROBE_BYTES bytes, taken from 8 places, go into a byte histogram. The
+ * effective alphabet n^2 / sum(count^2) is 2 to the collision entropy of the sample,
+ * random bytes come close to 256.
+ */
+static int compress_probe(const uint8_t *chunk, size_t length)
+{
+    uint32_t counts[256] = {0};
+    size_t window = COMPRESS_PROBE_BYTES / 8;
+    uint64_t sampled = 0;
+    uint64_t squares = 0;
+
+    for (int w = 0; w < 8; w++)
+    {
+        size_t start = length <= COMPRESS_PROBE_BYTES ? w * length / 8 : w * (length - window) / 7;
+        size_t stop = length <= COMPRESS_PROBE_BYTES ? (w + 1) * length / 8 : start + window;
+        for (size_t i = start; i < stop; i++)
+        {
+            counts[chunk[i]]++;
+        }
+        sampled += stop - start;
+    }
+    for (int b = 0; b < 256; b++)
+    {
+        squares += (uint64_t)counts[b] * counts[b];
+    }
+    return squares * PROBE_ALPHABET >= sampled * sampled;
+}
+
+// Worst case of compress_frame(): a stored chunk, or LZ literals with their length bytes.
+size_t compress_frame_bound(size_t length)
+{
+    return COMPRESS_FRAME_HEADER + length + length / 255 + 16;
+}
+
+static void put_frame_header(char *out, CompressCodec codec, size_t original, size_t stored)
+{
+    unsigned char *header = (unsigned char *)out;
+    header[0] = COMPRESS_MAGIC;
+    header[1] = (unsigned char)codec;
+    header[2] = 0;
+    header[3] = 0;
+    put_u32(header + 4, (uint32_t)original);
+    put_u32(header + 8, (uint32_t)stored);
+}
+
+/**
+ * @brief Turns a chunk into a frame: compressed if the probe and the result say it pays, raw otherwise.
+ *
+ * @param out At least compress_frame_bound(length) bytes.
+ * @return The frame length, header included.
+ */
+size_t compress_frame(const CompressOptions *options, const char *chunk, size_t length, char *out, CompressStats *stats)
+{
+    uint64_t start_ns = thread_cpu_ns();
+    size_t stored = 0;
+    CompressCodec codec = COMPRESS_NONE;
+
+    if (options->codec == COMPRESS_LZ && compress_probe((const uint8_t *)chunk, length))
+    {
+        stored = lz_compress((const uint8_t *)chunk, length, (uint8_t *)out + COMPRESS_FRAME_HEADER, length - length / STORE_MARGIN);
+        codec = stored > 0 ? COMPRESS_LZ : COMPRESS_NONE;
+    }
+    if (codec == COMPRESS_NONE)
+    {
+        memcpy(out + COMPRESS_FRAME_HEADER, chunk, length);
+        stored = length;
+        stats->stored++;
+    }
+    put_frame_header(out, codec, length, stored);
+    stats->frames++;
+    stats->original_bytes += length;
+    stats->wire_bytes += COMPRESS_FRAME_HEADER + stored;
+    stats->cpu_ns += thread_cpu_ns() - start_ns;
+    return COMPRESS_FRAME_HEADER + stored;
+}
+
+/**
+ * @brief Parses a frame header.
+ * @return 0 on success, -1 if the bytes are not a frame header this receiver accepts.
+ */
+int compress_parse_frame(const char *in, size_t length, CompressFrame *frame)
+{
+    const unsigned char *header = (const unsigned char *)in;
+    if (length < COMPRESS_FRAME_HEADER || header[0] != COMPRESS_MAGIC || header[1] > COMPRESS_LZ)
+    {
+        return -1;
+    }
+    frame->codec = (CompressCodec)header[1];
+    frame->original = get_u32(header + 4);
+    frame->stored = get_u32(header + 8);
+    if (frame->original > COMPRESS_MAX_CHUNK || frame->stored > compress_frame_bound(frame->original) ||
+        (frame->codec == COMPRESS_NONE && frame->stored != frame->original))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Makes room for a whole frame in a job's input, the bytes already received are kept.
+ * @return 0 on success, -1 if memory could not be obtained.
+ */
+int compress_job_reserve(CompressJob *job, size_t length)
+{
+    if (length <= job->input_capacity)
+    {
+        return 0;
+    }
+    char *input = (char *)realloc(job->input, length);
+    if (input == NULL)
+    {
+        perror("Failed to allocate a frame buffer");
+        return -1;
+    }
+    job->input = input;
+    job->input_capacity = length;
+    return 0;
+}
+
+// Decodes one frame into its job, on a worker thread.
+static int decompress_job(CompressJob *job)
+{
+    CompressFrame frame;
+    if (compress_parse_frame(job->input, job->input_length, &frame) < 0 ||
+        job->input_length != COMPRESS_FRAME_HEADER + (size_t)frame.stored)
+    {
+        return -1;
+    }
+    if (frame.codec == COMPRESS_NONE)
+    {
+        job->result = job->input + COMPRESS_FRAME_HEADER;
+        job->result_length = frame.stored;
+        return 0;
+    }
+    if (frame.original > job->output_capacity)
+    {
+        free(job->output);
+        job->output = (char *)malloc(frame.original);
+        job->output_capacity = job->output == NULL ? 0 : frame.original;
+        if (job->output == NULL)
+        {
+            perror("Failed to allocate a chunk buffer");
+            return -1;
+        }
+    }
+    long length = lz_decompress((const uint8_t *)job->input + COMPRESS_FRAME_HEADER, frame.stored,
+                                (uint8_t *)job->output, frame.original);
+    if (length != (long)frame.original)
+    {
+        return -1;
+    }
+    job->result = job->output;
+    job->result_length = frame.original;
+    return 0;
+}
+
+static void *decompressor_thread(void *arg)
+{
+    Decompressor *decompressor = (Decompressor *)arg;
+
+    busy_poll_enter(BUSY_POLL_WORKER);
+    pthread_mutex_lock(&decompressor->lock);
+    while (1)
+    {
+        while (!decompressor->stop && decompressor->taken == decompressor->submitted)
+        {
+            pthread_cond_wait(&decompressor->ready, &decompressor->lock);
+        }
+        if (decompressor->taken == decompressor->submitted)
+        {
+            break;
+        }
+        CompressJob *job = &decompressor->jobs[decompressor->taken++ % decompressor->job_count];
+        pthread_mutex_unlock(&decompressor->lock);
+
+        uint64_t start_ns = thread_cpu_ns();
+        int result = decompress_job(job);
+        uint64_t cpu_ns = thread_cpu_ns() - start_ns;
+
+        pthread_mutex_lock(&decompressor->lock);
+        if (result < 0)
+        {
+            fprintf(stderr, "Invalid compressed frame\n");
+            decompressor->error = 1;
+            job->result_length = 0;
+        }
+        decompressor->stats.cpu_ns += cpu_ns;
+        job->done = 1;
+        pthread_cond_broadcast(&decompressor->finished);
+    }
+    pthread_mutex_unlock(&decompressor->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the decompression workers.
+ *
+ * The network thread acquires a job, fills it with one whole frame and submits it. Workers
+ * decode frames in any order, the sink receives the chunks in frame order, always on the
+ * network thread, from decompressor_acquire() and decompressor_flush().
+ *
+ * @return 0 on success, -1 if no worker could be started.
+ */
+int decompressor_start(Decompressor *decompressor, const CompressOptions *options, DecompressSink sink, void *context)
+{
+    int threads = options->threads;
+
+    memset(decompressor, 0, sizeof(*decompressor));
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : (cpus > COMPRESS_MAX_THREADS ? COMPRESS_MAX_THREADS : (int)cpus);
+    }
+    decompressor->job_count = 2 * threads;
+    decompressor->sink = sink;
+    decompressor->context = context;
+    pthread_mutex_init(&decompressor->lock, NULL);
+    pthread_cond_init(&decompressor->ready, NULL);
+    pthread_cond_init(&decompressor->finished, NULL);
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&decompressor->ids[i], NULL, decompressor_thread, decompressor) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        decompressor->threads++;
+    }
+    if (decompressor->threads == 0)
+    {
+        pthread_mutex_destroy(&decompressor->lock);
+        pthread_cond_destroy(&decompressor->ready);
+        pthread_cond_destroy(&decompressor->finished);
+        return -1;
+    }
+    return 0;
+}
+
+// Hands the oldest frame to the sink, waiting for its worker. Called and returns with the lock held.
+static int decompressor_deliver(Decompressor *decompressor)
+{
+    CompressJob *job = &decompressor->jobs[decompressor->delivered % decompressor->job_count];
+    int result = 0;
+
+    while (!job->done)
+    {
+        pthread_cond_wait(&decompressor->finished, &decompressor->lock);
+    }
+    pthread_mutex_unlock(&decompressor->lock);
+    if (decompressor->error || decompressor->sink(decompressor->context, job->result, job->result_length) < 0)
+    {
+        result = -1;
+    }
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->stats.original_bytes += job->result_length;
+    job->done = 0;
+    decompressor->delivered++;
+    return result;
+}
+
+/**
+ * @brief The job for the next frame, delivering older frames while all jobs are busy.
+ * @return The job, NULL if a frame failed to decode or the sink failed.
+ */
+CompressJob *decompressor_acquire(Decompressor *decompressor)
+{
+    CompressJob *job = NULL;
+
+    pthread_mutex_lock(&decompressor->lock);
+    while (!decompressor->error && decompressor->submitted - decompressor->delivered == (uint64_t)decompressor->job_count)
+    {
+        if (decompressor_deliver(decompressor) < 0)
+        {
+            decompressor->error = 1;
+        }
+    }
+    if (!decompressor->error)
+    {
+        job = &decompressor->jobs[decompressor->submitted % decompressor->job_count];
+        job->input_length = 0;
+    }
+    pthread_mutex_unlock(&decompressor->lock);
+    return job;
+}
+
+/**
+ * @brief Queues the frame in the acquired job, job->input_length bytes of job->input.
+ * @return 0 on success, -1 if the frame header is invalid.
+ */
+int decompressor_submit(Decompressor *decompressor, CompressJob *job)
+{
+    CompressFrame frame;
+
+    if (compress_parse_frame(job->input, job->input_length, &frame) < 0)
+    {
+        fprintf(stderr, "Invalid compressed frame header\n");
+        return -1;
+    }
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->stats.frames++;
+    decompressor->stats.stored += frame.codec == COMPRESS_NONE;
+    decompressor->stats.wire_bytes += job->input_length;
+    decompressor->submitted++;
+    pthread_cond_signal(&decompressor->ready);
+    pthread_mutex_unlock(&decompressor->lock);
+    return 0;
+}
+
+/**
+ * @brief Delivers every submitted frame, e.g. at the end of a run.
+ * @return 0 on success, -1 if a frame failed to decode or the sink failed.
+ */
+int decompressor_flush(Decompressor *decompressor)
+{
+    pthread_mutex_lock(&decompressor->lock);
+    while (!decompressor->error && decompressor->delivered < decompressor->submitted)
+    {
+        if (decompressor_deliver(decompressor) < 0)
+        {
+            decompressor->error = 1;
+        }
+    }
+    int result = decompressor->error ? -1 : 0;
+    pthread_mutex_unlock(&decompressor->lock);
+    return result;
+}
+
+/**
+ * @brief Delivers what is left, stops the workers and frees the jobs.
+ * @return 0 if every frame was decoded and delivered, -1 otherwise.
+ */
+int decompressor_stop(Decompressor *decompressor, CompressStats *stats)
+{
+    int result = decompressor_flush(decompressor);
+
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->stop = 1;
+    pthread_cond_broadcast(&decompressor->ready);
+    pthread_mutex_unlock(&decompressor->lock);
+    for (int i = 0; i < decompressor->threads; i++)
+    {
+        pthread_join(decompressor->ids[i], NULL);
+    }
+    for (int i = 0; i < decompressor->job_count; i++)
+    {
+        free(decompressor->jobs[i].input);
+        free(decompressor->jobs[i].output);
+    }
+    if (stats != NULL)
+    {
+        *stats = decompressor->stats;
+    }
+    pthread_mutex_destroy(&decompressor->lock);
+    pthread_cond_destroy(&decompressor->ready);
+    pthread_cond_destroy(&decompressor->finished);
+    return result;
+}
+
+void compress_print(const CompressStats *stats, const char *name, FILE *out)
+{
+    double ratio = stats->wire_bytes > 0 ? (double)stats->original_bytes / (double)stats->wire_bytes : 0.0;
+    fprintf(out, "- %s: Frames=%llu (stored raw %llu); Bytes=%llu -> %llu on the wire (ratio %.2fx); CPU=%.2fms (%.2fMB/s)\n",
+            name, (unsigned long long)stats->frames, (unsigned long long)stats->stored,
+            (unsigned long long)stats->original_bytes, (unsigned long long)stats->wire_bytes, ratio,
+            stats_ns_to_ms(stats->cpu_ns), stats_speed_mb(stats->original_bytes, stats->cpu_ns));
+}
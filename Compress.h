@@ -0,0 +1,101 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// Every frame starts with its codec, original size and stored size, in network byte order
+#define COMPRESS_FRAME_HEADER 12
+#define COMPRESS_MAGIC 0x5A
+#define COMPRESS_DEFAULT_CHUNK (256 * 1024)
+// Largest chunk a frame may carry, receivers reject frames announcing more
+#define COMPRESS_MAX_CHUNK (16 * 1024 * 1024)
+#define COMPRESS_MAX_THREADS 16
+// Frames a receiver may hold between the network and the disk, twice the workers
+#define COMPRESS_MAX_JOBS (2 * COMPRESS_MAX_THREADS)
+// Bytes of a chunk the entropy probe looks at
+#define COMPRESS_PROBE_BYTES 4096
+
+typedef enum
+{
+    COMPRESS_NONE,        // chunks are sent as they are, no frames
+    COMPRESS_LZ           // LZ77 with an LZ4 style block format, no entropy coding
+} CompressCodec;
+
+typedef struct
+{
+    CompressCodec codec;  // sender: the codec tried on every chunk
+    size_t chunk_size;    // sender: bytes compressed into one frame
+    int threads;          // receiver: decompression workers, 0 for one per online CPU
+} CompressOptions;
+
+typedef struct
+{
+    uint64_t frames;
+    uint64_t stored;      // frames sent raw: the probe found them incompressible or they did not shrink
+    uint64_t original_bytes;
+    uint64_t wire_bytes;  // frame headers included
+    uint64_t cpu_ns;      // thread CPU time spent compressing (sender) or decompressing (receiver)
+} CompressStats;
+
+// The fields of a frame header
+typedef struct
+{
+    CompressCodec codec;
+    uint32_t original;
+    uint32_t stored;      // payload bytes after the header
+} CompressFrame;
+
+// One frame on its way from the network thread through a worker back to the network thread
+typedef struct
+{
+    char *input;          // the whole frame, header included
+    size_t input_capacity;
+    size_t input_length;
+    char *output;
+    size_t output_capacity;
+    const char *result;   // the decompressed chunk, in `output` or, for a stored frame, in `input`
+    size_t result_length;
+    int done;
+} CompressJob;
+
+// Called on the network thread with every chunk, in frame order
+typedef int (*DecompressSink)(void *context, const char *data, size_t length);
+
+// Decompresses frames on worker threads and hands the chunks back in order
+typedef struct
+{
+    CompressJob jobs[COMPRESS_MAX_JOBS];
+    int job_count;
+    int threads;
+    pthread_t ids[COMPRESS_MAX_THREADS];
+    uint64_t submitted;   // frames handed to the workers
+    uint64_t taken;       // frames a worker started on
+    uint64_t delivered;   // frames handed to the sink
+    int error;
+    int stop;
+    DecompressSink sink;
+    void *context;
+    CompressStats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     // a frame was submitted or the pipeline stops
+    pthread_cond_t finished;  // a worker finished a frame
+} Decompressor;
+
+// Function declarations
+void compress_options_defaults(CompressOptions *options);
+int compress_parse_arg(CompressOptions *options, int argc, char *argv[], int *index);
+void compress_usage(FILE *out);
+size_t compress_frame_bound(size_t length);
+size_t compress_frame(const CompressOptions *options, const char *chunk, size_t length, char *out, CompressStats *stats);
+int compress_parse_frame(const char *in, size_t length, CompressFrame *frame);
+int compress_job_reserve(CompressJob *job, size_t length);
+int decompressor_start(Decompressor *decompressor, const CompressOptions *options, DecompressSink sink, void *context);
+CompressJob *decompressor_acquire(Decompressor *decompressor);
+int decompressor_submit(Decompressor *decompressor, CompressJob *job);
+int decompressor_flush(Decompressor *decompressor);
+int decompressor_stop(Decompressor *decompressor, CompressStats *stats);
+void compress_print(const CompressStats *stats, const char *name, FILE *out);
+
+#endif
@@ -0,0 +1,399 @@
+#include "Disk_Writer.h"
+#include "Run_Stats.h"
+#include "Busy_Poll.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *sync_names[] = {"none", "run"};
+
+void disk_writer_options_defaults(DiskWriterOptions *options)
+{
+    options->block_size = DISK_WRITER_DEFAULT_BLOCK;
+    options->blocks = DISK_WRITER_DEFAULT_BLOCKS;
+    options->sync = DISK_SYNC_NONE;
+    options->sync_bytes = 0;
+}
+
+/**
+ * @brief Parses one writer option.
+ *
+ * Recognized flags: -write-block <bytes>, -write-blocks <n>, -sync <none|run|bytes>.
+ *
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a writer flag, -1 on error.
+ */
+int disk_writer_parse_arg(DiskWriterOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-write-block") != 0 && strcmp(flag, "-write-blocks") != 0 && strcmp(flag, "-sync") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+
+    if (strcmp(flag, "-write-block") == 0)
+    {
+        long long size = transfer_parse_size(value);
+        if (size < DISK_WRITER_ALIGN || size > 256LL * 1024 * 1024)
+        {
+            fprintf(stderr, "Write block must be between 4K and 256M: %s\n", value);
+            return -1;
+        }
+        options->block_size = (size_t)size;
+        return 1;
+    }
+    if (strcmp(flag, "-write-blocks") == 0)
+    {
+        options->blocks = atoi(value);
+        if (options->blocks < 2 || options->blocks > DISK_WRITER_MAX_BLOCKS)
+        {
+            fprintf(stderr, "Write blocks must be between 2 and %d\n", DISK_WRITER_MAX_BLOCKS);
+            return -1;
+        }
+        return 1;
+    }
+    for (int i = 0; i < (int)(sizeof(sync_names) / sizeof(sync_names[0])); i++)
+    {
+        if (strcmp(value, sync_names[i]) == 0)
+        {
+            options->sync = (DiskSyncPolicy)i;
+            return 1;
+        }
+    }
+    long long bytes = transfer_parse_size(value);
+    if (bytes <= 0)
+    {
+        fprintf(stderr, "Unknown sync policy: %s\n", value);
+        return -1;
+    }
+    options->sync = DISK_SYNC_BYTES;
+    options->sync_bytes = (uint64_t)bytes;
+    return 1;
+}
+
+void disk_writer_usage(FILE *out)
+{
+    fprintf(out, "Writer options:\n");
+    fprintf(out, "  -write-block <bytes>     bytes per disk write (default 1M)\n");
+    fprintf(out, "  -write-blocks <n>        blocks the network may run ahead of the disk (default %d)\n",
+            DISK_WRITER_DEFAULT_BLOCKS);
+    fprintf(out, "  -sync <policy>           none (default), run (fdatasync after every run) or a size such as 64M\n");
+    fprintf(out, "                           (fdatasync every that many bytes and after every run)\n");
+}
+
+static int queue_push(DiskQueue *queue, DiskBlock *block)
+{
+    uint32_t tail = queue->tail;
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head == DISK_WRITER_MAX_BLOCKS)
+    {
+        return -1;
+    }
+    queue->slots[tail % DISK_WRITER_MAX_BLOCKS] = block;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static DiskBlock *queue_pop(DiskQueue *queue)
+{
+    uint32_t head = queue->head;
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+        return NULL;
+    }
+    DiskBlock *block = queue->slots[head % DISK_WRITER_MAX_BLOCKS];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return block;
+}
+
+static int queue_depth(DiskQueue *queue)
+{
+    return (int)(__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE));
+}
+
+// Waiting side of both queues: yield while the other thread is likely to answer soon, then sleep briefly.
+static void backoff(unsigned *spins)
+{
+    struct timespec pause = {0, 50000};
+
+    if (++(*spins) < 64)
+    {
+        sched_yield();
+    }
+    else
+    {
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void writer_sync(DiskWriter *writer)
+{
+    uint64_t start = stats_now_ns();
+    if (fdatasync(writer->sink->fd) < 0)
+    {
+        // /dev/null and pipes cannot be synced, that is not an error
+        if (errno != EINVAL)
+        {
+            perror("fdatasync");
+            __atomic_store_n(&writer->error, 1, __ATOMIC_RELAXED);
+        }
+    }
+    writer->stats.sync_ns += stats_now_ns() - start;
+    writer->stats.syncs++;
+    writer->since_sync = 0;
+}
+
+// Consumer: writes blocks in submission order and hands them back to the network thread.
+static void *disk_writer_thread(void *arg)
+{
+    DiskWriter *writer = (DiskWriter *)arg;
+    unsigned spins = 0;
+
+    busy_poll_enter(BUSY_POLL_WORKER);
+
+    while (1)
+    {
+        DiskBlock *block = queue_pop(&writer->full);
+        if (block == NULL)
+        {
+            if (__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        if (block->seek)
+        {
+            writer->sink->offset = block->offset;
+        }
+
+        // After an error the blocks are still recycled so the network side never blocks forever
+        if (block->length > 0 && !__atomic_load_n(&writer->error, __ATOMIC_RELAXED))
+        {
+            uint64_t start = stats_now_ns();
+            if (transfer_sink_write(writer->sink, block->data, block->length) < 0)
+            {
+                __atomic_store_n(&writer->error, 1, __ATOMIC_RELAXED);
+            }
+            writer->stats.write_ns += stats_now_ns() - start;
+            writer->stats.blocks_written++;
+            writer->stats.bytes_written += block->length;
+            writer->since_sync += block->length;
+        }
+        if (writer->options.sync == DISK_SYNC_BYTES && writer->since_sync >= writer->options.sync_bytes)
+        {
+            writer_sync(writer);
+        }
+        if (block->sync && writer->options.sync != DISK_SYNC_NONE)
+        {
+            writer_sync(writer);
+        }
+
+        block->length = 0;
+        block->sync = 0;
+        block->seek = 0;
+        queue_push(&writer->free, block);
+        __atomic_add_fetch(&writer->completed, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocates the block pool and starts the writer thread.
+ * @return 0 on success, -1 if memory or the thread could not be obtained.
+ */
+int disk_writer_start(DiskWriter *writer, TransferSink *sink, const DiskWriterOptions *options)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->options = *options;
+    writer->options.block_size = (options->block_size + DISK_WRITER_ALIGN - 1) & ~(size_t)(DISK_WRITER_ALIGN - 1);
+    writer->sink = sink;
+    writer->stats.blocks = options->blocks;
+
+    for (int i = 0; i < options->blocks; i++)
+    {
+        void *data = NULL;
+        if (posix_memalign(&data, DISK_WRITER_ALIGN, writer->options.block_size) != 0)
+        {
+            fprintf(stderr, "Failed to allocate the write blocks\n");
+            for (int j = 0; j < i; j++)
+            {
+                free(writer->pool[j].data);
+            }
+            return -1;
+        }
+        writer->pool[i].data = (char *)data;
+        queue_push(&writer->free, &writer->pool[i]);
+    }
+    if (pthread_create(&writer->thread, NULL, disk_writer_thread, writer) != 0)
+    {
+        perror("pthread_create");
+        for (int i = 0; i < options->blocks; i++)
+        {
+            free(writer->pool[i].data);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Starts a run at offset 0 of the sink, call it between disk_writer_finish_run and the first reserve.
+void disk_writer_begin_run(DiskWriter *writer)
+{
+    transfer_sink_begin(writer->sink);
+}
+
+// Starts a run that keeps the sink's bytes, resized to `size`; the bytes are placed with disk_writer_seek.
+void disk_writer_begin_resume(DiskWriter *writer, uint64_t size)
+{
+    transfer_sink_resize(writer->sink, size);
+}
+
+static void submit(DiskWriter *writer)
+{
+    queue_push(&writer->full, writer->current);
+    writer->current = NULL;
+    writer->submitted++;
+
+    int depth = queue_depth(&writer->full);
+    if (depth > writer->stats.peak_queued)
+    {
+        writer->stats.peak_queued = depth;
+    }
+}
+
+// The bytes committed from now on are written from `offset` on.
+void disk_writer_seek(DiskWriter *writer, uint64_t offset)
+{
+    if (writer->current != NULL && writer->current->length > 0)
+    {
+        submit(writer);
+    }
+    if (writer->current != NULL)
+    {
+        writer->current->seek = 1;
+        writer->current->offset = offset;
+        return;
+    }
+    writer->seek = 1;
+    writer->seek_offset = offset;
+}
+
+/**
+ * @brief Returns space in the current block for the next receive.
+ *
+ * When the current block has less than `min_space` bytes left it is queued for the disk and a
+ * free block is taken from the pool. If the pool is empty the disk is behind: the wait is
+ * counted as backpressure.
+ *
+ * @param capacity Set to the free bytes at the returned address, at least `min_space`.
+ * @return Where to receive the next bytes.
+ */
+char *disk_writer_reserve(DiskWriter *writer, size_t min_space, size_t *capacity)
+{
+    if (writer->current != NULL && writer->options.block_size - writer->current->length < min_space)
+    {
+        submit(writer);
+    }
+    if (writer->current == NULL)
+    {
+        DiskBlock *block = queue_pop(&writer->free);
+        if (block == NULL)
+        {
+            uint64_t start = stats_now_ns();
+            unsigned spins = 0;
+            while ((block = queue_pop(&writer->free)) == NULL)
+            {
+                backoff(&spins);
+            }
+            writer->stats.stalls++;
+            writer->stats.stall_ns += stats_now_ns() - start;
+        }
+        block->seek = writer->seek;
+        block->offset = writer->seek_offset;
+        writer->seek = 0;
+        writer->current = block;
+    }
+    *capacity = writer->options.block_size - writer->current->length;
+    return writer->current->data + writer->current->length;
+}
+
+// Accounts `length` received bytes at the address returned by the last reserve.
+void disk_writer_commit(DiskWriter *writer, size_t length)
+{
+    writer->current->length += length;
+    if (writer->current->length == writer->options.block_size)
+    {
+        submit(writer);
+    }
+}
+
+/**
+ * @brief Queues the partial block and waits until the whole run is on the sink (synced if the policy asks).
+ * @return 0 on success, -1 if a write failed.
+ */
+int disk_writer_finish_run(DiskWriter *writer)
+{
+    size_t capacity;
+
+    if (writer->current == NULL)
+    {
+        disk_writer_reserve(writer, 0, &capacity);
+    }
+    writer->current->sync = 1;
+    submit(writer);
+
+    unsigned spins = 0;
+    while (__atomic_load_n(&writer->completed, __ATOMIC_ACQUIRE) != writer->submitted)
+    {
+        backoff(&spins);
+    }
+    return __atomic_load_n(&writer->error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+/**
+ * @brief Writes what is left, stops the thread and frees the pool.
+ * @param stats Receives the writer statistics, may be NULL.
+ * @return 0 if every write succeeded, -1 otherwise.
+ */
+int disk_writer_stop(DiskWriter *writer, DiskWriterStats *stats)
+{
+    int result = 0;
+
+    if (writer->current != NULL && writer->current->length > 0)
+    {
+        result = disk_writer_finish_run(writer);
+    }
+    __atomic_store_n(&writer->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(writer->thread, NULL);
+    for (int i = 0; i < writer->options.blocks; i++)
+    {
+        free(writer->pool[i].data);
+    }
+    if (stats != NULL)
+    {
+        *stats = writer->stats;
+    }
+    return result < 0 || writer->error ? -1 : 0;
+}
+
+void disk_writer_print(const DiskWriterStats *stats, FILE *out)
+{
+    fprintf(out, "- Writer: Blocks=%llu; Bytes=%llu; Write=%.2fms; Syncs=%llu (%.2fms)\n",
+            (unsigned long long)stats->blocks_written, (unsigned long long)stats->bytes_written,
+            stats_ns_to_ms(stats->write_ns), (unsigned long long)stats->syncs, stats_ns_to_ms(stats->sync_ns));
+    fprintf(out, "- Backpressure: Stalls=%llu (%.2fms); Peak queue=%d/%d blocks\n",
+            (unsigned long long)stats->stalls, stats_ns_to_ms(stats->stall_ns), stats->peak_queued, stats->blocks);
+}
@@ -0,0 +1,97 @@
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "Transfer.h"
+
+#define DISK_WRITER_DEFAULT_BLOCK (1024 * 1024)
+#define DISK_WRITER_DEFAULT_BLOCKS 8
+#define DISK_WRITER_MAX_BLOCKS 64
+// Blocks are allocated on this boundary and rounded up to a multiple of it
+#define DISK_WRITER_ALIGN 4096
+
+typedef enum
+{
+    DISK_SYNC_NONE,       // leave flushing to the page cache
+    DISK_SYNC_RUN,        // fdatasync at the end of every run
+    DISK_SYNC_BYTES       // fdatasync every sync_bytes bytes and at the end of every run
+} DiskSyncPolicy;
+
+typedef struct
+{
+    size_t block_size;    // bytes per pwrite
+    int blocks;           // blocks in the pool, the network can run this far ahead of the disk
+    DiskSyncPolicy sync;
+    uint64_t sync_bytes;
+} DiskWriterOptions;
+
+typedef struct
+{
+    uint64_t blocks_written;
+    uint64_t bytes_written;
+    uint64_t write_ns;    // time spent in pwrite
+    uint64_t syncs;
+    uint64_t sync_ns;     // time spent in fdatasync
+    uint64_t stalls;      // times the network thread found no free block
+    uint64_t stall_ns;    // time the network thread waited for one
+    int peak_queued;      // most blocks waiting for the disk at once
+    int blocks;
+} DiskWriterStats;
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    int sync;             // fdatasync after writing this block
+    int seek;             // written at `offset` rather than after the previous block
+    uint64_t offset;
+} DiskBlock;
+
+// Single producer, single consumer ring of blocks, the indices only grow
+typedef struct
+{
+    DiskBlock *slots[DISK_WRITER_MAX_BLOCKS];
+    char pad0[64];
+    uint32_t head;        // next slot to pop, written by the consumer
+    char pad1[64];
+    uint32_t tail;        // next slot to push, written by the producer
+    char pad2[64];
+} DiskQueue;
+
+// Moves received bytes to a sink on its own thread so disk stalls do not stop the socket from being drained
+typedef struct
+{
+    DiskWriterOptions options;
+    TransferSink *sink;
+    DiskBlock pool[DISK_WRITER_MAX_BLOCKS];
+    DiskQueue full;       // network thread -> writer thread
+    DiskQueue free;       // writer thread -> network thread
+    DiskBlock *current;   // block being filled by the network thread
+    uint64_t submitted;   // blocks pushed to `full`, network thread only
+    uint64_t completed;   // blocks written, published by the writer thread
+    uint64_t since_sync;  // writer thread only
+    int seek;             // the next block taken from the pool starts at seek_offset, network thread only
+    uint64_t seek_offset;
+    int error;
+    int stop;
+    DiskWriterStats stats;
+    pthread_t thread;
+} DiskWriter;
+
+// Function declarations
+void disk_writer_options_defaults(DiskWriterOptions *options);
+int disk_writer_parse_arg(DiskWriterOptions *options, int argc, char *argv[], int *index);
+void disk_writer_usage(FILE *out);
+int disk_writer_start(DiskWriter *writer, TransferSink *sink, const DiskWriterOptions *options);
+void disk_writer_begin_run(DiskWriter *writer);
+void disk_writer_begin_resume(DiskWriter *writer, uint64_t size);
+void disk_writer_seek(DiskWriter *writer, uint64_t offset);
+char *disk_writer_reserve(DiskWriter *writer, size_t min_space, size_t *capacity);
+void disk_writer_commit(DiskWriter *writer, size_t length);
+int disk_writer_finish_run(DiskWriter *writer);
+int disk_writer_stop(DiskWriter *writer, DiskWriterStats *stats);
+void disk_writer_print(const DiskWriterStats *stats, FILE *out);
+
+#endif
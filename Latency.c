@@ -0,0 +1,468 @@
+#include "Latency.h"
+#include "Transfer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+// Largest request a run may use, receivers reject headers announcing more
+#define LATENCY_MAX_SIZE (1024 * 1024)
+
+// The open-loop schedule all connections of a run take their requests from
+typedef struct
+{
+    const LatencyOptions *options;
+    uint64_t start_ns;
+    double interval_ns;   // between two planned requests, 0 without a target rate
+    uint64_t next;        // next request number, shared by the connections
+} LatencySchedule;
+
+typedef struct
+{
+    LatencySchedule *schedule;
+    LatencyChannel *channel;
+    Histogram latency;
+    Histogram service;
+    Histogram network;
+    uint64_t requests;
+    int error;
+    pthread_t thread;
+} LatencyClient;
+
+typedef struct
+{
+    LatencyChannel *channel;
+    uint32_t size;
+    uint64_t requests;
+    int error;
+    pthread_t thread;
+} LatencyEcho;
+
+void latency_options_defaults(LatencyOptions *options)
+{
+    options->enabled = 0;
+    options->size = LATENCY_DEFAULT_SIZE;
+    options->concurrency = 1;
+    options->rate = 0.0;
+    options->requests = LATENCY_DEFAULT_REQUESTS;
+}
+
+/**
+ * @brief Parses one latency option.
+ *
+ * Recognized flags: -latency, -latency-size <bytes>, -latency-concurrency <n>, -latency-rate <n>
+ * and -latency-requests <n>. Every flag with a value implies -latency.
+ *
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a latency flag, -1 on error.
+ */
+int latency_parse_arg(LatencyOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-latency") == 0)
+    {
+        options->enabled = 1;
+        return 1;
+    }
+    if (strcmp(flag, "-latency-size") != 0 && strcmp(flag, "-latency-concurrency") != 0 &&
+        strcmp(flag, "-latency-rate") != 0 && strcmp(flag, "-latency-requests") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+    options->enabled = 1;
+
+    if (strcmp(flag, "-latency-size") == 0)
+    {
+        long long size = transfer_parse_size(value);
+        if (size < LATENCY_MESSAGE_HEADER || size > LATENCY_MAX_SIZE)
+        {
+            fprintf(stderr, "Latency message size must be between %d and %dM: %s\n", LATENCY_MESSAGE_HEADER,
+                    LATENCY_MAX_SIZE >> 20, value);
+            return -1;
+        }
+        options->size = (uint32_t)size;
+        return 1;
+    }
+    if (strcmp(flag, "-latency-concurrency") == 0)
+    {
+        options->concurrency = atoi(value);
+        if (options->concurrency < 1 || options->concurrency > LATENCY_MAX_CONCURRENCY)
+        {
+            fprintf(stderr, "Latency concurrency must be between 1 and %d\n", LATENCY_MAX_CONCURRENCY);
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(flag, "-latency-rate") == 0)
+    {
+        options->rate = atof(value);
+        if (options->rate < 0.0)
+        {
+            fprintf(stderr, "Latency rate must not be negative: %s\n", value);
+            return -1;
+        }
+        return 1;
+    }
+    long long requests = transfer_parse_size(value);
+    if (requests < 1)
+    {
+        fprintf(stderr, "Invalid number of requests: %s\n", value);
+        return -1;
+    }
+    options->requests = (uint64_t)requests;
+    return 1;
+}
+
+void latency_usage(FILE *out)
+{
+    fprintf(out, "Latency options:\n");
+    fprintf(out, "  -latency                 send requests and time their responses instead of a file\n");
+    fprintf(out, "  -latency-size <bytes>    bytes of a request and of its response (default %d)\n", LATENCY_DEFAULT_SIZE);
+    fprintf(out, "  -latency-concurrency <n> requests in flight, one connection each (default 1)\n");
+    fprintf(out, "  -latency-rate <n>        requests per second on a fixed schedule, a late response does not\n");
+    fprintf(out, "                           delay the next request (default 0: send when a response is in)\n");
+    fprintf(out, "  -latency-requests <n>    requests per run (default %d)\n", LATENCY_DEFAULT_REQUESTS);
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(value >> (24 - 8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static void encode_header(uint32_t size, int connections, unsigned char *out)
+{
+    put_u32(out, LATENCY_MAGIC);
+    put_u32(out + 4, size);
+    put_u32(out + 8, (uint32_t)connections);
+}
+
+// Serializes the latency header, LATENCY_HEADER_SIZE bytes in network byte order.
+void latency_encode_header(const LatencyOptions *options, unsigned char *out)
+{
+    encode_header(options->size, options->concurrency, out);
+}
+
+/**
+ * @brief Parses the latency header that follows the run header of a latency run.
+ * @return 0 on success, -1 if the header is not a latency header or out of range.
+ */
+int latency_decode_header(const unsigned char *in, uint32_t *size, int *connections)
+{
+    uint32_t count = get_u32(in + 8);
+
+    *size = get_u32(in + 4);
+    if (get_u32(in) != LATENCY_MAGIC || *size < LATENCY_MESSAGE_HEADER || *size > LATENCY_MAX_SIZE || count < 1 ||
+        count > LATENCY_MAX_CONCURRENCY)
+    {
+        return -1;
+    }
+    *connections = (int)count;
+    return 0;
+}
+
+/**
+ * @brief Prepares empty latency statistics, they add up over the runs.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int latency_stats_init(LatencyStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->latency = (Histogram *)calloc(1, sizeof(Histogram));
+    stats->service = (Histogram *)calloc(1, sizeof(Histogram));
+    stats->network = (Histogram *)calloc(1, sizeof(Histogram));
+    if (stats->latency == NULL || stats->service == NULL || stats->network == NULL)
+    {
+        latency_stats_free(stats);
+        return -1;
+    }
+    return 0;
+}
+
+// Sleeps until a point in time of stats_now_ns(), returns at once if it has passed.
+static void sleep_until(uint64_t deadline_ns)
+{
+    uint64_t now = stats_now_ns();
+    if (deadline_ns > now)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)((deadline_ns - now) / 1000000000ULL);
+        ts.tv_nsec = (long)((deadline_ns - now) % 1000000000ULL);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * @brief Client thread of one connection.
+ *
+ * Takes the next request of the shared schedule, waits for its planned time, sends it and waits
+ * for the response. The latency counts from the planned time: a response that stalls holds the
+ * requests planned behind it back, and their wait is part of what they measure.
+ */
+static void *latency_client(void *arg)
+{
+    LatencyClient *client = (LatencyClient *)arg;
+    LatencySchedule *schedule = client->schedule;
+    const LatencyOptions *options = schedule->options;
+    unsigned char *request = (unsigned char *)calloc(1, options->size);
+    unsigned char *response = (unsigned char *)malloc(options->size);
+
+    if (request == NULL || response == NULL)
+    {
+        client->error = 1;
+    }
+    while (!client->error)
+    {
+        uint64_t number = __atomic_fetch_add(&schedule->next, 1, __ATOMIC_RELAXED);
+        int end = number >= options->requests;
+        uint64_t planned_ns = stats_now_ns();
+        if (!end && schedule->interval_ns > 0.0)
+        {
+            planned_ns = schedule->start_ns + (uint64_t)((double)number * schedule->interval_ns);
+            sleep_until(planned_ns);
+        }
+
+        put_u32(request, (uint32_t)number);
+        put_u32(request + 4, end ? LATENCY_END : 0);
+        uint64_t sent_ns = stats_now_ns();
+        if (client->channel->send(client->channel->context, (const char *)request, options->size) < 0 ||
+            client->channel->recv(client->channel->context, (char *)response, options->size) < 0 ||
+            get_u32(response) != (uint32_t)number)
+        {
+            fprintf(stderr, "Request %llu got no matching response\n", (unsigned long long)number);
+            client->error = 1;
+            break;
+        }
+        if (end)
+        {
+            break;
+        }
+        uint64_t done_ns = stats_now_ns();
+        histogram_record(&client->latency, done_ns - planned_ns);
+        histogram_record(&client->service, done_ns - sent_ns);
+        uint64_t wire_sent_ns;
+        uint64_t wire_received_ns;
+        if (client->channel->stamps != NULL &&
+            client->channel->stamps(client->channel->context, &wire_sent_ns, &wire_received_ns) == 0 &&
+            wire_received_ns > wire_sent_ns)
+        {
+            histogram_record(&client->network, wire_received_ns - wire_sent_ns);
+        }
+        client->requests++;
+    }
+    free(request);
+    free(response);
+    return NULL;
+}
+
+// Adds the counts of one histogram to another.
+static void histogram_add(Histogram *into, const Histogram *from)
+{
+    if (from->total == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    if (into->total == 0 || from->min < into->min)
+    {
+        into->min = from->min;
+    }
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+}
+
+/**
+ * @brief Runs the requests of one run over `count` connections, one thread each.
+ *
+ * With a target rate the requests are planned on a fixed schedule (open loop) and every
+ * connection takes the next planned request once its previous response is in. Without one
+ * every connection sends its next request as soon as the previous response arrived. Each
+ * connection ends with a LATENCY_END message the receiver echoes.
+ *
+ * The receiver first sends the latency header back on the first connection once every
+ * connection is set up, the requests start after it.
+ *
+ * @return 0 on success, -1 if a connection failed.
+ */
+int latency_run(const LatencyOptions *options, LatencyChannel *channels, int count, LatencyStats *stats)
+{
+    LatencySchedule schedule;
+    LatencyClient *clients;
+    unsigned char expected[LATENCY_HEADER_SIZE];
+    unsigned char header[LATENCY_HEADER_SIZE];
+    int started = 0;
+    int error = 0;
+
+    encode_header(options->size, count, expected);
+    if (channels[0].recv(channels[0].context, (char *)header, sizeof(header)) < 0 ||
+        memcmp(header, expected, sizeof(header)) != 0)
+    {
+        fprintf(stderr, "The receiver did not confirm the latency run\n");
+        return -1;
+    }
+    if ((clients = (LatencyClient *)calloc((size_t)count, sizeof(LatencyClient))) == NULL)
+    {
+        return -1;
+    }
+    // The default 50us timer slack would add to every request that waits for its planned time
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+    schedule.options = options;
+    schedule.interval_ns = options->rate > 0.0 ? 1000000000.0 / options->rate : 0.0;
+    schedule.next = 0;
+    schedule.start_ns = stats_now_ns();
+    for (; started < count; started++)
+    {
+        clients[started].schedule = &schedule;
+        clients[started].channel = &channels[started];
+        if (pthread_create(&clients[started].thread, NULL, latency_client, &clients[started]) != 0)
+        {
+            // The connections already running still end the run, the schedule ran out for them
+            __atomic_store_n(&schedule.next, options->requests, __ATOMIC_RELAXED);
+            error = 1;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        histogram_add(stats->latency, &clients[i].latency);
+        histogram_add(stats->service, &clients[i].service);
+        histogram_add(stats->network, &clients[i].network);
+        stats->requests += clients[i].requests;
+        stats->bytes += 2 * (uint64_t)options->size * clients[i].requests;
+        error |= clients[i].error;
+    }
+    stats->time_ns += stats_now_ns() - schedule.start_ns;
+    free(clients);
+    return error ? -1 : 0;
+}
+
+// Receiver thread of one connection: sends every request back until the LATENCY_END message.
+static void *latency_echo(void *arg)
+{
+    LatencyEcho *echo = (LatencyEcho *)arg;
+    unsigned char *message = (unsigned char *)malloc(echo->size);
+
+    if (message == NULL)
+    {
+        echo->error = 1;
+    }
+    while (!echo->error)
+    {
+        if (echo->channel->recv(echo->channel->context, (char *)message, echo->size) < 0 ||
+            echo->channel->send(echo->channel->context, (const char *)message, echo->size) < 0)
+        {
+            echo->error = 1;
+            break;
+        }
+        if (get_u32(message + 4) & LATENCY_END)
+        {
+            break;
+        }
+        echo->requests++;
+    }
+    free(message);
+    return NULL;
+}
+
+/**
+ * @brief Answers the requests of one run, the first connection on the calling thread.
+ *
+ * Call it once every connection of the run is set up: it confirms the run to the sender by
+ * sending the latency header back on the first connection.
+ *
+ * @param requests Set to the number of requests answered.
+ * @return 0 once every connection sent its LATENCY_END message, -1 if one failed.
+ */
+int latency_serve(LatencyChannel *channels, int count, uint32_t size, uint64_t *requests)
+{
+    unsigned char header[LATENCY_HEADER_SIZE];
+    LatencyEcho *echoes;
+    int started = 1;
+    int error = 0;
+
+    *requests = 0;
+    encode_header(size, count, header);
+    if (channels[0].send(channels[0].context, (const char *)header, sizeof(header)) < 0 ||
+        (echoes = (LatencyEcho *)calloc((size_t)count, sizeof(LatencyEcho))) == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        echoes[i].channel = &channels[i];
+        echoes[i].size = size;
+    }
+    for (; started < count; started++)
+    {
+        if (pthread_create(&echoes[started].thread, NULL, latency_echo, &echoes[started]) != 0)
+        {
+            error = 1;
+            break;
+        }
+    }
+    latency_echo(&echoes[0]);
+    for (int i = 0; i < started; i++)
+    {
+        if (i > 0)
+        {
+            pthread_join(echoes[i].thread, NULL);
+        }
+        *requests += echoes[i].requests;
+        error |= echoes[i].error;
+    }
+    free(echoes);
+    return error ? -1 : 0;
+}
+
+void latency_print(const LatencyStats *stats, const LatencyOptions *options, FILE *out)
+{
+    double seconds = (double)stats->time_ns / 1000000000.0;
+
+    fprintf(out, "- Latency: Requests=%llu; Size=%u; Connections=%d; Rate=%.0f/s (target ", (unsigned long long)stats->requests,
+            options->size, options->concurrency, seconds > 0.0 ? (double)stats->requests / seconds : 0.0);
+    if (options->rate > 0.0)
+    {
+        fprintf(out, "%.0f/s)\n", options->rate);
+    }
+    else
+    {
+        fprintf(out, "none, closed loop)\n");
+    }
+    histogram_print(stats->latency, "Request latency", out);
+    histogram_print(stats->service, "Service time", out);
+    if (stats->network->total > 0)
+    {
+        histogram_print(stats->network, "Network time (kernel timestamps)", out);
+    }
+}
+
+void latency_stats_free(LatencyStats *stats)
+{
+    free(stats->latency);
+    free(stats->service);
+    free(stats->network);
+    memset(stats, 0, sizeof(*stats));
+}
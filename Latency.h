@@ -0,0 +1,64 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "Run_Stats.h"
+
+#define LATENCY_MAGIC 0x50494E47 // "PING"
+// Message size and connection count of a latency run, in network byte order, after the run header
+#define LATENCY_HEADER_SIZE 12
+// Every request and response starts with its request number and flags
+#define LATENCY_MESSAGE_HEADER 8
+#define LATENCY_END 1            // the last message on a connection, the receiver echoes it and stops
+#define LATENCY_DEFAULT_SIZE 64
+#define LATENCY_DEFAULT_REQUESTS 10000
+#define LATENCY_MAX_CONCURRENCY 64
+
+// Sender side: the shape of the request/response load
+typedef struct
+{
+    int enabled;
+    uint32_t size;        // bytes of a request and of its response, header included
+    int concurrency;      // requests in flight, each on its own connection
+    double rate;          // requests per second over all connections, 0 sends the next one as soon as a response is in
+    uint64_t requests;    // requests per run
+} LatencyOptions;
+
+typedef struct
+{
+    uint64_t requests;
+    uint64_t bytes;       // request and response bytes
+    uint64_t time_ns;     // wall time of the runs
+    Histogram *latency;   // from the time the schedule planned the request, a stalled response delays the next ones
+    Histogram *service;   // from the time the request was actually sent
+    Histogram *network;   // from the kernel's TX timestamp of the request to the RX timestamp of the response
+} LatencyStats;
+
+/**
+ * How the requests of one connection reach the peer. send writes a whole message, recv waits
+ * for exactly `length` bytes. Each connection is driven by its own thread. stamps, NULL on a
+ * channel without kernel timestamps, gives the kernel's TX timestamp of the last request and
+ * RX timestamp of its response.
+ */
+typedef struct
+{
+    int (*send)(void *context, const char *data, size_t length);   // 0 on success, -1 on an error
+    int (*recv)(void *context, char *data, size_t length);         // 0 or -1
+    void *context;
+    int (*stamps)(void *context, uint64_t *sent_ns, uint64_t *received_ns);   // 0, or -1 if one is missing
+} LatencyChannel;
+
+// Function declarations
+void latency_options_defaults(LatencyOptions *options);
+int latency_parse_arg(LatencyOptions *options, int argc, char *argv[], int *index);
+void latency_usage(FILE *out);
+void latency_encode_header(const LatencyOptions *options, unsigned char *out);
+int latency_decode_header(const unsigned char *in, uint32_t *size, int *connections);
+int latency_stats_init(LatencyStats *stats);
+int latency_run(const LatencyOptions *options, LatencyChannel *channels, int count, LatencyStats *stats);
+int latency_serve(LatencyChannel *channels, int count, uint32_t size, uint64_t *requests);
+void latency_print(const LatencyStats *stats, const LatencyOptions *options, FILE *out);
+void latency_stats_free(LatencyStats *stats);
+
+#endif
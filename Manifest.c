@@ -0,0 +1,768 @@
+#include "Manifest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// xxHash64 primes
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+// Seeds of the chunk hashes and of the inner nodes of the Merkle tree, so a node never equals a chunk
+#define CHUNK_SEED 0
+#define NODE_SEED 1
+
+void manifest_options_defaults(ManifestOptions *options)
+{
+    options->enabled = 0;
+    options->chunk_size = MANIFEST_DEFAULT_CHUNK;
+}
+
+/**
+ * @brief Parses one manifest option: -manifest or -manifest-chunk <bytes> (which implies -manifest).
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a manifest flag, -1 on error.
+ */
+int manifest_parse_arg(ManifestOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-manifest") == 0)
+    {
+        options->enabled = 1;
+        return 1;
+    }
+    if (strcmp(flag, "-manifest-chunk") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+    long long size = transfer_parse_size(value);
+    if (size < MANIFEST_MIN_CHUNK || size > MANIFEST_MAX_CHUNK)
+    {
+        fprintf(stderr, "Manifest chunk must be between 4K and %dM: %s\n", MANIFEST_MAX_CHUNK >> 20, value);
+        return -1;
+    }
+    options->enabled = 1;
+    options->chunk_size = (uint32_t)size;
+    return 1;
+}
+
+void manifest_usage(FILE *out)
+{
+    fprintf(out, "Manifest options:\n");
+    fprintf(out, "  -manifest                start every run with chunk hashes, send only the chunks the receiver\n");
+    fprintf(out, "                           does not hold yet (it keeps its progress in <output>.state)\n");
+    fprintf(out, "  -manifest-chunk <bytes>  bytes per hashed chunk (default %dM)\n", MANIFEST_DEFAULT_CHUNK >> 20);
+}
+
+static uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Little-endian loads, the hash of a chunk is the same on every host
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh_round(0, value);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/**
+ * @brief xxHash64 of a buffer: fast, not cryptographic, good enough to catch corrupt or stale chunks.
+ */
+uint64_t manifest_hash(const void *data, size_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + length;
+    uint64_t h;
+
+    if (length >= 32)
+    {
+        uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        uint64_t v2 = seed + XXH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME1;
+        while (end - p >= 32)
+        {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else
+    {
+        h = seed + XXH_PRIME5;
+    }
+    h += (uint64_t)length;
+
+    while (end - p >= 8)
+    {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if (end - p >= 4)
+    {
+        h ^= (uint64_t)read32(p) * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (uint64_t)(*p++) * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(value >> (24 - 8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static void put_u64(unsigned char *out, uint64_t value)
+{
+    put_u32(out, (uint32_t)(value >> 32));
+    put_u32(out + 4, (uint32_t)value);
+}
+
+static uint64_t get_u64(const unsigned char *in)
+{
+    return ((uint64_t)get_u32(in) << 32) | get_u32(in + 4);
+}
+
+static uint64_t chunk_offset(const Manifest *manifest, uint32_t index)
+{
+    return (uint64_t)index * manifest->chunk_size;
+}
+
+static size_t chunk_length(const Manifest *manifest, uint32_t index)
+{
+    uint64_t left = manifest->size - chunk_offset(manifest, index);
+    return left < manifest->chunk_size ? (size_t)left : manifest->chunk_size;
+}
+
+static int chunk_verified(const Manifest *manifest, uint32_t index)
+{
+    return (manifest->verified[index / 8] >> (index % 8)) & 1;
+}
+
+static size_t bitmap_size(uint32_t chunk_count)
+{
+    return ((size_t)chunk_count + 7) / 8;
+}
+
+/**
+ * @brief Root of the binary Merkle tree over the chunk hashes, an odd node is carried up as it is.
+ *
+ * The receiver recomputes it from the hashes it got, which catches a manifest damaged on its way.
+ */
+static uint64_t merkle_root(const uint64_t *hashes, uint32_t count)
+{
+    if (count == 0)
+    {
+        return manifest_hash(NULL, 0, NODE_SEED);
+    }
+    uint64_t *level = (uint64_t *)malloc((size_t)count * sizeof(uint64_t));
+    if (level == NULL)
+    {
+        return 0;
+    }
+    memcpy(level, hashes, (size_t)count * sizeof(uint64_t));
+    while (count > 1)
+    {
+        uint32_t parents = 0;
+        for (uint32_t i = 0; i < count; i += 2)
+        {
+            if (i + 1 == count)
+            {
+                level[parents++] = level[i];
+                continue;
+            }
+            unsigned char pair[16];
+            put_u64(pair, level[i]);
+            put_u64(pair + 8, level[i + 1]);
+            level[parents++] = manifest_hash(pair, sizeof(pair), NODE_SEED);
+        }
+        count = parents;
+    }
+    uint64_t root = level[0];
+    free(level);
+    return root;
+}
+
+static void manifest_free(Manifest *manifest)
+{
+    free(manifest->hashes);
+    free(manifest->verified);
+    manifest->hashes = NULL;
+    manifest->verified = NULL;
+}
+
+// Sizes the manifest of a `size` byte file and allocates its hashes and bitmap.
+static int manifest_alloc(Manifest *manifest, uint64_t size, uint32_t chunk_size)
+{
+    memset(manifest, 0, sizeof(*manifest));
+    if (chunk_size < MANIFEST_MIN_CHUNK || chunk_size > MANIFEST_MAX_CHUNK)
+    {
+        return -1;
+    }
+    uint64_t count = size / chunk_size + (size % chunk_size != 0);
+    if (count > UINT32_MAX)
+    {
+        return -1;
+    }
+    manifest->size = size;
+    manifest->chunk_size = chunk_size;
+    manifest->chunk_count = (uint32_t)count;
+    manifest->hashes = (uint64_t *)calloc(count > 0 ? count : 1, sizeof(uint64_t));
+    manifest->verified = (uint8_t *)calloc(bitmap_size(manifest->chunk_count) + 1, 1);
+    if (manifest->hashes == NULL || manifest->verified == NULL)
+    {
+        perror("Failed to allocate the manifest");
+        manifest_free(manifest);
+        return -1;
+    }
+    return 0;
+}
+
+static void encode_header(const Manifest *manifest, unsigned char *out)
+{
+    put_u32(out, MANIFEST_MAGIC);
+    put_u32(out + 4, manifest->chunk_size);
+    put_u64(out + 8, manifest->size);
+    put_u32(out + 16, manifest->chunk_count);
+    put_u32(out + 20, 0);
+    put_u64(out + 24, manifest->root);
+}
+
+// Parses a manifest header and allocates the manifest it describes.
+static int decode_header(const unsigned char *in, Manifest *manifest)
+{
+    if (get_u32(in) != MANIFEST_MAGIC || manifest_alloc(manifest, get_u64(in + 8), get_u32(in + 4)) < 0)
+    {
+        return -1;
+    }
+    manifest->root = get_u64(in + 24);
+    if (get_u32(in + 16) != manifest->chunk_count)
+    {
+        manifest_free(manifest);
+        return -1;
+    }
+    return 0;
+}
+
+static void encode_hashes(const Manifest *manifest, unsigned char *out)
+{
+    for (uint32_t i = 0; i < manifest->chunk_count; i++)
+    {
+        put_u64(out + 8 * (size_t)i, manifest->hashes[i]);
+    }
+}
+
+static void decode_hashes(const unsigned char *in, Manifest *manifest)
+{
+    for (uint32_t i = 0; i < manifest->chunk_count; i++)
+    {
+        manifest->hashes[i] = get_u64(in + 8 * (size_t)i);
+    }
+}
+
+/**
+ * @brief Names the receiver's state file after its output, e.g. RUDP_file.bin.state.
+ * @return 0 if the output is a regular file, -1 if progress cannot be kept (e.g. /dev/null).
+ */
+int manifest_state_path(const TransferSink *sink, const char *path, char *out, size_t size)
+{
+    struct stat st;
+
+    if (fstat(sink->fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+    int length = snprintf(out, size, "%s.state", path);
+    return length < 0 || (size_t)length >= size ? -1 : 0;
+}
+
+// The state file holds the manifest the output was written against and its verified bitmap.
+static int load_state(const char *path, Manifest *state)
+{
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    FILE *file = fopen(path, "rb");
+    int result = -1;
+
+    if (file == NULL)
+    {
+        return -1;
+    }
+    if (fread(header, 1, sizeof(header), file) == sizeof(header) && decode_header(header, state) == 0)
+    {
+        size_t hashes = 8 * (size_t)state->chunk_count;
+        unsigned char *buffer = (unsigned char *)malloc(hashes + 1);
+        if (buffer != NULL && fread(buffer, 1, hashes, file) == hashes &&
+            fread(state->verified, 1, bitmap_size(state->chunk_count), file) == bitmap_size(state->chunk_count))
+        {
+            decode_hashes(buffer, state);
+            result = 0;
+        }
+        free(buffer);
+        if (result < 0)
+        {
+            manifest_free(state);
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+// Rewrites the state file through a temporary one, a crash leaves either the old or the new state.
+static int save_state(const char *path, const Manifest *manifest)
+{
+    char temporary[4096];
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    size_t hashes = 8 * (size_t)manifest->chunk_count;
+    unsigned char *buffer = (unsigned char *)malloc(hashes + 1);
+    int length = snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = NULL;
+    int result = -1;
+
+    if (buffer != NULL && length > 0 && (size_t)length < sizeof(temporary) && (file = fopen(temporary, "wb")) != NULL)
+    {
+        encode_header(manifest, header);
+        encode_hashes(manifest, buffer);
+        if (fwrite(header, 1, sizeof(header), file) == sizeof(header) && fwrite(buffer, 1, hashes, file) == hashes &&
+            fwrite(manifest->verified, 1, bitmap_size(manifest->chunk_count), file) == bitmap_size(manifest->chunk_count))
+        {
+            result = 0;
+        }
+        if (fclose(file) != 0 || result < 0 || rename(temporary, path) < 0)
+        {
+            perror(path);
+            result = -1;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+static int channel_turn(ManifestChannel *channel, int sending)
+{
+    return channel->turn != NULL ? channel->turn(channel->context, sending) : 0;
+}
+
+// Hashes every chunk of the source and the Merkle root over them.
+static int build_manifest(Manifest *manifest, TransferSource *source, uint32_t chunk_size, ManifestStats *stats)
+{
+    TransferReader reader;
+    const char *chunk;
+    size_t length;
+
+    if (manifest_alloc(manifest, source->size, chunk_size) < 0)
+    {
+        return -1;
+    }
+    uint64_t start_ns = stats_now_ns();
+    if (transfer_reader_start(&reader, source, 0, source->size, chunk_size) < 0)
+    {
+        manifest_free(manifest);
+        return -1;
+    }
+    for (uint32_t i = 0; (chunk = transfer_reader_next(&reader, &length)) != NULL; i++)
+    {
+        manifest->hashes[i] = manifest_hash(chunk, length, CHUNK_SEED);
+    }
+    if (transfer_reader_stop(&reader) < 0)
+    {
+        manifest_free(manifest);
+        return -1;
+    }
+    manifest->root = merkle_root(manifest->hashes, manifest->chunk_count);
+    stats->hash_ns += stats_now_ns() - start_ns;
+    return 0;
+}
+
+/**
+ * @brief Reads the receiver's answer: the chunks it wants next, set in `bitmap`.
+ * @return The number of chunks wanted, 0 once the receiver is done, -1 on an error.
+ */
+static long recv_want(ManifestChannel *channel, const Manifest *manifest, unsigned char *bitmap, uint32_t *missing)
+{
+    unsigned char want[MANIFEST_WANT_SIZE];
+
+    if (channel_turn(channel, 0) < 0)
+    {
+        return -1;
+    }
+    int valid = channel->recv(channel->context, (char *)want, sizeof(want)) == 0 &&
+                get_u32(want) == MANIFEST_WANT_MAGIC && get_u32(want + 4) == manifest->chunk_count;
+    uint32_t wanted = valid ? get_u32(want + 8) : 0;
+    if (valid && wanted > 0)
+    {
+        valid = channel->recv(channel->context, (char *)bitmap, bitmap_size(manifest->chunk_count)) == 0;
+    }
+    // The line goes back to the sender even after an error, the control messages still follow
+    if (channel_turn(channel, 1) < 0 || !valid)
+    {
+        fprintf(stderr, "Invalid answer to the manifest\n");
+        return -1;
+    }
+    *missing = get_u32(want + 12);
+    return wanted;
+}
+
+// Sends the manifest, then every batch of chunks the receiver asks for until it wants none.
+static int send_chunks(ManifestChannel *channel, const Manifest *manifest, TransferSource *source,
+                       unsigned char *buffer, char *data, ManifestStats *stats)
+{
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    uint32_t missing = 0;
+    long wanted;
+
+    encode_header(manifest, header);
+    encode_hashes(manifest, buffer);
+    if (channel->send(channel->context, (const char *)header, sizeof(header)) < 0 ||
+        channel->send(channel->context, (const char *)buffer, 8 * (size_t)manifest->chunk_count) < 0)
+    {
+        return -1;
+    }
+    while ((wanted = recv_want(channel, manifest, buffer, &missing)) > 0)
+    {
+        stats->rounds++;
+        for (uint32_t i = 0; i < manifest->chunk_count; i++)
+        {
+            if (((buffer[i / 8] >> (i % 8)) & 1) == 0)
+            {
+                continue;
+            }
+            size_t length = chunk_length(manifest, i);
+            if (transfer_source_read(source, chunk_offset(manifest, i), data, length) < 0 ||
+                channel->send(channel->context, data, length) < 0)
+            {
+                return -1;
+            }
+            stats->sent++;
+            stats->bytes += length;
+        }
+    }
+    if (wanted < 0)
+    {
+        return -1;
+    }
+    stats->missing += missing;
+    return missing == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Sender: hashes the source, sends the manifest, then the chunks the receiver asks for.
+ *
+ * The receiver answers every batch of chunks with the ones it still wants, a chunk that failed
+ * its hash on arrival is asked for again, until it wants none.
+ *
+ * @return 0 once the receiver holds every chunk, -1 on an I/O error or if it gave up.
+ */
+int manifest_send_run(const ManifestOptions *options, ManifestChannel *channel, TransferSource *source,
+                      ManifestStats *stats)
+{
+    Manifest manifest;
+    int result = -1;
+
+    if (build_manifest(&manifest, source, options->chunk_size, stats) < 0)
+    {
+        return -1;
+    }
+    stats->chunks += manifest.chunk_count;
+    size_t hashes = 8 * (size_t)manifest.chunk_count;
+    size_t bitmap = bitmap_size(manifest.chunk_count);
+    unsigned char *buffer = (unsigned char *)malloc((hashes > bitmap ? hashes : bitmap) + 1);
+    char *data = (char *)malloc(manifest.chunk_size);
+    if (buffer == NULL || data == NULL)
+    {
+        perror("Failed to allocate the manifest buffers");
+    }
+    else
+    {
+        result = send_chunks(channel, &manifest, source, buffer, data, stats);
+    }
+    free(buffer);
+    free(data);
+    manifest_free(&manifest);
+    return result;
+}
+
+// Reads a chunk back from the output and compares it with its hash.
+static int verify_on_disk(const Manifest *manifest, uint32_t index, int fd, char *data)
+{
+    size_t length = chunk_length(manifest, index);
+    size_t done = 0;
+
+    while (done < length)
+    {
+        ssize_t bytes = pread(fd, data + done, length - done, (off_t)(chunk_offset(manifest, index) + done));
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return 0;
+        }
+        done += bytes;
+    }
+    return manifest_hash(data, length, CHUNK_SEED) == manifest->hashes[index];
+}
+
+// Chunks recorded as verified against the same hash and length are checked again on disk, the rest is wanted.
+static void plan_chunks(Manifest *manifest, const Manifest *state, int fd, char *data, ManifestStats *stats)
+{
+    for (uint32_t i = 0; i < manifest->chunk_count; i++)
+    {
+        if (i >= state->chunk_count || state->chunk_size != manifest->chunk_size || !chunk_verified(state, i) ||
+            state->hashes[i] != manifest->hashes[i] || chunk_length(state, i) != chunk_length(manifest, i))
+        {
+            continue;
+        }
+        if (verify_on_disk(manifest, i, fd, data))
+        {
+            manifest->verified[i / 8] |= (uint8_t)(1 << (i % 8));
+            stats->present++;
+        }
+        else
+        {
+            stats->corrupt++;
+        }
+    }
+}
+
+static int send_want(ManifestChannel *channel, const Manifest *manifest, uint32_t wanted, uint32_t missing,
+                     unsigned char *bitmap)
+{
+    unsigned char want[MANIFEST_WANT_SIZE];
+
+    put_u32(want, MANIFEST_WANT_MAGIC);
+    put_u32(want + 4, manifest->chunk_count);
+    put_u32(want + 8, wanted);
+    put_u32(want + 12, missing);
+    if (channel->send(channel->context, (const char *)want, sizeof(want)) < 0)
+    {
+        return -1;
+    }
+    if (wanted == 0)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < bitmap_size(manifest->chunk_count); i++)
+    {
+        bitmap[i] = (uint8_t)~manifest->verified[i];
+    }
+    if (manifest->chunk_count % 8 != 0)
+    {
+        bitmap[manifest->chunk_count / 8] &= (uint8_t)((1 << (manifest->chunk_count % 8)) - 1);
+    }
+    return channel->send(channel->context, (const char *)bitmap, bitmap_size(manifest->chunk_count));
+}
+
+// Hands a verified chunk to the writer at its place in the output.
+static void write_chunk(DiskWriter *writer, uint64_t offset, const char *data, size_t length, RunStats *run_stats)
+{
+    disk_writer_seek(writer, offset);
+    while (length > 0)
+    {
+        size_t capacity;
+        char *block = disk_writer_reserve(writer, 1, &capacity);
+        size_t piece = length < capacity ? length : capacity;
+        memcpy(block, data, piece);
+        disk_writer_commit(writer, piece);
+        run_stats_chunk(run_stats, piece);
+        data += piece;
+        length -= piece;
+    }
+}
+
+// Asks for the chunks that are not verified yet, round after round, until none is missing or the rounds run out.
+static int recv_chunks(ManifestChannel *channel, Manifest *manifest, uint32_t verified, DiskWriter *writer,
+                       const char *state_path, unsigned char *bitmap, char *data, RunStats *run_stats,
+                       ManifestStats *stats)
+{
+    for (int round = 0;; round++)
+    {
+        uint32_t missing = manifest->chunk_count - verified;
+        uint32_t wanted = round < MANIFEST_MAX_ROUNDS ? missing : 0;
+        if (channel_turn(channel, 1) < 0 || send_want(channel, manifest, wanted, missing, bitmap) < 0 ||
+            channel_turn(channel, 0) < 0)
+        {
+            return -1;
+        }
+        if (wanted == 0)
+        {
+            stats->missing += missing;
+            return missing == 0 ? 0 : -1;
+        }
+
+        stats->rounds++;
+        uint32_t since_save = 0;
+        for (uint32_t i = 0; i < manifest->chunk_count; i++)
+        {
+            if (chunk_verified(manifest, i))
+            {
+                continue;
+            }
+            size_t length = chunk_length(manifest, i);
+            if (channel->recv(channel->context, data, length) < 0)
+            {
+                return -1;
+            }
+            stats->sent++;
+            stats->bytes += length;
+            uint64_t start_ns = stats_now_ns();
+            int match = manifest_hash(data, length, CHUNK_SEED) == manifest->hashes[i];
+            stats->hash_ns += stats_now_ns() - start_ns;
+            if (!match)
+            {
+                stats->corrupt++;
+                continue;
+            }
+            write_chunk(writer, chunk_offset(manifest, i), data, length, run_stats);
+            manifest->verified[i / 8] |= (uint8_t)(1 << (i % 8));
+            verified++;
+            if (state_path != NULL && ++since_save == MANIFEST_SAVE_CHUNKS)
+            {
+                save_state(state_path, manifest);
+                since_save = 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Receiver: takes the manifest of a `size` byte run and asks only for the chunks it lacks.
+ *
+ * Chunks a previous run verified (see the state file) are hashed again on disk, those that still
+ * match are kept. Every chunk that arrives is hashed before it is written; one that does not match
+ * is asked for again, for at most MANIFEST_MAX_ROUNDS rounds. The state file is rewritten every
+ * MANIFEST_SAVE_CHUNKS chunks and at the end, so an interrupted transfer resumes where it stopped.
+ *
+ * @param state_path NULL to neither resume nor keep progress.
+ * @return 0 once every chunk is verified, -1 on an I/O error or with chunks still missing.
+ */
+int manifest_recv_run(ManifestChannel *channel, uint64_t size, DiskWriter *writer, const char *state_path,
+                      RunStats *run_stats, ManifestStats *stats)
+{
+    Manifest manifest;
+    Manifest state;
+    unsigned char header[MANIFEST_HEADER_SIZE];
+
+    if (channel->recv(channel->context, (char *)header, sizeof(header)) < 0 || decode_header(header, &manifest) < 0)
+    {
+        fprintf(stderr, "Invalid manifest\n");
+        return -1;
+    }
+    size_t hashes = 8 * (size_t)manifest.chunk_count;
+    unsigned char *buffer = (unsigned char *)malloc(hashes + bitmap_size(manifest.chunk_count) + 1);
+    char *data = (char *)malloc(manifest.chunk_size);
+    if (buffer == NULL || data == NULL || channel->recv(channel->context, (char *)buffer, hashes) < 0)
+    {
+        free(buffer);
+        free(data);
+        manifest_free(&manifest);
+        return -1;
+    }
+    decode_hashes(buffer, &manifest);
+    if (manifest.size != size || merkle_root(manifest.hashes, manifest.chunk_count) != manifest.root)
+    {
+        fprintf(stderr, "The manifest does not match its root or the run\n");
+        free(buffer);
+        free(data);
+        manifest_free(&manifest);
+        return -1;
+    }
+    stats->chunks += manifest.chunk_count;
+
+    uint64_t start_ns = stats_now_ns();
+    uint64_t present = stats->present;
+    disk_writer_begin_resume(writer, size);
+    if (state_path != NULL && load_state(state_path, &state) == 0)
+    {
+        plan_chunks(&manifest, &state, writer->sink->fd, data, stats);
+        manifest_free(&state);
+    }
+    stats->hash_ns += stats_now_ns() - start_ns;
+
+    int result = recv_chunks(channel, &manifest, (uint32_t)(stats->present - present), writer, state_path, buffer, data,
+                             run_stats, stats);
+    if (state_path != NULL)
+    {
+        save_state(state_path, &manifest);
+    }
+    free(buffer);
+    free(data);
+    manifest_free(&manifest);
+    return result;
+}
+
+// Prints the fields the given side fills in: only the receiver knows what was present or corrupt.
+void manifest_print(const ManifestStats *stats, ManifestRole role, const char *name, FILE *out)
+{
+    if (role == MANIFEST_RECEIVER)
+    {
+        fprintf(out, "- %s: Chunks=%llu; Present=%llu; Received=%llu (%llu bytes); Corrupt=%llu; Missing=%llu; Rounds=%llu; Hash=%.2fms\n",
+                name, (unsigned long long)stats->chunks, (unsigned long long)stats->present, (unsigned long long)stats->sent,
+                (unsigned long long)stats->bytes, (unsigned long long)stats->corrupt, (unsigned long long)stats->missing,
+                (unsigned long long)stats->rounds, stats_ns_to_ms(stats->hash_ns));
+        return;
+    }
+    fprintf(out, "- %s: Chunks=%llu; Sent=%llu (%llu bytes); Missing=%llu; Rounds=%llu; Hash=%.2fms\n",
+            name, (unsigned long long)stats->chunks, (unsigned long long)stats->sent, (unsigned long long)stats->bytes,
+            (unsigned long long)stats->missing, (unsigned long long)stats->rounds, stats_ns_to_ms(stats->hash_ns));
+}
@@ -0,0 +1,86 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "Transfer.h"
+#include "Disk_Writer.h"
+#include "Run_Stats.h"
+
+#define MANIFEST_MAGIC 0x4D4E4654 // "MNFT"
+#define MANIFEST_WANT_MAGIC 0x57414E54 // "WANT"
+// Chunk size, file size, chunk count and Merkle root, in network byte order
+#define MANIFEST_HEADER_SIZE 32
+// Chunks the receiver still wants in a round and chunks it still misses
+#define MANIFEST_WANT_SIZE 16
+#define MANIFEST_DEFAULT_CHUNK (1024 * 1024)
+#define MANIFEST_MIN_CHUNK 4096
+#define MANIFEST_MAX_CHUNK (64 * 1024 * 1024)
+// Chunks that failed their hash are asked for again, at most this many rounds per run
+#define MANIFEST_MAX_ROUNDS 3
+// The receiver rewrites its state file after this many verified chunks
+#define MANIFEST_SAVE_CHUNKS 64
+
+// Sender side: whether runs start with a manifest and how the file is cut into chunks
+typedef struct
+{
+    int enabled;
+    uint32_t chunk_size;
+} ManifestOptions;
+
+// The side whose statistics manifest_print() reports, each fills in only some of the fields
+typedef enum
+{
+    MANIFEST_SENDER,
+    MANIFEST_RECEIVER
+} ManifestRole;
+
+typedef struct
+{
+    uint64_t chunks;
+    uint64_t present;     // receiver: verified on disk from an earlier run, never sent
+    uint64_t sent;        // chunks sent (sender) or received (receiver)
+    uint64_t corrupt;     // receiver: failed their hash, on disk or on arrival
+    uint64_t missing;     // chunks the receiver still lacked when the run ended
+    uint64_t rounds;
+    uint64_t bytes;       // chunk bytes sent or received
+    uint64_t hash_ns;     // time spent hashing
+} ManifestStats;
+
+// A file cut into chunks, each with a 64-bit xxHash, and the Merkle root over the chunk hashes
+typedef struct
+{
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint64_t root;
+    uint64_t *hashes;
+    uint8_t *verified;    // receiver: bitmap of the chunks on disk that match their hash
+} Manifest;
+
+/**
+ * How the manifest exchange reaches the peer. Both directions share one line: a side that
+ * wrote calls turn(context, 0) before it reads the peer's answer, a side that read calls
+ * turn(context, 1) before it writes again. turn may be NULL when nothing changes between directions.
+ */
+typedef struct
+{
+    int (*send)(void *context, const char *data, size_t length);   // 0 on success, -1 on an error
+    int (*recv)(void *context, char *data, size_t length);         // exactly `length` bytes, 0 or -1
+    int (*turn)(void *context, int sending);
+    void *context;
+} ManifestChannel;
+
+// Function declarations
+void manifest_options_defaults(ManifestOptions *options);
+int manifest_parse_arg(ManifestOptions *options, int argc, char *argv[], int *index);
+void manifest_usage(FILE *out);
+uint64_t manifest_hash(const void *data, size_t length, uint64_t seed);
+int manifest_state_path(const TransferSink *sink, const char *path, char *out, size_t size);
+int manifest_send_run(const ManifestOptions *options, ManifestChannel *channel, TransferSource *source,
+                      ManifestStats *stats);
+int manifest_recv_run(ManifestChannel *channel, uint64_t size, DiskWriter *writer, const char *state_path,
+                      RunStats *run_stats, ManifestStats *stats);
+void manifest_print(const ManifestStats *stats, ManifestRole role, const char *name, FILE *out);
+
+#endif
@@ -0,0 +1,263 @@
+#include "Payload.h"
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define PAYLOAD_VERIFY_BLOCK (64 * 1024)
+
+static const char *pattern_names[] = {"random", "compressible", "zero"};
+
+void payload_options_defaults(PayloadOptions *options)
+{
+    options->pattern = PAYLOAD_RANDOM;
+    options->seed = 1;
+    options->threads = 0;
+}
+
+/**
+ * @brief Parses one payload option.
+ *
+ * Recognized flags: -payload <random|compressible|zero>, -seed <n>, -gen-threads <n>.
+ *
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a payload flag, -1 on error.
+ */
+int payload_parse_arg(PayloadOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-payload") != 0 && strcmp(flag, "-seed") != 0 && strcmp(flag, "-gen-threads") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+
+    if (strcmp(flag, "-payload") == 0)
+    {
+        for (int i = 0; i < (int)(sizeof(pattern_names) / sizeof(pattern_names[0])); i++)
+        {
+            if (strcmp(value, pattern_names[i]) == 0)
+            {
+                options->pattern = (PayloadPattern)i;
+                return 1;
+            }
+        }
+        fprintf(stderr, "Unknown payload pattern: %s\n", value);
+        return -1;
+    }
+    if (strcmp(flag, "-seed") == 0)
+    {
+        char *end = NULL;
+        options->seed = strtoull(value, &end, 0);
+        if (end == value || *end != '\0')
+        {
+            fprintf(stderr, "Invalid seed: %s\n", value);
+            return -1;
+        }
+        return 1;
+    }
+    options->threads = atoi(value);
+    if (options->threads < 1 || options->threads > PAYLOAD_MAX_THREADS)
+    {
+        fprintf(stderr, "Generator threads must be between 1 and %d\n", PAYLOAD_MAX_THREADS);
+        return -1;
+    }
+    return 1;
+}
+
+void payload_usage(FILE *out)
+{
+    fprintf(out, "Payload options:\n");
+    fprintf(out, "  -payload <pattern>       random (default), compressible or zero\n");
+    fprintf(out, "  -seed <n>                seed of the payload stream (default 1)\n");
+    fprintf(out, "  -gen-threads <n>         generator threads for large payloads (default: online CPUs)\n");
+}
+
+const char *payload_pattern_name(PayloadPattern pattern)
+{
+    return pattern_names[pattern];
+}
+
+/**
+ * @brief The 64-bit word at a position of the stream.
+ *
+ * This is splitmix64 evaluated directly at `index`, so any word can be computed without the
+ * ones before it. Fills can start at any offset and split across threads, and the loop
+ * has no carried dependency, so the compiler can vectorize it.
+ */
+static inline uint64_t payload_word(PayloadPattern pattern, uint64_t seed, uint64_t index)
+{
+    uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    if (pattern == PAYLOAD_COMPRESSIBLE)
+    {
+        z = (z & 0x0707070707070707ULL) | 0x6161616161616161ULL;
+    }
+    return z;
+}
+
+// Fills a range on the calling thread, byte N of the stream is byte N % 8 of word N / 8 in little endian order.
+static void payload_fill_range(PayloadPattern pattern, uint64_t seed, uint64_t offset, unsigned char *out, size_t length)
+{
+    if (pattern == PAYLOAD_ZERO)
+    {
+        memset(out, 0, length);
+        return;
+    }
+
+    // Unaligned head
+    while (length > 0 && (offset & 7) != 0)
+    {
+        uint64_t word = payload_word(pattern, seed, offset >> 3);
+        *out++ = (unsigned char)(word >> (8 * (offset & 7)));
+        offset++;
+        length--;
+    }
+
+    // Whole words
+    uint64_t index = offset >> 3;
+    size_t words = length >> 3;
+    for (size_t i = 0; i < words; i++)
+    {
+        uint64_t word = htole64(payload_word(pattern, seed, index + i));
+        memcpy(out + i * 8, &word, 8);
+    }
+    out += words * 8;
+    offset += words * 8;
+    length -= words * 8;
+
+    // Tail
+    if (length > 0)
+    {
+        uint64_t word = payload_word(pattern, seed, offset >> 3);
+        for (size_t i = 0; i < length; i++)
+        {
+            out[i] = (unsigned char)(word >> (8 * i));
+        }
+    }
+}
+
+typedef struct
+{
+    const PayloadOptions *options;
+    uint64_t offset;
+    unsigned char *out;
+    size_t length;
+} PayloadSlice;
+
+static void *payload_fill_thread(void *arg)
+{
+    PayloadSlice *slice = (PayloadSlice *)arg;
+    payload_fill_range(slice->options->pattern, slice->options->seed, slice->offset, slice->out, slice->length);
+    return NULL;
+}
+
+/**
+ * @brief Writes bytes [offset, offset + length) of the payload stream into a buffer.
+ *
+ * Large fills are split into word aligned slices generated in parallel. If a thread cannot
+ * be started its slice is generated by the caller.
+ */
+void payload_fill(const PayloadOptions *options, uint64_t offset, void *buffer, size_t length)
+{
+    int threads = options->threads;
+    pthread_t ids[PAYLOAD_MAX_THREADS];
+    PayloadSlice slices[PAYLOAD_MAX_THREADS];
+    int started[PAYLOAD_MAX_THREADS];
+
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : (cpus > PAYLOAD_MAX_THREADS ? PAYLOAD_MAX_THREADS : (int)cpus);
+    }
+    if ((size_t)threads > length / (PAYLOAD_PARALLEL_MIN / 2))
+    {
+        threads = (int)(length / (PAYLOAD_PARALLEL_MIN / 2));
+    }
+    if (threads <= 1 || length < PAYLOAD_PARALLEL_MIN)
+    {
+        payload_fill_range(options->pattern, options->seed, offset, (unsigned char *)buffer, length);
+        return;
+    }
+
+    size_t slice_length = (length / threads) & ~(size_t)7;
+    size_t done = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        slices[t].options = options;
+        slices[t].offset = offset + done;
+        slices[t].out = (unsigned char *)buffer + done;
+        slices[t].length = t == threads - 1 ? length - done : slice_length;
+        done += slices[t].length;
+        started[t] = pthread_create(&ids[t], NULL, payload_fill_thread, &slices[t]) == 0;
+        if (!started[t])
+        {
+            payload_fill_thread(&slices[t]);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        if (started[t])
+        {
+            pthread_join(ids[t], NULL);
+        }
+    }
+}
+
+/**
+ * @brief Allocates a buffer holding the first `size` bytes of the payload stream.
+ * @return The buffer (free with free()), or NULL for a zero size or if memory could not be allocated.
+ */
+char *payload_generate(const PayloadOptions *options, size_t size)
+{
+    char *buffer = NULL;
+
+    if (size == 0)
+    {
+        return NULL;
+    }
+    buffer = (char *)malloc(size);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    payload_fill(options, 0, buffer, size);
+    return buffer;
+}
+
+/**
+ * @brief Checks received bytes against the payload stream.
+ * @param offset The stream offset of the first byte of the buffer.
+ * @return -1 if every byte matches, otherwise the stream offset of the first mismatch.
+ */
+int64_t payload_verify(const PayloadOptions *options, uint64_t offset, const void *buffer, size_t length)
+{
+    unsigned char expected[PAYLOAD_VERIFY_BLOCK];
+    const unsigned char *received = (const unsigned char *)buffer;
+
+    for (size_t done = 0; done < length;)
+    {
+        size_t block = length - done < sizeof(expected) ? length - done : sizeof(expected);
+        payload_fill_range(options->pattern, options->seed, offset + done, expected, block);
+        if (memcmp(expected, received + done, block) != 0)
+        {
+            for (size_t i = 0; i < block; i++)
+            {
+                if (expected[i] != received[done + i])
+                {
+                    return (int64_t)(offset + done + i);
+                }
+            }
+        }
+        done += block;
+    }
+    return -1;
+}
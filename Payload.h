@@ -0,0 +1,35 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Fills below this size stay on the calling thread
+#define PAYLOAD_PARALLEL_MIN (8 * 1024 * 1024)
+#define PAYLOAD_MAX_THREADS 16
+
+typedef enum
+{
+    PAYLOAD_RANDOM,       // incompressible pseudo-random bytes
+    PAYLOAD_COMPRESSIBLE, // pseudo-random letters 'a'..'h', about 3 bits of entropy per byte
+    PAYLOAD_ZERO          // all zero bytes
+} PayloadPattern;
+
+// Describes a payload stream: byte N of the stream only depends on the pattern, the seed and N
+typedef struct
+{
+    PayloadPattern pattern;
+    uint64_t seed;
+    int threads;          // generator threads for large fills, 0 for one per online CPU
+} PayloadOptions;
+
+// Function declarations
+void payload_options_defaults(PayloadOptions *options);
+int payload_parse_arg(PayloadOptions *options, int argc, char *argv[], int *index);
+void payload_usage(FILE *out);
+const char *payload_pattern_name(PayloadPattern pattern);
+void payload_fill(const PayloadOptions *options, uint64_t offset, void *buffer, size_t length);
+char *payload_generate(const PayloadOptions *options, size_t size);
+int64_t payload_verify(const PayloadOptions *options, uint64_t offset, const void *buffer, size_t length);
+
+#endif
@@ -1,4 +1,8 @@
 #include "RUDP_API.h"
+#include "RUDP_Impair.h"
+#include "Busy_Poll.h"
+#include "Timestamp.h"
+#include "RUDP_Log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +12,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <linux/sock_diag.h>
 
 #define MAX_RETRANSMISSION_COUNT 30
 #define PACKET_HISTORY_SIZE 10
@@ -18,236 +26,1338 @@ int history_index = 0;
 
 unsigned short int calculate_checksum(void *data, unsigned int bytes);
 
+// Serial number comparison (RFC 1982): true if `a` comes before `b`, so transfers longer than 65535 packets survive the wrap
+static int seq_before(uint16_t a, uint16_t b)
+{
+    return (int16_t)(uint16_t)(a - b) < 0;
+}
+
+uint64_t rudp_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Sends one datagram of the connection and counts it.
+ssize_t rudp_transmit(RUDPConnection *connection, const void *packet, size_t length, const struct sockaddr *addr, socklen_t addr_len)
+{
+    return rudp_transmit_on(connection, connection->sockfd, packet, length, addr, addr_len);
+}
+
+// rudp_transmit() on another socket of the connection, the one of a path rudp_add_path() added.
+ssize_t rudp_transmit_on(RUDPConnection *connection, int sockfd, const void *packet, size_t length, const struct sockaddr *addr,
+                         socklen_t addr_len)
+{
+    ssize_t bytes_sent = rudp_impair_sendto(sockfd, packet, length, 0, addr, addr_len);
+    if (bytes_sent > 0)
+    {
+        STATS_ADD(connection, packets_sent, 1);
+        STATS_ADD(connection, bytes_sent, bytes_sent);
+    }
+    return bytes_sent;
+}
+
+/**
+ * @brief rudp_transmit() for a data segment: with timestamps on, the kernel queues a TX
+ * timestamp of it under *key, otherwise *key is RUDP_NO_TIMESTAMP.
+ *
+ * Datagrams the impairment shim holds back leave the socket at the shim's discretion, so they
+ * are sent without one.
+ */
+ssize_t rudp_transmit_timed(RUDPConnection *connection, const void *packet, size_t length, const struct sockaddr *addr,
+                            socklen_t addr_len, uint32_t *key)
+{
+    if (!connection->timestamps || rudp_impair_enabled())
+    {
+        *key = RUDP_NO_TIMESTAMP;
+        return rudp_transmit(connection, packet, length, addr, addr_len);
+    }
+    ssize_t bytes_sent = timestamp_sendto(connection->sockfd, packet, length, 0, addr, addr_len);
+    if (bytes_sent > 0)
+    {
+        *key = __atomic_fetch_add(&connection->tx_key, 1, __ATOMIC_RELAXED);
+        STATS_ADD(connection, packets_sent, 1);
+        STATS_ADD(connection, bytes_sent, bytes_sent);
+    }
+    else
+    {
+        *key = RUDP_NO_TIMESTAMP;
+    }
+    return bytes_sent;
+}
+
+// Receives one datagram of the connection and counts it, with its kernel RX timestamp in connection->rx_ns.
+ssize_t rudp_receive(RUDPConnection *connection, void *packet, size_t length, struct sockaddr *addr, socklen_t *addr_len)
+{
+    if (connection->unread != NULL)
+    {
+        // Counted when it was read from the socket
+        ssize_t bytes = connection->unread_length < (ssize_t)length ? connection->unread_length : (ssize_t)length;
+        memcpy(packet, connection->unread, bytes);
+        if (addr != NULL && addr_len != NULL)
+        {
+            socklen_t from_len = *addr_len < sizeof(connection->unread_from) ? *addr_len : sizeof(connection->unread_from);
+            memcpy(addr, &connection->unread_from, from_len);
+            *addr_len = from_len;
+        }
+        free(connection->unread);
+        connection->unread = NULL;
+        connection->rx_ns = connection->unread_rx_ns;
+        return bytes;
+    }
+    return rudp_receive_on(connection, connection->sockfd, packet, length, addr, addr_len);
+}
+
+// rudp_receive() from another socket of the connection, without the datagram rudp_unread() kept.
+ssize_t rudp_receive_on(RUDPConnection *connection, int sockfd, void *packet, size_t length, struct sockaddr *addr,
+                        socklen_t *addr_len)
+{
+    union
+    {
+        char buffer[TIMESTAMP_CONTROL_SIZE];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {packet, length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_len != NULL ? *addr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (connection->timestamps)
+    {
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+    }
+    ssize_t bytes_received = busy_poll_recvmsg(rudp_impair_recvmsg, sockfd, &msg, 0);
+    connection->rx_ns = 0;
+    if (bytes_received > 0)
+    {
+        if (addr_len != NULL)
+        {
+            *addr_len = msg.msg_namelen;
+        }
+        if (connection->timestamps && (connection->rx_ns = timestamp_rx(&msg)) != 0)
+        {
+            STATS_ADD(connection, rx_timestamps, 1);
+        }
+        STATS_ADD(connection, packets_received, 1);
+        STATS_ADD(connection, bytes_received, bytes_received);
+    }
+    return bytes_received;
+}
+
+
+/**
+ * @brief Gives a datagram back to the connection, the next rudp_receive() returns it.
+ *
+ * Used when the engine stops after reading the first segment of a peer that took its turn
+ * to send. Only one datagram is kept, a later one is dropped and will be retransmitted.
+ */
+void rudp_unread(RUDPConnection *connection, const void *packet, ssize_t length, const struct sockaddr_in *from)
+{
+    if (connection->unread != NULL || length <= 0 || (size_t)length > sizeof(RUDPPacket))
+    {
+        return;
+    }
+    connection->unread = (RUDPPacket *)malloc(sizeof(RUDPPacket));
+    if (connection->unread == NULL)
+    {
+        return;
+    }
+    memcpy(connection->unread, packet, length);
+    connection->unread_length = length;
+    connection->unread_from = *from;
+    connection->unread_rx_ns = connection->rx_ns;
+}
+
+// Process secret of the resumption tokens, a receiver that restarts invalidates the tokens it gave out
+static uint64_t token_secret;
+static pthread_once_t token_once = PTHREAD_ONCE_INIT;
+
+static void token_init(void)
+{
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (random == NULL || fread(&token_secret, sizeof(token_secret), 1, random) != 1)
+    {
+        token_secret = rudp_now_ns() ^ ((uint64_t)getpid() << 32);
+    }
+    if (random != NULL)
+    {
+        fclose(random);
+    }
+}
+
+/**
+ * @brief The resumption token a receiver gives to the senders of one address.
+ *
+ * A keyed hash of the sender's IP address, so a returning sender (a new process, a new port)
+ * keeps its token and a receiver checks one without keeping state. It is a cookie against
+ * blind address spoofing, not a cryptographic MAC. Never 0, which means "no token".
+ */
+uint32_t rudp_token(const struct sockaddr_in *peer)
+{
+    pthread_once(&token_once, token_init);
+    uint64_t x = token_secret ^ peer->sin_addr.s_addr;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return (uint32_t)(x >> 32) | 1;
+}
+
+/**
+ * @brief Keeps the key of the resumption tokens in a file, so the tokens a receiver gave out stay
+ *        valid after it restarts.
+ *
+ * The key is read from the file if it holds one, otherwise the process key is written there
+ * (mode 0600). Call it before the first connection.
+ *
+ * @return 0 on success, -1 if the file could not be read or written.
+ */
+int rudp_set_token_key(const char *path)
+{
+    pthread_once(&token_once, token_init);
+    FILE *file = fopen(path, "rb");
+    if (file != NULL)
+    {
+        uint64_t key;
+        int loaded = fread(&key, sizeof(key), 1, file) == 1;
+        fclose(file);
+        if (loaded)
+        {
+            token_secret = key;
+            return 0;
+        }
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror("Error creating the token key file");
+        return -1;
+    }
+    if (write(fd, &token_secret, sizeof(token_secret)) != (ssize_t)sizeof(token_secret))
+    {
+        perror("Error writing the token key file");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Sends a header-only control packet, the peer reads nothing else of it.
+static int rudp_send_control(RUDPConnection *connection, const RUDPHeader *header, const struct sockaddr_in *to)
+{
+    return rudp_transmit(connection, header, sizeof(*header), (const struct sockaddr *)to, sizeof(*to)) < 0 ? -1 : 0;
+}
+
+// Bytes a data segment takes on the wire: its header and payload, not the rest of the data field.
+size_t rudp_segment_size(const RUDPPacket *packet)
+{
+    return RUDP_SEGMENT_HEADER_SIZE + (size_t)packet->length;
+}
+
+/**
+ * @brief Takes the payload length of a received data segment from the size of its datagram.
+ * @return 0 on success, -1 if the datagram is not a data segment (a control packet) or does not fit one.
+ */
+int rudp_segment_length(RUDPPacket *packet, ssize_t length)
+{
+    if (length < (ssize_t)RUDP_SEGMENT_HEADER_SIZE || length > (ssize_t)(RUDP_SEGMENT_HEADER_SIZE + RUDP_FEC_SHARD_SIZE) ||
+        packet->header.flags.DATA != 1)
+    {
+        return -1;
+    }
+    packet->length = (int)(length - (ssize_t)RUDP_SEGMENT_HEADER_SIZE);
+    return 0;
+}
+
+// Whether a datagram is a data packet whose checksum and length check out, its length is filled in from the datagram's size.
+int rudp_valid_data(RUDPPacket *packet, ssize_t length)
+{
+    return rudp_segment_length(packet, length) == 0 && packet->length <= MAX_PACKET_SIZE &&
+           verify_checksum(packet->data, packet->length, packet->header.checksum) == 1 && packet->header.stream < RUDP_MAX_STREAMS;
+}
+
+/**
+ * @brief Receiver: answers a SYN with a SYN-ACK carrying the sender's token.
+ *
+ * The SYN-ACK also acknowledges the segment the SYN carried if it was taken, i.e. comes
+ * before the next expected sequence number; sequence number 0 means it was not.
+ * A repeated SYN (its SYN-ACK was lost) is answered the same way.
+ *
+ * @return 0 on success, -1 if the SYN-ACK could not be sent.
+ */
+int rudp_answer_syn(RUDPConnection *connection, const RUDPPacket *packet, ssize_t length, const struct sockaddr_in *from)
+{
+    RUDPHeader synack;
+    memset(&synack, 0, sizeof(synack));
+    synack.flags.SYN = 1;
+    synack.flags.ACK = 1;
+    synack.token = rudp_token(from);
+    synack.window = rudp_receive_window(connection->sockfd, 1);
+    if (length >= (ssize_t)RUDP_SEGMENT_HEADER_SIZE && packet->header.flags.DATA == 1 &&
+        seq_before(packet->header.sequence_number, connection->next_sequence_number))
+    {
+        synack.sequence_number = packet->header.sequence_number;
+    }
+    RUDP_LOG(RUDP_LOG_DEBUG, "Sending SYN-ACK for packet %lld", synack.sequence_number);
+    return rudp_send_control(connection, &synack, from);
+}
+
+/**
+ * @brief Sender: completes a handshake deferred by rudp_connect() with a SYN that carries no data.
+ *
+ * The SYN is sent again with a doubling timeout until the SYN-ACK arrives. Used where the
+ * first segment cannot ride in the SYN (FEC groups, the engine).
+ *
+ * @return 0 on success (or if there is no handshake left to do), -1 if no SYN-ACK arrived.
+ */
+int rudp_handshake(RUDPConnection *connection)
+{
+    RUDPHeader syn;
+    RUDPPacket synack;
+    socklen_t addr_len = sizeof(connection->sender_addr);
+
+    if (!connection->syn_pending)
+    {
+        return 0;
+    }
+    memset(&syn, 0, sizeof(syn));
+    syn.flags.SYN = 1;
+    syn.token = connection->token;
+    for (int attempt = 0; attempt < RUDP_HANDSHAKE_RETRIES; attempt++)
+    {
+        RUDP_LOG(RUDP_LOG_DEBUG, "Sending SYN (attempt %lld)", attempt + 1);
+        if (rudp_send_control(connection, &syn, &connection->sender_addr) < 0)
+        {
+            perror("Error sending SYN packet");
+            return -1;
+        }
+        uint64_t timeout_us = (uint64_t)RUDP_HANDSHAKE_TIMEOUT_US << attempt;
+        struct timeval tv = {(time_t)(timeout_us / 1000000), (suseconds_t)(timeout_us % 1000000)};
+        setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        ssize_t bytes_received;
+        do {
+            bytes_received = rudp_receive(connection, &synack, sizeof(synack), (struct sockaddr *)&connection->sender_addr, &addr_len);
+        } while (bytes_received > 0 && !(synack.header.flags.SYN == 1 && synack.header.flags.ACK == 1));
+        if (bytes_received > 0)
+        {
+            connection->token = synack.header.token;
+            connection->syn_pending = 0;
+            STATS_SET(connection, rwnd, synack.header.window);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received SYN-ACK");
+            return 0;
+        }
+        STATS_ADD(connection, timeouts, 1);
+    }
+    RUDP_LOG(RUDP_LOG_WARN, "No SYN-ACK received");
+    return -1;
+}
+
+static RUDPConnection *rudp_connection_new(struct sockaddr_in *receiver_addr, int sockfd)
+{
+    RUDPConnection *connection = (RUDPConnection *)calloc(1, sizeof(RUDPConnection));// Allocate memory for the RUDPConnection
+    if (connection == NULL)
+    {
+        perror("Failed to allocate memory for RUDPConnection");
+        return NULL;
+    }
+    connection->sockfd = sockfd;// Store the socket file descriptor
+    connection->stats.rto_us = RUDP_ACK_TIMEOUT_US;
+    connection->start_ns = rudp_now_ns();
+    connection->receiver_addr = *receiver_addr;// Store the receiver's address
+    connection->next_sequence_number = 1;// Set the next sequence number to 1
+    connection->stream_open[RUDP_STREAM_DATA] = 1;
+    connection->stream_open[RUDP_STREAM_CONTROL] = 1;
+    return connection;
+}
+
+/**
+ * @brief Sender: creates a connection whose handshake rides on the first segment.
+ *
+ * Nothing is sent yet. The first rudp_send() sends its segment as a SYN; a receiver that
+ * recognizes `token` (from an earlier connection, see rudp_get_token()) takes the segment right
+ * away, otherwise it answers with a fresh token and the segment is sent again, one round trip
+ * later, like after a classic handshake.
+ *
+ * @param token The receiver's token from an earlier connection, 0 if there is none.
+ * @return The connection, or NULL if it could not be allocated.
+ */
+RUDPConnection *rudp_connect(struct sockaddr_in *receiver_addr, int sockfd, uint32_t token)
+{
+    RUDPConnection *connection = rudp_connection_new(receiver_addr, sockfd);
+    if (connection != NULL)
+    {
+        connection->sender_addr = *receiver_addr;
+        connection->syn_pending = 1;
+        connection->token = token;
+    }
+    return connection;
+}
+
+// The token the receiver gave in its SYN-ACK, 0 before the handshake completed.
+uint32_t rudp_get_token(const RUDPConnection *connection)
+{
+    return connection->syn_pending ? 0 : connection->token;
+}
+
+/**
+ * @brief A function to create a new RUDP connection.
+ * @param receiver_addr The address of the receiver.
+ * @param sender_addr The address of the sender, NULL on the sender side.
+ * @param sockfd The socket file descriptor.
+ * @return A pointer to the newly created RUDPConnection, NULL if the handshake failed.
+ * @note The sender sends a SYN and waits for the SYN-ACK, resending the SYN with a doubling timeout.
+ * @note The receiver waits for a SYN and answers it, the connection is usable right away: a lost
+ * SYN-ACK shows up as a repeated SYN, which rudp_recv() answers again. A SYN with a valid token may
+ * carry the first segment, the first rudp_recv() returns it.
+ */
+RUDPConnection *rudp_socket(struct sockaddr_in *receiver_addr, struct sockaddr_in *sender_addr, int sockfd)
+{
+    if (sender_addr == NULL)
+    {
+        // Sender side
+        RUDPConnection *connection = rudp_connect(receiver_addr, sockfd, 0);
+        if (connection != NULL && rudp_handshake(connection) < 0)
+        {
+            free(connection);
+            return NULL;
+        }
+        return connection;
+    }
+
+    // Receiver side
+    RUDPConnection *connection = rudp_connection_new(receiver_addr, sockfd);
+    if (connection == NULL)
+    {
+        return NULL;
+    }
+    connection->sender_addr = *sender_addr;
+
+    RUDPPacket *syn_packet = (RUDPPacket *)malloc(sizeof(RUDPPacket));
+    if (syn_packet == NULL)
+    {
+        perror("Failed to allocate SYN packet");
+        free(connection);
+        return NULL;
+    }
+    struct sockaddr_in syn_sender_addr;
+    while (1)// Wait for a SYN packet
+    {
+        socklen_t syn_sender_addr_len = sizeof(syn_sender_addr);
+        ssize_t bytes_received = rudp_receive(connection, syn_packet, sizeof(RUDPPacket), (struct sockaddr *)&syn_sender_addr, &syn_sender_addr_len);
+        if (bytes_received < 0)
+        {
+            perror("Error receiving SYN packet");
+            free(syn_packet);
+            free(connection);
+            return NULL;
+        }
+        if (syn_packet->header.flags.SYN != 1)
+        {
+            continue;
+        }
+        connection->sender_addr = syn_sender_addr; // Store the sender's address
+        // A returning sender's first segment is taken with the SYN, saving the round trip of the handshake
+        if (syn_packet->header.token == rudp_token(&syn_sender_addr) && rudp_valid_data(syn_packet, bytes_received) &&
+            syn_packet->header.sequence_number == connection->next_sequence_number)
+        {
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received SYN with packet %lld and a valid token", syn_packet->header.sequence_number);
+            connection->pending = syn_packet;
+            connection->next_sequence_number++;
+            STATS_ADD(connection, goodput_bytes, syn_packet->length);
+        }
+        if (rudp_answer_syn(connection, syn_packet, bytes_received, &syn_sender_addr) < 0)
+        {
+            perror("Error sending SYN-ACK packet");
+        }
+        break;
+    }
+    if (connection->pending == NULL)
+    {
+        free(syn_packet);
+    }
+    return connection;
+}
+
+// Lets the socket queue `packets` whole datagrams (SO_RCVBUFFORCE needs CAP_NET_ADMIN, SO_RCVBUF is capped by rmem_max).
+void rudp_grow_receive_buffer(int sockfd, int packets)
+{
+    int size = packets * (int)sizeof(RUDPPacket);
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+    {
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+}
+
+/**
+ * @brief The receive window of a socket-backed receiver: whole packets its receive buffer can still queue.
+ *
+ * The kernel charges a datagram its buffer overhead as well, about a kilobyte for a packet.
+ *
+ * @param share Connections reading the socket, each is offered an equal part of the free space.
+ */
+uint32_t rudp_receive_window(int sockfd, int share)
+{
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &length) < 0 || length < sizeof(meminfo))
+    {
+        return 1;
+    }
+    uint32_t free_bytes = meminfo[SK_MEMINFO_RCVBUF] > meminfo[SK_MEMINFO_RMEM_ALLOC] ? meminfo[SK_MEMINFO_RCVBUF] - meminfo[SK_MEMINFO_RMEM_ALLOC] : 0;
+    return free_bytes / (uint32_t)(sizeof(RUDPPacket) + 1024) / (uint32_t)(share > 0 ? share : 1);
+}
+
+// Gives the connection its FEC state, sized for the largest group a peer may send.
+static RUDPFecState *rudp_fec_state(RUDPConnection *connection)
+{
+    if (connection->fec == NULL)
+    {
+        connection->fec = (RUDPFecState *)calloc(1, sizeof(RUDPFecState));
+        if (connection->fec == NULL)
+        {
+            perror("Failed to allocate FEC state");
+            return NULL;
+        }
+        // A group arrives as one burst, let the socket hold a few
+        rudp_grow_receive_buffer(connection->sockfd, 4 * RUDP_FEC_MAX_SHARDS);
+    }
+    return connection->fec;
+}
+
+static uint8_t *rudp_fec_shard(RUDPFecState *fec, int index)
+{
+    if (fec->shards[index] == NULL)
+    {
+        fec->shards[index] = (uint8_t *)malloc(RUDP_FEC_SHARD_SIZE);
+        if (fec->shards[index] == NULL)
+        {
+            perror("Failed to allocate FEC shard");
+        }
+    }
+    return fec->shards[index];
+}
+
+static int rudp_fec_segment_length(const uint8_t *shard)
+{
+    return (shard[0] << 8) | shard[1];
+}
+
+/**
+ * @brief Turns FEC on or off for the data this side sends.
+ *
+ * With FEC every rudp_send() call adds a segment to a group. Once config->k segments are
+ * queued they are sent back to back with config->m parity segments and the group is
+ * acknowledged as a whole, the receiver rebuilds up to m lost segments without a round trip.
+ * rudp_flush() sends a partial group.
+ *
+ * @param config The group shape, k == 0 turns FEC off.
+ * @return 0 on success, -1 if the state could not be allocated.
+ */
+int rudp_set_fec(RUDPConnection *connection, const RUDPFecConfig *config)
+{
+    if (config->k == 0)
+    {
+        if (connection->fec != NULL)
+        {
+            connection->fec->config.k = 0;
+        }
+        return 0;
+    }
+    RUDPFecState *fec = rudp_fec_state(connection);
+    if (fec == NULL)
+    {
+        return -1;
+    }
+    fec->config = *config;
+    fec->m = config->m;
+    fec->count = 0;
+    STATS_SET(connection, fec_parity, fec->m);
+    return 0;
+}
+
+/**
+ * @brief Turns on kernel timestamps for the connection's socket.
+ *
+ * Every datagram read afterwards carries the kernel's RX timestamp and every data segment
+ * sent asks for a TX timestamp. RTT samples then run from the segment's TX timestamp to the
+ * ACK's RX timestamp and one-way delays end at the RX timestamp, so the time the threads
+ * took to be scheduled no longer counts as network time.
+ *
+ * @return 0 on success, -1 if the socket refused.
+ */
+int rudp_set_timestamps(RUDPConnection *connection)
+{
+    if (timestamp_enable(connection->sockfd, TIMESTAMP_TX_ASKED) < 0)
+    {
+        return -1;
+    }
+    connection->timestamps = 1;
+    return 0;
+}
+
+/**
+ * @brief Sender: adds a path the engine may send segments on, a socket bound to `local` that
+ * sends to `remote`.
+ *
+ * The first call makes the connection's own socket path 0, towards the receiver address it was
+ * created with. The receiver needs nothing: it answers every segment from the address it came
+ * from, so the ACKs of a path come back on its socket. The blocking API keeps to path 0.
+ *
+ * @param local Address to bind, port 0 lets the kernel choose one.
+ * @return The index of the path, or -1 if the connection has RUDP_MAX_PATHS paths or the socket failed.
+ */
+int rudp_add_path(RUDPConnection *connection, const struct sockaddr_in *local, const struct sockaddr_in *remote)
+{
+    if (connection->path_count == RUDP_MAX_PATHS)
+    {
+        fprintf(stderr, "A connection has at most %d paths\n", RUDP_MAX_PATHS);
+        return -1;
+    }
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("Failed to create a path socket");
+        return -1;
+    }
+    if (bind(sockfd, (const struct sockaddr *)local, sizeof(*local)) < 0)
+    {
+        perror("Failed to bind a path socket");
+        close(sockfd);
+        return -1;
+    }
+    if (connection->path_count == 0)
+    {
+        connection->paths[0].sockfd = connection->sockfd;
+        connection->paths[0].remote = connection->receiver_addr;
+        connection->path_count = 1;
+    }
+    RUDPPath *path = &connection->paths[connection->path_count];
+    memset(path, 0, sizeof(*path));
+    path->sockfd = sockfd;
+    path->remote = *remote;
+    return connection->path_count++;
+}
+
+/**
+ * @brief Folds the RTT of a segment sent once into the smoothed RTT, right after its ACK was read.
+ *
+ * @param sent_ns rudp_now_ns() before the segment was sent, used without kernel timestamps.
+ * @param key The key rudp_transmit_timed() gave the segment.
+ */
+void rudp_rtt_sample(RUDPConnection *connection, uint64_t sent_ns, uint32_t key)
+{
+    uint64_t rtt_ns = rudp_now_ns() - sent_ns;
+    uint64_t tx_ns;
+
+    if (key != RUDP_NO_TIMESTAMP && connection->rx_ns != 0 && timestamp_tx(connection->sockfd, key, &tx_ns) == 0 &&
+        connection->rx_ns >= tx_ns)
+    {
+        rtt_ns = connection->rx_ns - tx_ns;
+        connection->data_tx_ns = tx_ns;
+        STATS_ADD(connection, kernel_rtt_samples, 1);
+    }
+    uint64_t rtt_us = rtt_ns / 1000;
+    uint64_t srtt_us = STATS_GET(connection, srtt_us);
+    STATS_SET(connection, rtt_us, rtt_us);
+    STATS_SET(connection, srtt_us, srtt_us == 0 ? rtt_us : (7 * srtt_us + rtt_us) / 8);
+}
+
+/**
+ * @brief Records the one-way delay of a data segment that was just read.
+ *
+ * The delay runs from the sender's timestamp to the RX timestamp (the wall clock without
+ * kernel timestamps), so it holds the offset between the two clocks. Only its variation is
+ * reported: the RFC 3550 jitter and the spread between the largest and smallest delay.
+ */
+void rudp_delay_sample(RUDPConnection *connection, const RUDPHeader *header)
+{
+    if (header->timestamp == 0)
+    {
+        return;
+    }
+    uint64_t rx_ns = connection->rx_ns != 0 ? connection->rx_ns : timestamp_wall_ns();
+    int64_t delay_ns = (int64_t)(rx_ns - header->timestamp);
+    uint64_t samples = STATS_GET(connection, delay_samples);
+
+    if (samples == 0)
+    {
+        connection->delay_min_ns = delay_ns;
+        connection->delay_max_ns = delay_ns;
+    }
+    else
+    {
+        int64_t change = delay_ns - connection->delay_last_ns;
+        int64_t jitter = (int64_t)STATS_GET(connection, delay_jitter_ns);
+        jitter += ((change < 0 ? -change : change) - jitter) / 16;
+        STATS_SET(connection, delay_jitter_ns, jitter);
+        connection->delay_min_ns = delay_ns < connection->delay_min_ns ? delay_ns : connection->delay_min_ns;
+        connection->delay_max_ns = delay_ns > connection->delay_max_ns ? delay_ns : connection->delay_max_ns;
+    }
+    connection->delay_last_ns = delay_ns;
+    STATS_SET(connection, delay_spread_ns, connection->delay_max_ns - connection->delay_min_ns);
+    STATS_ADD(connection, delay_samples, 1);
+}
+
+// Folds the receiver's loss report into the estimate and picks the parity count of the next group.
+static void rudp_fec_update_loss(RUDPConnection *connection, double sample)
+{
+    RUDPFecState *fec = connection->fec;
+    int k = fec->config.k;
+    int m_max = k < RUDP_FEC_MAX_SHARDS - k ? k : RUDP_FEC_MAX_SHARDS - k;
+
+    fec->loss = (7.0 * fec->loss + sample) / 8.0;
+    if (fec->config.adaptive)
+    {
+        fec->m = rudp_fec_adapt(k, fec->config.m, m_max > fec->config.m ? m_max : fec->config.m, fec->loss);
+        STATS_SET(connection, fec_parity, fec->m);
+    }
+}
+
+/**
+ * @brief Sends the queued segments as one FEC group and waits for its ACK.
+ *
+ * The group uses a single sequence number. On a timeout or a NACK the whole group is sent again.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int rudp_fec_send_group(RUDPConnection *connection, struct sockaddr_in *sender_addr)
+{
+    RUDPFecState *fec = connection->fec;
+    int k = fec->count;
+    int m = fec->m;
+    size_t shard_length = RUDP_FEC_LENGTH_BYTES;
+    uint64_t payload = 0;
+    RUDPPacket packet;
+
+    if (connection->reset)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    // Pad the data shards to the longest one, then compute the parity over the padded shards
+    for (int i = 0; i < k; i++)
+    {
+        size_t length = RUDP_FEC_LENGTH_BYTES + rudp_fec_segment_length(fec->shards[i]);
+        shard_length = length > shard_length ? length : shard_length;
+        payload += length - RUDP_FEC_LENGTH_BYTES;
+    }
+    for (int i = 0; i < k; i++)
+    {
+        size_t length = RUDP_FEC_LENGTH_BYTES + rudp_fec_segment_length(fec->shards[i]);
+        memset(fec->shards[i] + length, 0, shard_length - length);
+    }
+    for (int i = k; i < k + m; i++)
+    {
+        if (rudp_fec_shard(fec, i) == NULL)
+        {
+            return -1;
+        }
+    }
+    rudp_fec_encode(k, m, fec->shards, shard_length);
+
+    int max_retries = 5;
+    uint64_t sent_ns = 0;
+    uint32_t key = RUDP_NO_TIMESTAMP;
+    for (int transmission = 0; transmission < max_retries; transmission++)
+    {
+        if (transmission > 0) {
+            STATS_ADD(connection, retransmissions, k + m);
+        }
+        sent_ns = rudp_now_ns();
+        for (int i = 0; i < k + m; i++)
+        {
+            memset(&packet.header, 0, sizeof(packet.header));
+            packet.header.sequence_number = connection->next_sequence_number;
+            packet.header.flags.DATA = 1;
+            packet.header.fec.k = (uint8_t)k;
+            packet.header.fec.m = (uint8_t)m;
+            packet.header.fec.index = (uint8_t)i;
+            packet.header.stream = fec->stream;
+            packet.header.stream_sequence = fec->stream_sequence;
+            packet.header.flags.STREAM_FIN = fec->stream_fin;
+            if (i < k)
+            {
+                packet.length = rudp_fec_segment_length(fec->shards[i]);
+                memcpy(packet.data, fec->shards[i] + RUDP_FEC_LENGTH_BYTES, packet.length);
+            }
+            else
+            {
+                packet.length = (int)shard_length;
+                memcpy(packet.data, fec->shards[i], shard_length);
+            }
+            packet.header.checksum = calculate_checksum(&packet.data, packet.length);
+            packet.header.timestamp = timestamp_wall_ns();
+            // The group's RTT runs from its first segment, like sent_ns
+            ssize_t bytes_sent = transmission == 0 && i == 0 ?
+                rudp_transmit_timed(connection, &packet, rudp_segment_size(&packet), (struct sockaddr *)sender_addr, sizeof(*sender_addr), &key) :
+                rudp_transmit(connection, &packet, rudp_segment_size(&packet), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+            if (bytes_sent < 0) {
+                perror("Error sending data packet");
+                return -1;
+            }
+        }
+        STATS_ADD(connection, fec_parity_sent, m);
+        RUDP_LOG(RUDP_LOG_TRACE, "Sent FEC group %lld with %lld parity segments", connection->next_sequence_number, m);
+
+        struct timeval tv;
+        tv.tv_sec = RUDP_ACK_TIMEOUT_US / 1000000;
+        tv.tv_usec = RUDP_ACK_TIMEOUT_US % 1000000;
+        setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+        RUDPPacket ack_packet;
+        socklen_t sender_addr_len = sizeof(struct sockaddr_in);
+        int bytes_received;
+        do {
+            bytes_received = rudp_receive(connection, &ack_packet, sizeof(ack_packet), (struct sockaddr *)sender_addr, &sender_addr_len);
+        } while (bytes_received > 0 && ack_packet.header.flags.ACK == 1 && ack_packet.header.flags.NACK == 0 &&
+                 seq_before(ack_packet.header.sequence_number, connection->next_sequence_number));
+
+        if (bytes_received > 0 && ack_packet.header.flags.RST == 1) {
+            // A receiver that does not decode FEC groups (e.g. a shard) refuses them
+            fprintf(stderr, "The receiver does not take FEC groups\n");
+            connection->reset = 1;
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (bytes_received > 0 && ack_packet.header.flags.ACK == 1 && ack_packet.header.sequence_number == connection->next_sequence_number) {
+            RUDP_LOG(RUDP_LOG_TRACE, "Received ACK for FEC group %lld", connection->next_sequence_number);
+            if (transmission == 0) {
+                rudp_rtt_sample(connection, sent_ns, key);
+                if (ack_packet.header.fec.k > 0) {
+                    rudp_fec_update_loss(connection, (double)ack_packet.header.fec.index / ack_packet.header.fec.k);
+                }
+            }
+            STATS_ADD(connection, goodput_bytes, payload);
+            STATS_ADD(connection, fec_groups, 1);
+            connection->next_sequence_number++;
+            fec->count = 0;
+            return 0;
+        } else if (bytes_received > 0 && ack_packet.header.flags.NACK == 1) {
+            STATS_ADD(connection, nacks_received, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received NACK for FEC group %lld", connection->next_sequence_number);
+        } else {
+            STATS_ADD(connection, timeouts, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "No ACK received for FEC group, retrying...");
+        }
+        // More shards were lost than the group could absorb
+        rudp_fec_update_loss(connection, (double)(m + 1) / (k + m));
+    }
+
+    RUDP_LOG(RUDP_LOG_WARN, "Max retries reached for FEC group %lld", connection->next_sequence_number);
+    return -1;
+}
+
+// Adds one segment to the current FEC group, sending the group once it is full.
+static int rudp_fec_queue(RUDPConnection *connection, int stream, int fin, const char *buffer, int buffer_size, struct sockaddr_in *sender_addr)
+{
+    RUDPFecState *fec = connection->fec;
+    if (buffer_size < 0 || buffer_size > MAX_PACKET_SIZE)
+    {
+        return -1;
+    }
+    // A group carries one stream, and the segment that closes a stream goes out in a group of its own
+    if (fec->count > 0 && (fec->stream != stream || fin) && rudp_fec_send_group(connection, sender_addr) < 0)
+    {
+        return -1;
+    }
+    if (fec->count == 0)
+    {
+        fec->stream = (uint16_t)stream;
+        fec->stream_sequence = connection->stream_sent[stream];
+        fec->stream_fin = fin;
+    }
+    uint8_t *shard = rudp_fec_shard(fec, fec->count);
+    if (shard == NULL)
+    {
+        return -1;
+    }
+    shard[0] = (uint8_t)(buffer_size >> 8);
+    shard[1] = (uint8_t)buffer_size;
+    memcpy(shard + RUDP_FEC_LENGTH_BYTES, buffer, buffer_size);
+    connection->stream_sent[stream]++;
+    if ((++fec->count == fec->config.k || fin) && rudp_fec_send_group(connection, sender_addr) < 0)
+    {
+        return -1;
+    }
+    return buffer_size;
+}
+
+/**
+ * @brief Sends the segments queued for a partial FEC group, does nothing without FEC.
+ * @return 0 on success, -1 on failure.
+ */
+int rudp_flush(RUDPConnection *connection, struct sockaddr_in *sender_addr)
+{
+    if (connection->fec == NULL || connection->fec->config.k == 0 || connection->fec->count == 0)
+    {
+        return 0;
+    }
+    return rudp_fec_send_group(connection, sender_addr);
+}
 
+// Acknowledges an FEC group, reporting how many of the shards seen so far were lost.
+static void rudp_fec_ack(RUDPConnection *connection, uint16_t group, int seen, int lost, struct sockaddr_in *sender_addr)
+{
+    RUDPPacket ack_packet;
+    memset(&ack_packet.header, 0, sizeof(ack_packet.header));
+    ack_packet.header.sequence_number = group;
+    ack_packet.header.flags.ACK = 1;
+    ack_packet.header.fec.k = (uint8_t)seen;
+    ack_packet.header.fec.index = (uint8_t)lost;
+    rudp_transmit(connection, &ack_packet, sizeof(ack_packet.header), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+}
 
 /**
- * @brief A function to create a new RUDP connection.
- * @param receiver_addr The address of the receiver.
- * @param sender_addr The address of the sender.
- * @param sockfd The socket file descriptor.
- * @return A pointer to the newly created RUDPConnection.
- * @note This function handles the three-way handshake for establishing a connection.
- * @note It sends a SYN packet, waits for a SYN-ACK packet, and then sends an ACK packet.
- * @note If any error occurs during the handshake, it prints an error message and exits.
+ * @brief Adds a received FEC segment to the group being collected.
+ *
+ * Once k of the k + m segments are in, the missing data segments are rebuilt and the group is
+ * acknowledged. Segments of groups already delivered are only acknowledged again when they
+ * start a retransmission (index 0), the rest are the unneeded tail of a decoded group.
+ *
+ * @return 1 when the group is complete, 0 to keep receiving, -1 on failure.
  */
-RUDPConnection *rudp_socket(struct sockaddr_in *receiver_addr, struct sockaddr_in *sender_addr, int sockfd)
-{   
-    
-    RUDPConnection *connection = (RUDPConnection *)malloc(sizeof(RUDPConnection));// Allocate memory for the RUDPConnection
-    if (connection == NULL)
+static int rudp_fec_collect(RUDPConnection *connection, RUDPPacket *packet, struct sockaddr_in *sender_addr)
+{
+    RUDPFecState *fec = rudp_fec_state(connection);
+    uint16_t sequence = packet->header.sequence_number;
+    int k = packet->header.fec.k;
+    int m = packet->header.fec.m;
+    int index = packet->header.fec.index;
+
+    if (fec == NULL)
     {
-        perror("Failed to allocate memory for RUDPConnection");
-        exit(1);
+        return -1;
+    }
+    if (seq_before(sequence, connection->next_sequence_number)) {
+        if (index == 0) {
+            STATS_ADD(connection, duplicates, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received old FEC group %lld, expected %lld. Sending ACK.", sequence, connection->next_sequence_number);
+            rudp_fec_ack(connection, sequence, 0, 0, sender_addr);
+        }
+        return 0;
+    }
+    if (sequence != connection->next_sequence_number) {
+        STATS_ADD(connection, out_of_order, 1);
+        STATS_ADD(connection, nacks_sent, 1);
+        RUDPPacket nack_packet;
+        memset(&nack_packet.header, 0, sizeof(nack_packet.header));
+        nack_packet.header.sequence_number = connection->next_sequence_number;
+        nack_packet.header.flags.NACK = 1;
+        rudp_transmit(connection, &nack_packet, sizeof(nack_packet.header), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+        return 0;
     }
 
-    connection->sockfd = sockfd;// Store the socket file descriptor
-    connection->receiver_addr = *receiver_addr;// Store the receiver's address
-    if (sender_addr != NULL)
+    if (!fec->active || fec->group != sequence)
     {
-        connection->sender_addr = *sender_addr;
+        fec->active = 1;
+        fec->group = sequence;
+        fec->group_k = k;
+        fec->group_m = m;
+        fec->received = 0;
+        fec->highest = -1;
+        fec->shard_length = 0;
+        fec->stream = packet->header.stream;
+        fec->stream_sequence = packet->header.stream_sequence;
+        fec->stream_fin = packet->header.flags.STREAM_FIN;
+        memset(fec->present, 0, sizeof(fec->present));
     }
-    connection->next_sequence_number = 1;// Set the next sequence number to 1
-
-    if (sender_addr == NULL)
+    if (k != fec->group_k || m != fec->group_m || k + m > RUDP_FEC_MAX_SHARDS || index >= k + m ||
+        packet->length < 0 || packet->length > (index < k ? MAX_PACKET_SIZE : RUDP_FEC_SHARD_SIZE))
     {
-        // Sender side
-        connection->sender_addr = *receiver_addr; // Store the receiver's address as the sender's address
-
-        RUDPPacket syn_packet;// Create a SYN packet
-        syn_packet.length = htons(RUDP_HEADER_SIZE);// Set the length of the packet
-        syn_packet.header.checksum = 0;// Set the checksum to 0
-        syn_packet.header.flags.SYN = 1;// Set the SYN flag
-        syn_packet.header.checksum = htons(calculate_checksum((char *)&syn_packet, sizeof(RUDPPacket)));// Calculate the checksum
-        printf("Sending SYN packet with checksum: %u\n", ntohs(syn_packet.header.checksum));// Print the checksum
+        RUDP_LOG(RUDP_LOG_DEBUG, "Dropped malformed FEC segment %lld of group %lld", index, sequence);
+        return 0;
+    }
+    if (fec->present[index])
+    {
+        STATS_ADD(connection, duplicates, 1);
+        return 0;
+    }
 
-        if (sendto(sockfd, &syn_packet, RUDP_HEADER_SIZE, 0, (struct sockaddr *)receiver_addr, sizeof(struct sockaddr_in)) < 0)// Send the SYN packet
-        {
-            perror("Error sending SYN packet");
-            free(connection);
-            exit(1);
-        }
+    uint8_t *shard = rudp_fec_shard(fec, index);
+    if (shard == NULL)
+    {
+        return -1;
+    }
+    if (index < k)
+    {
+        shard[0] = (uint8_t)(packet->length >> 8);
+        shard[1] = (uint8_t)packet->length;
+        memcpy(shard + RUDP_FEC_LENGTH_BYTES, packet->data, packet->length);
+    }
+    else
+    {
+        memcpy(shard, packet->data, packet->length);
+        fec->shard_length = packet->length;
+    }
+    fec->present[index] = 1;
+    fec->received++;
+    fec->highest = index > fec->highest ? index : fec->highest;
+    if (fec->received < k)
+    {
+        return 0;
+    }
 
-        RUDPPacket synack_packet;// Create a SYN-ACK packet
-        struct sockaddr_in synack_sender_addr;
-        socklen_t synack_sender_addr_len = sizeof(synack_sender_addr);
-        while (1)
+    // Rebuild the data segments that did not arrive
+    int missing = 0;
+    for (int i = 0; i < k; i++)
+    {
+        missing += !fec->present[i];
+    }
+    if (missing > 0)
+    {
+        for (int i = 0; i < k; i++)
         {
-            if (recvfrom(sockfd, &synack_packet, sizeof(RUDPPacket), 0, (struct sockaddr *)&synack_sender_addr, &synack_sender_addr_len) < 0)
-            {
-                perror("Error receiving SYN-ACK packet");
-                free(connection);
-                exit(1);
-            }
-
-            if (synack_packet.header.flags.SYN == 1 && synack_packet.header.flags.ACK == 1)
+            if (fec->present[i])
             {
-                printf("Received SYN-ACK packet with checksum: %u\n", ntohs(synack_packet.header.checksum));
-                if (verify_checksum(&synack_packet, sizeof(RUDPPacket), synack_packet.header.checksum) == 0)
+                size_t length = RUDP_FEC_LENGTH_BYTES + rudp_fec_segment_length(fec->shards[i]);
+                if (length > fec->shard_length)
                 {
-                    break;
+                    RUDP_LOG(RUDP_LOG_WARN, "FEC group %lld is inconsistent, waiting for a retransmission", sequence);
+                    fec->active = 0;
+                    return 0;
                 }
+                memset(fec->shards[i] + length, 0, fec->shard_length - length);
             }
-        }
-
-        RUDPPacket ack_packet;// Create an ACK packet
-        ack_packet.length = htons(RUDP_HEADER_SIZE);
-        ack_packet.header.checksum = 0;
-        ack_packet.header.flags.ACK = 1;
-        ack_packet.header.checksum = htons(calculate_checksum((char *)&ack_packet, sizeof(RUDPPacket)));
-        printf("Sending ACK packet with checksum: %u\n", ntohs(ack_packet.header.checksum));
-
-        if (sendto(sockfd, &ack_packet, RUDP_HEADER_SIZE, 0, (struct sockaddr *)&synack_sender_addr, sizeof(struct sockaddr_in)) < 0)
-        {
-            perror("Error sending ACK packet");
-            free(connection);
-            exit(1);
-        }
-    }
-    else
-    {
-        // Receiver side
-        RUDPPacket syn_packet;// Create a SYN packet
-        struct sockaddr_in syn_sender_addr;
-        socklen_t syn_sender_addr_len = sizeof(syn_sender_addr);
-        while (1)// Wait for a SYN packet
-        {
-            if (recvfrom(sockfd, &syn_packet, sizeof(RUDPPacket), 0, (struct sockaddr *)&syn_sender_addr, &syn_sender_addr_len) < 0)
+            else if (rudp_fec_shard(fec, i) == NULL)
             {
-                perror("Error receiving SYN packet");
-                free(connection);
-                exit(1);
+                return -1;
             }
-
-            if (syn_packet.header.flags.SYN == 1)
+        }
+        rudp_fec_decode(k, m, fec->shards, fec->present, fec->shard_length);
+        for (int i = 0; i < k; i++)
+        {
+            if (RUDP_FEC_LENGTH_BYTES + (size_t)rudp_fec_segment_length(fec->shards[i]) > fec->shard_length)
             {
-                printf("Received SYN packet with checksum: %u\n", ntohs(syn_packet.header.checksum));
-                if (verify_checksum(&syn_packet, sizeof(RUDPPacket), syn_packet.header.checksum) == 0)
-                {
-                    connection->sender_addr = syn_sender_addr; // Store the sender's address
-                    break;
-                }
+                RUDP_LOG(RUDP_LOG_WARN, "FEC group %lld did not decode, waiting for a retransmission", sequence);
+                fec->active = 0;
+                return 0;
             }
         }
+        STATS_ADD(connection, fec_recovered, missing);
+        RUDP_LOG(RUDP_LOG_DEBUG, "Rebuilt %lld segments of FEC group %lld", missing, sequence);
+    }
 
-        RUDPPacket synack_packet;// Create a SYN-ACK packet
-        synack_packet.length = htons(RUDP_HEADER_SIZE);
-        synack_packet.header.checksum = 0;
-        synack_packet.header.flags.SYN = 1;
-        synack_packet.header.flags.ACK = 1;
-        synack_packet.header.checksum = htons(calculate_checksum((char *)&synack_packet, sizeof(RUDPPacket)));
-        printf("Sending SYN-ACK packet with checksum: %u\n", ntohs(synack_packet.header.checksum));
+    rudp_fec_ack(connection, sequence, fec->highest + 1, fec->highest + 1 - fec->received, sender_addr);
+    STATS_ADD(connection, fec_groups, 1);
+    STATS_SET(connection, fec_parity, m);
+    connection->next_sequence_number++;
+    fec->active = 0;
+    fec->deliver_next = 0;
+    fec->deliver_count = k;
+    return 1;
+}
 
-        if (sendto(sockfd, &synack_packet, RUDP_HEADER_SIZE, 0, (struct sockaddr *)&syn_sender_addr, sizeof(struct sockaddr_in)) < 0)
-        {
-            perror("Error sending SYN-ACK packet");
-            free(connection);
-            exit(1);
-        }
+// Copies the next segment of the decoded group to the caller, the group's stream numbers its segments in order.
+static int rudp_fec_deliver(RUDPConnection *connection, char *buffer, int buffer_size, RUDPStreamInfo *info)
+{
+    RUDPFecState *fec = connection->fec;
+    RUDPHeader header;
+    memset(&header, 0, sizeof(header));
+    header.stream = fec->stream;
+    header.stream_sequence = fec->stream_sequence + (uint32_t)fec->deliver_next;
+    header.flags.STREAM_FIN = fec->stream_fin;
+    rudp_stream_deliver(connection, &header, info);
 
-        RUDPPacket ack_packet;// Create an ACK packet
-        while (1)// Wait for an ACK packet
-        {
-            if (recvfrom(sockfd, &ack_packet, sizeof(RUDPPacket), 0, NULL, NULL) < 0)
-            {
-                perror("Error receiving ACK packet");
-                free(connection);
-                exit(1);
-            }
+    uint8_t *shard = fec->shards[fec->deliver_next++];
+    int length = rudp_fec_segment_length(shard);
 
-            if (ack_packet.header.flags.ACK == 1)
-            {
-                printf("Received ACK packet with checksum: %u\n", ntohs(ack_packet.header.checksum));
-                if (verify_checksum(&ack_packet, sizeof(RUDPPacket), ack_packet.header.checksum) == 0)
-                {
-                    break;
-                }
-            }
-        }
+    if (length > buffer_size) {
+        length = buffer_size;  // Truncate to the caller's buffer
     }
-
-    return connection;
+    memcpy(buffer, shard + RUDP_FEC_LENGTH_BYTES, length);
+    STATS_ADD(connection, goodput_bytes, length);
+    return length;
 }
+
 /**
- * @brief Sends a data packet over a RUDP connection.
- * 
- * This function prepares and sends a data packet, then waits for an acknowledgment.
- * It handles retransmissions if no ACK is received or if a NACK is received.
- * 
- * @param connection Pointer to the RUDPConnection structure.
- * @param buffer Pointer to the data buffer to be sent.
- * @param buffer_size Size of the data buffer in bytes.
- * @param sender_addr Pointer to the sockaddr_in structure containing the sender's address.
- * 
- * @return Number of bytes sent on success, -1 on failure.
+ * @brief Fills a data packet: header, payload and the checksum over the payload.
  */
-int rudp_send(RUDPConnection *connection, char *buffer, int buffer_size, struct sockaddr_in *sender_addr)
+void rudp_packet_encode(RUDPPacket *packet, uint16_t sequence_number, const char *data, int length)
+{
+    memset(&packet->header, 0, sizeof(packet->header));
+    packet->length = length;
+    memcpy(packet->data, data, length);
+    packet->header.sequence_number = sequence_number;
+    packet->header.checksum = calculate_checksum(&packet->data, length);
+    packet->header.flags.DATA = 1;
+}
+
+// Keeps a copy of a sent packet, the oldest of the PACKET_HISTORY_SIZE copies is overwritten.
+void rudp_history_store(const RUDPPacket *packet)
+{
+    packet_history[history_index] = *packet;
+    history_index = (history_index + 1) % PACKET_HISTORY_SIZE;
+}
+
+// The copy of a recently sent packet a NACK asks for, NULL if it is no longer kept.
+const RUDPPacket *rudp_history_find(uint16_t sequence_number)
+{
+    for (int i = 0; i < PACKET_HISTORY_SIZE; i++)
+    {
+        if (packet_history[i].header.sequence_number == sequence_number)
+        {
+            return &packet_history[i];
+        }
+    }
+    return NULL;
+}
+
+// Sends one segment of a stream and waits for its ACK, `fin` closes the stream.
+static int rudp_send_segment(RUDPConnection *connection, int stream, int fin, const char *buffer, int buffer_size, struct sockaddr_in *sender_addr)
 {
+    if (connection->fec != NULL && connection->fec->config.k > 0) {
+        // A group cannot ride in a SYN
+        if (rudp_handshake(connection) < 0) {
+            return -1;
+        }
+        return rudp_fec_queue(connection, stream, fin, buffer, buffer_size, sender_addr);
+    }
+
     RUDPPacket packet;
-    packet.length = buffer_size;  // Set the packet length
-    memcpy(packet.data, buffer, buffer_size);  // Copy data to the packet
-    packet.header.sequence_number = connection->next_sequence_number;  // Set the sequence number
-    packet.header.checksum = calculate_checksum(&packet.data, sizeof(packet.data));  // Calculate the checksum
-    packet.header.flags.DATA = 1;  // Mark the packet as a data packet
+    rudp_packet_encode(&packet, connection->next_sequence_number, buffer, buffer_size);
+    packet.header.stream = (uint16_t)stream;
+    packet.header.stream_sequence = connection->stream_sent[stream];
+    packet.header.flags.STREAM_FIN = fin;
+    if (connection->syn_pending) {
+        // The first segment opens the connection, with the token of an earlier one if there is one
+        packet.header.flags.SYN = 1;
+        packet.header.token = connection->token;
+    }
 
     int max_retries = 5;  // Maximum number of retransmission attempts
     int retry_count = 0;  // Current retry count
 
+    int transmissions = 0;  // Karn's algorithm: only packets sent once give an RTT sample
+    uint64_t sent_ns = 0;
+    uint32_t key = RUDP_NO_TIMESTAMP;
+
     while (retry_count < max_retries) {
         // Send the packet
-        int bytes_sent = sendto(connection->sockfd, &packet, sizeof(packet), 0, (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+        if (transmissions++ > 0) {
+            STATS_ADD(connection, retransmissions, 1);
+        }
+        sent_ns = rudp_now_ns();
+        packet.header.timestamp = timestamp_wall_ns();
+        int bytes_sent = transmissions == 1 ?
+            rudp_transmit_timed(connection, &packet, rudp_segment_size(&packet), (struct sockaddr *)sender_addr, sizeof(*sender_addr), &key) :
+            rudp_transmit(connection, &packet, rudp_segment_size(&packet), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
         if (bytes_sent < 0) {
             perror("Error sending data packet");
             return -1;
         }
 
-        printf("Sent packet with sequence number: %u\n", packet.header.sequence_number);
+        RUDP_LOG(RUDP_LOG_TRACE, "Sent packet with sequence number: %lld", packet.header.sequence_number);
 
-        // Store the packet in history
-        packet_history[history_index] = packet;
-        history_index = (history_index + 1) % PACKET_HISTORY_SIZE;
+        rudp_history_store(&packet);
 
         RUDPPacket ack_packet;
         socklen_t sender_addr_len = sizeof(struct sockaddr_in);
         
         // Set timeout for receiving ACK
         struct timeval tv;
-        tv.tv_sec = 1;  // 1 second timeout
-        tv.tv_usec = 0;
+        tv.tv_sec = RUDP_ACK_TIMEOUT_US / 1000000;
+        tv.tv_usec = RUDP_ACK_TIMEOUT_US % 1000000;
         setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
 
-        // Try to receive ACK
-        int bytes_received = recvfrom(connection->sockfd, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)sender_addr, &sender_addr_len);
+        // Try to receive ACK, stale ACKs of earlier packets (duplicated or late datagrams) are skipped
+        int bytes_received;
+        int answered = 0;
+        while (1) {
+            bytes_received = rudp_receive(connection, &ack_packet, sizeof(ack_packet), (struct sockaddr *)sender_addr, &sender_addr_len);
+            if (bytes_received >= (int)RUDP_SEGMENT_HEADER_SIZE && ack_packet.header.flags.DATA == 1 && ack_packet.header.flags.SYN == 0) {
+                // A half duplex exchange (see Manifest.h): both sides number their segments on the same sequence
+                if (seq_before(ack_packet.header.sequence_number, connection->next_sequence_number)) {
+                    // The peer still resends its last segment, our ACK of it was lost
+                    RUDPPacket stale_ack;
+                    memset(&stale_ack.header, 0, sizeof(stale_ack.header));
+                    stale_ack.header.sequence_number = ack_packet.header.sequence_number;
+                    stale_ack.header.flags.ACK = 1;
+                    stale_ack.header.window = rudp_receive_window(connection->sockfd, 1);
+                    rudp_transmit(connection, &stale_ack, sizeof(stale_ack.header), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+                    continue;
+                }
+                // The peer already answers after our segment, so it took it and only its ACK was lost
+                answered = seq_before(connection->next_sequence_number, ack_packet.header.sequence_number);
+                break;
+            }
+            if (bytes_received > 0 && ack_packet.header.flags.ACK == 1 && ack_packet.header.flags.NACK == 0 &&
+                ack_packet.header.flags.SYN == 0 && seq_before(ack_packet.header.sequence_number, connection->next_sequence_number)) {
+                continue;
+            }
+            break;
+        }
 
-        if (bytes_received > 0 && ack_packet.header.flags.ACK == 1 && ack_packet.header.sequence_number == connection->next_sequence_number) {
-            // Received valid ACK
-            printf("Received ACK for packet %u\n", connection->next_sequence_number);
+        if (bytes_received > 0 && ack_packet.header.flags.SYN == 1 && ack_packet.header.flags.ACK == 1 && packet.header.flags.SYN == 1) {
+            // Handshake done, the token is kept for the next connection
+            connection->syn_pending = 0;
+            connection->token = ack_packet.header.token;
+            STATS_SET(connection, rwnd, ack_packet.header.window);
+            packet.header.flags.SYN = 0;
+            packet.header.token = 0;
+            if (ack_packet.header.sequence_number != connection->next_sequence_number) {
+                // The receiver did not take the segment with the SYN (no valid token), send it again now
+                RUDP_LOG(RUDP_LOG_DEBUG, "SYN-ACK without the first segment, sending it again");
+                transmissions = 0;
+                continue;
+            }
+        }
+
+        if (answered || (bytes_received > 0 && ack_packet.header.flags.ACK == 1 && ack_packet.header.sequence_number == connection->next_sequence_number)) {
+            // Received valid ACK, one segment at a time never outruns the receive window
+            RUDP_LOG(RUDP_LOG_TRACE, "Received ACK for packet %lld", connection->next_sequence_number);
+            if (!answered) {
+                STATS_SET(connection, rwnd, ack_packet.header.window);
+            }
+            if (transmissions == 1 && !answered) {
+                rudp_rtt_sample(connection, sent_ns, key);
+            }
+            STATS_ADD(connection, goodput_bytes, buffer_size);
             connection->next_sequence_number++;
+            connection->stream_sent[stream]++;
             return bytes_sent;
         } else if (bytes_received > 0 && ack_packet.header.flags.NACK == 1) {
             // Received NACK
-            printf("Received NACK for packet %u, expected %u\n", connection->next_sequence_number, ack_packet.header.sequence_number);
-            if (ack_packet.header.sequence_number < connection->next_sequence_number) {
+            STATS_ADD(connection, nacks_received, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received NACK for packet %lld, expected %lld", connection->next_sequence_number, ack_packet.header.sequence_number);
+            if (seq_before(ack_packet.header.sequence_number, connection->next_sequence_number)) {
                 // Receiver expects a lower sequence number, go back
-                for (int i = 0; i < PACKET_HISTORY_SIZE; i++) {
-                    if (packet_history[i].header.sequence_number == ack_packet.header.sequence_number) {
-                        packet = packet_history[i];  // Retrieve the old packet from history
-                        connection->next_sequence_number = ack_packet.header.sequence_number;
-                        retry_count = 0;  // Reset retry count
-                        break;
-                    }
+                const RUDPPacket *old = rudp_history_find(ack_packet.header.sequence_number);
+                if (old != NULL) {
+                    packet = *old;
+                    connection->next_sequence_number = ack_packet.header.sequence_number;
+                    retry_count = 0;  // Reset retry count
                 }
             }
         } else {
             // No response received
-            printf("No ACK received, retrying...\n");
+            STATS_ADD(connection, timeouts, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "No ACK received, retrying...");
         }
 
         retry_count++;
     }
 
-    printf("Max retries reached for packet %u\n", connection->next_sequence_number);
+    RUDP_LOG(RUDP_LOG_WARN, "Max retries reached for packet %lld", connection->next_sequence_number);
+    return -1;
+}
+
+/**
+ * @brief Sends a data packet over a RUDP connection.
+ * 
+ * This function prepares and sends a data packet, then waits for an acknowledgment.
+ * It handles retransmissions if no ACK is received or if a NACK is received.
+ * 
+ * @param connection Pointer to the RUDPConnection structure.
+ * @param buffer Pointer to the data buffer to be sent.
+ * @param buffer_size Size of the data buffer in bytes.
+ * @param sender_addr Pointer to the sockaddr_in structure containing the sender's address.
+ * 
+ * @return Number of bytes sent on success, -1 on failure.
+ * @note The segment goes on stream 0 (RUDP_STREAM_DATA), see rudp_stream_write() for the others.
+ */
+int rudp_send(RUDPConnection *connection, char *buffer, int buffer_size, struct sockaddr_in *sender_addr)
+{
+    return rudp_send_segment(connection, RUDP_STREAM_DATA, 0, buffer, buffer_size, sender_addr);
+}
+
+/**
+ * @brief Opens a stream of its own, e.g. for a second file or a flow of messages.
+ *
+ * Nothing is sent, the peer learns of the stream from its first segment. The connection
+ * numbers the segments of every stream apart, so a receiver hands out each stream in order
+ * without waiting for the segments of the others (see rudp_stream_read()).
+ *
+ * @return The stream, -1 if RUDP_MAX_STREAMS are open already.
+ */
+int rudp_stream_open(RUDPConnection *connection)
+{
+    for (int stream = RUDP_STREAM_CONTROL + 1; stream < RUDP_MAX_STREAMS; stream++)
+    {
+        if (!connection->stream_open[stream])
+        {
+            connection->stream_open[stream] = 1;
+            return stream;
+        }
+    }
+    RUDP_LOG(RUDP_LOG_WARN, "All %lld streams are open", RUDP_MAX_STREAMS);
     return -1;
 }
+
+// Whether segments may be written on `stream`.
+static int rudp_stream_writable(const RUDPConnection *connection, int stream)
+{
+    if (stream < 0 || stream >= RUDP_MAX_STREAMS || !connection->stream_open[stream])
+    {
+        RUDP_LOG(RUDP_LOG_WARN, "Stream %lld is not open", stream);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends one segment on an open stream, like rudp_send() does on stream 0.
+ * @return Number of bytes sent on success, -1 on failure or if the stream is not open.
+ */
+int rudp_stream_write(RUDPConnection *connection, int stream, const char *buffer, int buffer_size, struct sockaddr_in *sender_addr)
+{
+    if (!rudp_stream_writable(connection, stream))
+    {
+        return -1;
+    }
+    return rudp_send_segment(connection, stream, 0, buffer, buffer_size, sender_addr);
+}
+
+/**
+ * @brief Closes a stream opened with rudp_stream_open(), the peer reads an empty segment marked fin.
+ *
+ * Streams 0 and 1 last as long as the connection. A closed stream may be handed out again by
+ * rudp_stream_open(), its segments keep counting from where they stopped.
+ *
+ * @return 0 on success, -1 on failure or if the stream is not open.
+ */
+int rudp_stream_close(RUDPConnection *connection, int stream, struct sockaddr_in *sender_addr)
+{
+    if (stream <= RUDP_STREAM_CONTROL || !rudp_stream_writable(connection, stream))
+    {
+        return -1;
+    }
+    connection->stream_open[stream] = 0;
+    return rudp_send_segment(connection, stream, 1, "", 0, sender_addr) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Counts a segment as handed to the application and tells which stream it belongs to.
+ *
+ * Used by rudp_stream_read() and the engine. A segment the application already had, e.g.
+ * handed out by an engine that stopped before the gap in front of it was filled, is not
+ * counted again.
+ *
+ * @param info Filled with the stream of the segment, may be NULL.
+ * @return 1 if the segment is new to its stream, 0 if it was handed out before.
+ */
+int rudp_stream_deliver(RUDPConnection *connection, const RUDPHeader *header, RUDPStreamInfo *info)
+{
+    uint32_t *delivered = &connection->stream_delivered[header->stream];
+
+    if ((int32_t)(header->stream_sequence - *delivered) < 0)
+    {
+        return 0;
+    }
+    *delivered = header->stream_sequence + 1;
+    if (info != NULL)
+    {
+        info->stream = header->stream;
+        info->fin = header->flags.STREAM_FIN;
+    }
+    return 1;
+}
 /**
  * @brief Receives a data packet over a RUDP connection.
  * 
@@ -263,6 +1373,21 @@ int rudp_send(RUDPConnection *connection, char *buffer, int buffer_size, struct
  */
 
 int rudp_recv(RUDPConnection *connection, char *buffer, int buffer_size, struct sockaddr_in *sender_addr)
+{
+    return rudp_stream_read(connection, buffer, buffer_size, NULL, sender_addr);
+}
+
+/**
+ * @brief Receives the next segment of any stream, like rudp_recv(), and tells which stream it belongs to.
+ *
+ * The blocking API takes segments in the order they were sent, so every stream comes out in
+ * order; the engine (rudp_engine_read()) also hands out a stream's segments while another
+ * stream waits for a retransmission.
+ *
+ * @param info Filled with the stream of the segment, may be NULL.
+ * @return Number of bytes received (0 for the end of a stream), -1 on failure.
+ */
+int rudp_stream_read(RUDPConnection *connection, char *buffer, int buffer_size, RUDPStreamInfo *info, struct sockaddr_in *sender_addr)
 {
     RUDPPacket packet;
     socklen_t sender_addr_len = sizeof(*sender_addr);
@@ -270,54 +1395,116 @@ int rudp_recv(RUDPConnection *connection, char *buffer, int buffer_size, struct
     int valid_checksum;
     uint16_t last_in_order_sequence = connection->next_sequence_number - 1;  // Last in-order sequence number received
 
+    // The segment that came with the SYN is handed out first
+    if (connection->pending != NULL) {
+        int length = connection->pending->length < buffer_size ? connection->pending->length : buffer_size;
+        memcpy(buffer, connection->pending->data, length);
+        rudp_stream_deliver(connection, &connection->pending->header, info);
+        free(connection->pending);
+        connection->pending = NULL;
+        return length;
+    }
+
+    // Segments of a decoded FEC group are handed out before reading the socket again
+    if (connection->fec != NULL && connection->fec->deliver_next < connection->fec->deliver_count) {
+        return rudp_fec_deliver(connection, buffer, buffer_size, info);
+    }
+
     while (1) {
-        // Receive a packet
-        bytes_received = recvfrom(connection->sockfd, &packet, buffer_size, 0, (struct sockaddr *)sender_addr, &sender_addr_len);
+        // Receive a packet, the datagram is a whole segment whatever the size of the caller's buffer
+        bytes_received = rudp_receive(connection, &packet, sizeof(packet), (struct sockaddr *)sender_addr, &sender_addr_len);
         if (bytes_received < 0) {
             perror("Error receiving data packet");
             return -1;
         }
 
+        if (packet.header.flags.SYN == 1) {
+            // The sender did not get the SYN-ACK yet
+            rudp_answer_syn(connection, &packet, bytes_received, sender_addr);
+            continue;
+        }
+        if (rudp_segment_length(&packet, bytes_received) < 0) {
+            // A control packet, e.g. the ACK that ends an older sender's handshake
+            continue;
+        }
+
         // Verify checksum
-        valid_checksum = verify_checksum(&packet.data, sizeof(packet.data), packet.header.checksum);
+        valid_checksum = verify_checksum(&packet.data, packet.length, packet.header.checksum);
         
-        printf("Received packet with sequence number: %u, expected: %u\n", packet.header.sequence_number, connection->next_sequence_number);
+        RUDP_LOG(RUDP_LOG_TRACE, "Received packet with sequence number: %lld, expected: %lld", packet.header.sequence_number, connection->next_sequence_number);
+
+        if (valid_checksum != 1 || packet.header.stream >= RUDP_MAX_STREAMS) {
+            // Corrupted, drop it and let the sender retransmit
+            if (valid_checksum != 1) {
+                STATS_ADD(connection, checksum_failures, 1);
+            }
+            RUDP_LOG(RUDP_LOG_DEBUG, "Dropped invalid packet %lld", packet.header.sequence_number);
+            continue;
+        }
+        rudp_delay_sample(connection, &packet.header);
+        connection->data_rx_ns = connection->rx_ns;
+
+        if (packet.header.fec.k > 0) {
+            int complete = rudp_fec_collect(connection, &packet, sender_addr);
+            if (complete < 0) {
+                return -1;
+            }
+            if (complete > 0) {
+                return rudp_fec_deliver(connection, buffer, buffer_size, info);
+            }
+            continue;
+        }
         
-        if (packet.header.sequence_number == connection->next_sequence_number && packet.header.flags.DATA == 1 && valid_checksum == 1) {
+        if (packet.header.sequence_number == connection->next_sequence_number) {
             // Received valid packet in correct order
-            printf("Valid packet received\n");
+            RUDP_LOG(RUDP_LOG_TRACE, "Valid packet received");
+            if (packet.length > buffer_size) {
+                packet.length = buffer_size;  // Truncate to the caller's buffer
+            }
             memcpy(buffer, packet.data, packet.length);  // Copy data to buffer
+            STATS_ADD(connection, goodput_bytes, packet.length);
             
             connection->next_sequence_number++;
             last_in_order_sequence = packet.header.sequence_number;
-        } else if (packet.header.sequence_number < connection->next_sequence_number) {
+        } else if (seq_before(packet.header.sequence_number, connection->next_sequence_number)) {
             // Received old packet
-            printf("Received old packet %u, expected %u. Sending ACK.\n", packet.header.sequence_number, connection->next_sequence_number);
+            STATS_ADD(connection, duplicates, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received old packet %lld, expected %lld. Sending ACK.", packet.header.sequence_number, connection->next_sequence_number);
             RUDPPacket ack_packet;
+            memset(&ack_packet.header, 0, sizeof(ack_packet.header));
             ack_packet.header.sequence_number = packet.header.sequence_number;
             ack_packet.header.flags.ACK = 1;
-            sendto(connection->sockfd, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+            ack_packet.header.window = rudp_receive_window(connection->sockfd, 1);
+            rudp_transmit(connection, &ack_packet, sizeof(ack_packet.header), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
             continue;
-        } else if (packet.header.sequence_number > connection->next_sequence_number) {
+        } else if (seq_before(connection->next_sequence_number, packet.header.sequence_number)) {
             // Received future packet
-            printf("Received future packet %u, expected %u. Sending NACK.\n", packet.header.sequence_number, connection->next_sequence_number);
+            STATS_ADD(connection, out_of_order, 1);
+            STATS_ADD(connection, nacks_sent, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received future packet %lld, expected %lld. Sending NACK.", packet.header.sequence_number, connection->next_sequence_number);
             RUDPPacket nack_packet;
+            memset(&nack_packet.header, 0, sizeof(nack_packet.header));
             nack_packet.header.sequence_number = connection->next_sequence_number;
             nack_packet.header.flags.NACK = 1;
-            sendto(connection->sockfd, &nack_packet, sizeof(nack_packet), 0, (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+            rudp_transmit(connection, &nack_packet, sizeof(nack_packet.header), (struct sockaddr *)sender_addr, sizeof(*sender_addr));
             continue;
         }
 
         // Send cumulative ACK
         RUDPPacket cumulative_ack;
+        memset(&cumulative_ack.header, 0, sizeof(cumulative_ack.header));
         cumulative_ack.header.sequence_number = last_in_order_sequence;
         cumulative_ack.header.flags.ACK = 1;
-        if (sendto(connection->sockfd, &cumulative_ack, sizeof(cumulative_ack), 0, (struct sockaddr *)sender_addr, sizeof(*sender_addr)) < 0) {
+        cumulative_ack.header.window = rudp_receive_window(connection->sockfd, 1);
+        if (rudp_transmit(connection, &cumulative_ack, sizeof(cumulative_ack.header), (struct sockaddr *)sender_addr, sizeof(*sender_addr)) < 0) {
             perror("Error sending ACK packet");
             return -1;
         }
-        printf("Sent ACK for packet %u\n", last_in_order_sequence);
+        RUDP_LOG(RUDP_LOG_TRACE, "Sent ACK for packet %lld", last_in_order_sequence);
 
+        if (rudp_stream_deliver(connection, &packet.header, info) == 0) {
+            continue;
+        }
         return packet.length;  // Return the length of received data
     }
 }
@@ -339,30 +1526,38 @@ int rudp_recv_fin(RUDPConnection *connection){
     //do - while until we get a FIN packet
     do{
         // Receive a FIN packet
-        bytes_received = recvfrom(connection->sockfd, &fin_packet, sizeof(fin_packet), 0, (struct sockaddr *)&connection->sender_addr, &sender_addr_len);
+        bytes_received = rudp_receive(connection, &fin_packet, sizeof(fin_packet), (struct sockaddr *)&connection->sender_addr, &sender_addr_len);
         if (bytes_received < 0)
         {
             perror("Error receiving FIN packet");
             return -1;
         }
         if(fin_packet.header.flags.FIN != 1){
-            printf("Error receiving FIN packet\n");
-            
+            RUDP_LOG(RUDP_LOG_DEBUG, "Waiting for FIN, got another packet");
+            if (fin_packet.header.flags.DATA == 1 && seq_before(fin_packet.header.sequence_number, connection->next_sequence_number)) {
+                // The ACK of the last data packet was lost, acknowledge the retransmission again
+                RUDPPacket ack_packet;
+                memset(&ack_packet.header, 0, sizeof(ack_packet.header));
+                ack_packet.header.sequence_number = fin_packet.header.sequence_number;
+                ack_packet.header.flags.ACK = 1;
+                rudp_transmit(connection, &ack_packet, sizeof(ack_packet.header), (struct sockaddr *)&connection->sender_addr, sizeof(connection->sender_addr));
+            }
         }
-        printf("Received FIN packet with checksum: %u\n", fin_packet.header.checksum);
-        printf("Received FIN packet with sequence number: %u\n", fin_packet.header.sequence_number);
+        RUDP_LOG(RUDP_LOG_DEBUG, "Received FIN packet with checksum: %lld", fin_packet.header.checksum);
+        RUDP_LOG(RUDP_LOG_DEBUG, "Received FIN packet with sequence number: %lld", fin_packet.header.sequence_number);
     }while(fin_packet.header.flags.FIN != 1);
 
     RUDPPacket fin_ack_packet;
+    memset(&fin_ack_packet.header, 0, sizeof(fin_ack_packet.header));
     fin_ack_packet.header.flags.FIN_ACK = 1;
     char *fin_ack_massage = "FIN_ACK";
     memcpy(fin_ack_packet.data, fin_ack_massage, strlen(fin_ack_massage));
-    if (sendto(connection->sockfd, &fin_ack_packet, sizeof(fin_ack_packet), 0, (struct sockaddr *)&connection->sender_addr, sizeof(connection->sender_addr)) < 0)
+    if (rudp_transmit(connection, &fin_ack_packet, sizeof(fin_ack_packet.header), (struct sockaddr *)&connection->sender_addr, sizeof(connection->sender_addr)) < 0)
     {
         perror("Error sending FIN_ACK packet");
         return -1;
     }
-    printf("Sending FIN_ACK packet with checksum: %u\n", fin_ack_packet.header.flags.FIN_ACK);
+    RUDP_LOG(RUDP_LOG_DEBUG, "Sending FIN_ACK packet with checksum: %lld", fin_ack_packet.header.flags.FIN_ACK);
     return 0;
 }
 /**
@@ -377,34 +1572,181 @@ int rudp_recv_fin(RUDPConnection *connection){
  * @return 0 on success, or -1 on error.
  */
 int rudp_send_fin(RUDPConnection *connection){
+    // Nothing was sent, the receiver still waits for the SYN
+    if (rudp_handshake(connection) < 0) {
+        return -1;
+    }
+    // Data still waiting in a partial FEC group goes out before the FIN
+    if (rudp_flush(connection, &connection->sender_addr) < 0) {
+        return -1;
+    }
     RUDPPacket fin_packet;
+    memset(&fin_packet.header, 0, sizeof(fin_packet.header));
     fin_packet.header.flags.FIN = 1;
     char *fin_massage = "FIN";
     memcpy(fin_packet.data, fin_massage, strlen(fin_massage));
-    if (sendto(connection->sockfd, &fin_packet, sizeof(fin_packet), 0, (struct sockaddr *)&connection->sender_addr, sizeof(connection->sender_addr)) < 0)
-    {
-        perror("Error sending FIN packet");
-        return -1;
-    }
-    printf("Sending FIN packet with checksum: %u\n", fin_packet.header.flags.FIN);
-    //wait for FIN_ACK
     RUDPPacket fin_ack_packet;
     socklen_t sender_addr_len = sizeof(connection->sender_addr);
-    if(recvfrom(connection->sockfd, &fin_ack_packet, sizeof(fin_ack_packet), 0, (struct sockaddr *)&connection->sender_addr, &sender_addr_len)<0){
-        perror("Error receiving FIN_ACK packet");
-        return -1;
+
+    // Same wait as for an ACK, the socket may still carry another timeout (e.g. after an engine stopped)
+    struct timeval tv;
+    tv.tv_sec = RUDP_ACK_TIMEOUT_US / 1000000;
+    tv.tv_usec = RUDP_ACK_TIMEOUT_US % 1000000;
+    setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+    // Resend the FIN until the FIN_ACK arrives, either one may be lost
+    for (int retry_count = 0; retry_count < 5; retry_count++)
+    {
+        if (rudp_transmit(connection, &fin_packet, sizeof(fin_packet.header), (struct sockaddr *)&connection->sender_addr, sizeof(connection->sender_addr)) < 0)
+        {
+            perror("Error sending FIN packet");
+            return -1;
+        }
+        RUDP_LOG(RUDP_LOG_DEBUG, "Sending FIN packet with checksum: %lld", fin_packet.header.flags.FIN);
+        //wait for FIN_ACK
+        int bytes_received;
+        do {
+            bytes_received = rudp_receive(connection, &fin_ack_packet, sizeof(fin_ack_packet), (struct sockaddr *)&connection->sender_addr, &sender_addr_len);
+        } while (bytes_received > 0 && fin_ack_packet.header.flags.FIN_ACK != 1);
+        if (bytes_received > 0)
+        {
+            RUDP_LOG(RUDP_LOG_DEBUG, "Received FIN_ACK packet with checksum: %lld", fin_ack_packet.header.flags.FIN_ACK);
+            return 0;
+        }
     }
-    printf("Received FIN_ACK packet with checksum: %u\n", fin_ack_packet.header.flags.FIN_ACK);
-    return 0;
+    RUDP_LOG(RUDP_LOG_WARN, "No FIN_ACK received");
+    return -1;
 }
 
 // Closes a connection between peers.
 void rudp_close(RUDPConnection *connection)
 {
+    free(connection->pending);
+    free(connection->unread);
+    if (connection->fec != NULL)
+    {
+        for (int i = 0; i < RUDP_FEC_MAX_SHARDS; i++)
+        {
+            free(connection->fec->shards[i]);
+        }
+        free(connection->fec);
+    }
+    for (int i = 1; i < connection->path_count; i++)
+    {
+        close(connection->paths[i].sockfd);
+    }
     close(connection->sockfd);
     free(connection);
 }
 
+/**
+ * @brief Takes a snapshot of the connection statistics.
+ *
+ * Safe to call from another thread while the connection is in use, every field is read
+ * atomically (the snapshot as a whole is not).
+ *
+ * @param connection The connection.
+ * @return The counters, with elapsed_ns and goodput_mbs computed at the time of the call.
+ */
+RUDPStats rudp_get_stats(RUDPConnection *connection)
+{
+    RUDPStats stats;
+    stats.packets_sent = STATS_GET(connection, packets_sent);
+    stats.bytes_sent = STATS_GET(connection, bytes_sent);
+    stats.packets_received = STATS_GET(connection, packets_received);
+    stats.bytes_received = STATS_GET(connection, bytes_received);
+    stats.retransmissions = STATS_GET(connection, retransmissions);
+    stats.timeouts = STATS_GET(connection, timeouts);
+    stats.nacks_sent = STATS_GET(connection, nacks_sent);
+    stats.nacks_received = STATS_GET(connection, nacks_received);
+    stats.duplicates = STATS_GET(connection, duplicates);
+    stats.out_of_order = STATS_GET(connection, out_of_order);
+    stats.checksum_failures = STATS_GET(connection, checksum_failures);
+    stats.goodput_bytes = STATS_GET(connection, goodput_bytes);
+    stats.rtt_us = STATS_GET(connection, rtt_us);
+    stats.srtt_us = STATS_GET(connection, srtt_us);
+    stats.rto_us = STATS_GET(connection, rto_us);
+    stats.fec_groups = STATS_GET(connection, fec_groups);
+    stats.fec_parity_sent = STATS_GET(connection, fec_parity_sent);
+    stats.fec_recovered = STATS_GET(connection, fec_recovered);
+    stats.fec_parity = STATS_GET(connection, fec_parity);
+    stats.rwnd = STATS_GET(connection, rwnd);
+    stats.window_stalls = STATS_GET(connection, window_stalls);
+    stats.window_probes = STATS_GET(connection, window_probes);
+    stats.rx_timestamps = STATS_GET(connection, rx_timestamps);
+    stats.kernel_rtt_samples = STATS_GET(connection, kernel_rtt_samples);
+    stats.delay_samples = STATS_GET(connection, delay_samples);
+    stats.delay_jitter_ns = STATS_GET(connection, delay_jitter_ns);
+    stats.delay_spread_ns = STATS_GET(connection, delay_spread_ns);
+    stats.elapsed_ns = rudp_now_ns() - connection->start_ns;
+    stats.goodput_mbs = stats.elapsed_ns > 0 ? (double)stats.goodput_bytes / (1024.0 * 1024.0) / ((double)stats.elapsed_ns / 1e9) : 0.0;
+    return stats;
+}
+
+// Prints a statistics snapshot in the style of the end-of-run statistics block.
+void rudp_print_stats(const RUDPStats *stats, FILE *out)
+{
+    fprintf(out, "- Packets: Sent=%llu (%llu bytes); Received=%llu (%llu bytes)\n",
+            (unsigned long long)stats->packets_sent, (unsigned long long)stats->bytes_sent,
+            (unsigned long long)stats->packets_received, (unsigned long long)stats->bytes_received);
+    fprintf(out, "- Recovery: Retransmissions=%llu; Timeouts=%llu; NACKs sent=%llu; NACKs received=%llu\n",
+            (unsigned long long)stats->retransmissions, (unsigned long long)stats->timeouts,
+            (unsigned long long)stats->nacks_sent, (unsigned long long)stats->nacks_received);
+    fprintf(out, "- Arrivals: Duplicates=%llu; Out of order=%llu; Checksum failures=%llu\n",
+            (unsigned long long)stats->duplicates, (unsigned long long)stats->out_of_order,
+            (unsigned long long)stats->checksum_failures);
+    fprintf(out, "- RTT=%.1fus; SRTT=%.1fus; RTO=%.1fms; Goodput=%.2fMB/s over %.2fms\n",
+            (double)stats->rtt_us, (double)stats->srtt_us, stats->rto_us / 1000.0, stats->goodput_mbs,
+            stats->elapsed_ns / 1000000.0);
+    if (stats->fec_groups > 0)
+    {
+        fprintf(out, "- FEC: Groups=%llu; Parity sent=%llu; Recovered=%llu; Parity per group=%llu\n",
+                (unsigned long long)stats->fec_groups, (unsigned long long)stats->fec_parity_sent,
+                (unsigned long long)stats->fec_recovered, (unsigned long long)stats->fec_parity);
+    }
+    if (stats->window_stalls > 0 || stats->window_probes > 0)
+    {
+        fprintf(out, "- Flow control: Receive window=%llu; Stalls=%llu; Probes=%llu\n",
+                (unsigned long long)stats->rwnd, (unsigned long long)stats->window_stalls,
+                (unsigned long long)stats->window_probes);
+    }
+    if (stats->rx_timestamps > 0 || stats->kernel_rtt_samples > 0)
+    {
+        fprintf(out, "- Kernel timestamps: RX=%llu; RTT samples=%llu\n", (unsigned long long)stats->rx_timestamps,
+                (unsigned long long)stats->kernel_rtt_samples);
+    }
+    if (stats->delay_samples > 0)
+    {
+        fprintf(out, "- One-way delay variation: Jitter=%.1fus; Spread=%.1fus over %llu segments\n",
+                stats->delay_jitter_ns / 1000.0, stats->delay_spread_ns / 1000.0,
+                (unsigned long long)stats->delay_samples);
+    }
+}
+
+// Prints one line per path of a multipath sender, nothing for a single path.
+void rudp_print_paths(const RUDPConnection *connection, FILE *out)
+{
+    for (int i = 0; i < connection->path_count; i++)
+    {
+        const RUDPPath *path = &connection->paths[i];
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+        char local_ip[INET_ADDRSTRLEN] = "?";
+        char remote_ip[INET_ADDRSTRLEN] = "?";
+
+        memset(&local, 0, sizeof(local));
+        if (getsockname(path->sockfd, (struct sockaddr *)&local, &local_len) == 0)
+        {
+            inet_ntop(AF_INET, &local.sin_addr, local_ip, sizeof(local_ip));
+        }
+        inet_ntop(AF_INET, &path->remote.sin_addr, remote_ip, sizeof(remote_ip));
+        fprintf(out, "- Path %d %s:%d -> %s:%d: Sent=%llu; Retransmitted=%llu; Timeouts=%llu; Failures=%llu; SRTT=%.1fus\n",
+                i, local_ip, ntohs(local.sin_port), remote_ip, ntohs(path->remote.sin_port),
+                (unsigned long long)path->segments_sent, (unsigned long long)path->retransmissions,
+                (unsigned long long)path->timeouts, (unsigned long long)path->failures, (double)path->srtt_us);
+    }
+}
+
 /*
  * @brief A checksum function that returns 16 bit checksum for data.
  * @param data The data to do the checksum for.
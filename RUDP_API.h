@@ -2,6 +2,7 @@
 #define RUDP_API_H
 #include <sys/socket.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,10 +13,26 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/time.h>
+#include "RUDP_FEC.h"
 
 #define MAX_PACKET_SIZE 59800
-#define RUDP_HEADER_SIZE 5
 #define WINDOW_SIZE 5
+// How long rudp_send waits for an ACK before retransmitting
+#define RUDP_ACK_TIMEOUT_US 1000000
+// First wait for a SYN-ACK, doubled for every SYN sent again
+#define RUDP_HANDSHAKE_TIMEOUT_US 250000
+#define RUDP_HANDSHAKE_RETRIES 5
+// A parity segment: the length prefix and the longest data segment of its group
+#define RUDP_FEC_SHARD_SIZE (RUDP_FEC_LENGTH_BYTES + MAX_PACKET_SIZE)
+// Streams of one connection, each ordered on its own: rudp_send() writes stream 0, control messages
+// go on stream 1 and rudp_stream_open() hands out the others
+#define RUDP_MAX_STREAMS 16
+#define RUDP_STREAM_DATA 0
+#define RUDP_STREAM_CONTROL 1
+// Key of a datagram sent without asking for a kernel TX timestamp
+#define RUDP_NO_TIMESTAMP UINT32_MAX
+// Paths of a multipath sender: the connection's own socket is path 0, rudp_add_path() adds the others
+#define RUDP_MAX_PATHS 4
 
 typedef struct
 {
@@ -27,13 +44,31 @@ typedef struct
     unsigned int RST : 1;
     unsigned int NACK : 1;
     unsigned int DATA : 1;
+    unsigned int STREAM_FIN : 1;  // in a data segment: the last one of its stream, it carries no data
 } RUDPFlags;
 
+// Position of a segment in its FEC group, all zero when FEC is off
+typedef struct
+{
+    uint8_t k;        // data segments in the group (in an ACK: shards the receiver looked at)
+    uint8_t m;        // parity segments in the group
+    uint8_t index;    // data 0..k-1, parity k..k+m-1 (in an ACK: shards missing among those looked at)
+    uint8_t unused;
+} RUDPFecHeader;
+
 typedef struct
 {
     uint16_t sequence_number;
     uint16_t checksum;
     RUDPFlags flags;
+    RUDPFecHeader fec;
+    uint32_t sack;    // in an ACK: bit b set when sequence number + 2 + b arrived out of order
+    uint32_t token;   // in a SYN: the resumption token the sender holds; in a SYN-ACK: the one it should keep
+    uint32_t window;  // in an ACK or SYN-ACK: segments the receiver can still take after the acknowledged one
+    uint16_t stream;  // in a data segment: the stream it belongs to
+    uint16_t unused;
+    uint32_t stream_sequence;  // in a data segment: its position in the stream, counted in segments
+    uint64_t timestamp;        // in a data segment: the sender's wall clock (ns) when it went out, for the one-way delay
 
 } RUDPHeader;
 
@@ -41,12 +76,74 @@ typedef struct
 typedef struct
 {
     RUDPHeader header;
-    char data[MAX_PACKET_SIZE];
+    char data[RUDP_FEC_SHARD_SIZE]; // a data segment, or a whole parity shard
     int length;
     int retransmission_count;
 
 } RUDPPacket;
 
+// A data segment goes out as its header and `length` bytes of payload, the receiver takes the length from the datagram's size
+#define RUDP_SEGMENT_HEADER_SIZE offsetof(RUDPPacket, data)
+
+// The stream a segment handed out by rudp_stream_read() belongs to
+typedef struct
+{
+    int stream;
+    int fin;          // the peer closed the stream, the segment carries no data
+} RUDPStreamInfo;
+
+// Counters and gauges of one connection, see rudp_get_stats()
+typedef struct
+{
+    uint64_t packets_sent;       // every datagram, control packets and retransmissions included
+    uint64_t bytes_sent;
+    uint64_t packets_received;
+    uint64_t bytes_received;
+    uint64_t retransmissions;    // data packets sent again after a timeout or a NACK
+    uint64_t timeouts;           // ACK waits that expired
+    uint64_t nacks_sent;
+    uint64_t nacks_received;
+    uint64_t duplicates;         // data packets received again
+    uint64_t out_of_order;       // data packets ahead of the expected sequence number
+    uint64_t checksum_failures;
+    uint64_t goodput_bytes;      // payload delivered in order (receiver) or acknowledged (sender)
+    uint64_t rtt_us;             // last RTT sample, 0 before the first one
+    uint64_t srtt_us;            // smoothed RTT (RFC 6298)
+    uint64_t rto_us;             // the ACK timeout in use
+    uint64_t fec_groups;         // FEC groups sent (sender) or completed (receiver)
+    uint64_t fec_parity_sent;    // parity segments, retransmitted groups included
+    uint64_t fec_recovered;      // data segments rebuilt from parity instead of being retransmitted
+    uint64_t fec_parity;         // parity segments per group in use
+    uint64_t rwnd;               // last receive window the peer advertised, in segments
+    uint64_t window_stalls;      // times the receive window, not the congestion window, stopped the sender
+    uint64_t window_probes;      // segments sent into a closed receive window to learn when it opens
+    uint64_t rx_timestamps;      // datagrams received with a kernel RX timestamp
+    uint64_t kernel_rtt_samples; // RTT samples taken between kernel TX and RX timestamps
+    uint64_t delay_samples;      // data segments that carried the sender's timestamp
+    uint64_t delay_jitter_ns;    // one-way delay variation, smoothed like the RTP interarrival jitter (RFC 3550)
+    uint64_t delay_spread_ns;    // largest one-way delay above the smallest one seen
+    uint64_t elapsed_ns;         // time since the connection was created
+    double goodput_mbs;          // goodput_bytes over elapsed_ns in MB/s (2^20 bytes)
+} RUDPStats;
+
+// One way to the receiver: a socket bound to a local address and the receiver address it sends to
+typedef struct
+{
+    int sockfd;
+    struct sockaddr_in remote;
+    // kept by the engine: the RX thread writes the smoothed RTT, the TX thread the counters
+    uint64_t srtt_us;
+    uint64_t segments_sent;      // transmissions on the path, retransmissions included
+    uint64_t retransmissions;
+    uint64_t timeouts;           // retransmission timeouts of segments last sent on the path
+    uint64_t failures;           // times the path was taken out of the schedule
+} RUDPPath;
+
+// Connection counters, relaxed atomics keep them cheap and readable from another thread
+#define STATS_ADD(connection, field, value) __atomic_fetch_add(&(connection)->stats.field, (uint64_t)(value), __ATOMIC_RELAXED)
+#define STATS_SET(connection, field, value) __atomic_store_n(&(connection)->stats.field, (uint64_t)(value), __ATOMIC_RELAXED)
+#define STATS_GET(connection, field) __atomic_load_n(&(connection)->stats.field, __ATOMIC_RELAXED)
+
 // define a structure for an RUDP connection
 typedef struct
 {
@@ -55,17 +152,91 @@ typedef struct
     struct sockaddr_in sender_addr;
     // serial number of the next packet to send
     uint16_t next_sequence_number;
+    // updated with relaxed atomics so another thread can take a snapshot
+    RUDPStats stats;
+    uint64_t start_ns;
+    // NULL until rudp_set_fec() is called (sender) or the first FEC group arrives (receiver)
+    RUDPFecState *fec;
+    // sender: the handshake has not happened yet, the first segment goes out as a SYN
+    int syn_pending;
+    uint32_t token;
+    // sender: the receiver refused the connection with an RST, every later send fails
+    int reset;
+    // receiver: the segment that came with the SYN, returned by the first rudp_recv()
+    RUDPPacket *pending;
+    // a datagram the engine read but left to the blocking API, rudp_receive() returns it first
+    RUDPPacket *unread;
+    ssize_t unread_length;
+    struct sockaddr_in unread_from;
+    // per stream: position of the next segment sent and of the next one handed to the application
+    uint32_t stream_sent[RUDP_MAX_STREAMS];
+    uint32_t stream_delivered[RUDP_MAX_STREAMS];
+    uint8_t stream_open[RUDP_MAX_STREAMS];  // opened with rudp_stream_open() and not closed yet
+    // rudp_set_timestamps() was called: reads take the kernel's RX timestamp, data segments ask for a TX one
+    int timestamps;
+    uint32_t tx_key;            // key of the next TX timestamp the socket will queue
+    uint64_t rx_ns;             // kernel RX timestamp of the datagram rudp_receive() returned last, 0 if none
+    uint64_t unread_rx_ns;
+    uint64_t data_tx_ns;        // kernel TX timestamp of the last data segment that gave an RTT sample
+    uint64_t data_rx_ns;        // kernel RX timestamp of the last valid data segment read
+    // receiver: one-way delays of the sender's timestamps, their clock offset cancels out
+    int64_t delay_min_ns;
+    int64_t delay_max_ns;
+    int64_t delay_last_ns;
+    // sender: the paths the engine spreads segments over, 0 until rudp_add_path() is called
+    RUDPPath paths[RUDP_MAX_PATHS];
+    int path_count;
 } RUDPConnection;
 
 // Function declarations
 RUDPConnection *rudp_socket(struct sockaddr_in *receiver_addr, struct sockaddr_in *sender_addr, int sockfd);
+RUDPConnection *rudp_connect(struct sockaddr_in *receiver_addr, int sockfd, uint32_t token);
+int rudp_handshake(RUDPConnection *connection);
+uint32_t rudp_get_token(const RUDPConnection *connection);
+uint32_t rudp_token(const struct sockaddr_in *peer);
+int rudp_set_token_key(const char *path);
+int rudp_answer_syn(RUDPConnection *connection, const RUDPPacket *packet, ssize_t length, const struct sockaddr_in *from);
 unsigned short int calculate_checksum(void *data, unsigned int bytes);
 int rudp_recv_fin(RUDPConnection *connection);
 int rudp_send_fin(RUDPConnection *connection);
 int rudp_send(RUDPConnection *connection, char *buffer, int buffer_size, struct sockaddr_in *sender_addr);
 int rudp_recv(RUDPConnection *connection, char *buffer, int buffer_size, struct sockaddr_in *sender_addr);
+int rudp_stream_open(RUDPConnection *connection);
+int rudp_stream_write(RUDPConnection *connection, int stream, const char *buffer, int buffer_size, struct sockaddr_in *sender_addr);
+int rudp_stream_close(RUDPConnection *connection, int stream, struct sockaddr_in *sender_addr);
+int rudp_stream_read(RUDPConnection *connection, char *buffer, int buffer_size, RUDPStreamInfo *info, struct sockaddr_in *sender_addr);
+int rudp_stream_deliver(RUDPConnection *connection, const RUDPHeader *header, RUDPStreamInfo *info);
+int rudp_set_fec(RUDPConnection *connection, const RUDPFecConfig *config);
+int rudp_set_timestamps(RUDPConnection *connection);
+int rudp_add_path(RUDPConnection *connection, const struct sockaddr_in *local, const struct sockaddr_in *remote);
+void rudp_print_paths(const RUDPConnection *connection, FILE *out);
+int rudp_flush(RUDPConnection *connection, struct sockaddr_in *sender_addr);
 void rudp_close(RUDPConnection *connection);
+RUDPStats rudp_get_stats(RUDPConnection *connection);
+void rudp_print_stats(const RUDPStats *stats, FILE *out);
 int verify_checksum(void *data, unsigned int bytes, unsigned short int received_checksum);
+// Per packet building blocks of rudp_send() and rudp_recv(), also timed by RUDP_Bench
+void rudp_packet_encode(RUDPPacket *packet, uint16_t sequence_number, const char *data, int length);
+size_t rudp_segment_size(const RUDPPacket *packet);
+int rudp_segment_length(RUDPPacket *packet, ssize_t length);
+int rudp_valid_data(RUDPPacket *packet, ssize_t length);
+void rudp_history_store(const RUDPPacket *packet);
+const RUDPPacket *rudp_history_find(uint16_t sequence_number);
 void convert_to_network_order(RUDPPacket *packet);
+// Datagram I/O of a connection through the impairment layer, counted in its statistics
+ssize_t rudp_transmit(RUDPConnection *connection, const void *packet, size_t length, const struct sockaddr *addr, socklen_t addr_len);
+ssize_t rudp_transmit_on(RUDPConnection *connection, int sockfd, const void *packet, size_t length, const struct sockaddr *addr,
+                         socklen_t addr_len);
+ssize_t rudp_transmit_timed(RUDPConnection *connection, const void *packet, size_t length, const struct sockaddr *addr,
+                            socklen_t addr_len, uint32_t *key);
+ssize_t rudp_receive(RUDPConnection *connection, void *packet, size_t length, struct sockaddr *addr, socklen_t *addr_len);
+ssize_t rudp_receive_on(RUDPConnection *connection, int sockfd, void *packet, size_t length, struct sockaddr *addr,
+                        socklen_t *addr_len);
+void rudp_unread(RUDPConnection *connection, const void *packet, ssize_t length, const struct sockaddr_in *from);
+uint64_t rudp_now_ns(void);
+void rudp_rtt_sample(RUDPConnection *connection, uint64_t sent_ns, uint32_t key);
+void rudp_delay_sample(RUDPConnection *connection, const RUDPHeader *header);
+void rudp_grow_receive_buffer(int sockfd, int packets);
+uint32_t rudp_receive_window(int sockfd, int share);
 
 #endif
\ No newline at end of file
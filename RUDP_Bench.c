@@ -0,0 +1,491 @@
+#include "RUDP_API.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+// Results of every case, the file is read by scripts
+#define DEFAULT_OUTPUT "bench_results/micro.csv"
+#define DEFAULT_ITERATIONS 20000
+// Operations over loopback wait for another thread, fewer of them give a stable mean
+#define DEFAULT_NET_ITERATIONS 2000
+// Seconds the peer thread waits for the next datagram
+#define BENCH_PEER_TIMEOUT 5
+
+// Payload sizes of the per packet cases: powers of two, one Ethernet datagram and the largest segment
+static const int payload_sizes[] = {16, 64, 256, 1024, 1472, 4096, 16384, 32768, MAX_PACKET_SIZE};
+#define PAYLOAD_SIZES ((int)(sizeof(payload_sizes) / sizeof(payload_sizes[0])))
+
+typedef struct
+{
+    int iterations;       // timed operations per case, warmup excluded
+    int warmup;           // untimed operations before every case
+    int net_iterations;   // the same for the cases over loopback
+    int net_warmup;
+    FILE *out;            // one CSV line per case
+} BenchOptions;
+
+// Keeps the compiler from dropping the work of a case
+static volatile uint64_t bench_sink;
+
+// Time stamp counter on x86, which ticks at a constant rate close to the nominal clock; 0 elsewhere.
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+#else
+    return 0;
+#endif
+}
+
+// A running measurement: wall time and cycles from bench_start() to bench_stop()
+typedef struct
+{
+    uint64_t start_ns;
+    uint64_t start_cycles;
+} BenchTimer;
+
+static void bench_start(BenchTimer *timer)
+{
+    timer->start_cycles = bench_cycles();
+    timer->start_ns = rudp_now_ns();
+}
+
+/**
+ * @brief Prints one case and appends it to the result file.
+ * @param bytes Payload bytes per operation, 0 when the size does not matter (no cycles/byte).
+ */
+static void bench_stop(BenchTimer *timer, const BenchOptions *options, const char *name, int bytes, int iterations)
+{
+    uint64_t elapsed_ns = rudp_now_ns() - timer->start_ns;
+    uint64_t cycles = bench_cycles() - timer->start_cycles;
+    double ns_per_op = (double)elapsed_ns / iterations;
+    double cycles_per_op = (double)cycles / iterations;
+    double cycles_per_byte = bytes > 0 ? cycles_per_op / bytes : 0.0;
+    double mbs = bytes > 0 && elapsed_ns > 0 ? (double)bytes * iterations / (1024.0 * 1024.0) / (elapsed_ns / 1e9) : 0.0;
+
+    printf("- %-18s %6d B: %12.1f ns/op; %12.1f cycles/op; %7.3f cycles/B; %9.1f MB/s\n", name, bytes, ns_per_op,
+           cycles_per_op, cycles_per_byte, mbs);
+    fprintf(options->out, "%s,%d,%d,%.1f,%.1f,%.4f,%.1f\n", name, bytes, iterations, ns_per_op, cycles_per_op,
+            cycles_per_byte, mbs);
+    fflush(stdout);
+}
+
+/**
+ * @brief calculate_checksum() and verify_checksum() over every payload size, and over the whole
+ * data field, the largest parity shard of an FEC group.
+ */
+static void bench_checksum(const BenchOptions *options, char *data)
+{
+    BenchTimer timer;
+    uint64_t sum = 0;
+
+    for (int s = 0; s <= PAYLOAD_SIZES; s++)
+    {
+        int size = s < PAYLOAD_SIZES ? payload_sizes[s] : (int)sizeof(((RUDPPacket *)NULL)->data);
+        for (int i = 0; i < options->warmup; i++)
+        {
+            sum += calculate_checksum(data, size);
+        }
+        bench_start(&timer);
+        for (int i = 0; i < options->iterations; i++)
+        {
+            data[0] = (char)i;
+            sum += calculate_checksum(data, size);
+        }
+        bench_stop(&timer, options, "checksum", size, options->iterations);
+
+        unsigned short checksum = calculate_checksum(data, size);
+        bench_start(&timer);
+        for (int i = 0; i < options->iterations; i++)
+        {
+            sum += verify_checksum(data, size, checksum);
+        }
+        bench_stop(&timer, options, "verify_checksum", size, options->iterations);
+    }
+    bench_sink += sum;
+}
+
+// rudp_packet_encode() (header, payload copy, checksum) and rudp_valid_data(), what every data packet costs on each side.
+static void bench_packet(const BenchOptions *options, RUDPPacket *packet, const char *data)
+{
+    BenchTimer timer;
+    uint64_t sum = 0;
+
+    for (int s = 0; s < PAYLOAD_SIZES; s++)
+    {
+        int size = payload_sizes[s];
+        for (int i = 0; i < options->warmup; i++)
+        {
+            rudp_packet_encode(packet, (uint16_t)i, data, size);
+        }
+        bench_start(&timer);
+        for (int i = 0; i < options->iterations; i++)
+        {
+            rudp_packet_encode(packet, (uint16_t)i, data, size);
+            sum += packet->header.checksum;
+        }
+        bench_stop(&timer, options, "packet_encode", size, options->iterations);
+
+        bench_start(&timer);
+        for (int i = 0; i < options->iterations; i++)
+        {
+            sum += rudp_valid_data(packet, (ssize_t)(RUDP_SEGMENT_HEADER_SIZE + size));
+        }
+        bench_stop(&timer, options, "packet_decode", size, options->iterations);
+    }
+    bench_sink += sum;
+}
+
+// rudp_history_store() of a whole packet and rudp_history_find() of the oldest copy kept and of one no longer kept.
+static void bench_history(const BenchOptions *options, RUDPPacket *packet)
+{
+    BenchTimer timer;
+    uint64_t sum = 0;
+    int bytes = (int)sizeof(*packet);
+
+    for (int i = 0; i < options->warmup; i++)
+    {
+        packet->header.sequence_number = (uint16_t)i;
+        rudp_history_store(packet);
+    }
+    bench_start(&timer);
+    for (int i = 0; i < options->iterations; i++)
+    {
+        packet->header.sequence_number = (uint16_t)i;
+        rudp_history_store(packet);
+    }
+    bench_stop(&timer, options, "history_store", bytes, options->iterations);
+
+    // The copies kept are those of the last stores, the first of them is found last
+    uint16_t last = (uint16_t)(options->iterations - 1);
+    uint16_t oldest = (uint16_t)(last - 9);
+    bench_start(&timer);
+    for (int i = 0; i < options->iterations; i++)
+    {
+        sum += rudp_history_find(oldest) != NULL;
+    }
+    bench_stop(&timer, options, "history_find_hit", 0, options->iterations);
+
+    bench_start(&timer);
+    for (int i = 0; i < options->iterations; i++)
+    {
+        sum += rudp_history_find((uint16_t)(last + 1)) != NULL;
+    }
+    bench_stop(&timer, options, "history_find_miss", 0, options->iterations);
+    bench_sink += sum;
+}
+
+// Two UDP sockets bound to loopback, the receiver's address is where the sender sends
+typedef struct
+{
+    int sender_fd;
+    int receiver_fd;
+    struct sockaddr_in receiver_addr;
+    int connections;      // receiver: connections to accept, each closed with a FIN
+    int messages;         // receiver: messages to take on every connection before its FIN
+    int error;
+} BenchLink;
+
+static int bench_socket(struct sockaddr_in *addr)
+{
+    socklen_t addr_len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0)
+    {
+        perror("Failed to create UDP socket");
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 || getsockname(fd, (struct sockaddr *)addr, &addr_len) < 0)
+    {
+        perror("Failed to bind UDP socket");
+        close(fd);
+        return -1;
+    }
+    rudp_grow_receive_buffer(fd, 4);
+    return fd;
+}
+
+/**
+ * @brief The peer of the loopback cases: accepts every connection on a copy of its socket,
+ * takes its messages and answers its FIN, like RUDP_Receiver does.
+ */
+static void *bench_receiver(void *arg)
+{
+    BenchLink *link = (BenchLink *)arg;
+    struct sockaddr_in sender_addr;
+    char *buffer = (char *)malloc(MAX_PACKET_SIZE);
+
+    memset(&sender_addr, 0, sizeof(sender_addr));
+    for (int c = 0; c < link->connections && buffer != NULL && !link->error; c++)
+    {
+        // rudp_close() closes the socket of the connection
+        int fd = dup(link->receiver_fd);
+        RUDPConnection *connection = fd >= 0 ? rudp_socket(&link->receiver_addr, &sender_addr, fd) : NULL;
+        if (connection == NULL)
+        {
+            link->error = 1;
+            break;
+        }
+        for (int m = 0; m < link->messages; m++)
+        {
+            if (rudp_recv(connection, buffer, MAX_PACKET_SIZE, &sender_addr) < 0)
+            {
+                link->error = 1;
+                break;
+            }
+        }
+        if (!link->error && rudp_recv_fin(connection) < 0)
+        {
+            link->error = 1;
+        }
+        rudp_close(connection);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int bench_link_open(BenchLink *link, int connections, int messages, pthread_t *thread)
+{
+    struct sockaddr_in sender_addr;
+
+    memset(link, 0, sizeof(*link));
+    link->connections = connections;
+    link->messages = messages;
+    link->receiver_fd = bench_socket(&link->receiver_addr);
+    link->sender_fd = link->receiver_fd >= 0 ? bench_socket(&sender_addr) : -1;
+    // A receiver whose sender gave up stops instead of waiting forever
+    struct timeval timeout = {BENCH_PEER_TIMEOUT, 0};
+    if (link->receiver_fd >= 0)
+    {
+        setsockopt(link->receiver_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    if (link->sender_fd < 0)
+    {
+        if (link->receiver_fd >= 0)
+        {
+            close(link->receiver_fd);
+        }
+        return -1;
+    }
+    if (pthread_create(thread, NULL, bench_receiver, link) != 0)
+    {
+        perror("Failed to start the receiver thread");
+        close(link->sender_fd);
+        close(link->receiver_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_link_close(BenchLink *link, pthread_t thread)
+{
+    pthread_join(thread, NULL);
+    close(link->sender_fd);
+    close(link->receiver_fd);
+    return link->error ? -1 : 0;
+}
+
+// The SYN / SYN-ACK exchange of rudp_handshake() and the FIN / FIN_ACK one of rudp_send_fin(), one connection each.
+static int bench_handshake(const BenchOptions *options)
+{
+    BenchLink link;
+    pthread_t thread;
+    uint64_t handshake_ns = 0, handshake_cycles = 0, fin_ns = 0, fin_cycles = 0;
+    int total = options->net_warmup + options->net_iterations;
+
+    if (bench_link_open(&link, total, 0, &thread) < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < total && !link.error; i++)
+    {
+        BenchTimer timer;
+        int fd = dup(link.sender_fd);
+        RUDPConnection *connection = fd >= 0 ? rudp_connect(&link.receiver_addr, fd, 0) : NULL;
+        if (connection == NULL)
+        {
+            link.error = 1;
+            break;
+        }
+        bench_start(&timer);
+        int result = rudp_handshake(connection);
+        uint64_t middle_ns = rudp_now_ns(), middle_cycles = bench_cycles();
+        result = result < 0 ? -1 : rudp_send_fin(connection);
+        if (i >= options->net_warmup)
+        {
+            handshake_ns += middle_ns - timer.start_ns;
+            handshake_cycles += middle_cycles - timer.start_cycles;
+            fin_ns += rudp_now_ns() - middle_ns;
+            fin_cycles += bench_cycles() - middle_cycles;
+        }
+        rudp_close(connection);
+        if (result < 0)
+        {
+            link.error = 1;
+        }
+    }
+    if (bench_link_close(&link, thread) < 0)
+    {
+        fprintf(stderr, "Handshake over loopback failed\n");
+        return -1;
+    }
+
+    // The two phases of one loop are reported as cases of their own
+    BenchTimer timer = {0, 0};
+    uint64_t now_ns = rudp_now_ns(), now_cycles = bench_cycles();
+    timer.start_ns = now_ns - handshake_ns;
+    timer.start_cycles = now_cycles - handshake_cycles;
+    bench_stop(&timer, options, "handshake", 0, options->net_iterations);
+    now_ns = rudp_now_ns();
+    now_cycles = bench_cycles();
+    timer.start_ns = now_ns - fin_ns;
+    timer.start_cycles = now_cycles - fin_cycles;
+    bench_stop(&timer, options, "fin", 0, options->net_iterations);
+    return 0;
+}
+
+// rudp_send() through rudp_recv() on the peer thread and back with the ACK, for every payload size.
+static int bench_send_recv(const BenchOptions *options, char *data)
+{
+    BenchLink link;
+    pthread_t thread;
+    int per_size = options->net_warmup + options->net_iterations;
+
+    if (bench_link_open(&link, 1, per_size * PAYLOAD_SIZES, &thread) < 0)
+    {
+        return -1;
+    }
+    RUDPConnection *connection = rudp_socket(&link.receiver_addr, NULL, dup(link.sender_fd));
+    for (int s = 0; s < PAYLOAD_SIZES && connection != NULL && !link.error; s++)
+    {
+        BenchTimer timer;
+        int size = payload_sizes[s];
+        for (int i = 0; i < per_size; i++)
+        {
+            if (i == options->net_warmup)
+            {
+                bench_start(&timer);
+            }
+            if (rudp_send(connection, data, size, &link.receiver_addr) < 0)
+            {
+                link.error = 1;
+                break;
+            }
+        }
+        if (!link.error)
+        {
+            bench_stop(&timer, options, "send_recv", size, options->net_iterations);
+        }
+    }
+    if (connection == NULL || (!link.error && rudp_send_fin(connection) < 0))
+    {
+        link.error = 1;
+    }
+    if (connection != NULL)
+    {
+        rudp_close(connection);
+    }
+    if (bench_link_close(&link, thread) < 0)
+    {
+        fprintf(stderr, "rudp_send / rudp_recv over loopback failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-iters <n>] [-warmup <n>] [-net-iters <n>] [-o <file>]\n", name);
+    fprintf(stderr, "  -iters <n>               timed operations per in-memory case, default %d\n", DEFAULT_ITERATIONS);
+    fprintf(stderr, "  -warmup <n>              untimed operations before each case, default a tenth of the iterations\n");
+    fprintf(stderr, "  -net-iters <n>           timed operations per loopback case (handshake, FIN, send/recv), default %d\n",
+            DEFAULT_NET_ITERATIONS);
+    fprintf(stderr, "  -o <file>                CSV results, default %s\n", DEFAULT_OUTPUT);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options;
+    const char *path = DEFAULT_OUTPUT;
+    int warmup = -1;
+
+    memset(&options, 0, sizeof(options));
+    options.iterations = DEFAULT_ITERATIONS;
+    options.net_iterations = DEFAULT_NET_ITERATIONS;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+        }
+        if (strcmp(argv[i], "-iters") == 0)
+        {
+            options.iterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-warmup") == 0)
+        {
+            warmup = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-net-iters") == 0)
+        {
+            options.net_iterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            path = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    // The history find cases need a full history
+    if (options.iterations < 10 || options.net_iterations <= 0)
+    {
+        usage(argv[0]);
+    }
+    options.warmup = warmup >= 0 ? warmup : options.iterations / 10;
+    options.net_warmup = warmup >= 0 ? warmup : options.net_iterations / 10;
+
+    options.out = fopen(path, "w");
+    RUDPPacket *packet = (RUDPPacket *)malloc(sizeof(RUDPPacket));
+    char *data = (char *)malloc(sizeof(packet->data));
+    if (options.out == NULL || packet == NULL || data == NULL)
+    {
+        perror(options.out == NULL ? path : "Failed to allocate benchmark buffers");
+        exit(1);
+    }
+    for (size_t i = 0; i < sizeof(packet->data); i++)
+    {
+        data[i] = (char)(i * 131 + 7);
+    }
+    memset(packet, 0, sizeof(*packet));
+    fprintf(options.out, "benchmark,bytes,iterations,ns_per_op,cycles_per_op,cycles_per_byte,mb_per_s\n");
+
+    printf("----------------------------------\n");
+    printf("- RUDP micro benchmarks: %d iterations (%d over loopback), %d warmup%s\n", options.iterations,
+           options.net_iterations, options.warmup, bench_cycles() == 0 ? ", no cycle counter" : "");
+    bench_checksum(&options, data);
+    bench_packet(&options, packet, data);
+    bench_history(&options, packet);
+    int failed = bench_handshake(&options) < 0;
+    failed |= bench_send_recv(&options, data) < 0;
+    printf("----------------------------------\n");
+    printf("Results written to %s\n", path);
+
+    fclose(options.out);
+    free(packet);
+    free(data);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1151 @@
+#include "RUDP_Engine.h"
+#include "RUDP_Log.h"
+#include "Busy_Poll.h"
+#include "Timestamp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+
+// A segment sent this many times without being acknowledged fails the connection
+#define RUDP_ENGINE_MAX_TRANSMISSIONS 30
+// Duplicate ACKs carrying SACK bits before the holes are sent again
+#define RUDP_ENGINE_DUPACKS 3
+// Segments of a path sent again in a row, with none of its segments reported in between, that take it out of the schedule
+#define RUDP_ENGINE_PATH_LOSSES 3
+// How long a failed path stays out before a segment tries it again
+#define RUDP_ENGINE_PATH_RETRY_US 1000000
+#define RUDP_ENGINE_SLOT(engine, n) (&(engine)->slots[(n) % RUDP_ENGINE_SLOTS])
+
+static int queue_push(RUDPEngineQueue *queue, uint64_t from, uint64_t to)
+{
+    uint32_t tail = queue->tail;
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head == RUDP_ENGINE_REQUESTS)
+    {
+        return -1;
+    }
+    queue->slots[tail % RUDP_ENGINE_REQUESTS].from = from;
+    queue->slots[tail % RUDP_ENGINE_REQUESTS].to = to;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int queue_pop(RUDPEngineQueue *queue, RUDPEngineRange *range)
+{
+    uint32_t head = queue->head;
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+        return -1;
+    }
+    *range = queue->slots[head % RUDP_ENGINE_REQUESTS];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Waiting side of the rings: yield while the other thread is likely to answer soon, then sleep briefly.
+static void backoff(unsigned *spins)
+{
+    struct timespec pause = {0, 50000};
+
+    if (++(*spins) < 64)
+    {
+        sched_yield();
+    }
+    else
+    {
+        nanosleep(&pause, NULL);
+    }
+}
+
+static int engine_failed(RUDPEngine *engine)
+{
+    return __atomic_load_n(&engine->error, __ATOMIC_RELAXED);
+}
+
+static void engine_fail(RUDPEngine *engine)
+{
+    __atomic_store_n(&engine->error, 1, __ATOMIC_RELAXED);
+}
+
+// Segment counter of a 16-bit sequence number, taken as the one closest to `reference`.
+static int64_t engine_counter(const RUDPEngine *engine, uint16_t sequence_number, uint64_t reference)
+{
+    return (int64_t)reference + (int16_t)(uint16_t)(sequence_number - (uint16_t)(engine->base + reference));
+}
+
+// Segments in [una, next) last sent on a path, all of them on a single path.
+static uint64_t engine_path_flight(RUDPEngine *engine, int path, uint64_t una, uint64_t next)
+{
+    uint64_t flight = 0;
+
+    if (engine->path_count == 1)
+    {
+        return next - una;
+    }
+    for (uint64_t n = una; n < next; n++)
+    {
+        flight += __atomic_load_n(&RUDP_ENGINE_SLOT(engine, n)->path, __ATOMIC_RELAXED) == path;
+    }
+    return flight;
+}
+
+// Multiplicative decrease of a path after a loss, `flight` of its segments were unacknowledged.
+static void engine_reduce(RUDPEngine *engine, int path, uint64_t flight, int timeout)
+{
+    uint32_t ssthresh = flight / 2 < 2 ? 2 : (uint32_t)(flight / 2);
+    __atomic_store_n(&engine->paths[path].ssthresh, ssthresh, __ATOMIC_RELAXED);
+    __atomic_store_n(&engine->paths[path].cwnd, (timeout ? 1 : ssthresh) << RUDP_ENGINE_CWND_SHIFT, __ATOMIC_RELAXED);
+}
+
+// Smoothed RTT of a path, the connection's until the path has a sample of its own.
+static uint64_t engine_srtt_us(RUDPEngine *engine, int path)
+{
+    RUDPConnection *connection = engine->connection;
+    uint64_t srtt_us = connection->path_count > 0 ? __atomic_load_n(&connection->paths[path].srtt_us, __ATOMIC_RELAXED) : 0;
+
+    return srtt_us != 0 ? srtt_us : STATS_GET(connection, srtt_us);
+}
+
+// Retransmission timeout of the oldest segment: twice the smoothed RTT of its path, doubled per expiry.
+static uint64_t engine_rto_us(RUDPEngine *engine, int path, int backoffs)
+{
+    uint64_t srtt_us = engine_srtt_us(engine, path);
+    uint64_t rto_us = srtt_us == 0 ? RUDP_ACK_TIMEOUT_US : 2 * srtt_us + 1000;
+
+    if (rto_us < RUDP_ENGINE_MIN_RTO_US)
+    {
+        rto_us = RUDP_ENGINE_MIN_RTO_US;
+    }
+    rto_us <<= backoffs;
+    if (rto_us > RUDP_ACK_TIMEOUT_US)
+    {
+        rto_us = RUDP_ACK_TIMEOUT_US;
+    }
+    STATS_SET(engine->connection, rto_us, rto_us);
+    return rto_us;
+}
+
+// TX thread: whether a path is in the schedule, a failed one is tried again after RUDP_ENGINE_PATH_RETRY_US.
+static int engine_path_usable(const RUDPEngine *engine, int path, uint64_t now)
+{
+    uint64_t down_ns = engine->paths[path].down_ns;
+    return down_ns == 0 || now - down_ns > (uint64_t)RUDP_ENGINE_PATH_RETRY_US * 1000;
+}
+
+/**
+ * @brief TX thread: the path a segment goes on, the usable one with the lowest smoothed RTT.
+ *
+ * A path without an RTT sample of its own is tried first, so every path gets measured. New
+ * segments only go on a path with room in its congestion window; repairs are not limited by the
+ * windows but avoid `exclude`, the path that lost the segment, while another one is usable.
+ *
+ * @return The path, or -1 if no path has room for a new segment.
+ */
+static int engine_pick_path(RUDPEngine *engine, uint64_t una, int exclude, int need_room)
+{
+    RUDPConnection *connection = engine->connection;
+    uint64_t now = rudp_now_ns();
+    int best = -1;
+    uint64_t best_srtt_us = 0;
+
+    if (engine->path_count == 1)
+    {
+        uint64_t window = __atomic_load_n(&engine->paths[0].cwnd, __ATOMIC_RELAXED) >> RUDP_ENGINE_CWND_SHIFT;
+        window = window < 1 ? 1 : window > RUDP_ENGINE_SLOTS ? RUDP_ENGINE_SLOTS : window;
+        return !need_room || engine->next - una < window ? 0 : -1;
+    }
+    for (int path = 0; path < engine->path_count; path++)
+    {
+        if (path == exclude || !engine_path_usable(engine, path, now))
+        {
+            continue;
+        }
+        if (need_room)
+        {
+            uint64_t window = __atomic_load_n(&engine->paths[path].cwnd, __ATOMIC_RELAXED) >> RUDP_ENGINE_CWND_SHIFT;
+            window = window < 1 ? 1 : window > RUDP_ENGINE_SLOTS ? RUDP_ENGINE_SLOTS : window;
+            if (engine_path_flight(engine, path, una, engine->next) >= window)
+            {
+                continue;
+            }
+        }
+        uint64_t srtt_us = __atomic_load_n(&connection->paths[path].srtt_us, __ATOMIC_RELAXED);
+        if (best < 0 || srtt_us < best_srtt_us)
+        {
+            best = path;
+            best_srtt_us = srtt_us;
+        }
+    }
+    return best < 0 && !need_room ? (exclude >= 0 ? exclude : 0) : best;
+}
+
+// TX thread: takes a path out of the schedule while another one is in it, its segments go on the others.
+// error is the errno of the send that failed on the path, 0 if it went down on losses.
+static void engine_path_down(RUDPEngine *engine, int path, int error)
+{
+    uint64_t now = rudp_now_ns();
+    int others = 0;
+
+    for (int i = 0; i < engine->path_count; i++)
+    {
+        others += i != path && engine->paths[i].down_ns == 0;
+    }
+    if (others == 0)
+    {
+        return;
+    }
+    if (engine->paths[path].down_ns == 0)
+    {
+        engine->connection->paths[path].failures++;
+        if (error != 0)
+        {
+            RUDP_LOG(RUDP_LOG_WARN, "Path %lld failed to send (errno %lld), sending on the other paths", path, error);
+        }
+        else
+        {
+            RUDP_LOG(RUDP_LOG_WARN, "Path %lld failed after %lld losses in a row, sending on the other paths", path, engine->paths[path].losses);
+        }
+    }
+    engine->paths[path].down_ns = now;
+    __atomic_store_n(&engine->paths[path].cwnd, 1 << RUDP_ENGINE_CWND_SHIFT, __ATOMIC_RELAXED);
+}
+
+// TX thread: a path whose segments the receiver reported works, it is back in the schedule if it was out.
+static void engine_path_check(RUDPEngine *engine)
+{
+    for (int path = 0; path < engine->path_count; path++)
+    {
+        RUDPEnginePath *state = &engine->paths[path];
+        uint64_t acked = __atomic_load_n(&state->acked, __ATOMIC_RELAXED);
+        if (acked != state->seen_acked)
+        {
+            state->seen_acked = acked;
+            state->alive_ns = rudp_now_ns();
+            state->losses = 0;
+            if (state->down_ns != 0)
+            {
+                state->down_ns = 0;
+                RUDP_LOG(RUDP_LOG_WARN, "Path %lld works again", path);
+            }
+        }
+    }
+}
+
+/**
+ * @brief TX thread: a segment last sent on a path was lost, a path that loses all of them is taken out.
+ *
+ * Segments sprayed over paths of different delays arrive out of order, so losses alone are not
+ * enough: the path must also have gone a whole retransmission timeout without a segment reported.
+ */
+static void engine_path_lost(RUDPEngine *engine, int path)
+{
+    RUDPEnginePath *state = &engine->paths[path];
+
+    if (engine->path_count > 1 && ++state->losses >= RUDP_ENGINE_PATH_LOSSES &&
+        rudp_now_ns() - state->alive_ns > engine_rto_us(engine, path, 0) * 1000)
+    {
+        engine_path_down(engine, path, 0);
+    }
+}
+
+// Sends segment n on a path, its sequence number and checksum are filled in on the first transmission (the stream when it was queued).
+static void engine_transmit(RUDPEngine *engine, uint64_t n, int path)
+{
+    RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, n);
+    RUDPPacket *packet = slot->packet;
+    uint32_t transmissions = slot->transmissions;
+    RUDPEnginePath *via = &engine->paths[path];
+
+    if (transmissions == 0)
+    {
+        packet->header.sequence_number = (uint16_t)(engine->base + n);
+        packet->header.flags.DATA = 1;
+        packet->header.checksum = calculate_checksum(packet->data, packet->length);
+    }
+    else
+    {
+        STATS_ADD(engine->connection, retransmissions, 1);
+    }
+    // An ACK read before the key is stored falls back to sent_ns
+    uint32_t key = RUDP_NO_TIMESTAMP;
+    __atomic_store_n(&slot->tx_key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sent_ns, rudp_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->transmissions, transmissions + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->path, (uint8_t)path, __ATOMIC_RELAXED);
+    packet->header.timestamp = timestamp_wall_ns();
+    // Only the connection's own socket takes TX timestamps
+    ssize_t bytes_sent = transmissions == 0 && path == 0 ?
+        rudp_transmit_timed(engine->connection, packet, rudp_segment_size(packet), (struct sockaddr *)&via->peer, sizeof(via->peer), &key) :
+        rudp_transmit_on(engine->connection, via->sockfd, packet, rudp_segment_size(packet), (struct sockaddr *)&via->peer, sizeof(via->peer));
+    int error = bytes_sent < 0 ? errno : 0;
+    if (transmissions == 0)
+    {
+        __atomic_store_n(&slot->tx_key, key, __ATOMIC_RELAXED);
+    }
+    if (engine->connection->path_count > 0)
+    {
+        engine->connection->paths[path].segments_sent++;
+        engine->connection->paths[path].retransmissions += transmissions > 0;
+    }
+    if (bytes_sent < 0 && engine->path_count > 1)
+    {
+        // The segment is lost with the path, its timeout sends it on another one
+        engine_path_down(engine, path, error);
+    }
+    else if (bytes_sent < 0)
+    {
+        perror("Error sending data packet");
+        engine_fail(engine);
+    }
+    RUDP_LOG(RUDP_LOG_TRACE, "Engine sent packet %lld (transmission %lld)", packet->header.sequence_number, transmissions + 1);
+}
+
+// Sends the next segment into a closed receive window without counting it as sent, the ACK it brings carries the window.
+static void engine_probe(RUDPEngine *engine, int path)
+{
+    engine_transmit(engine, engine->next, path);
+    __atomic_store_n(&RUDP_ENGINE_SLOT(engine, engine->next)->transmissions, 0, __ATOMIC_RELAXED);
+    STATS_ADD(engine->connection, window_probes, 1);
+    RUDP_LOG(RUDP_LOG_DEBUG, "Receive window closed, probing with packet %lld", (uint16_t)(engine->base + engine->next));
+}
+
+/**
+ * @brief TX thread of a sender.
+ *
+ * Sends requested retransmissions first, then new segments while both the congestion window
+ * and the receiver's window allow, and retransmits the oldest segment when its timeout expires.
+ * With several paths each segment goes on the path engine_pick_path() picks, and a path whose
+ * segments keep getting lost is left out until it is tried again or reported to work.
+ * With nothing in flight and the receive window closed, no ACK would ever reopen it: the next
+ * segment is sent as a probe on the retransmission timeout instead. It never reads the socket.
+ */
+static void *engine_tx_thread(void *arg)
+{
+    RUDPEngine *engine = (RUDPEngine *)arg;
+    uint64_t resend = 0;
+    uint64_t resend_end = 0;
+    int reported = 0; // the RX thread asked for the repairs, the segments were lost rather than resent after a timeout
+    uint64_t last_una = 0;
+    int backoffs = 0;
+    uint64_t probe_ns = 0;
+    int probes = 0;
+    int stalled = 0;
+    unsigned spins = 0;
+
+    while (!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE) && !engine_failed(engine))
+    {
+        int worked = 0;
+        uint64_t una = __atomic_load_n(&engine->una, __ATOMIC_ACQUIRE);
+        uint64_t queued = __atomic_load_n(&engine->queued, __ATOMIC_ACQUIRE);
+        RUDPEngineRange range;
+
+        // Segments acknowledged from here on may still be sent again in this pass, their slots are not reused before the next one
+        __atomic_store_n(&engine->released, una, __ATOMIC_RELEASE);
+
+        if (engine->path_count > 1)
+        {
+            engine_path_check(engine);
+        }
+        while (queue_pop(&engine->requests, &range) == 0)
+        {
+            reported = 1;
+            if (resend >= resend_end)
+            {
+                resend = range.from;
+                resend_end = range.to;
+            }
+            else
+            {
+                resend = range.from < resend ? range.from : resend;
+                resend_end = range.to > resend_end ? range.to : resend_end;
+            }
+        }
+        if (resend < una)
+        {
+            resend = una;
+        }
+        if (resend_end > engine->next)
+        {
+            resend_end = engine->next;
+        }
+        while (resend < resend_end && __atomic_load_n(&RUDP_ENGINE_SLOT(engine, resend)->sacked, __ATOMIC_RELAXED))
+        {
+            resend++;
+        }
+
+        // Repairs are not limited by the window, they replace segments that already left the network
+        if (resend < resend_end)
+        {
+            int lost_on = RUDP_ENGINE_SLOT(engine, resend)->path;
+            if (reported)
+            {
+                engine_path_lost(engine, lost_on);
+            }
+            engine_transmit(engine, resend, engine_pick_path(engine, una, lost_on, 0));
+            resend++;
+            worked = 1;
+        }
+        else
+        {
+            int path = engine->next < queued ? engine_pick_path(engine, una, -1, 1) : -1;
+            uint64_t limit = __atomic_load_n(&engine->limit, __ATOMIC_ACQUIRE);
+            if (path >= 0 && engine->next < limit)
+            {
+                // Published first: on loopback the ACK may be processed before sendto() returns
+                __atomic_store_n(&engine->next, engine->next + 1, __ATOMIC_RELEASE);
+                engine_transmit(engine, engine->next - 1, path);
+                stalled = 0;
+                probes = 0;
+                worked = 1;
+            }
+            else if (path >= 0)
+            {
+                if (!stalled)
+                {
+                    STATS_ADD(engine->connection, window_stalls, 1);
+                    stalled = 1;
+                    probe_ns = rudp_now_ns();
+                }
+                if (una == engine->next && rudp_now_ns() - probe_ns > engine_rto_us(engine, path, probes) * 1000)
+                {
+                    engine_probe(engine, path);
+                    probe_ns = rudp_now_ns();
+                    probes += probes < 8;
+                    worked = 1;
+                }
+            }
+        }
+
+        if (una != last_una)
+        {
+            last_una = una;
+            backoffs = 0;
+        }
+        if (una < engine->next)
+        {
+            RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, una);
+            uint64_t sent_ns = __atomic_load_n(&slot->sent_ns, __ATOMIC_RELAXED);
+            int path = slot->path;
+            if (rudp_now_ns() - sent_ns > engine_rto_us(engine, path, backoffs) * 1000)
+            {
+                if (slot->transmissions >= RUDP_ENGINE_MAX_TRANSMISSIONS)
+                {
+                    RUDP_LOG(RUDP_LOG_WARN, "Max retries reached for packet %lld", (uint16_t)(engine->base + una));
+                    engine_fail(engine);
+                    break;
+                }
+                STATS_ADD(engine->connection, timeouts, 1);
+                RUDP_LOG(RUDP_LOG_DEBUG, "No ACK for packet %lld, %lld segments in flight", (uint16_t)(engine->base + una), engine->next - una);
+                engine_reduce(engine, path, engine_path_flight(engine, path, una, engine->next), 1);
+                if (engine->connection->path_count > 0)
+                {
+                    engine->connection->paths[path].timeouts++;
+                }
+                engine_path_lost(engine, path);
+                backoffs += backoffs < 8;
+                engine_transmit(engine, una, engine_pick_path(engine, una, path, 0));
+                // Without SACK bits the receiver may have dropped everything after the gap
+                resend = una + 1;
+                resend_end = engine->next;
+                reported = 0;
+                worked = 1;
+            }
+        }
+
+        if (worked)
+        {
+            spins = 0;
+        }
+        else
+        {
+            backoff(&spins);
+        }
+    }
+    return NULL;
+}
+
+// Sender: a cumulative ACK moved `una` to `acked`.
+static void engine_acknowledge(RUDPEngine *engine, uint64_t una, uint64_t acked)
+{
+    RUDPConnection *connection = engine->connection;
+    RUDPEngineSlot *last = RUDP_ENGINE_SLOT(engine, acked - 1);
+    uint64_t counts[RUDP_MAX_PATHS] = {0};
+
+    for (uint64_t n = una; n < acked; n++)
+    {
+        RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, n);
+        STATS_ADD(connection, goodput_bytes, slot->packet->length);
+        counts[__atomic_load_n(&slot->path, __ATOMIC_RELAXED)]++;
+    }
+    // Karn's algorithm: only a segment sent once gives an RTT sample
+    if (__atomic_load_n(&last->transmissions, __ATOMIC_RELAXED) == 1)
+    {
+        rudp_rtt_sample(connection, __atomic_load_n(&last->sent_ns, __ATOMIC_RELAXED),
+                        __atomic_load_n(&last->tx_key, __ATOMIC_RELAXED));
+        if (connection->path_count > 0)
+        {
+            RUDPPath *path = &connection->paths[__atomic_load_n(&last->path, __ATOMIC_RELAXED)];
+            uint64_t rtt_us = STATS_GET(connection, rtt_us);
+            uint64_t srtt_us = __atomic_load_n(&path->srtt_us, __ATOMIC_RELAXED);
+            __atomic_store_n(&path->srtt_us, srtt_us == 0 ? rtt_us : (7 * srtt_us + rtt_us) / 8, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Each path grows by the segments last sent on it: slow start below ssthresh, then one segment per window
+    for (int path = 0; path < engine->path_count; path++)
+    {
+        RUDPEnginePath *state = &engine->paths[path];
+        uint64_t count = counts[path];
+        if (count == 0)
+        {
+            continue;
+        }
+        __atomic_store_n(&state->acked, state->acked + count, __ATOMIC_RELAXED);
+        uint32_t cwnd = __atomic_load_n(&state->cwnd, __ATOMIC_RELAXED);
+        if ((cwnd >> RUDP_ENGINE_CWND_SHIFT) < __atomic_load_n(&state->ssthresh, __ATOMIC_RELAXED))
+        {
+            cwnd += (uint32_t)(count << RUDP_ENGINE_CWND_SHIFT);
+        }
+        else
+        {
+            cwnd += (uint32_t)((count << (2 * RUDP_ENGINE_CWND_SHIFT)) / cwnd);
+        }
+        if (cwnd > (RUDP_ENGINE_SLOTS << RUDP_ENGINE_CWND_SHIFT))
+        {
+            cwnd = RUDP_ENGINE_SLOTS << RUDP_ENGINE_CWND_SHIFT;
+        }
+        __atomic_store_n(&state->cwnd, cwnd, __ATOMIC_RELAXED);
+    }
+
+    // Slots are released only after their lengths were read
+    __atomic_store_n(&engine->una, acked, __ATOMIC_RELEASE);
+    engine->dupacks = 0;
+}
+
+/**
+ * @brief RX thread of a sender: the next datagram on any path's socket.
+ *
+ * A single path blocks in rudp_receive(). Several are polled, starting after the socket read
+ * last so a busy path does not hide the others. An error on an added path's socket reads as
+ * nothing, the losses of the path take it out of the schedule.
+ */
+static ssize_t engine_receive(RUDPEngine *engine, RUDPPacket *packet, struct sockaddr_in *from, int *turn)
+{
+    RUDPConnection *connection = engine->connection;
+    socklen_t from_len = sizeof(*from);
+    struct pollfd fds[RUDP_MAX_PATHS];
+
+    if (engine->path_count == 1)
+    {
+        return rudp_receive(connection, packet, sizeof(*packet), (struct sockaddr *)from, &from_len);
+    }
+    for (int path = 0; path < engine->path_count; path++)
+    {
+        fds[path].fd = engine->paths[path].sockfd;
+        fds[path].events = POLLIN;
+        fds[path].revents = 0;
+    }
+    int ready = poll(fds, (nfds_t)engine->path_count, RUDP_ENGINE_POLL_US / 1000);
+    for (int i = 0; ready > 0 && i < engine->path_count; i++)
+    {
+        int path = (*turn + 1 + i) % engine->path_count;
+        if (fds[path].revents & (POLLIN | POLLERR))
+        {
+            *turn = path;
+            if (path == 0)
+            {
+                return rudp_receive(connection, packet, sizeof(*packet), (struct sockaddr *)from, &from_len);
+            }
+            ssize_t bytes_received = rudp_receive_on(connection, fds[path].fd, packet, sizeof(*packet), (struct sockaddr *)from, &from_len);
+            if (bytes_received < 0)
+            {
+                errno = EAGAIN;
+            }
+            return bytes_received;
+        }
+    }
+    if (ready >= 0)
+    {
+        errno = EAGAIN;
+    }
+    return -1;
+}
+
+// RX thread of a sender: ACKs, SACK bits and NACKs, turned into window updates and retransmission requests.
+static void engine_sender_rx(RUDPEngine *engine)
+{
+    RUDPConnection *connection = engine->connection;
+    RUDPPacket *packet = engine->spare;
+    struct sockaddr_in from;
+    int turn = 0;
+
+    while (!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE) && !engine_failed(engine))
+    {
+        ssize_t bytes_received = engine_receive(engine, packet, &from, &turn);
+        if (bytes_received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error receiving ACK packet");
+            engine_fail(engine);
+            break;
+        }
+        if ((size_t)bytes_received < sizeof(RUDPHeader))
+        {
+            continue;
+        }
+
+        RUDPHeader *header = &packet->header;
+        uint64_t una = engine->una;
+        uint64_t next = __atomic_load_n(&engine->next, __ATOMIC_ACQUIRE);
+        int64_t counter = engine_counter(engine, header->sequence_number, una);
+
+        // A segment from the peer once everything is acknowledged: it took its turn to send (e.g. a
+        // manifest reply). The segment is left to the blocking API and nothing more is read.
+        if (header->flags.DATA == 1 && header->flags.ACK != 1 && una == __atomic_load_n(&engine->queued, __ATOMIC_ACQUIRE))
+        {
+            rudp_unread(connection, packet, bytes_received, &from);
+            break;
+        }
+        if (header->flags.NACK == 1)
+        {
+            // A plain receiver drops everything after a gap and asks for the gap: go back to it,
+            // once per round trip since every segment after the gap brings the same NACK
+            STATS_ADD(connection, nacks_received, 1);
+            uint64_t now = rudp_now_ns();
+            uint64_t holdoff_ns = 2 * STATS_GET(connection, srtt_us) * 1000 + 1000000;
+            if (counter >= (int64_t)una && (uint64_t)counter < next &&
+                ((uint64_t)counter != engine->nack_from || now - engine->nack_ns > holdoff_ns))
+            {
+                RUDP_LOG(RUDP_LOG_DEBUG, "Received NACK, going back to packet %lld", header->sequence_number);
+                queue_push(&engine->requests, (uint64_t)counter, next);
+                int path = __atomic_load_n(&RUDP_ENGINE_SLOT(engine, (uint64_t)counter)->path, __ATOMIC_RELAXED);
+                engine_reduce(engine, path, engine_path_flight(engine, path, una, next), 0);
+                engine->nack_from = (uint64_t)counter;
+                engine->nack_ns = now;
+            }
+            continue;
+        }
+        if (header->flags.ACK != 1)
+        {
+            continue;
+        }
+
+        int64_t acked = counter + 1;
+        // The newest ACK sets the receive window, a reordered older one would shrink it by mistake
+        if (acked >= (int64_t)engine->window_from)
+        {
+            engine->window_from = (uint64_t)acked;
+            __atomic_store_n(&engine->limit, (uint64_t)acked + header->window, __ATOMIC_RELEASE);
+            STATS_SET(connection, rwnd, header->window);
+        }
+        if (acked > (int64_t)una && (uint64_t)acked <= next)
+        {
+            RUDP_LOG(RUDP_LOG_TRACE, "Received ACK for packet %lld", header->sequence_number);
+            engine_acknowledge(engine, una, (uint64_t)acked);
+            una = (uint64_t)acked;
+        }
+        else if (acked == (int64_t)una && header->sack != 0)
+        {
+            engine->dupacks++;
+        }
+        else
+        {
+            continue;
+        }
+
+        // Bit b reports segment acked + 1 + b, the TX thread skips those when it repairs
+        uint64_t highest = 0;
+        for (int b = 0; b < 32; b++)
+        {
+            uint64_t n = una + 1 + (uint64_t)b;
+            if ((header->sack >> b & 1) && n < next)
+            {
+                RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, n);
+                if (!slot->sacked)
+                {
+                    // The segment made it, so did its path
+                    RUDPEnginePath *state = &engine->paths[__atomic_load_n(&slot->path, __ATOMIC_RELAXED)];
+                    __atomic_store_n(&state->acked, state->acked + 1, __ATOMIC_RELAXED);
+                }
+                __atomic_store_n(&slot->sacked, 1, __ATOMIC_RELAXED);
+                highest = n;
+            }
+        }
+        if (engine->dupacks >= RUDP_ENGINE_DUPACKS && una >= engine->recover_until && highest > una)
+        {
+            RUDP_LOG(RUDP_LOG_DEBUG, "Fast retransmit from packet %lld, %lld segments in flight", (uint16_t)(engine->base + una), next - una);
+            queue_push(&engine->requests, una, highest);
+            int path = __atomic_load_n(&RUDP_ENGINE_SLOT(engine, una)->path, __ATOMIC_RELAXED);
+            engine_reduce(engine, path, engine_path_flight(engine, path, una, next), 0);
+            engine->recover_until = next;
+            engine->dupacks = 0;
+        }
+    }
+}
+
+/**
+ * @brief Receiver: cumulative ACK of everything before `ready`, with the free slots of the ring.
+ *
+ * The RX thread adds the segments held after the gap. The application thread sends window
+ * updates without them, the slots after `ready` belong to the RX thread.
+ */
+static void engine_send_ack(RUDPEngine *engine, const struct sockaddr_in *to, int sack)
+{
+    uint64_t ready = __atomic_load_n(&engine->ready, __ATOMIC_ACQUIRE);
+    uint64_t end = __atomic_load_n(&engine->consumed, __ATOMIC_ACQUIRE) + RUDP_ENGINE_SLOTS;
+    RUDPHeader ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.sequence_number = (uint16_t)(engine->base + ready - 1);
+    ack.flags.ACK = 1;
+    ack.window = (uint32_t)(end - ready);
+    for (int b = 0; sack && b < 32; b++)
+    {
+        if (RUDP_ENGINE_SLOT(engine, ready + 1 + (uint64_t)b)->sacked)
+        {
+            ack.sack |= (uint32_t)1 << b;
+        }
+    }
+    __atomic_store_n(&engine->advertised, end, __ATOMIC_RELAXED);
+    // Only the header goes out, plain senders read nothing else of an ACK
+    if (rudp_transmit(engine->connection, &ack, sizeof(ack), (const struct sockaddr *)to, sizeof(*to)) < 0)
+    {
+        perror("Error sending ACK packet");
+    }
+}
+
+// RX thread of a receiver: verifies, reorders and acknowledges segments, the application only copies them out.
+static void engine_receiver_rx(RUDPEngine *engine)
+{
+    RUDPConnection *connection = engine->connection;
+    struct sockaddr_in from;
+    int warned = 0;
+
+    while (!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE))
+    {
+        RUDPPacket *packet = engine->spare;
+        socklen_t from_len = sizeof(from);
+        ssize_t bytes_received = rudp_receive(connection, packet, sizeof(*packet), (struct sockaddr *)&from, &from_len);
+        if (bytes_received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error receiving data packet");
+            engine_fail(engine);
+            break;
+        }
+        if (packet->header.flags.SYN == 1)
+        {
+            rudp_answer_syn(connection, packet, bytes_received, &from);
+            continue;
+        }
+        if (rudp_segment_length(packet, bytes_received) < 0)
+        {
+            continue;
+        }
+        if (verify_checksum(packet->data, packet->length, packet->header.checksum) != 1 ||
+            packet->length > MAX_PACKET_SIZE || packet->header.stream >= RUDP_MAX_STREAMS)
+        {
+            STATS_ADD(connection, checksum_failures, 1);
+            RUDP_LOG(RUDP_LOG_DEBUG, "Dropped invalid packet %lld", packet->header.sequence_number);
+            continue;
+        }
+        rudp_delay_sample(connection, &packet->header);
+        if (packet->header.fec.k > 0)
+        {
+            if (!warned)
+            {
+                RUDP_LOG(RUDP_LOG_WARN, "Dropping FEC groups, the engine does not decode them");
+                warned = 1;
+            }
+            continue;
+        }
+
+        uint64_t ready = engine->ready;
+        uint64_t consumed = __atomic_load_n(&engine->consumed, __ATOMIC_ACQUIRE);
+        int64_t counter = engine_counter(engine, packet->header.sequence_number, ready);
+        if (counter < (int64_t)ready)
+        {
+            STATS_ADD(connection, duplicates, 1);
+        }
+        else if ((uint64_t)counter >= consumed + RUDP_ENGINE_SLOTS)
+        {
+            // The application is a whole ring behind, the sender will send it again
+            RUDP_LOG(RUDP_LOG_DEBUG, "No room for packet %lld", packet->header.sequence_number);
+        }
+        else
+        {
+            RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, (uint64_t)counter);
+            if (slot->sacked)
+            {
+                STATS_ADD(connection, duplicates, 1);
+            }
+            else
+            {
+                if ((uint64_t)counter > ready)
+                {
+                    STATS_ADD(connection, out_of_order, 1);
+                }
+                // Slots at or after `ready` belong to this thread, the datagram is kept without a copy.
+                // Once marked, the application may hand it out before the gap in front of it is filled.
+                engine->spare = slot->packet;
+                slot->packet = packet;
+                __atomic_store_n(&slot->sacked, 1, __ATOMIC_RELEASE);
+            }
+            while (RUDP_ENGINE_SLOT(engine, ready)->sacked)
+            {
+                __atomic_store_n(&RUDP_ENGINE_SLOT(engine, ready)->sacked, 0, __ATOMIC_RELAXED);
+                STATS_ADD(connection, goodput_bytes, RUDP_ENGINE_SLOT(engine, ready)->packet->length);
+                ready++;
+            }
+            __atomic_store_n(&engine->ready, ready, __ATOMIC_RELEASE);
+        }
+        engine_send_ack(engine, &from, 1);
+    }
+}
+
+static void *engine_rx_thread(void *arg)
+{
+    RUDPEngine *engine = (RUDPEngine *)arg;
+
+    busy_poll_enter(BUSY_POLL_RECEIVE);
+    if (engine->role == RUDP_ENGINE_SENDER)
+    {
+        engine_sender_rx(engine);
+    }
+    else
+    {
+        engine_receiver_rx(engine);
+    }
+    return NULL;
+}
+
+static void engine_free(RUDPEngine *engine)
+{
+    for (int i = 0; i < RUDP_ENGINE_SLOTS; i++)
+    {
+        free(engine->slots[i].packet);
+    }
+    free(engine->spare);
+    free(engine);
+}
+
+/**
+ * @brief Hands an established connection to a TX and an RX thread.
+ *
+ * From here until rudp_engine_stop() the connection must only be used through the engine:
+ * the sender enqueues segments with rudp_engine_send() and the receiver dequeues them with
+ * rudp_engine_recv(). Up to RUDP_ENGINE_SLOTS segments are in flight under a congestion
+ * window and the receiver's window, the receiver acknowledges cumulatively with SACK bits and
+ * advertises the free slots of its ring. A receiver only runs the RX thread, its ACKs are sent
+ * as the data arrives, to the address each segment came from. A sender with paths added by
+ * rudp_add_path() spreads the segments over them, each path with a window and an RTT of its own.
+ *
+ * @param peer Where the data goes (sender), ignored by a receiver.
+ * @return The engine, or NULL if memory or a thread could not be obtained.
+ */
+RUDPEngine *rudp_engine_start(RUDPConnection *connection, const struct sockaddr_in *peer, RUDPEngineRole role)
+{
+    // Segments are not sent as SYNs by the TX thread, a deferred handshake is done first
+    if (role == RUDP_ENGINE_SENDER && rudp_handshake(connection) < 0)
+    {
+        return NULL;
+    }
+    RUDPEngine *engine = (RUDPEngine *)calloc(1, sizeof(RUDPEngine));
+    if (engine == NULL)
+    {
+        perror("Failed to allocate RUDP engine");
+        return NULL;
+    }
+    for (int i = 0; i < RUDP_ENGINE_SLOTS; i++)
+    {
+        engine->slots[i].packet = (RUDPPacket *)malloc(sizeof(RUDPPacket));
+        if (engine->slots[i].packet == NULL)
+        {
+            perror("Failed to allocate RUDP engine slots");
+            engine_free(engine);
+            return NULL;
+        }
+    }
+    engine->spare = (RUDPPacket *)malloc(sizeof(RUDPPacket));
+    if (engine->spare == NULL)
+    {
+        perror("Failed to allocate RUDP engine slots");
+        engine_free(engine);
+        return NULL;
+    }
+    engine->connection = connection;
+    engine->peer = peer != NULL ? *peer : connection->sender_addr;
+    engine->role = role;
+    engine->base = connection->next_sequence_number;
+    // A receiver answers on the connection's socket whatever path a segment came on
+    engine->path_count = role == RUDP_ENGINE_SENDER && connection->path_count > 0 ? connection->path_count : 1;
+    for (int i = 0; i < engine->path_count; i++)
+    {
+        engine->paths[i].sockfd = i == 0 ? connection->sockfd : connection->paths[i].sockfd;
+        engine->paths[i].peer = i == 0 ? engine->peer : connection->paths[i].remote;
+        engine->paths[i].cwnd = 2 << RUDP_ENGINE_CWND_SHIFT;
+        engine->paths[i].ssthresh = RUDP_ENGINE_SLOTS;
+        engine->paths[i].alive_ns = rudp_now_ns();
+        // A whole window may arrive back to back
+        rudp_grow_receive_buffer(engine->paths[i].sockfd, 2 * RUDP_ENGINE_SLOTS);
+    }
+    if (connection->pending != NULL)
+    {
+        // The segment that came with the SYN is the first one the application takes
+        memcpy(engine->slots[0].packet, connection->pending, sizeof(RUDPPacket));
+        free(connection->pending);
+        connection->pending = NULL;
+        engine->base--;
+        engine->ready = 1;
+    }
+    // The SYN-ACK advertised the first window, at least one segment goes out to learn the next one
+    engine->limit = STATS_GET(connection, rwnd) > 0 ? STATS_GET(connection, rwnd) : 1;
+    engine->advertised = engine->ready + RUDP_ENGINE_SLOTS;
+
+    // The threads wake up regularly to see whether they should stop
+    socklen_t timeout_len = sizeof(engine->saved_timeout);
+    getsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &engine->saved_timeout, &timeout_len);
+    struct timeval poll = {0, RUDP_ENGINE_POLL_US};
+    setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &poll, sizeof(poll));
+    for (int i = 1; i < engine->path_count; i++)
+    {
+        setsockopt(engine->paths[i].sockfd, SOL_SOCKET, SO_RCVTIMEO, &poll, sizeof(poll));
+    }
+
+    if (pthread_create(&engine->rx_thread, NULL, engine_rx_thread, engine) != 0)
+    {
+        perror("pthread_create");
+        setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &engine->saved_timeout, sizeof(engine->saved_timeout));
+        engine_free(engine);
+        return NULL;
+    }
+    engine->threads = 1;
+    if (role == RUDP_ENGINE_SENDER)
+    {
+        if (pthread_create(&engine->tx_thread, NULL, engine_tx_thread, engine) != 0)
+        {
+            perror("pthread_create");
+            rudp_engine_stop(engine);
+            return NULL;
+        }
+        engine->threads = 2;
+    }
+    return engine;
+}
+
+// Queues one segment of a stream, waiting while the whole ring is in flight or still used by the TX thread.
+static int engine_queue(RUDPEngine *engine, int stream, int fin, const char *buffer, int buffer_size)
+{
+    RUDPConnection *connection = engine->connection;
+    unsigned spins = 0;
+
+    if (buffer_size < 0 || buffer_size > MAX_PACKET_SIZE)
+    {
+        fprintf(stderr, "Segment of %d bytes does not fit in a packet\n", buffer_size);
+        return -1;
+    }
+    while (engine->queued - __atomic_load_n(&engine->released, __ATOMIC_ACQUIRE) >= RUDP_ENGINE_SLOTS)
+    {
+        if (engine_failed(engine))
+        {
+            return -1;
+        }
+        backoff(&spins);
+    }
+    RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, engine->queued);
+    memset(&slot->packet->header, 0, sizeof(slot->packet->header));
+    slot->packet->header.stream = (uint16_t)stream;
+    slot->packet->header.stream_sequence = connection->stream_sent[stream]++;
+    slot->packet->header.flags.STREAM_FIN = fin;
+    memcpy(slot->packet->data, buffer, buffer_size);
+    slot->packet->length = buffer_size;
+    slot->transmissions = 0;
+    __atomic_store_n(&slot->sacked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&engine->queued, engine->queued + 1, __ATOMIC_RELEASE);
+    return buffer_size;
+}
+
+/**
+ * @brief Queues one segment on stream 0, waiting while the whole ring is in flight.
+ * @return buffer_size on success, -1 if the segment is too large or the connection failed.
+ */
+int rudp_engine_send(RUDPEngine *engine, const char *buffer, int buffer_size)
+{
+    return engine_queue(engine, RUDP_STREAM_DATA, 0, buffer, buffer_size);
+}
+
+/**
+ * @brief Queues one segment on an open stream of the connection (see rudp_stream_open()).
+ * @return buffer_size on success, -1 if the stream is not open, the segment is too large or the connection failed.
+ */
+int rudp_engine_write(RUDPEngine *engine, int stream, const char *buffer, int buffer_size)
+{
+    if (stream < 0 || stream >= RUDP_MAX_STREAMS || !engine->connection->stream_open[stream])
+    {
+        fprintf(stderr, "Stream %d is not open\n", stream);
+        return -1;
+    }
+    return engine_queue(engine, stream, 0, buffer, buffer_size);
+}
+
+/**
+ * @brief Queues the end of a stream opened with rudp_stream_open(), like rudp_stream_close().
+ * @return 0 on success, -1 if the stream is not open or the connection failed.
+ */
+int rudp_engine_close_stream(RUDPEngine *engine, int stream)
+{
+    if (stream <= RUDP_STREAM_CONTROL || stream >= RUDP_MAX_STREAMS || !engine->connection->stream_open[stream])
+    {
+        fprintf(stderr, "Stream %d is not open\n", stream);
+        return -1;
+    }
+    engine->connection->stream_open[stream] = 0;
+    return engine_queue(engine, stream, 1, "", 0) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Waits until every queued segment is acknowledged.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int rudp_engine_flush(RUDPEngine *engine)
+{
+    unsigned spins = 0;
+
+    while (__atomic_load_n(&engine->una, __ATOMIC_ACQUIRE) != engine->queued)
+    {
+        if (engine_failed(engine))
+        {
+            return -1;
+        }
+        backoff(&spins);
+    }
+    return 0;
+}
+
+// Frees the slots handed out, in order: those after a gap wait until it is filled.
+static void engine_release(RUDPEngine *engine)
+{
+    uint64_t ready = __atomic_load_n(&engine->ready, __ATOMIC_ACQUIRE);
+
+    while (engine->consumed < ready && RUDP_ENGINE_SLOT(engine, engine->consumed)->delivered)
+    {
+        RUDP_ENGINE_SLOT(engine, engine->consumed)->delivered = 0;
+        __atomic_store_n(&engine->consumed, engine->consumed + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// The oldest segment whose stream has nothing missing in front of it, NULL if there is none yet.
+static RUDPEngineSlot *engine_deliverable(RUDPEngine *engine)
+{
+    RUDPConnection *connection = engine->connection;
+    uint64_t ready = __atomic_load_n(&engine->ready, __ATOMIC_ACQUIRE);
+
+    for (uint64_t n = engine->consumed; n < engine->consumed + RUDP_ENGINE_SLOTS; n++)
+    {
+        RUDPEngineSlot *slot = RUDP_ENGINE_SLOT(engine, n);
+        if (slot->delivered || (n >= ready && !__atomic_load_n(&slot->sacked, __ATOMIC_ACQUIRE)))
+        {
+            continue;
+        }
+        const RUDPHeader *header = &slot->packet->header;
+        int32_t distance = (int32_t)(header->stream_sequence - connection->stream_delivered[header->stream]);
+        if (distance == 0)
+        {
+            return slot;
+        }
+        if (distance < 0)
+        {
+            // Handed out before, e.g. by the blocking API after an earlier engine stopped
+            slot->delivered = 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes the next in-order segment, waiting for the RX thread if there is none.
+ * @return Number of bytes copied (the segment is truncated to buffer_size), -1 if the connection failed.
+ */
+int rudp_engine_recv(RUDPEngine *engine, char *buffer, int buffer_size)
+{
+    return rudp_engine_read(engine, buffer, buffer_size, NULL);
+}
+
+/**
+ * @brief Takes the next segment of any stream, waiting for the RX thread if there is none.
+ *
+ * Every stream comes out in order, but a gap only holds back its own stream: segments of the
+ * other streams that arrived after it are handed out while it waits for its retransmission.
+ * Their slots are freed once the gap is filled.
+ *
+ * @param info Filled with the stream of the segment, may be NULL.
+ * @return Number of bytes copied (the segment is truncated to buffer_size, 0 for the end of a
+ * stream), -1 if the connection failed.
+ */
+int rudp_engine_read(RUDPEngine *engine, char *buffer, int buffer_size, RUDPStreamInfo *info)
+{
+    unsigned spins = 0;
+    RUDPEngineSlot *slot;
+
+    engine_release(engine);
+    while ((slot = engine_deliverable(engine)) == NULL)
+    {
+        if (engine_failed(engine))
+        {
+            return -1;
+        }
+        backoff(&spins);
+        engine_release(engine);
+    }
+    RUDPPacket *packet = slot->packet;
+    int length = packet->length < buffer_size ? packet->length : buffer_size;
+    memcpy(buffer, packet->data, length);
+    rudp_stream_deliver(engine->connection, &packet->header, info);
+    slot->delivered = 1;
+    engine_release(engine);
+
+    // Window update: the sender learns the ring drained without waiting for its next probe
+    uint64_t ready = __atomic_load_n(&engine->ready, __ATOMIC_ACQUIRE);
+    uint64_t advertised = __atomic_load_n(&engine->advertised, __ATOMIC_RELAXED);
+    if ((int64_t)(advertised - ready) < RUDP_ENGINE_WINDOW_UPDATE && engine->consumed + RUDP_ENGINE_SLOTS - advertised >= RUDP_ENGINE_SLOTS / 2)
+    {
+        engine_send_ack(engine, &engine->peer, 0);
+    }
+    return length;
+}
+
+/**
+ * @brief Stops the threads and gives the connection back to the blocking API.
+ *
+ * The connection continues after the last acknowledged (sender) or delivered (receiver)
+ * segment, so rudp_send_fin() and rudp_recv_fin() work as usual. The engine is freed.
+ *
+ * @return 0 if the engine ran without error, -1 otherwise.
+ */
+int rudp_engine_stop(RUDPEngine *engine)
+{
+    RUDPConnection *connection = engine->connection;
+    int result = engine_failed(engine) ? -1 : 0;
+
+    __atomic_store_n(&engine->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(engine->rx_thread, NULL);
+    if (engine->threads > 1)
+    {
+        pthread_join(engine->tx_thread, NULL);
+    }
+    result = result < 0 || engine_failed(engine) ? -1 : 0;
+    connection->next_sequence_number = (uint16_t)(engine->base + (engine->role == RUDP_ENGINE_SENDER ? engine->una : engine->ready));
+    setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &engine->saved_timeout, sizeof(engine->saved_timeout));
+    engine_free(engine);
+    return result;
+}
@@ -0,0 +1,123 @@
+#ifndef RUDP_ENGINE_H
+#define RUDP_ENGINE_H
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "RUDP_API.h"
+
+// Segments in flight (sender) or held for reordering and delivery (receiver), a power of two
+#define RUDP_ENGINE_SLOTS 64
+// Retransmission requests the RX thread may queue for the TX thread
+#define RUDP_ENGINE_REQUESTS 16
+// How long the engine threads block in recvfrom before checking whether they should stop
+#define RUDP_ENGINE_POLL_US 20000
+// Shortest retransmission timeout of the engine, the longest is RUDP_ACK_TIMEOUT_US
+#define RUDP_ENGINE_MIN_RTO_US 10000
+// A receiver that advertised less than this many free slots sends a window update once half the ring is free
+#define RUDP_ENGINE_WINDOW_UPDATE (RUDP_ENGINE_SLOTS / 4)
+// The congestion window is kept in 1/256 segments so congestion avoidance can grow it by fractions
+#define RUDP_ENGINE_CWND_SHIFT 8
+
+typedef enum
+{
+    RUDP_ENGINE_SENDER,   // TX thread sends the queued segments, RX thread processes the ACKs
+    RUDP_ENGINE_RECEIVER  // RX thread reorders, acknowledges and hands segments to the application
+} RUDPEngineRole;
+
+// Segments [from, to) to send again, skipping the ones the receiver reported
+typedef struct
+{
+    uint64_t from;
+    uint64_t to;
+} RUDPEngineRange;
+
+// Single producer, single consumer ring of retransmission requests, RX thread -> TX thread
+typedef struct
+{
+    RUDPEngineRange slots[RUDP_ENGINE_REQUESTS];
+    char pad0[64];
+    uint32_t head;        // next request to pop, written by the TX thread
+    char pad1[64];
+    uint32_t tail;        // next request to push, written by the RX thread
+    char pad2[64];
+} RUDPEngineQueue;
+
+typedef struct
+{
+    RUDPPacket *packet;
+    uint64_t sent_ns;         // sender: last transmission, written by the TX thread
+    uint32_t transmissions;   // sender: written by the TX thread, read by the RX thread for Karn's rule
+    uint32_t tx_key;          // sender: kernel TX timestamp key of the first transmission, see rudp_transmit_timed()
+    uint8_t sacked;           // sender: reported by the receiver; receiver: arrived ahead of `ready`
+    uint8_t delivered;        // receiver: handed to the application ahead of `consumed`, application thread only
+    uint8_t path;             // sender: path of the last transmission, written by the TX thread
+} RUDPEngineSlot;
+
+// Sender: congestion and failure state of one path, its RTT and counters are kept by the connection
+typedef struct
+{
+    int sockfd;
+    struct sockaddr_in peer;
+    uint32_t cwnd;            // congestion window, written by the RX thread and on timeouts by the TX thread
+    uint32_t ssthresh;        // in whole segments
+    uint64_t acked;           // segments last sent on the path that the receiver reported, written by the RX thread
+    uint64_t seen_acked;      // TX thread: `acked` when the path last showed it works
+    uint64_t alive_ns;        // TX thread: when that was, or when the engine started
+    int losses;               // TX thread: its segments sent again since then
+    uint64_t down_ns;         // TX thread: when the path was taken out of the schedule, 0 while it is in
+} RUDPEnginePath;
+
+/**
+ * Pipelined connection: the application, TX and RX threads only share the slot rings and the
+ * counters below. Counters count segments since the engine started and only grow, segment n
+ * carries the sequence number base + n.
+ */
+typedef struct
+{
+    RUDPConnection *connection;
+    struct sockaddr_in peer;
+    RUDPEngineRole role;
+    uint16_t base;
+    RUDPEngineSlot slots[RUDP_ENGINE_SLOTS];
+    RUDPPacket *spare;        // receiver: the RX thread reads into it, then swaps it into a slot
+    char pad0[64];
+    uint64_t queued;          // sender: segments enqueued, written by the application
+    char pad1[64];
+    uint64_t next;            // sender: next new segment, written by the TX thread
+    uint64_t released;        // sender: `una` as the TX thread last saw it, older slots are free to reuse
+    char pad2[64];
+    uint64_t una;             // sender: oldest unacknowledged segment, written by the RX thread
+    uint64_t limit;           // sender: segments before this one fit in the receive window, written by the RX thread
+    char pad3[64];
+    uint64_t ready;           // receiver: segments received in order, written by the RX thread
+    char pad4[64];
+    uint64_t consumed;        // receiver: segments handed to the application
+    uint64_t advertised;      // receiver: end of the window in the last ACK, written by the RX and application threads
+    char pad5[64];
+    RUDPEnginePath paths[RUDP_MAX_PATHS];  // sender: path 0 is the connection's socket towards `peer`
+    int path_count;
+    RUDPEngineQueue requests;
+    uint64_t recover_until;   // RX thread: no new fast retransmit before `una` passes it
+    uint64_t window_from;     // RX thread: cumulative ACK of the last window update, older ACKs do not change it
+    int dupacks;              // RX thread
+    uint64_t nack_from;       // RX thread: last go-back-N request and when it was made
+    uint64_t nack_ns;
+    int error;
+    int stop;
+    int threads;
+    pthread_t tx_thread;
+    pthread_t rx_thread;
+    struct timeval saved_timeout;
+} RUDPEngine;
+
+// Function declarations
+RUDPEngine *rudp_engine_start(RUDPConnection *connection, const struct sockaddr_in *peer, RUDPEngineRole role);
+int rudp_engine_send(RUDPEngine *engine, const char *buffer, int buffer_size);
+int rudp_engine_write(RUDPEngine *engine, int stream, const char *buffer, int buffer_size);
+int rudp_engine_close_stream(RUDPEngine *engine, int stream);
+int rudp_engine_flush(RUDPEngine *engine);
+int rudp_engine_recv(RUDPEngine *engine, char *buffer, int buffer_size);
+int rudp_engine_read(RUDPEngine *engine, char *buffer, int buffer_size, RUDPStreamInfo *info);
+int rudp_engine_stop(RUDPEngine *engine);
+
+#endif
@@ -0,0 +1,270 @@
+#include "RUDP_FEC.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 and generator 2
+#define GF_POLYNOMIAL 0x11D
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+// Full product table, a multiply-add over a region is one lookup per byte
+static uint8_t gf_mul_table[256][256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init(void)
+{
+    int x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+    for (int i = 255; i < 512; i++)
+    {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    for (int a = 1; a < 256; a++)
+    {
+        for (int b = 1; b < 256; b++)
+        {
+            gf_mul_table[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+        }
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return gf_mul_table[a][b];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+/**
+ * @brief Coefficient of data segment `j` in parity segment `i`.
+ *
+ * Rows come from the Cauchy matrix 1 / (x_i + y_j) with x_i = i and y_j = 255 - j, so any k
+ * of the k + m segments rebuild the group. Columns are scaled so the first parity row is all
+ * ones, which makes one parity segment a plain XOR. The coefficients do not depend on m, so
+ * the sender can change the parity count between groups.
+ */
+static uint8_t fec_coefficient(int i, int j)
+{
+    uint8_t y = (uint8_t)(255 - j);
+    return gf_mul(gf_inv((uint8_t)(i ^ y)), y);
+}
+
+// dst ^= src, a word at a time
+static void region_xor(uint8_t *dst, const uint8_t *src, size_t length)
+{
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < length; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+// dst += coefficient * src
+static void region_madd(uint8_t *dst, const uint8_t *src, uint8_t coefficient, size_t length)
+{
+    if (coefficient == 0)
+    {
+        return;
+    }
+    if (coefficient == 1)
+    {
+        region_xor(dst, src, length);
+        return;
+    }
+    const uint8_t *row = gf_mul_table[coefficient];
+    for (size_t i = 0; i < length; i++)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+/**
+ * @brief Parses an FEC setting such as "8:2" (8 data and 2 parity segments per group) or "8:1:auto".
+ * @return 0 on success, -1 if the text is not a valid setting.
+ */
+int rudp_fec_parse(const char *text, RUDPFecConfig *config)
+{
+    char mode[8] = {0};
+    int fields = sscanf(text, "%d:%d:%7s", &config->k, &config->m, mode);
+
+    config->adaptive = fields == 3 && strcmp(mode, "auto") == 0;
+    if (fields < 2 || (fields == 3 && !config->adaptive) || config->k < 1 || config->m < 1 ||
+        config->k + config->m > RUDP_FEC_MAX_SHARDS)
+    {
+        fprintf(stderr, "Invalid FEC setting %s, expected <k>:<m>[:auto] with k + m <= %d\n", text, RUDP_FEC_MAX_SHARDS);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Picks the parity count for a measured shard loss rate.
+ *
+ * The smallest m, between m_min and m_max, that covers the expected number of lost shards
+ * of a group plus two standard deviations.
+ */
+int rudp_fec_adapt(int k, int m_min, int m_max, double loss)
+{
+    for (int m = m_min; m < m_max; m++)
+    {
+        double n = k + m;
+        double margin = m - n * loss;
+        if (margin >= 0 && margin * margin >= 4.0 * n * loss * (1.0 - loss))
+        {
+            return m;
+        }
+    }
+    return m_max;
+}
+
+/**
+ * @brief Computes the parity shards of a group.
+ * @param shards k data shards followed by m parity shards, all `length` bytes.
+ */
+void rudp_fec_encode(int k, int m, uint8_t *const *shards, size_t length)
+{
+    pthread_once(&gf_once, gf_init);
+    for (int i = 0; i < m; i++)
+    {
+        uint8_t *parity = shards[k + i];
+        memset(parity, 0, length);
+        for (int j = 0; j < k; j++)
+        {
+            region_madd(parity, shards[j], fec_coefficient(i, j), length);
+        }
+    }
+}
+
+/**
+ * @brief Rebuilds the missing data shards of a group in place.
+ *
+ * The parity shards used for the rebuild are overwritten.
+ *
+ * @param present Which of the k + m shards arrived.
+ * @return 0 on success, -1 if fewer than k shards arrived.
+ */
+int rudp_fec_decode(int k, int m, uint8_t *const *shards, const uint8_t *present, size_t length)
+{
+    int missing[RUDP_FEC_MAX_SHARDS];
+    int rows[RUDP_FEC_MAX_SHARDS];
+    uint8_t matrix[RUDP_FEC_MAX_SHARDS][RUDP_FEC_MAX_SHARDS];
+    uint8_t inverse[RUDP_FEC_MAX_SHARDS][RUDP_FEC_MAX_SHARDS];
+    int e = 0;
+    int r = 0;
+
+    pthread_once(&gf_once, gf_init);
+    for (int j = 0; j < k; j++)
+    {
+        if (!present[j])
+        {
+            missing[e++] = j;
+        }
+    }
+    for (int i = 0; i < m && r < e; i++)
+    {
+        if (present[k + i])
+        {
+            rows[r++] = i;
+        }
+    }
+    if (r < e)
+    {
+        return -1;
+    }
+    if (e == 0)
+    {
+        return 0;
+    }
+
+    // Remove the known data from the parity shards, what is left only depends on the missing data
+    for (int row = 0; row < e; row++)
+    {
+        uint8_t *syndrome = shards[k + rows[row]];
+        for (int j = 0; j < k; j++)
+        {
+            if (present[j])
+            {
+                region_madd(syndrome, shards[j], fec_coefficient(rows[row], j), length);
+            }
+        }
+        for (int c = 0; c < e; c++)
+        {
+            matrix[row][c] = fec_coefficient(rows[row], missing[c]);
+            inverse[row][c] = row == c;
+        }
+    }
+
+    // Gauss-Jordan inversion, every square submatrix of a Cauchy matrix is invertible
+    for (int c = 0; c < e; c++)
+    {
+        int pivot = c;
+        while (matrix[pivot][c] == 0)
+        {
+            pivot++;
+        }
+        if (pivot != c)
+        {
+            for (int i = 0; i < e; i++)
+            {
+                uint8_t t = matrix[c][i];
+                matrix[c][i] = matrix[pivot][i];
+                matrix[pivot][i] = t;
+                t = inverse[c][i];
+                inverse[c][i] = inverse[pivot][i];
+                inverse[pivot][i] = t;
+            }
+        }
+        uint8_t scale = gf_inv(matrix[c][c]);
+        for (int i = 0; i < e; i++)
+        {
+            matrix[c][i] = gf_mul(matrix[c][i], scale);
+            inverse[c][i] = gf_mul(inverse[c][i], scale);
+        }
+        for (int row = 0; row < e; row++)
+        {
+            uint8_t factor = matrix[row][c];
+            if (row == c || factor == 0)
+            {
+                continue;
+            }
+            for (int i = 0; i < e; i++)
+            {
+                matrix[row][i] ^= gf_mul(factor, matrix[c][i]);
+                inverse[row][i] ^= gf_mul(factor, inverse[c][i]);
+            }
+        }
+    }
+
+    for (int c = 0; c < e; c++)
+    {
+        uint8_t *data = shards[missing[c]];
+        memset(data, 0, length);
+        for (int row = 0; row < e; row++)
+        {
+            region_madd(data, shards[k + rows[row]], inverse[c][row], length);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef RUDP_FEC_H
+#define RUDP_FEC_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Data plus parity segments in one group, every segment of a group shares its sequence number
+#define RUDP_FEC_MAX_SHARDS 64
+// Shards start with the segment length, so a rebuilt segment knows its own size
+#define RUDP_FEC_LENGTH_BYTES 2
+
+// What the sender asked for with rudp_set_fec()
+typedef struct
+{
+    int k;                // data segments per group, 0 when FEC is off
+    int m;                // parity segments per group, the minimum when adaptive
+    int adaptive;         // raise m with the loss rate reported by the receiver
+} RUDPFecConfig;
+
+// Per connection FEC state: the group being filled (sender) or collected (receiver)
+typedef struct
+{
+    RUDPFecConfig config;
+    int m;                // parity segments of the next group
+    double loss;          // smoothed shard loss rate reported by the receiver
+    int count;            // sender: segments waiting in the group
+    // A group carries one stream: its segments follow each other from stream_sequence, a lone segment may close it
+    uint16_t stream;      // sender: of the group being filled; receiver: of the group collected
+    uint32_t stream_sequence;
+    int stream_fin;
+    int active;           // receiver: a group is being collected
+    uint16_t group;       // receiver: its sequence number
+    int group_k;
+    int group_m;
+    int received;
+    int highest;          // highest shard index seen, for the loss report
+    size_t shard_length;  // length of the parity shards of the group, 0 until one arrives
+    uint8_t present[RUDP_FEC_MAX_SHARDS];
+    int deliver_next;     // receiver: next decoded segment handed to rudp_recv
+    int deliver_count;
+    uint8_t *shards[RUDP_FEC_MAX_SHARDS];
+} RUDPFecState;
+
+// Function declarations
+int rudp_fec_parse(const char *text, RUDPFecConfig *config);
+int rudp_fec_adapt(int k, int m_min, int m_max, double loss);
+void rudp_fec_encode(int k, int m, uint8_t *const *shards, size_t length);
+int rudp_fec_decode(int k, int m, uint8_t *const *shards, const uint8_t *present, size_t length);
+
+#endif
@@ -0,0 +1,541 @@
+#include "RUDP_Impair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+// A datagram waiting for its (delayed or reordered) send time
+typedef struct
+{
+    int used;
+    int sockfd;
+    int flags;
+    int after_next;       // reordered: leaves right after the next datagram of the socket
+    uint64_t due_ns;
+    uint64_t order;       // ties between equal due times keep the scheduling order
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    char *data;
+} HeldDatagram;
+
+static struct
+{
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    int enabled;
+    RUDPImpairConfig config;
+    uint64_t rng;
+    int ge_bad;
+    uint64_t next_order;
+    int held_count;
+    RUDPImpairCounters counters;
+    HeldDatagram held[RUDP_IMPAIR_MAX_HELD];
+} impair = {.once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t impair_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// splitmix64, small and good enough to drive the impairment decisions
+static uint64_t impair_next(void)
+{
+    uint64_t z = (impair.rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Returns 1 with the given probability.
+static int impair_roll(double probability)
+{
+    if (probability <= 0.0)
+    {
+        return 0;
+    }
+    return (double)(impair_next() >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+void rudp_impair_config_defaults(RUDPImpairConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->ge_loss_bad = 1.0;
+    config->reorder_ms = 10;
+    config->seed = 1;
+}
+
+// Parses "0.05" or "5%" into a probability.
+static int parse_probability(const char *text, double *value)
+{
+    char *end = NULL;
+    *value = strtod(text, &end);
+    if (end == text)
+    {
+        return -1;
+    }
+    if (*end == '%')
+    {
+        *value /= 100.0;
+        end++;
+    }
+    return (*end == '\0' && *value >= 0.0 && *value <= 1.0) ? 0 : -1;
+}
+
+static int parse_count(const char *text, int *value)
+{
+    char *end = NULL;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || parsed < 0 || parsed > 60000)
+    {
+        return -1;
+    }
+    *value = (int)parsed;
+    return 0;
+}
+
+/**
+ * @brief Parses an impairment specification.
+ *
+ * The specification is a comma separated list of key=value pairs:
+ *  - loss=P                Bernoulli loss.
+ *  - ge=p:r[:bad[:good]]   Gilbert-Elliott burst loss, bad/good are the loss rates of each state (default 1 and 0).
+ *  - dup=P, reorder=P, corrupt=P
+ *  - reorder_ms=N          the longest a reordered datagram waits for the next one (default 10).
+ *  - delay=N, jitter=N     milliseconds.
+ *  - seed=N
+ * Probabilities are fractions ("0.02") or percentages ("2%").
+ *
+ * @param spec The specification.
+ * @param config The parsed configuration, starts from the defaults.
+ * @return 0 on success, -1 on a malformed specification.
+ */
+int rudp_impair_parse(const char *spec, RUDPImpairConfig *config)
+{
+    char copy[512];
+    char *saveptr = NULL;
+
+    rudp_impair_config_defaults(config);
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+
+    for (char *token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(token, '=');
+        int ok = -1;
+        if (value == NULL)
+        {
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(token, "loss") == 0)
+        {
+            ok = parse_probability(value, &config->loss);
+        }
+        else if (strcmp(token, "dup") == 0)
+        {
+            ok = parse_probability(value, &config->duplicate);
+        }
+        else if (strcmp(token, "reorder") == 0)
+        {
+            ok = parse_probability(value, &config->reorder);
+        }
+        else if (strcmp(token, "corrupt") == 0)
+        {
+            ok = parse_probability(value, &config->corrupt);
+        }
+        else if (strcmp(token, "reorder_ms") == 0)
+        {
+            ok = parse_count(value, &config->reorder_ms);
+        }
+        else if (strcmp(token, "delay") == 0)
+        {
+            ok = parse_count(value, &config->delay_ms);
+        }
+        else if (strcmp(token, "jitter") == 0)
+        {
+            ok = parse_count(value, &config->jitter_ms);
+        }
+        else if (strcmp(token, "seed") == 0)
+        {
+            char *end = NULL;
+            config->seed = strtoull(value, &end, 10);
+            ok = (end != value && *end == '\0') ? 0 : -1;
+        }
+        else if (strcmp(token, "ge") == 0)
+        {
+            double parts[4] = {0.0, 0.0, 1.0, 0.0};
+            int count = 0;
+            char *ge_saveptr = NULL;
+            for (char *part = strtok_r(value, ":", &ge_saveptr); part != NULL && count < 4;
+                 part = strtok_r(NULL, ":", &ge_saveptr))
+            {
+                if (parse_probability(part, &parts[count++]) < 0)
+                {
+                    return -1;
+                }
+            }
+            ok = count >= 2 ? 0 : -1;
+            config->ge_enabled = 1;
+            config->ge_p = parts[0];
+            config->ge_r = parts[1];
+            config->ge_loss_bad = parts[2];
+            config->ge_loss_good = parts[3];
+        }
+
+        if (ok < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Installs a configuration, the caller holds the lock.
+static void impair_install(const RUDPImpairConfig *config)
+{
+    if (config == NULL)
+    {
+        impair.enabled = 0;
+        return;
+    }
+    impair.config = *config;
+    impair.rng = config->seed;
+    impair.ge_bad = 0;
+    memset(&impair.counters, 0, sizeof(impair.counters));
+    impair.enabled = config->loss > 0 || config->ge_enabled || config->duplicate > 0 || config->reorder > 0 ||
+                     config->corrupt > 0 || config->delay_ms > 0 || config->jitter_ms > 0;
+}
+
+// Reads RUDP_IMPAIR once, before the first datagram.
+static void impair_init_from_env(void)
+{
+    RUDPImpairConfig config;
+    const char *spec = getenv(RUDP_IMPAIR_ENV);
+
+    if (spec == NULL || *spec == '\0')
+    {
+        return;
+    }
+    if (rudp_impair_parse(spec, &config) < 0)
+    {
+        fprintf(stderr, "Ignoring malformed %s: %s\n", RUDP_IMPAIR_ENV, spec);
+        return;
+    }
+    pthread_mutex_lock(&impair.lock);
+    impair_install(&config);
+    pthread_mutex_unlock(&impair.lock);
+}
+
+/**
+ * @brief Replaces the active impairments, overriding RUDP_IMPAIR.
+ * @param config The impairments to apply, or NULL to pass datagrams through untouched.
+ */
+void rudp_impair_configure(const RUDPImpairConfig *config)
+{
+    pthread_once(&impair.once, impair_init_from_env);
+    pthread_mutex_lock(&impair.lock);
+    impair_install(config);
+    pthread_mutex_unlock(&impair.lock);
+}
+
+int rudp_impair_enabled(void)
+{
+    pthread_once(&impair.once, impair_init_from_env);
+    return impair.enabled;
+}
+
+// Queues a copy of a datagram until `due_ns`. Returns -1 if the queue is full.
+static int impair_hold(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr,
+                       socklen_t addrlen, uint64_t due_ns, int after_next)
+{
+    if (impair.held_count == RUDP_IMPAIR_MAX_HELD || addrlen > sizeof(struct sockaddr_storage))
+    {
+        return -1;
+    }
+    for (int i = 0; i < RUDP_IMPAIR_MAX_HELD; i++)
+    {
+        HeldDatagram *held = &impair.held[i];
+        if (held->used)
+        {
+            continue;
+        }
+        held->data = (char *)malloc(len);
+        if (held->data == NULL)
+        {
+            return -1;
+        }
+        memcpy(held->data, buf, len);
+        memcpy(&held->addr, dest_addr, addrlen);
+        held->used = 1;
+        held->sockfd = sockfd;
+        held->flags = flags;
+        held->after_next = after_next;
+        held->due_ns = due_ns;
+        held->order = impair.next_order++;
+        held->addrlen = addrlen;
+        held->len = len;
+        impair.held_count++;
+        return 0;
+    }
+    return -1;
+}
+
+// Sends every held datagram that is due, earliest first. The caller holds the lock.
+static void impair_flush(uint64_t now)
+{
+    while (impair.held_count > 0)
+    {
+        HeldDatagram *next = NULL;
+        for (int i = 0; i < RUDP_IMPAIR_MAX_HELD; i++)
+        {
+            HeldDatagram *held = &impair.held[i];
+            if (held->used && held->due_ns <= now &&
+                (next == NULL || held->due_ns < next->due_ns || (held->due_ns == next->due_ns && held->order < next->order)))
+            {
+                next = held;
+            }
+        }
+        if (next == NULL)
+        {
+            return;
+        }
+        sendto(next->sockfd, next->data, next->len, next->flags, (struct sockaddr *)&next->addr, next->addrlen);
+        free(next->data);
+        next->used = 0;
+        impair.held_count--;
+    }
+}
+
+// Reordered datagrams of a socket follow the datagram that was just scheduled for `due_ns`.
+static void impair_release_after(int sockfd, uint64_t due_ns)
+{
+    for (int i = 0; i < RUDP_IMPAIR_MAX_HELD; i++)
+    {
+        HeldDatagram *held = &impair.held[i];
+        if (held->used && held->after_next && held->sockfd == sockfd)
+        {
+            held->after_next = 0;
+            held->due_ns = due_ns;
+            held->order = impair.next_order++;
+        }
+    }
+}
+
+// The earliest due time of the held datagrams, 0 if none are held.
+static uint64_t impair_next_due(void)
+{
+    uint64_t due = 0;
+    for (int i = 0; i < RUDP_IMPAIR_MAX_HELD; i++)
+    {
+        if (impair.held[i].used && (due == 0 || impair.held[i].due_ns < due))
+        {
+            due = impair.held[i].due_ns;
+        }
+    }
+    return due;
+}
+
+/**
+ * @brief sendto() that drops, duplicates, corrupts, delays and reorders datagrams as configured.
+ *
+ * Dropped datagrams are reported as sent, exactly like a loss on the wire. Without an active
+ * configuration this is a plain sendto().
+ *
+ * @return The datagram length on success, -1 on a socket error.
+ */
+ssize_t rudp_impair_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr,
+                           socklen_t addrlen)
+{
+    const RUDPImpairConfig *config = &impair.config;
+
+    if (!rudp_impair_enabled())
+    {
+        return sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+    }
+
+    pthread_mutex_lock(&impair.lock);
+    uint64_t now = impair_now_ns();
+    impair_flush(now);
+    impair.counters.datagrams++;
+
+    int drop = impair_roll(config->loss);
+    if (config->ge_enabled)
+    {
+        impair.ge_bad = impair.ge_bad ? !impair_roll(config->ge_r) : impair_roll(config->ge_p);
+        drop |= impair_roll(impair.ge_bad ? config->ge_loss_bad : config->ge_loss_good);
+    }
+    if (drop)
+    {
+        impair.counters.dropped++;
+        pthread_mutex_unlock(&impair.lock);
+        return (ssize_t)len;
+    }
+
+    int copies = 1;
+    if (impair_roll(config->duplicate))
+    {
+        impair.counters.duplicated++;
+        copies = 2;
+    }
+
+    ssize_t result = (ssize_t)len;
+    for (int copy = 0; copy < copies; copy++)
+    {
+        const char *data = (const char *)buf;
+        char *corrupted = NULL;
+        if (len > 0 && impair_roll(config->corrupt) && (corrupted = (char *)malloc(len)) != NULL)
+        {
+            memcpy(corrupted, buf, len);
+            corrupted[impair_next() % len] ^= (char)(1 + impair_next() % 255);
+            impair.counters.corrupted++;
+            data = corrupted;
+        }
+
+        uint64_t delay_ns = (uint64_t)config->delay_ms * 1000000ULL;
+        if (config->jitter_ms > 0)
+        {
+            delay_ns += impair_next() % ((uint64_t)config->jitter_ms * 1000000ULL + 1);
+        }
+
+        if (impair_roll(config->reorder) &&
+            impair_hold(sockfd, data, len, flags, dest_addr, addrlen, now + delay_ns + config->reorder_ms * 1000000ULL, 1) == 0)
+        {
+            impair.counters.reordered++;
+        }
+        else if (delay_ns > 0 && impair_hold(sockfd, data, len, flags, dest_addr, addrlen, now + delay_ns, 0) == 0)
+        {
+            impair.counters.delayed++;
+            impair_release_after(sockfd, now + delay_ns);
+        }
+        else
+        {
+            if (sendto(sockfd, data, len, flags, dest_addr, addrlen) < 0)
+            {
+                result = -1;
+            }
+            impair_release_after(sockfd, now);
+            impair_flush(now);
+        }
+        free(corrupted);
+    }
+
+    pthread_mutex_unlock(&impair.lock);
+    return result;
+}
+
+/**
+ * @brief recvmsg() that keeps releasing held datagrams while it waits.
+ *
+ * Honors the socket's SO_RCVTIMEO and MSG_DONTWAIT like recvmsg(). Without an active
+ * configuration this is a plain recvmsg().
+ */
+ssize_t rudp_impair_recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    struct timeval timeout = {0, 0};
+    socklen_t timeout_len = sizeof(timeout);
+    socklen_t name_capacity = msg->msg_namelen;
+    size_t control_capacity = msg->msg_controllen;
+
+    if (!rudp_impair_enabled())
+    {
+        return recvmsg(sockfd, msg, flags);
+    }
+
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &timeout_len);
+    uint64_t timeout_ns = (uint64_t)timeout.tv_sec * 1000000000ULL + (uint64_t)timeout.tv_usec * 1000ULL;
+    uint64_t start = impair_now_ns();
+
+    while (1)
+    {
+        pthread_mutex_lock(&impair.lock);
+        uint64_t now = impair_now_ns();
+        impair_flush(now);
+        uint64_t next_due = impair_next_due();
+        pthread_mutex_unlock(&impair.lock);
+
+        msg->msg_namelen = name_capacity;
+        msg->msg_controllen = control_capacity;
+        ssize_t bytes = recvmsg(sockfd, msg, flags | MSG_DONTWAIT);
+        if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || (flags & MSG_DONTWAIT))
+        {
+            return bytes;
+        }
+
+        // Sleep until a datagram arrives, a held datagram is due or the receive timeout expires
+        uint64_t wait_ns = UINT64_MAX;
+        if (timeout_ns > 0)
+        {
+            if (now - start >= timeout_ns)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            wait_ns = timeout_ns - (now - start);
+        }
+        if (next_due > 0 && next_due - now < wait_ns)
+        {
+            wait_ns = next_due > now ? next_due - now : 0;
+        }
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        struct timespec ts = {(time_t)(wait_ns / 1000000000ULL), (long)(wait_ns % 1000000000ULL)};
+        if (ppoll(&pfd, 1, wait_ns == UINT64_MAX ? NULL : &ts, NULL) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+// recvfrom() through rudp_impair_recvmsg().
+ssize_t rudp_impair_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr,
+                             socklen_t *addrlen)
+{
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = src_addr;
+    msg.msg_namelen = addrlen != NULL ? *addrlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t bytes = rudp_impair_recvmsg(sockfd, &msg, flags);
+    if (bytes >= 0 && addrlen != NULL)
+    {
+        *addrlen = msg.msg_namelen;
+    }
+    return bytes;
+}
+
+void rudp_impair_get_counters(RUDPImpairCounters *counters)
+{
+    pthread_mutex_lock(&impair.lock);
+    *counters = impair.counters;
+    pthread_mutex_unlock(&impair.lock);
+}
+
+// Prints the active impairments and what they did, nothing when the shim is disabled.
+void rudp_impair_print(FILE *out)
+{
+    RUDPImpairCounters counters;
+
+    if (!rudp_impair_enabled())
+    {
+        return;
+    }
+    rudp_impair_get_counters(&counters);
+    fprintf(out, "- Impairment: loss=%.3f ge=%s dup=%.3f reorder=%.3f corrupt=%.3f delay=%dms jitter=%dms seed=%llu\n",
+            impair.config.loss, impair.config.ge_enabled ? "on" : "off", impair.config.duplicate, impair.config.reorder,
+            impair.config.corrupt, impair.config.delay_ms, impair.config.jitter_ms, (unsigned long long)impair.config.seed);
+    fprintf(out, "- Impaired datagrams: Sent=%llu; Dropped=%llu; Duplicated=%llu; Reordered=%llu; Delayed=%llu; Corrupted=%llu\n",
+            (unsigned long long)counters.datagrams, (unsigned long long)counters.dropped,
+            (unsigned long long)counters.duplicated, (unsigned long long)counters.reordered,
+            (unsigned long long)counters.delayed, (unsigned long long)counters.corrupted);
+}
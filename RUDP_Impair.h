@@ -0,0 +1,54 @@
+#ifndef RUDP_IMPAIR_H
+#define RUDP_IMPAIR_H
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Environment variable read on first use, e.g. RUDP_IMPAIR="loss=2%,dup=1%,delay=20,jitter=5,seed=42"
+#define RUDP_IMPAIR_ENV "RUDP_IMPAIR"
+#define RUDP_IMPAIR_MAX_HELD 256
+
+// Impairments applied to every datagram RUDP_API sends. Probabilities are between 0 and 1.
+typedef struct
+{
+    double loss;          // independent (Bernoulli) drop probability
+    int ge_enabled;       // Gilbert-Elliott burst loss on top of `loss`
+    double ge_p;          // probability of moving from the good to the bad state
+    double ge_r;          // probability of moving from the bad to the good state
+    double ge_loss_good;  // drop probability in the good state
+    double ge_loss_bad;   // drop probability in the bad state
+    double duplicate;     // probability of sending a datagram twice
+    double reorder;       // probability of holding a datagram until the next one was sent
+    int reorder_ms;       // longest time a reordered datagram is held
+    double corrupt;       // probability of flipping one byte of a datagram
+    int delay_ms;         // constant one-way delay
+    int jitter_ms;        // uniform extra delay between 0 and jitter_ms
+    uint64_t seed;        // the same seed and traffic give the same impairments
+} RUDPImpairConfig;
+
+// What the shim did so far
+typedef struct
+{
+    uint64_t datagrams;
+    uint64_t dropped;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t delayed;
+    uint64_t corrupted;
+} RUDPImpairCounters;
+
+// Function declarations
+void rudp_impair_config_defaults(RUDPImpairConfig *config);
+int rudp_impair_parse(const char *spec, RUDPImpairConfig *config);
+void rudp_impair_configure(const RUDPImpairConfig *config);
+int rudp_impair_enabled(void);
+ssize_t rudp_impair_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr,
+                           socklen_t addrlen);
+ssize_t rudp_impair_recvmsg(int sockfd, struct msghdr *msg, int flags);
+ssize_t rudp_impair_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr,
+                             socklen_t *addrlen);
+void rudp_impair_get_counters(RUDPImpairCounters *counters);
+void rudp_impair_print(FILE *out);
+
+#endif
@@ -0,0 +1,222 @@
+#include "RUDP_Log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+
+// How often the drain thread empties the ring buffer
+#define RUDP_LOG_DRAIN_INTERVAL_NS 10000000L
+
+// A binary record, formatted only when it is drained
+typedef struct
+{
+    uint64_t sequence;   // ring slot state, see rudp_log_write()
+    uint64_t time_ns;
+    const char *format;
+    long long a;
+    long long b;
+    int level;
+} LogRecord;
+
+int rudp_log_level = RUDP_LOG_WARN;
+
+static LogRecord log_ring[RUDP_LOG_CAPACITY];
+static uint64_t log_tail;     // next slot to write, shared by every producer
+static uint64_t log_head;     // next slot to drain, owned by the consumer holding log_drain_lock
+static uint64_t log_dropped;
+static uint64_t log_start_ns;
+static int log_ring_ready;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *log_out;
+static pthread_t log_thread;
+static int log_thread_running;
+
+static const char *log_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+static uint64_t log_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Marks every slot as free for the first lap of the ring.
+static void log_init_ring(void)
+{
+    for (uint64_t i = 0; i < RUDP_LOG_CAPACITY; i++)
+    {
+        __atomic_store_n(&log_ring[i].sequence, i, __ATOMIC_RELAXED);
+    }
+    log_start_ns = log_now_ns();
+    __atomic_store_n(&log_ring_ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Appends a record to the ring buffer without taking a lock.
+ *
+ * The ring is a bounded multi-producer queue: a slot whose sequence equals the producer's
+ * position is free, the producer claims the position with a CAS and publishes the record by
+ * storing position + 1. When the ring is full the record is dropped and counted, the caller
+ * never waits for the drain.
+ */
+void rudp_log_write(int level, const char *format, long long a, long long b)
+{
+    if (!__atomic_load_n(&log_ring_ready, __ATOMIC_ACQUIRE))
+    {
+        pthread_once(&log_once, log_init_ring);
+    }
+
+    uint64_t position = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    LogRecord *record;
+    while (1)
+    {
+        record = &log_ring[position & (RUDP_LOG_CAPACITY - 1)];
+        int64_t diff = (int64_t)__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - (int64_t)position;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&log_tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            position = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->time_ns = log_now_ns();
+    record->format = format;
+    record->a = a;
+    record->b = b;
+    record->level = level;
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+void rudp_log_set_level(int level)
+{
+    __atomic_store_n(&rudp_log_level, level, __ATOMIC_RELAXED);
+}
+
+// Maps "off", "error", ..., "trace" to a level, -2 for an unknown name.
+int rudp_log_parse_level(const char *name)
+{
+    if (strcasecmp(name, "off") == 0)
+    {
+        return RUDP_LOG_OFF;
+    }
+    for (int level = RUDP_LOG_ERROR; level <= RUDP_LOG_TRACE; level++)
+    {
+        if (strcasecmp(name, log_level_names[level]) == 0)
+        {
+            return level;
+        }
+    }
+    return -2;
+}
+
+/**
+ * @brief Formats and writes every published record.
+ *
+ * Safe to call from any thread, consumers are serialized by a lock that producers never take.
+ */
+void rudp_log_flush(void)
+{
+    pthread_once(&log_once, log_init_ring);
+    pthread_mutex_lock(&log_drain_lock);
+    FILE *out = log_out != NULL ? log_out : stderr;
+    while (1)
+    {
+        LogRecord *record = &log_ring[log_head & (RUDP_LOG_CAPACITY - 1)];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log_head + 1)
+        {
+            break;
+        }
+        uint64_t since_start = record->time_ns - log_start_ns;
+        fprintf(out, "[%6llu.%06llu] %-5s ", (unsigned long long)(since_start / 1000000000ULL),
+                (unsigned long long)(since_start % 1000000000ULL / 1000ULL), log_level_names[record->level]);
+        fprintf(out, record->format, record->a, record->b);
+        fputc('\n', out);
+        __atomic_store_n(&record->sequence, log_head + RUDP_LOG_CAPACITY, __ATOMIC_RELEASE);
+        log_head++;
+    }
+    fflush(out);
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void *log_drain_thread(void *arg)
+{
+    struct timespec interval = {0, RUDP_LOG_DRAIN_INTERVAL_NS};
+    (void)arg;
+
+    while (__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE))
+    {
+        rudp_log_flush();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads RUDP_LOG and starts the background drain thread.
+ * @param out Where the records are written, stderr if NULL.
+ * @return 0 on success, -1 if the thread could not be started (records can still be flushed by hand).
+ */
+int rudp_log_start(FILE *out)
+{
+    const char *name = getenv(RUDP_LOG_ENV);
+
+    pthread_once(&log_once, log_init_ring);
+    if (name != NULL)
+    {
+        int level = rudp_log_parse_level(name);
+        if (level == -2)
+        {
+            fprintf(stderr, "Ignoring unknown %s level: %s\n", RUDP_LOG_ENV, name);
+        }
+        else
+        {
+            rudp_log_set_level(level);
+        }
+    }
+
+    log_out = out != NULL ? out : stderr;
+    if (log_thread_running)
+    {
+        return 0;
+    }
+    __atomic_store_n(&log_thread_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&log_thread, NULL, log_drain_thread, NULL) != 0)
+    {
+        __atomic_store_n(&log_thread_running, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+// Stops the drain thread and writes whatever is left, plus a note if records were dropped.
+void rudp_log_stop(void)
+{
+    if (__atomic_exchange_n(&log_thread_running, 0, __ATOMIC_ACQ_REL))
+    {
+        pthread_join(log_thread, NULL);
+    }
+    rudp_log_flush();
+    if (rudp_log_dropped() > 0)
+    {
+        fprintf(log_out != NULL ? log_out : stderr, "%llu log records dropped, the ring buffer was full\n",
+                (unsigned long long)rudp_log_dropped());
+    }
+}
+
+uint64_t rudp_log_dropped(void)
+{
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,55 @@
+#ifndef RUDP_LOG_H
+#define RUDP_LOG_H
+#include <stdint.h>
+#include <stdio.h>
+
+// Log levels, a record is kept if its level is at most the active level
+#define RUDP_LOG_OFF -1
+#define RUDP_LOG_ERROR 0
+#define RUDP_LOG_WARN 1
+#define RUDP_LOG_INFO 2
+#define RUDP_LOG_DEBUG 3
+#define RUDP_LOG_TRACE 4
+
+// Records above this level are compiled out, e.g. -DRUDP_LOG_COMPILE_LEVEL=RUDP_LOG_INFO
+#ifndef RUDP_LOG_COMPILE_LEVEL
+#define RUDP_LOG_COMPILE_LEVEL RUDP_LOG_TRACE
+#endif
+
+// Environment variable holding the runtime level: off, error, warn, info, debug or trace
+#define RUDP_LOG_ENV "RUDP_LOG"
+
+// Records the ring buffer holds before new ones are dropped, a power of two
+#define RUDP_LOG_CAPACITY 8192
+
+extern int rudp_log_level;
+
+/**
+ * @brief Logs a record with up to two integer arguments.
+ *
+ * The format must be a string literal and its conversions must be %lld (the arguments are
+ * stored as long long and formatted later by the drain thread). A disabled record costs a
+ * compare with a constant and a load of rudp_log_level, nothing at all when compiled out.
+ *
+ * RUDP_LOG(RUDP_LOG_TRACE, "Sent packet %lld", seq);
+ */
+#define RUDP_LOG(level, ...) RUDP_LOG_RECORD(level, __VA_ARGS__, 0, 0, 0)
+#define RUDP_LOG_RECORD(level, format, a, b, ...)                                                         \
+    do                                                                                                    \
+    {                                                                                                     \
+        if ((level) <= RUDP_LOG_COMPILE_LEVEL && (level) <= __atomic_load_n(&rudp_log_level, __ATOMIC_RELAXED)) \
+        {                                                                                                 \
+            rudp_log_write((level), (format), (long long)(a), (long long)(b));                            \
+        }                                                                                                 \
+    } while (0)
+
+// Function declarations
+void rudp_log_write(int level, const char *format, long long a, long long b);
+void rudp_log_set_level(int level);
+int rudp_log_parse_level(const char *name);
+int rudp_log_start(FILE *out);
+void rudp_log_flush(void);
+void rudp_log_stop(void);
+uint64_t rudp_log_dropped(void);
+
+#endif
@@ -1,23 +1,374 @@
 #include "RUDP_API.h"
+#include "RUDP_Engine.h"
+#include "RUDP_Shard.h"
+#include "RUDP_Impair.h"
+#include "RUDP_Log.h"
+#include "Run_Stats.h"
+#include "Transfer.h"
+#include "Disk_Writer.h"
+#include "Compress.h"
+#include "Manifest.h"
+#include "Latency.h"
+#include "Busy_Poll.h"
+#include "Shm_Ring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <time.h>
 
-#define FILE_SIZE (2 * 1024 * 1024) // 2MB
+#define OUTPUT_PATH "RUDP_file.bin"
 #define CONTROL_MSG_SIZE 100
 
+// A control message that overtook the end of a run on its own stream, kept for recv_control()
+static char control_pending[CONTROL_MSG_SIZE];
+static int control_pending_size = -1;
+
+// Receives the next segment of any stream through the engine when it runs, with the blocking API otherwise.
+static int recv_segment(RUDPConnection *connection, RUDPEngine *engine, char *buffer, int size, RUDPStreamInfo *info)
+{
+    if (engine != NULL)
+    {
+        return rudp_engine_read(engine, buffer, size, info);
+    }
+    return rudp_stream_read(connection, buffer, size, info, &connection->sender_addr);
+}
+
+// Receives one message of the data stream, a control message read on the way is kept for recv_control().
+static int recv_message(RUDPConnection *connection, RUDPEngine *engine, char *buffer, int size)
+{
+    RUDPStreamInfo info;
+
+    while (1)
+    {
+        int bytes = recv_segment(connection, engine, buffer, size, &info);
+        if (bytes < 0 || info.stream == RUDP_STREAM_DATA)
+        {
+            return bytes;
+        }
+        if (info.stream != RUDP_STREAM_CONTROL || control_pending_size >= 0)
+        {
+            fprintf(stderr, "Unexpected message on stream %d\n", info.stream);
+            return -1;
+        }
+        control_pending_size = bytes < CONTROL_MSG_SIZE ? bytes : CONTROL_MSG_SIZE;
+        memcpy(control_pending, buffer, control_pending_size);
+    }
+}
+
+// Receives the control message that ends a run, it may have arrived before the run's last data.
+static int recv_control(RUDPConnection *connection, RUDPEngine *engine, char *buffer, int size)
+{
+    RUDPStreamInfo info;
+
+    if (control_pending_size >= 0)
+    {
+        int bytes = control_pending_size < size ? control_pending_size : size;
+        memcpy(buffer, control_pending, bytes);
+        control_pending_size = -1;
+        return bytes;
+    }
+    int bytes = recv_segment(connection, engine, buffer, size, &info);
+    if (bytes >= 0 && info.stream != RUDP_STREAM_CONTROL)
+    {
+        fprintf(stderr, "Unexpected message on stream %d\n", info.stream);
+        return -1;
+    }
+    return bytes;
+}
+
+// The receiver's end of a manifest exchange or of a latency run, the engine only runs while the sender has the line
+typedef struct
+{
+    RUDPConnection *connection;
+    RUDPEngine **engine;
+    int use_engine;
+} ManifestLine;
+
+static int line_send(void *context, const char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+
+    for (size_t offset = 0; offset < length; offset += MAX_PACKET_SIZE)
+    {
+        int piece = (int)(length - offset < MAX_PACKET_SIZE ? length - offset : MAX_PACKET_SIZE);
+        if (rudp_send(line->connection, (char *)data + offset, piece, &line->connection->sender_addr) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int line_recv(void *context, char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+
+    for (size_t offset = 0; offset < length;)
+    {
+        int piece = (int)(length - offset < MAX_PACKET_SIZE ? length - offset : MAX_PACKET_SIZE);
+        int bytes = recv_message(line->connection, *line->engine, data + offset, piece);
+        if (bytes < 0)
+        {
+            return -1;
+        }
+        offset += bytes;
+    }
+    return 0;
+}
+
+// Answers on the blocking API with the engine stopped, then hands the line back to the sender.
+static int line_turn(void *context, int sending)
+{
+    ManifestLine *line = (ManifestLine *)context;
+
+    if (sending)
+    {
+        if (*line->engine != NULL)
+        {
+            rudp_engine_stop(*line->engine);
+            *line->engine = NULL;
+        }
+        return 0;
+    }
+    // rudp_send() left an ACK timeout on the socket, the receiver waits for the sender as long as it takes
+    struct timeval forever = {0, 0};
+    setsockopt(line->connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+    if (line->use_engine && (*line->engine = rudp_engine_start(line->connection, NULL, RUDP_ENGINE_RECEIVER)) == NULL)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// A request of a latency run, the sender may leave any gap before the next one.
+static int request_recv(void *context, char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    struct timeval forever = {0, 0};
+
+    setsockopt(line->connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+    return rudp_recv(line->connection, data, (int)length, &line->connection->sender_addr) == (int)length ? 0 : -1;
+}
+
+/**
+ * @brief Answers the requests of a latency run.
+ *
+ * The blocking API acknowledges every request as soon as it arrives and the response follows
+ * right after, so the engine stops for the run and starts again once the sender has the line back.
+ *
+ * @return 0 on success, -1 on an error or an invalid latency header.
+ */
+static int serve_requests(ManifestLine *line, uint64_t *requests)
+{
+    char header[LATENCY_HEADER_SIZE];
+    LatencyChannel channel = {line_send, request_recv, line, NULL};
+    uint32_t size;
+    int connections;
+
+    if (line_recv(line, header, sizeof(header)) < 0 ||
+        latency_decode_header((const unsigned char *)header, &size, &connections) < 0 || connections != 1 ||
+        size > MAX_PACKET_SIZE)
+    {
+        fprintf(stderr, "Invalid latency header\n");
+        return -1;
+    }
+    if (line_turn(line, 1) < 0)
+    {
+        return -1;
+    }
+    int result = latency_serve(&channel, 1, size, requests);
+    if (line_turn(line, 0) < 0)
+    {
+        return -1;
+    }
+    return result;
+}
+
+// Where decompressed chunks go: through the writer's blocks, counted as the run's goodput
+typedef struct
+{
+    DiskWriter *writer;
+    RunStats *stats;
+} ChunkSink;
+
+static int write_chunk(void *context, const char *data, size_t length)
+{
+    ChunkSink *sink = (ChunkSink *)context;
+
+    while (length > 0)
+    {
+        size_t capacity;
+        char *block = disk_writer_reserve(sink->writer, 1, &capacity);
+        size_t piece = length < capacity ? length : capacity;
+        memcpy(block, data, piece);
+        disk_writer_commit(sink->writer, piece);
+        run_stats_chunk(sink->stats, piece);
+        data += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+// Receives the messages of one frame into a job, the frame header tells how many bytes follow.
+static int recv_frame(RUDPConnection *connection, RUDPEngine *engine, CompressJob *job, uint32_t *original)
+{
+    CompressFrame frame;
+    size_t length = 0; // unknown until the first message is in
+
+    while (length == 0 || job->input_length < length)
+    {
+        if (compress_job_reserve(job, job->input_length + MAX_PACKET_SIZE) < 0)
+        {
+            return -1;
+        }
+        ssize_t bytes_received = recv_message(connection, engine, job->input + job->input_length, MAX_PACKET_SIZE);
+        if (bytes_received < 0)
+        {
+            return -1;
+        }
+        job->input_length += bytes_received;
+        if (length == 0)
+        {
+            if (compress_parse_frame(job->input, job->input_length, &frame) < 0)
+            {
+                return -1;
+            }
+            length = COMPRESS_FRAME_HEADER + (size_t)frame.stored;
+        }
+    }
+    if (job->input_length != length)
+    {
+        return -1;
+    }
+    *original = frame.original;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 3 || strcmp(argv[1], "-p") != 0)
+    int port = 0;
+    const char *path = OUTPUT_PATH; // Where the received bytes are written
+    int use_engine = 0; // Reorder and acknowledge on an RX thread, the main thread only copies out
+    int timestamps = 0; // One-way delays end at the kernel's RX timestamps
+    const char *token_key = NULL; // File of the resumption token key, kept across restarts
+    DiskWriterOptions writer_options;
+    RUDPShardOptions shard_options;
+    CompressOptions compress;
+    BusyPollOptions busy_poll;
+    ShmRingOptions shm;
+    ManifestStats manifest_stats;
+    disk_writer_options_defaults(&writer_options);
+    rudp_shard_options_defaults(&shard_options);
+    compress_options_defaults(&compress);
+    busy_poll_options_defaults(&busy_poll);
+    shm_ring_options_defaults(&shm);
+    memset(&manifest_stats, 0, sizeof(manifest_stats));
+    for (int i = 1; i < argc; i++)
+    {
+        int consumed = disk_writer_parse_arg(&writer_options, argc, argv, &i);
+        if (consumed == 0)
+        {
+            consumed = rudp_shard_parse_arg(&shard_options, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = compress_parse_arg(&compress, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = busy_poll_parse_arg(&busy_poll, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = shm_ring_parse_arg(&shm, argc, argv, &i);
+        }
+        if (consumed < 0)
+        {
+            exit(1);
+        }
+        if (consumed > 0)
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "-engine") == 0)
+        {
+            use_engine = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-timestamps") == 0)
+        {
+            timestamps = 1;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            port = 0;
+            break;
+        }
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-token-key") == 0)
+        {
+            token_key = argv[++i];
+        }
+        else
+        {
+            port = 0;
+            break;
+        }
+    }
+    if (port <= 0)
     {
-        fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s -p <port> [-o <path>] [-engine] [-timestamps] [-token-key <file>] [writer options] [shard options] [compression options] [busy poll options] [shared memory options]\n", argv[0]);
+        fprintf(stderr, "  -o <path>                write the received bytes to path, e.g. /dev/null (default %s)\n", OUTPUT_PATH);
+        fprintf(stderr, "  -engine                  receive, reorder and acknowledge packets on their own thread\n");
+        fprintf(stderr, "  -timestamps              time arrivals with the kernel's RX timestamps, for the one-way delay variation\n");
+        fprintf(stderr, "  -token-key <file>        keep the key of the senders' resumption tokens in file, so the tokens stay\n");
+        fprintf(stderr, "                           valid after a restart (default: a new key, and new tokens, every run)\n");
+        disk_writer_usage(stderr);
+        rudp_shard_usage(stderr);
+        compress_usage(stderr);
+        busy_poll_usage(stderr);
+        shm_ring_usage(stderr);
         exit(1);
     }
 
-    int port = atoi(argv[2]);
+    if (token_key != NULL && rudp_set_token_key(token_key) < 0)
+    {
+        exit(1);
+    }
+
+    // Sharded mode serves many senders at once, each worker thread with its own socket and connections
+    if (shard_options.shards > 0)
+    {
+        rudp_log_start(stderr);
+        int result = rudp_shard_serve(port, &shard_options, stdout);
+        rudp_impair_print(stdout);
+        rudp_log_stop();
+        return result < 0 ? 1 : 0;
+    }
+    // Every packet is received straight into a block, so a block must hold the largest one
+    if (writer_options.block_size < MAX_PACKET_SIZE)
+    {
+        writer_options.block_size = MAX_PACKET_SIZE;
+    }
+    // Pinned before the socket and the writer's pool are allocated, so they land on this CPU's NUMA node
+    if (busy_poll_configure(&busy_poll) < 0)
+    {
+        exit(1);
+    }
+    if (busy_poll_enter(BUSY_POLL_RECEIVE) < 0)
+    {
+        fprintf(stderr, "Failed to pin the receive thread to CPU %d\n", busy_poll.cpu);
+        exit(1);
+    }
 
     // Create UDP socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -49,6 +400,22 @@ int main(int argc, char *argv[])
         perror("Error binding socket");
         exit(1);
     }
+    if (busy_poll_apply(sockfd) < 0)
+    {
+        exit(1);
+    }
+    // Senders on this host hand their ring over before their first segment
+    ShmRing ring;
+    int shm_listener = -1;
+    int shared_runs = 0;
+    shm_ring_init(&ring);
+    if (shm.enabled && (shm_listener = shm_ring_listen("rudp", port)) < 0)
+    {
+        exit(1);
+    }
+
+    // Protocol tracing goes through the asynchronous log, the level comes from RUDP_LOG
+    rudp_log_start(stderr);
 
     // Set up RUDP socket
     RUDPConnection *rudp_conn = rudp_socket(&server_addr, &client_addr, sockfd);
@@ -57,51 +424,154 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Failed to create RUDP socket\n");
         exit(1);
     }
+    if (timestamps && rudp_set_timestamps(rudp_conn) < 0)
+    {
+        rudp_close(rudp_conn);
+        exit(1);
+    }
 
     printf("Starting Receiver...\n");
     printf("Waiting for RUDP connection...\n");
 
-    // Receive the file
-    char file_data[FILE_SIZE];
-    clock_t start_time, end_time;
-    int num_runs = 0;
-    double total_time = 0;
-    double total_bandwidth = 0;
-    double *time_taken = NULL;
-    double *bandwidth = NULL;
-    int current_run = 0;
+    RunStats stats;
+    if (run_stats_init(&stats) < 0)
+    {
+        fprintf(stderr, "Error allocating statistics\n");
+        rudp_close(rudp_conn);
+        exit(1);
+    }
 
-    FILE *fp = fopen("RUDP_file.bin", "wb");
-    if (fp == NULL)
+    // Packets are received into the blocks of the writer's pool and written on its thread,
+    // so a slow disk does not leave datagrams waiting in the socket buffer
+    TransferSink sink;
+    DiskWriter writer;
+    DiskWriterStats writer_stats;
+    if (transfer_sink_open(&sink, path) < 0 || disk_writer_start(&writer, &sink, &writer_options) < 0)
     {
-        fprintf(stderr, "Error opening file\n");
         rudp_close(rudp_conn);
         exit(1);
     }
+    RUDPEngine *engine = NULL;
+    if (use_engine && (engine = rudp_engine_start(rudp_conn, NULL, RUDP_ENGINE_RECEIVER)) == NULL)
+    {
+        rudp_close(rudp_conn);
+        exit(1);
+    }
+    // Frames are decompressed on worker threads and handed back in order, on this thread
+    ChunkSink chunk_sink = {&writer, &stats};
+    Decompressor decompressor;
+    CompressStats decompress_stats;
+    int decompressing = 0;
+    // Manifest runs keep their progress next to the output, unless it is not a regular file
+    ManifestLine line = {rudp_conn, &engine, use_engine};
+    ManifestChannel channel = {line_send, line_recv, line_turn, &line};
+    char state_buffer[4096];
+    const char *state_path = manifest_state_path(&sink, path, state_buffer, sizeof(state_buffer)) == 0 ? state_buffer : NULL;
+    int manifests = 0;
 
     while (1)
     {
-        fclose(fp);
-        fp = fopen("RUDP_file.bin", "wb");
-        if (fp == NULL)
+        // Every run starts with its length
+        uint64_t file_size = 0;
+        TransferMode mode = TRANSFER_PLAIN;
+        char header[CONTROL_MSG_SIZE];
+        ssize_t header_size = recv_message(rudp_conn, engine, header, sizeof(header));
+        if (header_size < 0 || transfer_decode_header((const unsigned char *)header, header_size, &file_size, &mode) < 0)
         {
-            fprintf(stderr, "Error opening file\n");
+            fprintf(stderr, "Error receiving file header\n");
             rudp_close(rudp_conn);
             exit(1);
         }
-        int total_bytes_received = 0;
+        int framed = mode == TRANSFER_FRAMED;
+        int shared = mode == TRANSFER_SHARED;
+        if (mode != TRANSFER_MANIFEST)
+        {
+            disk_writer_begin_run(&writer);
+        }
+        // The offer names the ring the bytes of the run go through
+        unsigned char offer[SHM_RING_OFFER_SIZE];
+        if (shared && (recv_message(rudp_conn, engine, (char *)offer, sizeof(offer)) != (int)sizeof(offer) ||
+                       shm_ring_accept(&ring, shm_listener, &rudp_conn->sender_addr, offer) < 0))
+        {
+            fprintf(stderr, "Error attaching the shared memory ring\n");
+            disk_writer_finish_run(&writer);
+            rudp_close(rudp_conn);
+            exit(1);
+        }
+        shared_runs += shared;
+        uint64_t total_bytes_received = 0;
 
-        start_time = clock();
-        while (total_bytes_received < FILE_SIZE)
+        // Wall clock of the run, starts before the first packet is received
+        run_stats_begin_run(&stats);
+        if (mode == TRANSFER_MANIFEST)
         {
-            if (current_run == 0)
+            // Only the chunks missing from the output are sent, the rest is checked on disk
+            manifests = 1;
+            if (manifest_recv_run(&channel, file_size, &writer, state_path, &stats, &manifest_stats) < 0)
             {
-                time_taken = malloc(sizeof(double) * num_runs);
-                bandwidth = malloc(sizeof(double) * num_runs);
+                fprintf(stderr, "Error receiving file, %llu chunks missing\n", (unsigned long long)manifest_stats.missing);
+                disk_writer_finish_run(&writer);
+                rudp_close(rudp_conn);
+                exit(1);
+            }
+            total_bytes_received = file_size;
+        }
+        // A latency run answers requests, nothing reaches the output
+        if (mode == TRANSFER_LATENCY)
+        {
+            uint64_t requests = 0;
+            if (serve_requests(&line, &requests) < 0)
+            {
+                fprintf(stderr, "Error answering requests\n");
+                disk_writer_finish_run(&writer);
+                rudp_close(rudp_conn);
+                exit(1);
+            }
+            printf("Answered %llu requests\n", (unsigned long long)requests);
+            total_bytes_received = file_size;
+        }
+        if (framed && !decompressing)
+        {
+            if (decompressor_start(&decompressor, &compress, write_chunk, &chunk_sink) < 0)
+            {
+                rudp_close(rudp_conn);
+                exit(1);
+            }
+            decompressing = 1;
+        }
+        // A framed run counts the bytes the frames announce, the chunks reach the writer through the sink
+        while (framed && total_bytes_received < file_size)
+        {
+            uint32_t original;
+            CompressJob *job = decompressor_acquire(&decompressor);
+            if (job == NULL || recv_frame(rudp_conn, engine, job, &original) < 0 ||
+                decompressor_submit(&decompressor, job) < 0)
+            {
+                fprintf(stderr, "Error receiving file\n");
+                rudp_close(rudp_conn);
+                exit(1);
             }
+            total_bytes_received += original;
+        }
+        if (framed && decompressor_flush(&decompressor) < 0)
+        {
+            fprintf(stderr, "Error decompressing file\n");
+            rudp_close(rudp_conn);
+            exit(1);
+        }
+        while (!framed && total_bytes_received < file_size)
+        {
             // Receive file data
 
-            ssize_t bytes_received = rudp_recv(rudp_conn, file_data, FILE_SIZE, &rudp_conn->sender_addr);
+            size_t capacity;
+            char *file_data = disk_writer_reserve(&writer, MAX_PACKET_SIZE, &capacity);
+            // The ring holds the next run's bytes too, a read stops at the end of this one
+            if (shared && file_size - total_bytes_received < capacity)
+            {
+                capacity = (size_t)(file_size - total_bytes_received);
+            }
+            ssize_t bytes_received = shared ? shm_ring_read(&ring, file_data, capacity)
+                                            : recv_message(rudp_conn, engine, file_data, (int)capacity);
 
             if (bytes_received < 0)
             {
@@ -109,27 +579,24 @@ int main(int argc, char *argv[])
                 rudp_close(rudp_conn);
                 exit(1);
             }
-            // printf("size received: %ld\n", bytes_received);
-            fwrite(file_data, sizeof(char), bytes_received, fp);
+            run_stats_chunk(&stats, bytes_received);
+            disk_writer_commit(&writer, bytes_received);
             total_bytes_received += bytes_received;
         }
-        end_time = clock();
-
-        // calculate time taken in milliseconds
-        time_taken[current_run] = (double)(end_time - start_time) / CLOCKS_PER_SEC * 1000;
-        printf("Time taken: %.2fms\n", time_taken[current_run]);
-
-        total_time += time_taken[current_run];
-        double total_mb = (double)total_bytes_received / 1024 / 1024;
-        bandwidth[current_run] = total_mb / (time_taken[current_run] / 1000); // in MB/s
-        printf("Bandwidth: %.2fMB/s\n", bandwidth[current_run]);
-        total_bandwidth += bandwidth[current_run];
+        const RunRecord *record = run_stats_end_run(&stats);
+        if (disk_writer_finish_run(&writer) < 0)
+        {
+            fprintf(stderr, "Error writing %s\n", path);
+        }
+        if (record != NULL)
+        {
+            printf("Time taken: %.2fms\n", stats_ns_to_ms(record->time_ns));
+            printf("Bandwidth: %.2fMB/s\n", stats_speed_mb(record->bytes, record->time_ns));
+        }
         printf("File transfer completed.\n");
-        num_runs++;
-        current_run++;
         printf("Waiting for control message...\n");
         char control_msg[1024] = {0};
-        ssize_t msg_size = rudp_recv(rudp_conn, control_msg, sizeof(control_msg), &rudp_conn->sender_addr);
+        ssize_t msg_size = recv_control(rudp_conn, engine, control_msg, sizeof(control_msg) - 1);
         if (msg_size < 0)
         {
             fprintf(stderr, "Error receiving control message\n");
@@ -141,27 +608,54 @@ int main(int argc, char *argv[])
         if (strcmp(control_msg, "exit") == 0)
         {
             printf("Sender sent exit message.\n");
+            // The FIN exchange is not pipelined, it runs on the blocking API once the engine stopped
+            if (engine != NULL)
+            {
+                rudp_engine_stop(engine);
+                engine = NULL;
+            }
             rudp_recv_fin(rudp_conn);
             break;
         } 
 
     }
 
-    // Calculate average time and bandwidth
-
+    rudp_log_stop();
+    if (decompressing)
+    {
+        decompressor_stop(&decompressor, &decompress_stats);
+    }
+    disk_writer_stop(&writer, &writer_stats);
     printf("File transfer completed.\n");
 
     printf("----------------------------------\n");
     printf("- * Statistics * -\n");
-    for (int i = 0; i < num_runs; i++)
+    run_stats_print(&stats, stdout);
+    disk_writer_print(&writer_stats, stdout);
+    if (decompressing)
     {
-        printf("Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", i + 1, time_taken[i], bandwidth[i]);
+        compress_print(&decompress_stats, "Decompression", stdout);
     }
-    double avg_time = total_time / num_runs;
-    double avg_bandwidth = total_bandwidth / num_runs;
-    printf("- Average time: %.2fms\n", avg_time);
-    printf("- Average bandwidth: %.2fMB/s\n", avg_bandwidth);
+    if (manifests)
+    {
+        manifest_print(&manifest_stats, MANIFEST_RECEIVER, "Manifest", stdout);
+    }
+    rudp_impair_print(stdout);
+    busy_poll_print(stdout);
+    if (shared_runs > 0)
+    {
+        shm_ring_print(&ring, stdout);
+    }
+    RUDPStats connection_stats = rudp_get_stats(rudp_conn);
+    rudp_print_stats(&connection_stats, stdout);
     printf("----------------------------------\n");
+    shm_ring_close(&ring);
+    if (shm_listener >= 0)
+    {
+        close(shm_listener);
+    }
+    run_stats_free(&stats);
+    transfer_sink_close(&sink);
 
     // Close the socket
     rudp_close(rudp_conn);
@@ -1,4 +1,12 @@
 #include "RUDP_API.h"
+#include "RUDP_Engine.h"
+#include "RUDP_Impair.h"
+#include "RUDP_Log.h"
+#include "Transfer.h"
+#include "Compress.h"
+#include "Manifest.h"
+#include "Latency.h"
+#include "Shm_Ring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,42 +15,397 @@
 #include <arpa/inet.h>
 #include <time.h>
 
-#define FILE_SIZE (2 * 1024 * 1024) // 2MB
 #define PACKET_SIZE 59800
 #define TIMEOUT 5 
 
-/*
- * @brief A random data generator function based on srand() and rand().
- * @param size The size of the data to generate (up to 2^32 bytes).
- * @return A pointer to the buffer.
+// Sends one message through the engine when it runs, with the blocking API otherwise.
+static int send_message(RUDPConnection *connection, RUDPEngine *engine, char *buffer, int size, struct sockaddr_in *dest_addr)
+{
+    if (engine != NULL)
+    {
+        return rudp_engine_send(engine, buffer, size);
+    }
+    return rudp_send(connection, buffer, size, dest_addr);
+}
+
+// Sends a control message on its own stream, it does not wait behind data the receiver still misses.
+static int send_control(RUDPConnection *connection, RUDPEngine *engine, const char *message, struct sockaddr_in *dest_addr)
+{
+    int size = (int)strlen(message) + 1;
+    if (engine != NULL)
+    {
+        return rudp_engine_write(engine, RUDP_STREAM_CONTROL, message, size);
+    }
+    return rudp_stream_write(connection, RUDP_STREAM_CONTROL, message, size, dest_addr);
+}
+
+// Sends a frame or a manifest chunk as consecutive messages of at most a packet each, the receiver reassembles it.
+static int send_split(RUDPConnection *connection, RUDPEngine *engine, const char *data, size_t length, struct sockaddr_in *dest_addr)
+{
+    for (size_t offset = 0; offset < length; offset += PACKET_SIZE)
+    {
+        int piece = (int)(length - offset < PACKET_SIZE ? length - offset : PACKET_SIZE);
+        if (send_message(connection, engine, (char *)data + offset, piece, dest_addr) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Streams the whole source: packet sized chunks, or compression frames when `frame` is a frame buffer.
+static int send_stream(RUDPConnection *connection, RUDPEngine *engine, TransferSource *source, const CompressOptions *compress,
+                       char *frame, CompressStats *compress_stats, struct sockaddr_in *dest_addr)
+{
+    // Compressed runs read larger chunks, each becomes one frame split over as many packets as it needs
+    size_t chunk_size = frame != NULL ? compress->chunk_size : PACKET_SIZE;
+    TransferReader reader;
+    const char *chunk;
+    size_t bytes_to_send;
+    uint64_t total_bytes_sent = 0;
+    if (transfer_reader_start(&reader, source, 0, source->size, chunk_size) < 0)
+    {
+        return -1;
+    }
+    while ((chunk = transfer_reader_next(&reader, &bytes_to_send)) != NULL)
+    {
+        RUDP_LOG(RUDP_LOG_TRACE, "next_sequence_number before sending: %lld", connection->next_sequence_number);
+        int sent = frame != NULL ? send_split(connection, engine, frame, compress_frame(compress, chunk, bytes_to_send, frame, compress_stats), dest_addr)
+                                 : send_message(connection, engine, (char *)chunk, (int)bytes_to_send, dest_addr);
+        if (sent < 0)
+        {
+            break;
+        }
+        total_bytes_sent += bytes_to_send;
+        RUDP_LOG(RUDP_LOG_TRACE, "Sent %lld bytes", total_bytes_sent);
+    }
+    int flushed = engine != NULL ? rudp_engine_flush(engine) : rudp_flush(connection, dest_addr);
+    if (transfer_reader_stop(&reader) < 0 || total_bytes_sent < source->size || flushed < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// The sender's end of a manifest exchange or of a latency run, the engine only runs while the sender has the line
+typedef struct
+{
+    RUDPConnection *connection;
+    RUDPEngine **engine;
+    int use_engine;
+    struct sockaddr_in *dest_addr;
+} ManifestLine;
+
+static int line_send(void *context, const char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    return send_split(line->connection, *line->engine, data, length, line->dest_addr);
+}
+
+static int line_recv(void *context, char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    struct sockaddr_in from = *line->dest_addr;
+
+    for (size_t offset = 0; offset < length;)
+    {
+        int piece = (int)(length - offset < MAX_PACKET_SIZE ? length - offset : MAX_PACKET_SIZE);
+        int bytes = rudp_recv(line->connection, data + offset, piece, &from);
+        if (bytes < 0)
+        {
+            return -1;
+        }
+        offset += bytes;
+    }
+    return 0;
+}
+
+// Hands the line to the receiver once everything sent is acknowledged, and takes it back.
+static int line_turn(void *context, int sending)
+{
+    ManifestLine *line = (ManifestLine *)context;
+
+    if (sending)
+    {
+        if (line->use_engine && (*line->engine = rudp_engine_start(line->connection, line->dest_addr, RUDP_ENGINE_SENDER)) == NULL)
+        {
+            return -1;
+        }
+        return 0;
+    }
+    int flushed = *line->engine != NULL ? rudp_engine_flush(*line->engine) : rudp_flush(line->connection, line->dest_addr);
+    if (*line->engine != NULL)
+    {
+        rudp_engine_stop(*line->engine);
+        *line->engine = NULL;
+    }
+    // The receiver may check many chunks on its disk before it answers
+    struct timeval forever = {0, 0};
+    setsockopt(line->connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+    return flushed;
+}
+
+// A request of a latency run goes out at once, even when -fec would rather wait to fill a group.
+static int request_send(void *context, const char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    // Timestamps of an earlier request must not pair with this one
+    line->connection->data_tx_ns = 0;
+    line->connection->data_rx_ns = 0;
+    if (rudp_send(line->connection, (char *)data, (int)length, line->dest_addr) < 0)
+    {
+        return -1;
+    }
+    return rudp_flush(line->connection, line->dest_addr);
+}
+
+// A response of a latency run, the receiver resends a lost one for as long as TIMEOUT.
+static int request_recv(void *context, char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    struct sockaddr_in from = *line->dest_addr;
+    struct timeval timeout = {TIMEOUT, 0};
+
+    setsockopt(line->connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return rudp_recv(line->connection, data, (int)length, &from) == (int)length ? 0 : -1;
+}
+
+// The request's kernel TX timestamp, taken when its ACK gave an RTT sample, and the response's RX timestamp.
+static int request_stamps(void *context, uint64_t *sent_ns, uint64_t *received_ns)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    *sent_ns = line->connection->data_tx_ns;
+    *received_ns = line->connection->data_rx_ns;
+    return *sent_ns != 0 && *received_ns != 0 ? 0 : -1;
+}
+
+/**
+ * @brief Runs the requests of one latency run instead of sending the file.
+ *
+ * Every request and response is a single segment, acknowledged by the blocking API as soon as it
+ * arrives, so a run carries one request at a time.
+ *
+ * @return 0 once the last response arrived, -1 on an error.
  */
-char *util_generate_random_data(unsigned int size)
+static int send_requests(ManifestLine *line, const LatencyOptions *latency, LatencyStats *latency_stats)
 {
-    char *buffer = NULL;
-    // Argument check.
-    if (size == 0)
-        return NULL;
-    buffer = (char *)calloc(size, sizeof(char));
-    // Error checking.
-    if (buffer == NULL)
-        return NULL;
-    // Randomize the seed of the random number generator.
-    srand(time(NULL));
-    for (unsigned int i = 0; i < size; i++)
-        *(buffer + i) = ((unsigned int)rand() % 256);
-    return buffer;
+    unsigned char header[TRANSFER_HEADER_SIZE];
+    unsigned char latency_header[LATENCY_HEADER_SIZE];
+    LatencyChannel channel = {request_send, request_recv, line, line->connection->timestamps ? request_stamps : NULL};
+
+    transfer_encode_header(latency->requests * latency->size, TRANSFER_LATENCY, header);
+    latency_encode_header(latency, latency_header);
+    if (rudp_send(line->connection, (char *)header, sizeof(header), line->dest_addr) < 0 ||
+        rudp_send(line->connection, (char *)latency_header, sizeof(latency_header), line->dest_addr) < 0 ||
+        rudp_flush(line->connection, line->dest_addr) < 0)
+    {
+        return -1;
+    }
+    return latency_run(latency, &channel, 1, latency_stats);
+}
+
+// Reads the token an earlier run saved for this receiver, 0 (none) if the file has no line for it.
+static uint32_t load_token(const char *path, const char *ip, int port)
+{
+    FILE *file = fopen(path, "r");
+    char line_ip[64];
+    int line_port;
+    unsigned int line_token;
+    uint32_t token = 0;
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+    while (fscanf(file, "%63s %d %x", line_ip, &line_port, &line_token) == 3)
+    {
+        if (strcmp(line_ip, ip) == 0 && line_port == port)
+        {
+            token = line_token;
+        }
+    }
+    fclose(file);
+    return token;
+}
+
+// Keeps one line per receiver, the other receivers' tokens are copied over.
+static void save_token(const char *path, const char *ip, int port, uint32_t token)
+{
+    FILE *file = fopen(path, "r");
+    char lines[64][96];
+    int count = 0;
+    char line_ip[64];
+    int line_port;
+    unsigned int line_token;
+
+    if (file != NULL)
+    {
+        while (count < 63 && fscanf(file, "%63s %d %x", line_ip, &line_port, &line_token) == 3)
+        {
+            if (strcmp(line_ip, ip) != 0 || line_port != port)
+            {
+                snprintf(lines[count++], sizeof(lines[0]), "%s %d %08x", line_ip, line_port, line_token);
+            }
+        }
+        fclose(file);
+    }
+    snprintf(lines[count++], sizeof(lines[0]), "%s %d %08x", ip, port, (unsigned int)token);
+    file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror("Failed to save the session token");
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, "%s\n", lines[i]);
+    }
+    fclose(file);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 5 || strcmp(argv[1], "-ip") != 0 || strcmp(argv[3], "-p") != 0)
+    const char *ip = NULL;
+    int port = 0;
+    int runs = 0; // Number of times to send the file without asking, 0 to ask after every run
+    TransferOptions transfer;
+    TransferSource source;
+    CompressOptions compress;
+    CompressStats compress_stats;
+    ManifestOptions manifest;
+    ManifestStats manifest_stats;
+    LatencyOptions latency;
+    LatencyStats latency_stats;
+    ShmRingOptions shm;
+    RUDPFecConfig fec = {0, 0, 0}; // Forward error correction, off unless -fec is given
+    int use_engine = 0; // Pipeline the connection over a TX and an RX thread
+    int timestamps = 0; // Take RTT samples and request times from the kernel's TX and RX timestamps
+    const char *resume = NULL; // File of the receivers' tokens, lets the first segment ride in the SYN
+    const char *paths[RUDP_MAX_PATHS - 1]; // Extra paths of the engine, <local-ip>[,<remote-ip>]
+    int path_count = 0;
+    transfer_options_defaults(&transfer);
+    compress_options_defaults(&compress);
+    memset(&compress_stats, 0, sizeof(compress_stats));
+    manifest_options_defaults(&manifest);
+    memset(&manifest_stats, 0, sizeof(manifest_stats));
+    latency_options_defaults(&latency);
+    shm_ring_options_defaults(&shm);
+    for (int i = 1; i < argc; i++)
+    {
+        int consumed = transfer_parse_arg(&transfer, argc, argv, &i);
+        if (consumed == 0)
+        {
+            consumed = compress_parse_arg(&compress, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = manifest_parse_arg(&manifest, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = latency_parse_arg(&latency, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = shm_ring_parse_arg(&shm, argc, argv, &i);
+        }
+        if (consumed < 0)
+        {
+            exit(1);
+        }
+        if (consumed > 0)
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "-engine") == 0)
+        {
+            use_engine = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-timestamps") == 0)
+        {
+            timestamps = 1;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            ip = NULL;
+            break;
+        }
+        if (strcmp(argv[i], "-ip") == 0)
+        {
+            ip = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-runs") == 0)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-resume") == 0)
+        {
+            resume = argv[++i];
+        }
+        else if (strcmp(argv[i], "-path") == 0 && path_count < RUDP_MAX_PATHS - 1)
+        {
+            paths[path_count++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "-fec") == 0)
+        {
+            if (rudp_fec_parse(argv[++i], &fec) < 0)
+            {
+                exit(1);
+            }
+        }
+        else
+        {
+            ip = NULL;
+            break;
+        }
+    }
+    if (ip == NULL || port <= 0 || runs < 0 || (use_engine && fec.k > 0) || (manifest.enabled && compress.codec != COMPRESS_NONE) ||
+        (path_count > 0 && !use_engine))
+    {
+        fprintf(stderr, "Usage: %s -ip <IP> -p <port> [-runs <n>] [-resume <file>] [-fec <k>:<m>[:auto] | -engine [-path <local-ip>[,<remote-ip>]]...] [-timestamps] [transfer options] [compression options | manifest options | latency options] [shared memory options]\n", argv[0]);
+        fprintf(stderr, "  -resume <file>           keep the receiver's session token in file, a later run sends its first\n");
+        fprintf(stderr, "                           segment with the SYN instead of waiting a round trip for the handshake\n");
+        fprintf(stderr, "                           (a token outlives the receiver process only with its -token-key)\n");
+        fprintf(stderr, "  -fec <k>:<m>[:auto]      send k data segments with m parity segments per group,\n");
+        fprintf(stderr, "                           auto raises m with the loss rate the receiver reports\n");
+        fprintf(stderr, "  -engine                  keep a window of packets in flight, sent and acknowledged on their own threads\n");
+        fprintf(stderr, "  -path <local>[,<remote>] also send from the local address, to the receiver's remote address (default\n");
+        fprintf(stderr, "                           -ip); segments go on the path with the lowest RTT, up to %d paths with -ip's\n", RUDP_MAX_PATHS);
+        fprintf(stderr, "  -timestamps              measure RTT and request times between the kernel's TX and RX timestamps\n");
+        transfer_usage(stderr);
+        compress_usage(stderr);
+        manifest_usage(stderr);
+        latency_usage(stderr);
+        shm_ring_usage(stderr);
+        exit(1);
+    }
+    // A latency run sends requests instead of the file, one at a time over the blocking API
+    if (latency.enabled && (use_engine || manifest.enabled || compress.codec != COMPRESS_NONE))
     {
-        fprintf(stderr, "Usage: %s -ip <IP> -p <port>\n", argv[0]);
+        fprintf(stderr, "-latency cannot be combined with -engine, -manifest or -compress\n");
+        exit(1);
+    }
+    if (latency.enabled && (latency.concurrency > 1 || latency.size > MAX_PACKET_SIZE))
+    {
+        fprintf(stderr, "RUDP latency runs carry one request at a time, of at most %d bytes\n", MAX_PACKET_SIZE);
+        exit(1);
+    }
+    if (latency.enabled && latency_stats_init(&latency_stats) < 0)
+    {
+        perror("Failed to allocate the latency statistics");
         exit(1);
     }
 
-    const char *ip = argv[2];
-    int port = atoi(argv[4]);
+    if (transfer_source_open(&source, &transfer) < 0)
+    {
+        exit(1);
+    }
 
     // Create UDP socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -72,8 +435,12 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    // Set up RUDP socket
-    RUDPConnection *rudp_conn = rudp_socket(&dest_addr, NULL, sockfd);
+    // Protocol tracing goes through the asynchronous log, the level comes from RUDP_LOG
+    rudp_log_start(stderr);
+
+    // Set up RUDP socket, the handshake rides on the first segment
+    uint32_t token = resume != NULL ? load_token(resume, ip, port) : 0;
+    RUDPConnection *rudp_conn = rudp_connect(&dest_addr, sockfd, token);
     if (rudp_conn == NULL)
     {
         fprintf(stderr, "Failed to create RUDP socket\n");
@@ -82,89 +449,192 @@ int main(int argc, char *argv[])
     }
     printf("RUDP socket created successfully\n");
     printf("RUDP connection created successfully\n");
-
-    // Generate random file data
-    char *file_data = util_generate_random_data(FILE_SIZE);
-    char* file_buffer = (char*)malloc(PACKET_SIZE*sizeof(char));
-    if (file_buffer == NULL)
+    if ((fec.k > 0 && rudp_set_fec(rudp_conn, &fec) < 0) || (timestamps && rudp_set_timestamps(rudp_conn) < 0))
     {
-        perror("Failed to allocate memory");
         rudp_close(rudp_conn);
-        close(sockfd);
         exit(1);
     }
-    
-    if (file_data == NULL)
+    // Extra paths to the receiver, the engine schedules segments over them and the connection's own socket
+    for (int i = 0; i < path_count; i++)
+    {
+        struct sockaddr_in local = dest_addr;
+        struct sockaddr_in remote = dest_addr;
+        char local_ip[INET_ADDRSTRLEN];
+        const char *comma = strchr(paths[i], ',');
+        size_t local_length = comma != NULL ? (size_t)(comma - paths[i]) : strlen(paths[i]);
+
+        local.sin_port = 0;
+        snprintf(local_ip, sizeof(local_ip), "%.*s", (int)local_length, paths[i]);
+        if (local_length >= sizeof(local_ip) || inet_pton(AF_INET, local_ip, &local.sin_addr) <= 0 ||
+            (comma != NULL && inet_pton(AF_INET, comma + 1, &remote.sin_addr) <= 0))
+        {
+            fprintf(stderr, "Invalid path %s, expected <local-ip>[,<remote-ip>]\n", paths[i]);
+            rudp_close(rudp_conn);
+            exit(1);
+        }
+        if (rudp_add_path(rudp_conn, &local, &remote) < 0)
+        {
+            rudp_close(rudp_conn);
+            exit(1);
+        }
+    }
+    RUDPEngine *engine = NULL;
+    if (use_engine && (engine = rudp_engine_start(rudp_conn, &dest_addr, RUDP_ENGINE_SENDER)) == NULL)
     {
-        perror("Failed to generate random data");
         rudp_close(rudp_conn);
-        close(sockfd);
         exit(1);
     }
 
+    char *frame = NULL;
+    if (compress.codec != COMPRESS_NONE && (frame = (char *)malloc(compress_frame_bound(compress.chunk_size))) == NULL)
+    {
+        perror("Failed to allocate the frame buffer");
+        exit(1);
+    }
+    // A receiver on this host takes the bytes of plain runs through a shared memory ring, the connection carries the rest
+    ShmRing ring;
+    int shared = 0;
+    shm_ring_init(&ring);
+    if (shm.enabled && !latency.enabled && !manifest.enabled && frame == NULL)
+    {
+        shared = shm_ring_offer(&ring, "rudp", &dest_addr, shm.size) == 0;
+        printf(shared ? "Shared memory ring handed to the receiver\n" : "The receiver is not sharing memory, using the network\n");
+    }
+    // Manifest runs hand the line to the receiver between the manifest and the chunks it asks for
+    ManifestLine line = {rudp_conn, &engine, use_engine, &dest_addr};
+    ManifestChannel channel = {line_send, line_recv, line_turn, &line};
+
     int send_again = 1;
+    int run = 0;
+    int failed = 0;
     char c;
     while (send_again)
     {
         
-        // Send the file
-        printf("Sending file...\n");
-        int total_bytes_sent = 0;
-        while (total_bytes_sent < FILE_SIZE)
-        {   
-            printf("next_sequence_number before sending: %u\n", rudp_conn->next_sequence_number);
-            int bytes_to_send = (FILE_SIZE - total_bytes_sent) < PACKET_SIZE ? (FILE_SIZE - total_bytes_sent) : PACKET_SIZE;
-            memcpy(file_buffer, file_data + total_bytes_sent, bytes_to_send);
-            
-            if (rudp_send(rudp_conn, file_buffer, bytes_to_send, &dest_addr) < 0)
+        // A latency run sends its own headers, then the requests
+        if (latency.enabled)
+        {
+            printf("Sending requests...\n");
+            if (send_requests(&line, &latency, &latency_stats) < 0)
+            {
+                fprintf(stderr, "Failed to send requests\n");
+                failed = 1;
+                break;
+            }
+            printf("Requests sent successfully\n");
+        }
+        else
+        {
+            // Send the file: a header with its length, then packets streamed from the source
+            printf("Sending file...\n");
+            unsigned char header[TRANSFER_HEADER_SIZE];
+            unsigned char offer[SHM_RING_OFFER_SIZE];
+            transfer_encode_header(source.size, shared ? TRANSFER_SHARED : manifest.enabled ? TRANSFER_MANIFEST : (frame != NULL ? TRANSFER_FRAMED : TRANSFER_PLAIN), header);
+            shm_ring_encode_offer(&ring, offer);
+            if (send_message(rudp_conn, engine, (char *)header, sizeof(header), &dest_addr) < 0 ||
+                (shared && send_message(rudp_conn, engine, (char *)offer, sizeof(offer), &dest_addr) < 0))
+            {
+                fprintf(stderr, "Failed to send file header\n");
+                failed = 1;
+                break;
+            }
+
+            int sent = shared ? shm_ring_send(&ring, &source)
+                              : manifest.enabled ? manifest_send_run(&manifest, &channel, &source, &manifest_stats)
+                                                 : send_stream(rudp_conn, engine, &source, &compress, frame, &compress_stats, &dest_addr);
+            if (sent < 0)
             {
                 fprintf(stderr, "Failed to send file\n");
+                failed = 1;
                 break;
             }
-            total_bytes_sent += bytes_to_send;
-            printf("Sent %d bytes\n", total_bytes_sent);
+            printf("File sent successfully\n");
         }
-        printf("File sent successfully\n");
 
         // Ask the user if they want to send the file again
         
-        printf("Do you want to send the file again? (y/n): ");
-        scanf(" %c", &c);
+        run++;
+        if (runs > 0)
+        {
+            c = run < runs ? 'y' : 'n';
+        }
+        else
+        {
+            printf("Do you want to send the file again? (y/n): ");
+            scanf(" %c", &c);
+        }
         if (c == 'y' || c == 'Y')
         {
-            char *keep_alive = "keep_alive";
-            
-            
-            if (rudp_send(rudp_conn, keep_alive, sizeof(keep_alive), &dest_addr) < 0){
+            if (send_control(rudp_conn, engine, "keep_alive", &dest_addr) < 0){
                 fprintf(stderr, "Failed to send keep alive message\n");
                 
             }
             printf("Keep alive message sent successfully\n");
             send_again = 1;
-            total_bytes_sent = 0;
             
             
         }
         else
         {
             send_again = 0;
-            char exit_message[5] = "exit";
             printf("Sending exit message...\n");
-            if (rudp_send(rudp_conn, exit_message, sizeof(exit_message), &dest_addr) < 0)
+            if (send_control(rudp_conn, engine, "exit", &dest_addr) < 0)
             {
                 fprintf(stderr, "Failed to send exit message\n");
             }
+            // The FIN exchange is not pipelined, the engine hands the connection back once the exit message is acknowledged
+            if (engine != NULL)
+            {
+                rudp_engine_flush(engine);
+                rudp_engine_stop(engine);
+                engine = NULL;
+            }
             rudp_send_fin(rudp_conn);
             printf("Exit message sent successfully\n");
             break;
         }
     }
 
+    if (engine != NULL)
+    {
+        rudp_engine_stop(engine);
+    }
+    rudp_log_stop();
+    if (resume != NULL && rudp_get_token(rudp_conn) != 0)
+    {
+        save_token(resume, ip, port, rudp_get_token(rudp_conn));
+    }
+    RUDPStats connection_stats = rudp_get_stats(rudp_conn);
+    printf("----------------------------------\n");
+    printf("- * Statistics * -\n");
+    rudp_print_stats(&connection_stats, stdout);
+    rudp_print_paths(rudp_conn, stdout);
+    rudp_impair_print(stdout);
+    if (frame != NULL)
+    {
+        compress_print(&compress_stats, "Compression", stdout);
+    }
+    if (manifest.enabled)
+    {
+        manifest_print(&manifest_stats, MANIFEST_SENDER, "Manifest", stdout);
+    }
+    if (latency.enabled)
+    {
+        latency_print(&latency_stats, &latency, stdout);
+        latency_stats_free(&latency_stats);
+    }
+    if (shared)
+    {
+        shm_ring_print(&ring, stdout);
+    }
+    printf("----------------------------------\n");
+
     // Clean up
-    free(file_data);
-    free(file_buffer);
+    shm_ring_close(&ring);
+    transfer_source_close(&source);
+    free(frame);
     rudp_close(rudp_conn);
     close(sockfd);
 
-    return 0;
+    return failed ? 1 : 0;
 }
\ No newline at end of file
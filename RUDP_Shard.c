@@ -0,0 +1,566 @@
+#include "RUDP_Shard.h"
+#include "RUDP_API.h"
+#include "RUDP_Impair.h"
+#include "RUDP_Log.h"
+#include "Run_Stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/filter.h>
+
+#define TABLE_MASK (RUDP_SHARD_CONNECTIONS - 1)
+
+static const char *steer_names[] = {"hash", "port"};
+
+void rudp_shard_options_defaults(RUDPShardOptions *options)
+{
+    options->shards = 0;
+    options->steer = RUDP_STEER_HASH;
+    options->connections = 0;
+}
+
+/**
+ * @brief Parses one sharding option.
+ *
+ * Recognized flags: -shards <n>, -steer <hash|port>, -conns <n>.
+ *
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a sharding flag, -1 on error.
+ */
+int rudp_shard_parse_arg(RUDPShardOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-shards") != 0 && strcmp(flag, "-steer") != 0 && strcmp(flag, "-conns") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+
+    if (strcmp(flag, "-shards") == 0)
+    {
+        options->shards = atoi(value);
+        if (options->shards < 1 || options->shards > RUDP_SHARD_MAX)
+        {
+            fprintf(stderr, "Shards must be between 1 and %d\n", RUDP_SHARD_MAX);
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(flag, "-conns") == 0)
+    {
+        options->connections = atoi(value);
+        if (options->connections < 0)
+        {
+            fprintf(stderr, "Invalid connection count: %s\n", value);
+            return -1;
+        }
+        return 1;
+    }
+    for (int i = 0; i < (int)(sizeof(steer_names) / sizeof(steer_names[0])); i++)
+    {
+        if (strcmp(value, steer_names[i]) == 0)
+        {
+            options->steer = (RUDPSteer)i;
+            return 1;
+        }
+    }
+    fprintf(stderr, "Unknown steering: %s\n", value);
+    return -1;
+}
+
+void rudp_shard_usage(FILE *out)
+{
+    fprintf(out, "Shard options:\n");
+    fprintf(out, "  -shards <n>              serve many senders at once with n SO_REUSEPORT sockets, one thread per core\n");
+    fprintf(out, "                           (the received bytes are counted, not written)\n");
+    fprintf(out, "  -steer <hash|port>       pick the shard by the kernel's 4-tuple hash (default) or the sender's port\n");
+    fprintf(out, "  -conns <n>               stop after n connections ended (default: serve forever)\n");
+}
+
+static uint32_t shard_hash(const struct sockaddr_in *peer)
+{
+    uint64_t key = ((uint64_t)peer->sin_addr.s_addr << 16) | peer->sin_port;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40);
+}
+
+static int table_find(const RUDPShard *shard, const struct sockaddr_in *peer)
+{
+    uint32_t i = shard_hash(peer) & TABLE_MASK;
+    while (shard->table[i].used)
+    {
+        if (shard->table[i].peer.sin_addr.s_addr == peer->sin_addr.s_addr && shard->table[i].peer.sin_port == peer->sin_port)
+        {
+            return (int)i;
+        }
+        i = (i + 1) & TABLE_MASK;
+    }
+    return -1;
+}
+
+static int table_insert(RUDPShard *shard, const struct sockaddr_in *peer, uint64_t now)
+{
+    if (shard->count >= RUDP_SHARD_CONNECTIONS / 4 * 3)
+    {
+        return -1;
+    }
+    uint32_t i = shard_hash(peer) & TABLE_MASK;
+    while (shard->table[i].used)
+    {
+        i = (i + 1) & TABLE_MASK;
+    }
+    RUDPShardConnection *connection = &shard->table[i];
+    memset(connection, 0, sizeof(*connection));
+    connection->used = 1;
+    connection->peer = *peer;
+    connection->next_sequence_number = 1;
+    connection->run_header = 1;
+    connection->last_ns = now;
+    if (++shard->count > shard->stats.peak_connections)
+    {
+        shard->stats.peak_connections = shard->count;
+    }
+    return (int)i;
+}
+
+// Linear probing without tombstones: entries after the hole move back if their probe passed it.
+static void table_remove(RUDPShard *shard, int index)
+{
+    uint32_t hole = (uint32_t)index;
+    uint32_t i = hole;
+
+    shard->table[hole].used = 0;
+    shard->count--;
+    while (1)
+    {
+        i = (i + 1) & TABLE_MASK;
+        if (!shard->table[i].used)
+        {
+            return;
+        }
+        uint32_t home = shard_hash(&shard->table[i].peer) & TABLE_MASK;
+        if (((i - home) & TABLE_MASK) >= ((i - hole) & TABLE_MASK))
+        {
+            shard->table[hole] = shard->table[i];
+            shard->table[i].used = 0;
+            hole = i;
+        }
+    }
+}
+
+// A control packet: only the header goes out, senders read nothing else of it.
+static void shard_reply(RUDPShard *shard, const struct sockaddr_in *to, uint16_t sequence_number, int ack, int nack, int syn, int fin_ack)
+{
+    RUDPHeader header;
+    memset(&header, 0, sizeof(header));
+    header.sequence_number = sequence_number;
+    header.flags.ACK = ack;
+    header.flags.NACK = nack;
+    header.flags.SYN = syn;
+    header.flags.FIN_ACK = fin_ack;
+    header.token = syn ? rudp_token(to) : 0;
+    // The shard's socket buffer is shared by its connections
+    header.window = ack ? rudp_receive_window(shard->sockfd, shard->count) : 0;
+    if (rudp_impair_sendto(shard->sockfd, &header, sizeof(header), 0, (const struct sockaddr *)to, sizeof(*to)) < 0)
+    {
+        perror("Error sending control packet");
+    }
+}
+
+// Refuses a connection the shard cannot serve, the sender fails at once instead of retrying until it gives up.
+static void shard_reset(RUDPShard *shard, const struct sockaddr_in *to, uint16_t sequence_number)
+{
+    RUDPHeader header;
+    memset(&header, 0, sizeof(header));
+    header.sequence_number = sequence_number;
+    header.flags.RST = 1;
+    if (rudp_impair_sendto(shard->sockfd, &header, sizeof(header), 0, (const struct sockaddr *)to, sizeof(*to)) < 0)
+    {
+        perror("Error sending control packet");
+    }
+}
+
+// Removes a connection, `reason` is the counter of the way it ended (closed, expired or unsupported).
+static void shard_end(RUDPShard *shard, int index, uint64_t *reason, uint64_t *finished)
+{
+    RUDPShardConnection *connection = &shard->table[index];
+
+    RUDP_LOG(RUDP_LOG_INFO, "Shard connection from port %lld ended after %lld bytes", ntohs(connection->peer.sin_port), connection->goodput_bytes);
+    (*reason)++;
+    if (reason != &shard->stats.expired)
+    {
+        shard->last_ns = rudp_now_ns();
+    }
+    table_remove(shard, index);
+    __atomic_add_fetch(finished, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Handles one datagram with the receiving side of rudp_socket, rudp_recv and rudp_recv_fin.
+ *
+ * Data packets are a header and their payload, the DATA flag tells them from control packets.
+ * A SYN with a valid token may carry the first segment, it is taken like any data packet and
+ * acknowledged with the SYN-ACK.
+ */
+static void shard_handle(RUDPShard *shard, RUDPPacket *packet, size_t length, const struct sockaddr_in *from, uint64_t now, uint64_t *finished)
+{
+    int index = table_find(shard, from);
+    RUDPFlags flags = packet->header.flags;
+    int data = rudp_segment_length(packet, (ssize_t)length) == 0;
+
+    if (flags.SYN == 1)
+    {
+        if (index < 0)
+        {
+            index = table_insert(shard, from, now);
+            if (index < 0)
+            {
+                shard->stats.refused++;
+                RUDP_LOG(RUDP_LOG_WARN, "Shard %lld is full, dropping a SYN", shard->index);
+                return;
+            }
+            shard->stats.opened++;
+            if (shard->first_ns == 0)
+            {
+                shard->first_ns = now;
+            }
+            RUDP_LOG(RUDP_LOG_INFO, "Shard %lld accepted a connection from port %lld", shard->index, ntohs(from->sin_port));
+        }
+        if (!data || packet->header.token != rudp_token(from))
+        {
+            // Without a valid token the segment is not taken, a repeated SYN means the SYN-ACK was lost
+            int16_t distance = (int16_t)(uint16_t)(packet->header.sequence_number - shard->table[index].next_sequence_number);
+            uint16_t acknowledged = data && distance < 0 ? packet->header.sequence_number : 0;
+            shard_reply(shard, from, acknowledged, 1, 0, 1, 0);
+            return;
+        }
+    }
+    else if (!data && flags.FIN != 1)
+    {
+        if (index >= 0 && flags.ACK == 1)
+        {
+            shard->table[index].open = 1;
+            shard->table[index].last_ns = now;
+        }
+        else
+        {
+            shard->stats.strays++;
+        }
+        return;
+    }
+
+    if (flags.FIN == 1)
+    {
+        // Stateless, a FIN repeated because the FIN_ACK was lost finds no connection any more
+        shard_reply(shard, from, 0, 0, 0, 0, 1);
+        if (index >= 0)
+        {
+            shard_end(shard, index, &shard->stats.closed, finished);
+        }
+        return;
+    }
+    if (index < 0 || !data)
+    {
+        shard->stats.strays++;
+        return;
+    }
+
+    RUDPShardConnection *connection = &shard->table[index];
+    connection->open = 1;
+    connection->last_ns = now;
+    if (packet->header.fec.k > 0)
+    {
+        // FEC groups are not decoded here, the sender is told at once rather than left to give up on them
+        RUDP_LOG(RUDP_LOG_WARN, "Shard %lld resets a connection from port %lld that sends FEC groups", shard->index, ntohs(from->sin_port));
+        shard_reset(shard, from, packet->header.sequence_number);
+        shard_end(shard, index, &shard->stats.unsupported, finished);
+        return;
+    }
+    if (verify_checksum(packet->data, packet->length, packet->header.checksum) != 1 || packet->length > MAX_PACKET_SIZE)
+    {
+        shard->stats.checksum_failures++;
+        return;
+    }
+
+    uint16_t sequence_number = packet->header.sequence_number;
+    int16_t distance = (int16_t)(uint16_t)(sequence_number - connection->next_sequence_number);
+    if (distance == 0)
+    {
+        connection->next_sequence_number++;
+        if (packet->header.stream != RUDP_STREAM_DATA)
+        {
+            // A control message (send again or not) ends a run, the next one starts with its header
+            connection->run_header = 1;
+        }
+        else if (connection->run_header)
+        {
+            connection->run_header = 0;
+        }
+        else
+        {
+            connection->goodput_bytes += packet->length;
+            shard->stats.goodput_bytes += packet->length;
+        }
+        shard_reply(shard, from, sequence_number, 1, 0, flags.SYN, 0);
+    }
+    else if (distance < 0)
+    {
+        shard->stats.duplicates++;
+        shard_reply(shard, from, sequence_number, 1, 0, flags.SYN, 0);
+    }
+    else
+    {
+        shard->stats.out_of_order++;
+        shard_reply(shard, from, connection->next_sequence_number, 0, 1, 0, 0);
+    }
+}
+
+typedef struct
+{
+    RUDPShard *shard;
+    int *stop;
+    uint64_t *finished;
+} ShardWorker;
+
+static void *shard_thread(void *arg)
+{
+    ShardWorker *worker = (ShardWorker *)arg;
+    RUDPShard *shard = worker->shard;
+    RUDPPacket *packet = (RUDPPacket *)malloc(sizeof(RUDPPacket));
+    uint64_t last_sweep = rudp_now_ns();
+
+    if (packet == NULL)
+    {
+        perror("Failed to allocate shard buffer");
+        return NULL;
+    }
+    if (shard->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(shard->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            shard->cpu = -1;
+        }
+    }
+
+    while (!__atomic_load_n(worker->stop, __ATOMIC_ACQUIRE))
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t bytes_received = rudp_impair_recvfrom(shard->sockfd, packet, sizeof(*packet), 0, (struct sockaddr *)&from, &from_len);
+        uint64_t now = rudp_now_ns();
+
+        if (now - last_sweep > 1000000000ULL)
+        {
+            for (int i = 0; i < RUDP_SHARD_CONNECTIONS;)
+            {
+                if (shard->table[i].used && now - shard->table[i].last_ns > RUDP_SHARD_IDLE_MS * 1000000ULL)
+                {
+                    shard_end(shard, i, &shard->stats.expired, worker->finished);
+                    continue;
+                }
+                i++;
+            }
+            last_sweep = now;
+        }
+        if (bytes_received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error receiving packet");
+            break;
+        }
+        shard->stats.packets++;
+        shard->stats.bytes += bytes_received;
+        shard_handle(shard, packet, (size_t)bytes_received, &from, now, worker->finished);
+    }
+    free(packet);
+    return NULL;
+}
+
+/**
+ * @brief Makes the kernel pick the shard from the sender's UDP port.
+ *
+ * The program returns an index into the reuseport group, i.e. the order the sockets were bound
+ * in. It reads the port through the network header and assumes an IPv4 header without options;
+ * an index out of range makes the kernel fall back to its hash.
+ */
+static int shard_attach_steering(int sockfd, int shards)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, (uint32_t)(SKF_NET_OFF + 20)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+    {
+        perror("Error attaching the steering program");
+        return -1;
+    }
+    return 0;
+}
+
+static void shard_print(const RUDPShardStats *stats, const char *name, int cpu, FILE *out)
+{
+    fprintf(out, "- %s (cpu %d): Connections=%llu (closed %llu, expired %llu, refused %llu, unsupported %llu, peak %d); Packets=%llu (%llu bytes)\n",
+            name, cpu, (unsigned long long)stats->opened, (unsigned long long)stats->closed,
+            (unsigned long long)stats->expired, (unsigned long long)stats->refused, (unsigned long long)stats->unsupported,
+            stats->peak_connections,
+            (unsigned long long)stats->packets, (unsigned long long)stats->bytes);
+    fprintf(out, "  Goodput=%llu bytes (%.2fMB/s over %.2fms); Duplicates=%llu; NACKs=%llu; Checksum failures=%llu; Strays=%llu\n",
+            (unsigned long long)stats->goodput_bytes, stats_speed_mb(stats->goodput_bytes, stats->busy_ns),
+            stats_ns_to_ms(stats->busy_ns), (unsigned long long)stats->duplicates,
+            (unsigned long long)stats->out_of_order, (unsigned long long)stats->checksum_failures,
+            (unsigned long long)stats->strays);
+}
+
+/**
+ * @brief Serves RUDP senders on `port` with one SO_REUSEPORT socket and worker thread per shard.
+ *
+ * The kernel steers every datagram of a sender to the same socket, so each worker owns the
+ * connections it sees in its own table and shares nothing with the others. Worker i is pinned
+ * to core i modulo the online cores. Returns once options->connections connections ended.
+ *
+ * @return 0 on success, -1 if a socket or thread could not be set up.
+ */
+int rudp_shard_serve(int port, const RUDPShardOptions *options, FILE *out)
+{
+    int count = options->shards;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    RUDPShard *shards = (RUDPShard *)calloc(count, sizeof(RUDPShard));
+    ShardWorker workers[RUDP_SHARD_MAX];
+    int stop = 0;
+    uint64_t finished = 0;
+    int started = 0;
+    int result = 0;
+
+    if (shards == NULL)
+    {
+        perror("Failed to allocate shards");
+        return -1;
+    }
+
+    // Sockets join the reuseport group in shard order, the steering program indexes that order
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    struct timeval poll = {0, RUDP_SHARD_POLL_US};
+    for (int i = 0; i < count; i++)
+    {
+        int opt = 1;
+        shards[i].index = i;
+        shards[i].cpu = cpus > 0 ? (int)(i % cpus) : -1;
+        shards[i].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (shards[i].sockfd < 0 ||
+            setsockopt(shards[i].sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            setsockopt(shards[i].sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+            bind(shards[i].sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            perror("Error setting up a shard socket");
+            count = i + (shards[i].sockfd >= 0);
+            result = -1;
+            break;
+        }
+        setsockopt(shards[i].sockfd, SOL_SOCKET, SO_RCVTIMEO, &poll, sizeof(poll));
+        rudp_grow_receive_buffer(shards[i].sockfd, 64);
+    }
+    if (result == 0 && options->steer == RUDP_STEER_PORT && shard_attach_steering(shards[0].sockfd, count) < 0)
+    {
+        result = -1;
+    }
+
+    for (int i = 0; result == 0 && i < count; i++)
+    {
+        workers[i].shard = &shards[i];
+        workers[i].stop = &stop;
+        workers[i].finished = &finished;
+        if (pthread_create(&shards[i].thread, NULL, shard_thread, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            result = -1;
+            break;
+        }
+        started++;
+    }
+
+    if (result == 0)
+    {
+        fprintf(out, "Serving port %d with %d shards (steering by %s)...\n", port, count, steer_names[options->steer]);
+        fflush(out);
+        struct timespec pause = {0, 100000000};
+        while (options->connections == 0 || __atomic_load_n(&finished, __ATOMIC_ACQUIRE) < (uint64_t)options->connections)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(shards[i].thread, NULL);
+    }
+
+    if (started > 0)
+    {
+        RUDPShardStats total;
+        uint64_t first_ns = 0;
+        uint64_t last_ns = 0;
+        memset(&total, 0, sizeof(total));
+        fprintf(out, "----------------------------------\n");
+        fprintf(out, "- * Shard statistics * -\n");
+        for (int i = 0; i < started; i++)
+        {
+            RUDPShardStats *stats = &shards[i].stats;
+            char name[32];
+            stats->busy_ns = shards[i].last_ns > shards[i].first_ns ? shards[i].last_ns - shards[i].first_ns : 0;
+            snprintf(name, sizeof(name), "Shard %d", i);
+            shard_print(stats, name, shards[i].cpu, out);
+
+            total.opened += stats->opened;
+            total.closed += stats->closed;
+            total.expired += stats->expired;
+            total.refused += stats->refused;
+            total.unsupported += stats->unsupported;
+            total.packets += stats->packets;
+            total.bytes += stats->bytes;
+            total.goodput_bytes += stats->goodput_bytes;
+            total.duplicates += stats->duplicates;
+            total.out_of_order += stats->out_of_order;
+            total.checksum_failures += stats->checksum_failures;
+            total.strays += stats->strays;
+            total.peak_connections += stats->peak_connections;
+            if (shards[i].first_ns != 0 && (first_ns == 0 || shards[i].first_ns < first_ns))
+            {
+                first_ns = shards[i].first_ns;
+            }
+            if (shards[i].last_ns > last_ns)
+            {
+                last_ns = shards[i].last_ns;
+            }
+        }
+        total.busy_ns = last_ns > first_ns ? last_ns - first_ns : 0;
+        shard_print(&total, "Total", -1, out);
+        fprintf(out, "----------------------------------\n");
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        close(shards[i].sockfd);
+    }
+    free(shards);
+    return result;
+}
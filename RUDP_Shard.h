@@ -0,0 +1,79 @@
+#ifndef RUDP_SHARD_H
+#define RUDP_SHARD_H
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define RUDP_SHARD_MAX 64
+// Connections one shard tracks at once, a power of two (the table is kept at most 3/4 full)
+#define RUDP_SHARD_CONNECTIONS 256
+// A connection that sent nothing for this long is dropped from its table
+#define RUDP_SHARD_IDLE_MS 10000
+// How long a shard blocks in recvfrom before it looks for idle connections and the stop flag
+#define RUDP_SHARD_POLL_US 100000
+
+// How the kernel picks the shard of a datagram among the SO_REUSEPORT sockets
+typedef enum
+{
+    RUDP_STEER_HASH,      // the kernel's hash of the 4-tuple
+    RUDP_STEER_PORT       // a classic BPF program: the sender's UDP port modulo the shard count
+} RUDPSteer;
+
+typedef struct
+{
+    int shards;           // worker threads, each with its own socket; 0 runs the single connection receiver
+    RUDPSteer steer;
+    int connections;      // stop after this many connections ended, 0 to serve forever
+} RUDPShardOptions;
+
+typedef struct
+{
+    uint64_t opened;
+    uint64_t closed;          // ended with a FIN
+    uint64_t expired;         // ended by the idle timeout
+    uint64_t refused;         // SYNs dropped because the table was full
+    uint64_t unsupported;     // reset because they sent FEC groups, which shards do not decode
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t goodput_bytes;   // file bytes delivered in order: stream 0 after each run's header
+    uint64_t duplicates;
+    uint64_t out_of_order;    // answered with a NACK
+    uint64_t checksum_failures;
+    uint64_t strays;          // datagrams of no connection of this shard
+    int peak_connections;
+    uint64_t busy_ns;         // from the first SYN to the last FIN
+} RUDPShardStats;
+
+// One connection in a shard's table, keyed by the sender's address
+typedef struct
+{
+    int used;
+    int open;                 // the handshake ACK or the first data packet arrived
+    struct sockaddr_in peer;
+    uint16_t next_sequence_number;
+    int run_header;           // the next stream 0 segment is a run's header, not file data
+    uint64_t goodput_bytes;
+    uint64_t last_ns;
+} RUDPShardConnection;
+
+typedef struct
+{
+    int index;
+    int cpu;                  // the core the worker is pinned to, -1 if pinning failed
+    int sockfd;
+    pthread_t thread;
+    RUDPShardConnection table[RUDP_SHARD_CONNECTIONS];
+    int count;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    RUDPShardStats stats;     // worker only until it is joined
+} RUDPShard;
+
+// Function declarations
+void rudp_shard_options_defaults(RUDPShardOptions *options);
+int rudp_shard_parse_arg(RUDPShardOptions *options, int argc, char *argv[], int *index);
+void rudp_shard_usage(FILE *out);
+int rudp_shard_serve(int port, const RUDPShardOptions *options, FILE *out);
+
+#endif
@@ -0,0 +1,246 @@
+#include "Run_Stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Reads the raw monotonic clock.
+ *
+ * CLOCK_MONOTONIC_RAW is wall time that is never slewed by NTP, unlike clock() which
+ * only counts the CPU time of the process and misses every blocking wait.
+ *
+ * @return The current time in nanoseconds.
+ */
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+double stats_ns_to_ms(uint64_t ns)
+{
+    return (double)ns / 1000000.0;
+}
+
+// Throughput in MB/s (2^20 bytes), 0 for an empty interval.
+double stats_speed_mb(uint64_t bytes, uint64_t ns)
+{
+    if (ns == 0)
+    {
+        return 0.0;
+    }
+    return (double)bytes / RUN_STATS_MB / ((double)ns / 1000000000.0);
+}
+
+// Maps a value to its bucket: exact below 2 * HISTOGRAM_SUB_COUNT, log-linear above.
+static int histogram_index(uint64_t value)
+{
+    if (value < 2 * HISTOGRAM_SUB_COUNT)
+    {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    int top = (int)(value >> shift);
+    return (shift + 1) * HISTOGRAM_SUB_COUNT + (top - HISTOGRAM_SUB_COUNT);
+}
+
+// The highest value that falls into a bucket.
+static uint64_t histogram_bucket_value(int index)
+{
+    if (index < 2 * HISTOGRAM_SUB_COUNT)
+    {
+        return (uint64_t)index;
+    }
+    int shift = index / HISTOGRAM_SUB_COUNT - 1;
+    uint64_t top = (uint64_t)(index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT);
+    return ((top + 1) << shift) - 1;
+}
+
+void histogram_reset(Histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_record(Histogram *histogram, uint64_t value)
+{
+    histogram->counts[histogram_index(value)]++;
+    if (histogram->total == 0 || value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+    histogram->total++;
+    histogram->sum += (double)value;
+}
+
+/**
+ * @brief Returns the value at a percentile.
+ *
+ * @param histogram The histogram to query.
+ * @param percentile A percentile between 0 and 100, e.g. 99.9.
+ * @return The highest value of the bucket holding the percentile (never above the recorded maximum),
+ * 0 for an empty histogram.
+ */
+uint64_t histogram_percentile(const Histogram *histogram, double percentile)
+{
+    uint64_t rank = 0, seen = 0;
+
+    if (histogram->total == 0)
+    {
+        return 0;
+    }
+    rank = (uint64_t)(percentile / 100.0 * (double)histogram->total + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = histogram_bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+double histogram_mean(const Histogram *histogram)
+{
+    return histogram->total > 0 ? histogram->sum / (double)histogram->total : 0.0;
+}
+
+// Prints count, mean and the p50/p99/p99.9/max of a histogram of nanoseconds in microseconds.
+void histogram_print(const Histogram *histogram, const char *name, FILE *out)
+{
+    fprintf(out, "- %s: Count=%llu; Mean=%.1fus; p50=%.1fus; p99=%.1fus; p99.9=%.1fus; Max=%.1fus\n", name,
+            (unsigned long long)histogram->total, histogram_mean(histogram) / 1000.0,
+            histogram_percentile(histogram, 50.0) / 1000.0, histogram_percentile(histogram, 99.0) / 1000.0,
+            histogram_percentile(histogram, 99.9) / 1000.0, histogram->max / 1000.0);
+}
+
+/**
+ * @brief Prepares an empty run collector.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int run_stats_init(RunStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->run_chunks = (Histogram *)calloc(1, sizeof(Histogram));
+    stats->all_chunks = (Histogram *)calloc(1, sizeof(Histogram));
+    if (stats->run_chunks == NULL || stats->all_chunks == NULL)
+    {
+        run_stats_free(stats);
+        return -1;
+    }
+    return 0;
+}
+
+// Starts the clock of a new run, call it right before the first receive of the run.
+void run_stats_begin_run(RunStats *stats)
+{
+    stats->started++;
+    stats->run_start_ns = stats_now_ns();
+    stats->last_chunk_ns = stats->run_start_ns;
+    stats->run_bytes = 0;
+    histogram_reset(stats->run_chunks);
+}
+
+// Records one received chunk and the time since the previous one (or since the run started).
+void run_stats_chunk(RunStats *stats, size_t bytes)
+{
+    uint64_t now = stats_now_ns();
+    histogram_record(stats->run_chunks, now - stats->last_chunk_ns);
+    histogram_record(stats->all_chunks, now - stats->last_chunk_ns);
+    stats->last_chunk_ns = now;
+    stats->run_bytes += bytes;
+}
+
+/**
+ * @brief Closes the current run at its last chunk and stores its record.
+ *
+ * A run that moved no file bytes (a latency run, a manifest run that found every chunk
+ * present) is not recorded, it has no time or speed to average.
+ *
+ * @return The stored record, or NULL if the run moved no bytes or memory could not be allocated.
+ */
+const RunRecord *run_stats_end_run(RunStats *stats)
+{
+    if (stats->run_bytes == 0)
+    {
+        return NULL;
+    }
+    if (stats->count == stats->capacity)
+    {
+        int capacity = stats->capacity == 0 ? 16 : stats->capacity * 2;
+        RunRecord *runs = (RunRecord *)realloc(stats->runs, sizeof(RunRecord) * capacity);
+        if (runs == NULL)
+        {
+            return NULL;
+        }
+        stats->runs = runs;
+        stats->capacity = capacity;
+    }
+
+    RunRecord *record = &stats->runs[stats->count++];
+    record->run = stats->started;
+    record->bytes = stats->run_bytes;
+    record->chunks = stats->run_chunks->total;
+    record->time_ns = stats->last_chunk_ns - stats->run_start_ns;
+    record->p50_ns = histogram_percentile(stats->run_chunks, 50.0);
+    record->p99_ns = histogram_percentile(stats->run_chunks, 99.0);
+    record->p999_ns = histogram_percentile(stats->run_chunks, 99.9);
+    record->max_ns = stats->run_chunks->max;
+    return record;
+}
+
+void run_stats_print_run(const RunRecord *record, FILE *out)
+{
+    fprintf(out, "- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s; Chunks=%llu; Interval p50=%.1fus p99=%.1fus "
+                 "p99.9=%.1fus max=%.1fus\n",
+            record->run, stats_ns_to_ms(record->time_ns), stats_speed_mb(record->bytes, record->time_ns),
+            (unsigned long long)record->chunks, record->p50_ns / 1000.0, record->p99_ns / 1000.0,
+            record->p999_ns / 1000.0, record->max_ns / 1000.0);
+}
+
+/**
+ * @brief Prints every run and the averages.
+ *
+ * The average bandwidth is the total number of bytes over the total time, so long runs
+ * weigh more than short ones.
+ */
+void run_stats_print(const RunStats *stats, FILE *out)
+{
+    uint64_t total_bytes = 0, total_ns = 0;
+
+    for (int i = 0; i < stats->count; i++)
+    {
+        run_stats_print_run(&stats->runs[i], out);
+        total_bytes += stats->runs[i].bytes;
+        total_ns += stats->runs[i].time_ns;
+    }
+    if (stats->count == 0)
+    {
+        return;
+    }
+    fprintf(out, "-\n");
+    fprintf(out, "- Average time: %.2fms\n", stats_ns_to_ms(total_ns) / stats->count);
+    fprintf(out, "- Average bandwidth: %.2fMB/s\n", stats_speed_mb(total_bytes, total_ns));
+    histogram_print(stats->all_chunks, "Chunk interval", out);
+}
+
+void run_stats_free(RunStats *stats)
+{
+    free(stats->runs);
+    free(stats->run_chunks);
+    free(stats->all_chunks);
+    memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,68 @@
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Log-linear (HDR style) histogram: 2^7 linear sub-buckets per power of two, about 0.8% relative error
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// All throughput in the run statistics is reported in MB/s with 1MB = 2^20 bytes
+#define RUN_STATS_MB (1024.0 * 1024.0)
+
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+// Results of one file transfer
+typedef struct
+{
+    int run;           // number of the run, counting the runs that moved no file bytes and were not recorded
+    uint64_t bytes;
+    uint64_t chunks;
+    uint64_t time_ns;  // wall time from the start of the run to its last chunk
+    uint64_t p50_ns;   // percentiles of the interval between consecutive chunks
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} RunRecord;
+
+// Collects wall time and chunk intervals of consecutive runs
+typedef struct
+{
+    RunRecord *runs;
+    int count;
+    int capacity;
+    int started;       // runs begun, recorded or not
+    uint64_t run_start_ns;
+    uint64_t last_chunk_ns;
+    uint64_t run_bytes;
+    Histogram *run_chunks; // intervals of the current run
+    Histogram *all_chunks; // intervals of every run
+} RunStats;
+
+// Function declarations
+uint64_t stats_now_ns(void);
+double stats_ns_to_ms(uint64_t ns);
+double stats_speed_mb(uint64_t bytes, uint64_t ns);
+void histogram_reset(Histogram *histogram);
+void histogram_record(Histogram *histogram, uint64_t value);
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+double histogram_mean(const Histogram *histogram);
+void histogram_print(const Histogram *histogram, const char *name, FILE *out);
+int run_stats_init(RunStats *stats);
+void run_stats_begin_run(RunStats *stats);
+void run_stats_chunk(RunStats *stats, size_t bytes);
+const RunRecord *run_stats_end_run(RunStats *stats);
+void run_stats_print_run(const RunRecord *record, FILE *out);
+void run_stats_print(const RunStats *stats, FILE *out);
+void run_stats_free(RunStats *stats);
+
+#endif
@@ -0,0 +1,544 @@
+#include "Shm_Ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <ifaddrs.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+#define SHM_RING_MAGIC 0x53484D52 // "SHMR"
+// The ring's bytes start on their own page, after the shared header
+#define SHM_RING_DATA_OFFSET 4096
+#define SHM_RING_CACHE_LINE 64
+// Chunks shm_ring_send() reads from the source ahead of the ring
+#define SHM_RING_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * The header at the start of the memfd. The producer owns head and the consumer owns tail, each
+ * on its own cache line so the two cores do not bounce one line between them. A waiting flag is
+ * set by an end that is about to sleep on its eventfd, the other end only writes the eventfd
+ * when it sees the flag, so a ring that keeps up costs no system calls.
+ */
+struct ShmRingShared
+{
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t capacity;
+    uint64_t cookie;
+    char pad0[SHM_RING_CACHE_LINE - 24];
+    uint64_t head;              // bytes written, only ever grows
+    uint32_t consumer_waiting;
+    char pad1[SHM_RING_CACHE_LINE - 12];
+    uint64_t tail;              // bytes read, only ever grows
+    uint32_t producer_waiting;
+    char pad2[SHM_RING_CACHE_LINE - 12];
+};
+
+void shm_ring_options_defaults(ShmRingOptions *options)
+{
+    options->enabled = 0;
+    options->size = SHM_RING_DEFAULT_SIZE;
+}
+
+/**
+ * @brief Parses a shared memory flag at argv[*index], moving *index past its value.
+ *
+ * @return 1 if the flag was consumed, 0 if it is not a shared memory flag, -1 on an invalid value.
+ */
+int shm_ring_parse_arg(ShmRingOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-shm") == 0)
+    {
+        options->enabled = 1;
+        return 1;
+    }
+    if (strcmp(flag, "-shm-size") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    const char *value = argv[++(*index)];
+    long long size = transfer_parse_size(value);
+    if (size < 4096 || size > SHM_RING_MAX_SIZE)
+    {
+        fprintf(stderr, "Shared memory ring size must be between 4K and 1G: %s\n", value);
+        return -1;
+    }
+    options->enabled = 1;
+    options->size = (size_t)size;
+    return 1;
+}
+
+void shm_ring_usage(FILE *out)
+{
+    fprintf(out, "Shared memory options (both sides, a peer on another host falls back to the network):\n");
+    fprintf(out, "  -shm                     move the bytes of plain runs through a shared memory ring\n");
+    fprintf(out, "  -shm-size <size>         ring the sender sets up, e.g. 64M (default 8M)\n");
+}
+
+// An end with no ring set up, safe to close
+void shm_ring_init(ShmRing *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->memfd = -1;
+    ring->data_fd = -1;
+    ring->space_fd = -1;
+    ring->link = -1;
+}
+
+/**
+ * @brief Whether `peer` is this host: a loopback address or one of the host's interfaces.
+ */
+int shm_ring_is_local(const struct sockaddr_in *peer)
+{
+    struct ifaddrs *interfaces;
+    int local = 0;
+
+    if ((ntohl(peer->sin_addr.s_addr) >> 24) == 127)
+    {
+        return 1;
+    }
+    if (getifaddrs(&interfaces) < 0)
+    {
+        return 0;
+    }
+    for (struct ifaddrs *entry = interfaces; entry != NULL && !local; entry = entry->ifa_next)
+    {
+        local = entry->ifa_addr != NULL && entry->ifa_addr->sa_family == AF_INET &&
+                ((struct sockaddr_in *)entry->ifa_addr)->sin_addr.s_addr == peer->sin_addr.s_addr;
+    }
+    freeifaddrs(interfaces);
+    return local;
+}
+
+// The abstract Unix socket a receiver takes rings on: tied to its service and port, gone with the process
+static socklen_t rendezvous_address(const char *service, int port, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "shm-ring/%s/%d", service, port);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + length);
+}
+
+/**
+ * @brief Receiver: opens the socket senders on this host hand their rings over on.
+ *
+ * @return The listening socket, or -1 on an error.
+ */
+int shm_ring_listen(const char *service, int port)
+{
+    struct sockaddr_un address;
+    socklen_t length = rendezvous_address(service, port, &address);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, length) < 0 || listen(listener, 4) < 0)
+    {
+        perror("Failed to open the shared memory rendezvous");
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return -1;
+    }
+    return listener;
+}
+
+static int ring_map(ShmRing *ring, size_t capacity)
+{
+    ring->capacity = capacity;
+    ring->map_size = SHM_RING_DATA_OFFSET + capacity;
+    void *map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    ring->shared = (struct ShmRingShared *)map;
+    ring->data = (char *)map + SHM_RING_DATA_OFFSET;
+    return 0;
+}
+
+/**
+ * @brief Sender: sets up a ring of `capacity` bytes and hands it to the receiver at `peer`.
+ *
+ * The memfd and the two eventfds go over the receiver's rendezvous socket, the connection
+ * stays open so either end notices when the other one exits. The receiver picks the ring up
+ * when the first TRANSFER_SHARED run header arrives with the ring's offer.
+ *
+ * @return 0 on success, -1 if the peer is on another host or takes no rings (nothing is printed
+ * for those, the caller falls back to the network) or on an error.
+ */
+int shm_ring_offer(ShmRing *ring, const char *service, const struct sockaddr_in *peer, size_t capacity)
+{
+    struct sockaddr_un address;
+    socklen_t address_length = rendezvous_address(service, ntohs(peer->sin_port), &address);
+
+    shm_ring_init(ring);
+    ring->producer = 1;
+    if (!shm_ring_is_local(peer))
+    {
+        return -1;
+    }
+    ring->link = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ring->link < 0 || connect(ring->link, (struct sockaddr *)&address, address_length) < 0)
+    {
+        shm_ring_close(ring);
+        return -1;
+    }
+    if (getrandom(&ring->cookie, sizeof(ring->cookie), 0) != (ssize_t)sizeof(ring->cookie))
+    {
+        ring->cookie = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    }
+    ring->memfd = memfd_create("shm-ring", MFD_CLOEXEC);
+    ring->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->memfd < 0 || ring->data_fd < 0 || ring->space_fd < 0 ||
+        ftruncate(ring->memfd, (off_t)(SHM_RING_DATA_OFFSET + capacity)) < 0)
+    {
+        perror("Failed to create the shared memory ring");
+        shm_ring_close(ring);
+        return -1;
+    }
+    if (ring_map(ring, capacity) < 0)
+    {
+        shm_ring_close(ring);
+        return -1;
+    }
+    ring->shared->magic = SHM_RING_MAGIC;
+    ring->shared->capacity = capacity;
+    ring->shared->cookie = ring->cookie;
+
+    union
+    {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[3] = {ring->memfd, ring->data_fd, ring->space_fd};
+    struct iovec iov = {&ring->cookie, sizeof(ring->cookie)};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(ring->link, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(ring->cookie))
+    {
+        perror("Failed to hand over the shared memory ring");
+        shm_ring_close(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void shm_ring_encode_offer(const ShmRing *ring, unsigned char *out)
+{
+    for (int i = 0; i < SHM_RING_OFFER_SIZE; i++)
+    {
+        out[i] = (unsigned char)(ring->cookie >> (8 * (SHM_RING_OFFER_SIZE - 1 - i)));
+    }
+}
+
+// Takes the ring handed over on one rendezvous connection, -1 if it is not the one offered.
+static int ring_take(ShmRing *ring, int link, uint64_t cookie)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[3] = {-1, -1, -1};
+    uint64_t sent_cookie = 0;
+    struct iovec iov = {&sent_cookie, sizeof(sent_cookie)};
+    struct msghdr msg;
+    struct pollfd wait = {link, POLLIN, 0};
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if (poll(&wait, 1, SHM_RING_ACCEPT_MS) <= 0 ||
+        recvmsg(link, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != (ssize_t)sizeof(sent_cookie))
+    {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+    {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    ring->memfd = fds[0];
+    ring->data_fd = fds[1];
+    ring->space_fd = fds[2];
+    ring->link = link;
+    ring->cookie = cookie;
+
+    struct ShmRingShared header;
+    if (fds[2] < 0 || sent_cookie != cookie || pread(ring->memfd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.magic != SHM_RING_MAGIC || header.cookie != cookie || header.capacity == 0 ||
+        header.capacity > SHM_RING_MAX_SIZE || ring_map(ring, (size_t)header.capacity) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receiver: attaches to the ring a TRANSFER_SHARED run header offered.
+ *
+ * A ring already attached under the same offer is kept. Otherwise the sender's connection is
+ * taken from `listener`, waiting up to SHM_RING_ACCEPT_MS; connections of other senders that
+ * are queued on the way are dropped.
+ *
+ * @param peer The network peer that sent the offer, it must be on this host.
+ * @param offer SHM_RING_OFFER_SIZE bytes read after the run header.
+ * @return 0 on success, -1 if the offered ring did not arrive.
+ */
+int shm_ring_accept(ShmRing *ring, int listener, const struct sockaddr_in *peer, const unsigned char *offer)
+{
+    uint64_t cookie = 0;
+
+    for (int i = 0; i < SHM_RING_OFFER_SIZE; i++)
+    {
+        cookie = (cookie << 8) | offer[i];
+    }
+    if (ring->shared != NULL && ring->cookie == cookie)
+    {
+        return 0;
+    }
+    shm_ring_close(ring);
+    if (listener < 0 || !shm_ring_is_local(peer))
+    {
+        fprintf(stderr, "A shared memory run from a sender this receiver cannot share memory with\n");
+        return -1;
+    }
+    while (1)
+    {
+        struct pollfd wait = {listener, POLLIN, 0};
+        if (poll(&wait, 1, SHM_RING_ACCEPT_MS) <= 0)
+        {
+            fprintf(stderr, "The shared memory ring was not handed over\n");
+            return -1;
+        }
+        int link = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (link < 0)
+        {
+            perror("accept");
+            return -1;
+        }
+        if (ring_take(ring, link, cookie) == 0)
+        {
+            return 0;
+        }
+        shm_ring_close(ring);
+    }
+}
+
+// Wakes the other end if it went to sleep. The fence orders the index just published before the flag is read.
+static void ring_notify(ShmRing *ring, uint32_t *waiting, int fd)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) && write(fd, &one, sizeof(one)) == (ssize_t)sizeof(one))
+    {
+        ring->stats.wakeups++;
+    }
+}
+
+// Bytes the consumer may read, or the producer may write
+static size_t ring_ready(const ShmRing *ring)
+{
+    uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE);
+    return (size_t)(ring->producer ? ring->capacity - (head - tail) : head - tail);
+}
+
+/**
+ * @brief Sleeps on this end's eventfd until the other end moved its index.
+ *
+ * The flag is raised before the index is checked once more, so a wakeup cannot fall between
+ * the check and the sleep.
+ *
+ * @return 0 once there is something to do, -1 if the other end exited.
+ */
+static int ring_wait(ShmRing *ring)
+{
+    uint32_t *waiting = ring->producer ? &ring->shared->producer_waiting : &ring->shared->consumer_waiting;
+    int fd = ring->producer ? ring->space_fd : ring->data_fd;
+    struct pollfd waits[2] = {{fd, POLLIN, 0}, {ring->link, POLLIN, 0}};
+    uint64_t value;
+    int result = 0;
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    ring->stats.waits++;
+    while (ring_ready(ring) == 0)
+    {
+        if (poll(waits, 2, -1) < 0 && errno != EINTR)
+        {
+            result = -1;
+            break;
+        }
+        if (waits[0].revents & POLLIN)
+        {
+            if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            {
+                result = -1;
+                break;
+            }
+        }
+        // Nothing is sent on the link after the handover, any event on it is the other end leaving
+        if (waits[1].revents != 0 && ring_ready(ring) == 0)
+        {
+            result = -1;
+            break;
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return result;
+}
+
+/**
+ * @brief Producer: copies all `length` bytes into the ring, sleeping while it is full.
+ *
+ * @return 0 on success, -1 if the consumer exited.
+ */
+int shm_ring_write(ShmRing *ring, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t space = ring_ready(ring);
+        if (space == 0)
+        {
+            if (ring_wait(ring) < 0)
+            {
+                fprintf(stderr, "The shared memory receiver went away\n");
+                return -1;
+            }
+            continue;
+        }
+        uint64_t head = ring->shared->head;
+        size_t offset = (size_t)(head % ring->capacity);
+        size_t piece = length < space ? length : space;
+        if (piece > ring->capacity - offset)
+        {
+            piece = ring->capacity - offset;
+        }
+        memcpy(ring->data + offset, data, piece);
+        __atomic_store_n(&ring->shared->head, head + piece, __ATOMIC_RELEASE);
+        ring_notify(ring, &ring->shared->consumer_waiting, ring->data_fd);
+        ring->stats.bytes += piece;
+        data += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+/**
+ * @brief Producer: streams the whole source into the ring, the consumer reads it as it arrives.
+ *
+ * @return 0 on success, -1 on a read error or if the consumer exited.
+ */
+int shm_ring_send(ShmRing *ring, TransferSource *source)
+{
+    TransferReader reader;
+    const char *chunk;
+    size_t length;
+    int result = 0;
+
+    if (transfer_reader_start(&reader, source, 0, source->size, SHM_RING_CHUNK_SIZE) < 0)
+    {
+        return -1;
+    }
+    while (result == 0 && (chunk = transfer_reader_next(&reader, &length)) != NULL)
+    {
+        result = shm_ring_write(ring, chunk, length);
+    }
+    if (transfer_reader_stop(&reader) < 0 || result < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Consumer: copies out up to `length` bytes, sleeping while the ring is empty.
+ *
+ * Bytes written before the producer exited are still read.
+ *
+ * @return The number of bytes read, at least 1, or -1 if the producer exited.
+ */
+ssize_t shm_ring_read(ShmRing *ring, char *buffer, size_t length)
+{
+    size_t available = ring_ready(ring);
+
+    if (available == 0)
+    {
+        if (ring_wait(ring) < 0)
+        {
+            fprintf(stderr, "The shared memory sender went away\n");
+            return -1;
+        }
+        available = ring_ready(ring);
+    }
+    uint64_t tail = ring->shared->tail;
+    size_t offset = (size_t)(tail % ring->capacity);
+    size_t piece = length < available ? length : available;
+    if (piece > ring->capacity - offset)
+    {
+        piece = ring->capacity - offset;
+    }
+    memcpy(buffer, ring->data + offset, piece);
+    __atomic_store_n(&ring->shared->tail, tail + piece, __ATOMIC_RELEASE);
+    ring_notify(ring, &ring->shared->producer_waiting, ring->space_fd);
+    ring->stats.bytes += piece;
+    return (ssize_t)piece;
+}
+
+void shm_ring_print(const ShmRing *ring, FILE *out)
+{
+    fprintf(out, "- Shared memory ring: Size=%lluKB; %s=%llu bytes; Waits=%llu; Wakeups sent=%llu\n",
+            (unsigned long long)(ring->capacity / 1024), ring->producer ? "Written" : "Read",
+            (unsigned long long)ring->stats.bytes, (unsigned long long)ring->stats.waits,
+            (unsigned long long)ring->stats.wakeups);
+}
+
+// Unmaps the ring and closes its descriptors, the statistics are kept for shm_ring_print().
+void shm_ring_close(ShmRing *ring)
+{
+    if (ring->shared != NULL)
+    {
+        munmap(ring->shared, ring->map_size);
+        ring->shared = NULL;
+        ring->data = NULL;
+    }
+    int *fds[4] = {&ring->memfd, &ring->data_fd, &ring->space_fd, &ring->link};
+    for (int i = 0; i < 4; i++)
+    {
+        if (*fds[i] >= 0)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
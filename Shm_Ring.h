@@ -0,0 +1,64 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "Transfer.h"
+
+#define SHM_RING_DEFAULT_SIZE (8 * 1024 * 1024)
+#define SHM_RING_MAX_SIZE (1024 * 1024 * 1024)
+// Follows a TRANSFER_SHARED run header on the network connection: the cookie of the ring the run uses
+#define SHM_RING_OFFER_SIZE 8
+// How long a receiver waits for the ring a run header announced
+#define SHM_RING_ACCEPT_MS 5000
+
+// Both ends: whether plain runs to a peer on the same host move through a shared memory ring
+typedef struct
+{
+    int enabled;
+    size_t size;          // ring capacity in bytes, the sender's choice
+} ShmRingOptions;
+
+// What one end of a ring did since it was set up
+typedef struct
+{
+    uint64_t bytes;       // bytes written (sender) or read (receiver)
+    uint64_t waits;       // times the ring was full (sender) or empty (receiver) and this end slept
+    uint64_t wakeups;     // eventfd writes to wake the other end
+} ShmRingStats;
+
+// One end of a single producer, single consumer byte ring in a memfd shared by the two processes
+typedef struct
+{
+    struct ShmRingShared *shared;  // NULL while no ring is set up
+    char *data;
+    size_t capacity;
+    size_t map_size;
+    uint64_t cookie;
+    int producer;         // the sender's end
+    int memfd;
+    int data_fd;          // eventfd: the producer wakes the consumer
+    int space_fd;         // eventfd: the consumer wakes the producer
+    int link;             // Unix socket the ring was handed over on, hangs up when the other end exits
+    ShmRingStats stats;
+} ShmRing;
+
+// Function declarations
+void shm_ring_options_defaults(ShmRingOptions *options);
+int shm_ring_parse_arg(ShmRingOptions *options, int argc, char *argv[], int *index);
+void shm_ring_usage(FILE *out);
+void shm_ring_init(ShmRing *ring);
+int shm_ring_is_local(const struct sockaddr_in *peer);
+int shm_ring_listen(const char *service, int port);
+int shm_ring_offer(ShmRing *ring, const char *service, const struct sockaddr_in *peer, size_t capacity);
+int shm_ring_accept(ShmRing *ring, int listener, const struct sockaddr_in *peer, const unsigned char *offer);
+void shm_ring_encode_offer(const ShmRing *ring, unsigned char *out);
+int shm_ring_write(ShmRing *ring, const char *data, size_t length);
+int shm_ring_send(ShmRing *ring, TransferSource *source);
+ssize_t shm_ring_read(ShmRing *ring, char *buffer, size_t length);
+void shm_ring_print(const ShmRing *ring, FILE *out);
+void shm_ring_close(ShmRing *ring);
+
+#endif
@@ -0,0 +1,301 @@
+#include "TCP_Info.h"
+#include "Run_Stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+// Sampling is off unless -info is given.
+void tcp_info_options_defaults(TCPInfoOptions *options)
+{
+    options->interval_ms = 0;
+    options->prefix = TCP_INFO_DEFAULT_PREFIX;
+}
+
+/**
+ * @brief Consumes one sampler flag (and its value) from the command line.
+ *
+ * @param options The structure to update.
+ * @param argc The number of command line arguments.
+ * @param argv The array of command line arguments.
+ * @param index The index of the flag, advanced past its value when one is consumed.
+ * @return 1 if the flag was consumed, 0 if it is not a sampler flag, -1 on a bad value.
+ */
+int tcp_info_parse_arg(TCPInfoOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-info") != 0 && strcmp(flag, "-info-prefix") != 0)
+    {
+        return 0;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    (*index)++;
+
+    if (strcmp(flag, "-info-prefix") == 0)
+    {
+        options->prefix = argv[*index];
+        return 1;
+    }
+
+    options->interval_ms = atoi(argv[*index]);
+    if (options->interval_ms <= 0)
+    {
+        fprintf(stderr, "Invalid sampling interval: %s\n", argv[*index]);
+        return -1;
+    }
+    return 1;
+}
+
+void tcp_info_usage(FILE *out)
+{
+    fprintf(out, "Telemetry options:\n");
+    fprintf(out, "  -info <ms>               sample TCP_INFO every <ms> milliseconds during each run\n");
+    fprintf(out, "  -info-prefix <prefix>    output files are <prefix>_<role>_run<N>.csv or\n");
+    fprintf(out, "                           <prefix>_<role>_stream<N>.csv in striped mode (default %s)\n",
+            TCP_INFO_DEFAULT_PREFIX);
+}
+
+/**
+ * @brief Reads the kernel's transport state of a TCP socket.
+ *
+ * Bytes in flight are computed the way the kernel does it
+ * ((unacked - sacked - lost + retrans) * mss).
+ *
+ * @param sock The TCP socket.
+ * @param sample The reading, time_ms is left for the caller.
+ * @return 0 on success, -1 on error.
+ */
+int tcp_info_read(int sock, TCPInfoSample *sample)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+    {
+        return -1;
+    }
+
+    uint32_t packets_out = info.tcpi_unacked - info.tcpi_sacked - info.tcpi_lost + info.tcpi_retrans;
+    if (info.tcpi_sacked + info.tcpi_lost > info.tcpi_unacked + info.tcpi_retrans)
+    {
+        packets_out = 0;
+    }
+
+    sample->cwnd = info.tcpi_snd_cwnd;
+    sample->ssthresh = info.tcpi_snd_ssthresh;
+    sample->srtt_us = info.tcpi_rtt;
+    sample->rttvar_us = info.tcpi_rttvar;
+    sample->total_retrans = info.tcpi_total_retrans;
+    sample->bytes_in_flight = packets_out * info.tcpi_snd_mss;
+    sample->delivery_rate = info.tcpi_delivery_rate;
+    sample->pacing_rate = info.tcpi_pacing_rate;
+    return 0;
+}
+
+// Takes one sample, writes it to the time series and folds it into the summary. Caller holds the lock.
+static void sampler_take(TCPInfoSampler *sampler)
+{
+    TCPInfoSample sample;
+    TCPInfoSummary *summary = &sampler->summary;
+
+    if (tcp_info_read(sampler->sock, &sample) < 0)
+    {
+        return;
+    }
+    sample.time_ms = stats_ns_to_ms(stats_now_ns()) - sampler->start_ms;
+
+    fprintf(sampler->out, "%.3f,%u,%u,%u,%u,%u,%u,%llu,%llu\n", sample.time_ms, sample.cwnd, sample.ssthresh,
+            sample.srtt_us, sample.rttvar_us, sample.total_retrans, sample.bytes_in_flight,
+            (unsigned long long)sample.delivery_rate, (unsigned long long)sample.pacing_rate);
+
+    if (summary->samples == 0)
+    {
+        sampler->first_retrans = sample.total_retrans;
+        summary->cwnd_min = sample.cwnd;
+    }
+    summary->samples++;
+    if (sample.cwnd < summary->cwnd_min)
+    {
+        summary->cwnd_min = sample.cwnd;
+    }
+    if (sample.cwnd > summary->cwnd_max)
+    {
+        summary->cwnd_max = sample.cwnd;
+    }
+    if (sample.srtt_us > summary->srtt_max_us)
+    {
+        summary->srtt_max_us = sample.srtt_us;
+    }
+    if (sample.delivery_rate > summary->delivery_rate_max)
+    {
+        summary->delivery_rate_max = sample.delivery_rate;
+    }
+    sampler->cwnd_sum += sample.cwnd;
+    sampler->srtt_sum += sample.srtt_us;
+    summary->retrans = sample.total_retrans - sampler->first_retrans;
+}
+
+static void *sampler_thread(void *arg)
+{
+    TCPInfoSampler *sampler = (TCPInfoSampler *)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&sampler->lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (sampler->running)
+    {
+        deadline.tv_nsec += (long)sampler->interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        // Sleep until the next tick or until tcp_info_sampler_stop() wakes us up
+        while (sampler->running && pthread_cond_timedwait(&sampler->wakeup, &sampler->lock, &deadline) != ETIMEDOUT)
+        {
+        }
+        if (sampler->running)
+        {
+            sampler_take(sampler);
+        }
+    }
+    pthread_mutex_unlock(&sampler->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts sampling TCP_INFO of a socket in a background thread.
+ *
+ * The time series goes to <prefix>_<label>.csv. A sample is also taken right away
+ * and when the sampler stops, so even runs shorter than the interval have a start and an end point.
+ *
+ * @param sampler The sampler to start.
+ * @param options The command line settings, nothing is done if sampling is disabled.
+ * @param sock The TCP socket to sample.
+ * @param label Names the file, e.g. "sender_run3" or "receiver_stream1".
+ * @return 0 on success (or when disabled), -1 on error.
+ */
+int tcp_info_sampler_start(TCPInfoSampler *sampler, const TCPInfoOptions *options, int sock, const char *label)
+{
+    char path[512];
+    pthread_condattr_t attr;
+
+    memset(sampler, 0, sizeof(*sampler));
+    if (options->interval_ms <= 0)
+    {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s_%s.csv", options->prefix, label);
+    sampler->out = fopen(path, "w");
+    if (sampler->out == NULL)
+    {
+        perror("fopen");
+        return -1;
+    }
+    fprintf(sampler->out, "time_ms,cwnd,ssthresh,srtt_us,rttvar_us,total_retrans,bytes_in_flight,delivery_rate,pacing_rate\n");
+
+    sampler->sock = sock;
+    sampler->interval_ms = options->interval_ms;
+    sampler->running = 1;
+    sampler->start_ms = stats_ns_to_ms(stats_now_ns());
+    pthread_mutex_init(&sampler->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sampler->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sampler_take(sampler);
+    if (pthread_create(&sampler->thread, NULL, sampler_thread, sampler) != 0)
+    {
+        perror("pthread_create");
+        fclose(sampler->out);
+        sampler->out = NULL;
+        sampler->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops the sampler, closes its time series and returns the run summary.
+ *
+ * @param sampler A sampler started with tcp_info_sampler_start().
+ * @param summary The aggregates of the run, all zero if sampling was disabled.
+ */
+void tcp_info_sampler_stop(TCPInfoSampler *sampler, TCPInfoSummary *summary)
+{
+    if (!sampler->running)
+    {
+        memset(summary, 0, sizeof(*summary));
+        return;
+    }
+
+    pthread_mutex_lock(&sampler->lock);
+    sampler->running = 0;
+    sampler_take(sampler);
+    pthread_cond_signal(&sampler->wakeup);
+    pthread_mutex_unlock(&sampler->lock);
+    pthread_join(sampler->thread, NULL);
+
+    if (sampler->summary.samples > 0)
+    {
+        sampler->summary.cwnd_avg = sampler->cwnd_sum / sampler->summary.samples;
+        sampler->summary.srtt_avg_us = sampler->srtt_sum / sampler->summary.samples;
+    }
+    *summary = sampler->summary;
+
+    fclose(sampler->out);
+    pthread_cond_destroy(&sampler->wakeup);
+    pthread_mutex_destroy(&sampler->lock);
+}
+
+void tcp_info_print_summary(const TCPInfoSummary *summary, FILE *out)
+{
+    if (summary->samples == 0)
+    {
+        return;
+    }
+    fprintf(out, "- TCP_INFO: Samples=%d; Cwnd=%u/%.1f/%u (min/avg/max); SRTT=%.0f/%uus (avg/max); Retrans=%u; "
+                 "DeliveryRate=%.2fMB/s (max)\n",
+            summary->samples, summary->cwnd_min, summary->cwnd_avg, summary->cwnd_max, summary->srtt_avg_us,
+            summary->srtt_max_us, summary->retrans, (double)summary->delivery_rate_max / RUN_STATS_MB);
+}
+
+/**
+ * @brief Appends one run's summary to <prefix>_<role>_summary.csv, next to the time series.
+ */
+void tcp_info_append_summary(const TCPInfoOptions *options, const char *role, int run, const TCPInfoSummary *summary)
+{
+    char path[512];
+    FILE *out = NULL;
+
+    if (options->interval_ms <= 0 || summary->samples == 0)
+    {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s_%s_summary.csv", options->prefix, role);
+    out = fopen(path, run == 1 ? "w" : "a");
+    if (out == NULL)
+    {
+        perror("fopen");
+        return;
+    }
+    if (run == 1)
+    {
+        fprintf(out, "run,samples,cwnd_min,cwnd_avg,cwnd_max,srtt_avg_us,srtt_max_us,retrans,delivery_rate_max\n");
+    }
+    fprintf(out, "%d,%d,%u,%.1f,%u,%.0f,%u,%u,%llu\n", run, summary->samples, summary->cwnd_min, summary->cwnd_avg,
+            summary->cwnd_max, summary->srtt_avg_us, summary->srtt_max_us, summary->retrans,
+            (unsigned long long)summary->delivery_rate_max);
+    fclose(out);
+}
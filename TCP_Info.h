@@ -0,0 +1,69 @@
+#ifndef TCP_INFO_H
+#define TCP_INFO_H
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define TCP_INFO_DEFAULT_PREFIX "tcp_info"
+
+// Command line settings of the TCP_INFO sampler, an interval of 0 disables it
+typedef struct
+{
+    int interval_ms;
+    const char *prefix;
+} TCPInfoOptions;
+
+// One getsockopt(TCP_INFO) reading
+typedef struct
+{
+    double time_ms;          // since the sampler started
+    uint32_t cwnd;           // segments
+    uint32_t ssthresh;       // segments
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t total_retrans;  // segments retransmitted since the connection started
+    uint32_t bytes_in_flight;
+    uint64_t delivery_rate;  // bytes per second
+    uint64_t pacing_rate;    // bytes per second
+} TCPInfoSample;
+
+// Aggregates of all samples taken during one run
+typedef struct
+{
+    int samples;
+    uint32_t cwnd_min;
+    uint32_t cwnd_max;
+    double cwnd_avg;
+    double srtt_avg_us;
+    uint32_t srtt_max_us;
+    uint32_t retrans;        // retransmissions during the run
+    uint64_t delivery_rate_max;
+} TCPInfoSummary;
+
+typedef struct
+{
+    int sock;
+    int interval_ms;
+    int running;
+    FILE *out;
+    double start_ms;
+    uint32_t first_retrans;
+    double cwnd_sum;
+    double srtt_sum;
+    TCPInfoSummary summary;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+} TCPInfoSampler;
+
+// Function declarations
+void tcp_info_options_defaults(TCPInfoOptions *options);
+int tcp_info_parse_arg(TCPInfoOptions *options, int argc, char *argv[], int *index);
+void tcp_info_usage(FILE *out);
+int tcp_info_read(int sock, TCPInfoSample *sample);
+int tcp_info_sampler_start(TCPInfoSampler *sampler, const TCPInfoOptions *options, int sock, const char *label);
+void tcp_info_sampler_stop(TCPInfoSampler *sampler, TCPInfoSummary *summary);
+void tcp_info_print_summary(const TCPInfoSummary *summary, FILE *out);
+void tcp_info_append_summary(const TCPInfoOptions *options, const char *role, int run, const TCPInfoSummary *summary);
+
+#endif
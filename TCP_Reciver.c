@@ -8,24 +8,158 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <sys/time.h>
+#include "Run_Stats.h"
+#include "TCP_Tuning.h"
+#include "TCP_Stripe.h"
+#include "TCP_Info.h"
+#include "Transfer.h"
+#include "Disk_Writer.h"
+#include "Compress.h"
+#include "Manifest.h"
+#include "Latency.h"
+#include "Busy_Poll.h"
+#include "Shm_Ring.h"
+
+
+#define OUTPUT_PATH "test.bin"
+
+// Where decompressed chunks go: through the writer's blocks, counted as the run's goodput
+typedef struct {
+    DiskWriter *writer;
+    RunStats *stats;
+} ChunkSink;
+
+static int write_chunk(void *context, const char *data, size_t length) {
+    ChunkSink *sink = (ChunkSink *)context;
+    while (length > 0) {
+        size_t capacity;
+        char *block = disk_writer_reserve(sink->writer, 1, &capacity);
+        size_t piece = length < capacity ? length : capacity;
+        memcpy(block, data, piece);
+        disk_writer_commit(sink->writer, piece);
+        run_stats_chunk(sink->stats, piece);
+        data += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+// The receiver's end of a manifest exchange
+static int line_send(void *context, const char *data, size_t length) {
+    int sock = *(int *)context;
+    while (length > 0) {
+        ssize_t bytes = send(sock, data, length, 0);
+        if (bytes < 0) {
+            perror("send");
+            return -1;
+        }
+        data += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+// recv() that spins first when busy polling is on
+static ssize_t spin_recv(int sock, void *data, size_t length, int flags) {
+    struct iovec iov = {data, length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return busy_poll_recvmsg(recvmsg, sock, &msg, flags);
+}
 
+static int line_recv(void *context, char *data, size_t length) {
+    return spin_recv(*(int *)context, data, length, MSG_WAITALL) == (ssize_t)length ? 0 : -1;
+}
 
-#define DEST_IP "127.0.0.1"
-#define BUFFER_SIZE 2*1024*1024
-#define FILE_SIZE 2*1024*1024
+// One connection of a latency run, quick ACKs are re-armed after every request
+typedef struct {
+    int sock;
+    const TCPTuning *tuning;
+} RequestLine;
+
+static int request_send(void *context, const char *data, size_t length) {
+    return line_send(&((RequestLine *)context)->sock, data, length);
+}
+
+static int request_recv(void *context, char *data, size_t length) {
+    RequestLine *line = (RequestLine *)context;
+    int result = line_recv(&line->sock, data, length);
+    tcp_tuning_after_recv(line->sock, line->tuning);
+    return result;
+}
 
 /**
- * @brief Function to print the data of a single file transfer run.
- * This function takes the run count, transfer time, and chunk bandwidth as input and prints the data in a formatted manner.
+ * @brief Answers the requests of a latency run.
  *
- * @param run_count The number of the current run.
- * @param transfer_time The time taken for the transfer in milliseconds.
- * @param chunk_bandwidth The bandwidth achieved during the transfer in MB/s.
+ * Reads the latency header, accepts the run's other connections from the listening socket and
+ * echoes every request on its own connection until each one sent its last message.
  *
- * @note This function is used to print the data of each file transfer run.
+ * @return 0 on success, -1 on a socket error or an invalid header.
  */
-void printRunData(int run_count, double transfer_time, double chunk_bandwidth) {
-   printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", run_count, transfer_time, chunk_bandwidth);
+static int serve_requests(int listen_sock, int sender_sock, const TCPTuning *tuning, uint64_t *requests) {
+    unsigned char header[LATENCY_HEADER_SIZE];
+    TCPTuning request_tuning = *tuning;
+    RequestLine lines[LATENCY_MAX_CONCURRENCY];
+    LatencyChannel channels[LATENCY_MAX_CONCURRENCY];
+    uint32_t size;
+    int connections;
+    int count = 1;
+    int result = -1;
+
+    if (recv(sender_sock, header, sizeof(header), MSG_WAITALL) != (ssize_t)sizeof(header) ||
+        latency_decode_header(header, &size, &connections) < 0) {
+        printf("Invalid latency header\n");
+        return -1;
+    }
+    tcp_tuning_request_response(&request_tuning);
+    lines[0].sock = sender_sock;
+    for (; count < connections; count++) {
+        lines[count].sock = accept(listen_sock, NULL, NULL);
+        if (lines[count].sock < 0) {
+            perror("accept");
+            break;
+        }
+    }
+    if (count == connections) {
+        result = 0;
+        for (int i = 0; i < count; i++) {
+            lines[i].tuning = &request_tuning;
+            channels[i].send = request_send;
+            channels[i].recv = request_recv;
+            channels[i].context = &lines[i];
+            channels[i].stamps = NULL;
+            if (tcp_tuning_apply(lines[i].sock, &request_tuning) < 0) {
+                result = -1;
+            }
+        }
+        if (result == 0) {
+            result = latency_serve(channels, count, size, requests);
+        }
+    }
+    for (int i = 1; i < count; i++) {
+        close(lines[i].sock);
+    }
+    return result;
+}
+
+// Receives one whole compression frame into a job: its header, then the payload the header announces.
+static int recv_frame(int sock, CompressJob *job, uint32_t *original) {
+    CompressFrame frame;
+    if (compress_job_reserve(job, COMPRESS_FRAME_HEADER) < 0 ||
+        spin_recv(sock, job->input, COMPRESS_FRAME_HEADER, MSG_WAITALL) != COMPRESS_FRAME_HEADER ||
+        compress_parse_frame(job->input, COMPRESS_FRAME_HEADER, &frame) < 0 ||
+        compress_job_reserve(job, COMPRESS_FRAME_HEADER + (size_t)frame.stored) < 0) {
+        return -1;
+    }
+    if (frame.stored > 0 &&
+        spin_recv(sock, job->input + COMPRESS_FRAME_HEADER, frame.stored, MSG_WAITALL) != (ssize_t)frame.stored) {
+        return -1;
+    }
+    job->input_length = COMPRESS_FRAME_HEADER + (size_t)frame.stored;
+    *original = frame.original;
+    return 0;
 }
 
 /**
@@ -33,11 +167,11 @@ void printRunData(int run_count, double transfer_time, double chunk_bandwidth) {
  *
  * This function is the entry point of the receiver program. It performs the following tasks:
  *  1. Initializes variables.
- *  2. Opens a file for writing ("test.bin").
+ *  2. Opens the output for writing ("test.bin" unless -o is given).
  *  3. Sets up a TCP socket.
  *  4. Binds the socket to a specified port and listens for incoming connections.
  *  5. Accepts a connection from a sender.
- *  6. Receives data from the sender in a loop, writing it to the file.
+ *  6. Reads the length of each run from its header, then receives that many bytes, writing them to the output.
  *  7. Calculates and prints statistics for each file transfer run (time and bandwidth).
  *  8. Sends a message ("Hello, World!") to the sender after each file transfer.
  *  9. Checks if the sender wants to continue (based on the received reply).
@@ -48,43 +182,123 @@ void printRunData(int run_count, double transfer_time, double chunk_bandwidth) {
  * @return 0 If the program runs successfully, 1 otherwise.
  */
 int main(int argc, char *argv[]) {
-    if (argc < 4) {
-        printf("Usage: %s <port_number> <congestion_control_algorithm>\n", argv[0]);
+    TCPTuning tuning; // Socket options requested on the command line
+    TCPInfoOptions info; // TCP_INFO sampling settings
+    TCPInfoSampler sampler; // Samples the connection during each run
+    TCPInfoSummary info_summary; // TCP_INFO aggregates of the current run
+    char label[32];
+    int port_number = 0;
+    int streams = 0; // Number of striped connections, 0 for the regular single connection mode
+    const char *path = OUTPUT_PATH; // Where the received bytes are written
+    TransferSink sink;
+    DiskWriterOptions writer_options; // Block pool and sync policy of the disk writer
+    DiskWriter writer; // Writes the received bytes on its own thread
+    DiskWriterStats writer_stats;
+    CompressOptions compress; // Decompression workers of framed runs
+    BusyPollOptions busy_poll; // How reads wait for data and where the threads run
+    ShmRingOptions shm; // Whether senders on this host may hand over a shared memory ring
+    ShmRing ring; // The ring shared runs go through
+    int shm_listener = -1;
+    int shared_runs = 0;
+    Decompressor decompressor;
+    CompressStats decompress_stats;
+    int decompressing = 0;
+    ManifestStats manifest_stats; // Chunks kept, received and checked by manifest runs
+    int manifests = 0;
+    char state_buffer[4096];
+    const char *state_path = NULL; // Where manifest runs keep their progress, NULL for e.g. /dev/null
+
+    tcp_tuning_defaults(&tuning);
+    tcp_info_options_defaults(&info);
+    disk_writer_options_defaults(&writer_options);
+    compress_options_defaults(&compress);
+    busy_poll_options_defaults(&busy_poll);
+    shm_ring_options_defaults(&shm);
+    shm_ring_init(&ring);
+    memset(&manifest_stats, 0, sizeof(manifest_stats));
+    for (int i = 1; i < argc; i++) {
+        int consumed = tcp_tuning_parse_arg(&tuning, argc, argv, &i);
+        if (consumed == 0) {
+            consumed = tcp_info_parse_arg(&info, argc, argv, &i);
+        }
+        if (consumed == 0) {
+            consumed = disk_writer_parse_arg(&writer_options, argc, argv, &i);
+        }
+        if (consumed == 0) {
+            consumed = compress_parse_arg(&compress, argc, argv, &i);
+        }
+        if (consumed == 0) {
+            consumed = busy_poll_parse_arg(&busy_poll, argc, argv, &i);
+        }
+        if (consumed == 0) {
+            consumed = shm_ring_parse_arg(&shm, argc, argv, &i);
+        }
+        if (consumed < 0) {
+            return 1;
+        }
+        if (consumed == 0 && strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port_number = atoi(argv[++i]);
+        } else if (consumed == 0 && strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (consumed == 0 && strcmp(argv[i], "-streams") == 0 && i + 1 < argc) {
+            streams = atoi(argv[++i]);
+            if (streams < 1 || streams > STRIPE_MAX_STREAMS) {
+                printf("Number of streams must be between 1 and %d\n", STRIPE_MAX_STREAMS);
+                return 1;
+            }
+        } else if (consumed == 0) {
+            port_number = 0;
+            break;
+        }
+    }
+    if (port_number <= 0) {
+        printf("Usage: %s -p <port_number> -algo <congestion_control_algorithm> [tuning options] [-o <path>] [-streams <n>]\n", argv[0]);
+        printf("General options:\n");
+        printf("  -o <path>                write the received bytes to path, e.g. /dev/null (default %s)\n", OUTPUT_PATH);
+        printf("  -streams <n>             receive one file striped over n parallel connections\n");
+        tcp_tuning_usage(stdout);
+        tcp_info_usage(stdout);
+        disk_writer_usage(stdout);
+        compress_usage(stdout);
+        busy_poll_usage(stdout);
+        shm_ring_usage(stdout);
         return 1;
     }
 
-    // Open file for writing the received data
-    FILE* fp = fopen("test.bin", "wb");
-    if (fp == NULL) {
-        printf("Error opening file\n");
+    // Pinned before the buffers are allocated, so they land on this CPU's NUMA node
+    if (busy_poll_configure(&busy_poll) < 0) {
+        return 1;
+    }
+    if (busy_poll_enter(BUSY_POLL_RECEIVE) < 0) {
+        printf("Failed to pin the receive thread to CPU %d\n", busy_poll.cpu);
         return 1;
     }
 
+    // Open the output for writing the received data
+    if (transfer_sink_open(&sink, path) < 0) {
+        return 1;
+    }
+    if (manifest_state_path(&sink, path, state_buffer, sizeof(state_buffer)) == 0) {
+        state_path = state_buffer;
+    }
+
     char *message = "Hello, World!"; // Message to send to sender after each transfer
     int sock; // Socket descriptor
     struct sockaddr_in receiver, sender; // Address structures
     socklen_t sender_len = sizeof(sender);
 
-    // Initialize variables for statistics
+    // Wall time and chunk intervals of every run
+    RunStats stats;
     int run_count = 0;
-    double total_time_sum = 0.0; // Accumulated total time across all runs (seconds)
-    double total_bytes_overall = 0.0; // Accumulated total bytes received across all runs
-
-    // Variables used within the inner loop for each file transfer
-    double run_time = 0.0; // Time taken for the current file transfer (milliseconds)
-    double run_bandwidth = 0.0; // Bandwidth achieved for the current file transfer (MB/s)
-    double run_bytes = 0.0; // Total bytes received for the current file transfer
+    if (run_stats_init(&stats) < 0) {
+        printf("Error allocating statistics\n");
+        return 1;
+    }
 
     // Initialize address structures to zero
     memset(&receiver, 0, sizeof(receiver));
     memset(&sender, 0, sizeof(sender));
 
-    // Get port number and congestion control algorithm from command line arguments
-    int port_number = atoi(argv[2]);
-    char* algo = argv[4];
-
-
-
     // Set socket options
     int opt = 1;
     sock = socket(AF_INET, SOCK_STREAM, 0); // Create a TCP socket
@@ -100,15 +314,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Set congestion control algorithm using setsockopt()
-    if(setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, algo, sizeof(algo)) < 0){
-        perror("setsockopt");
-        exit(1);
+    // Set congestion control algorithm and the other tuning options, accepted sockets inherit them
+    if (tcp_tuning_apply(sock, &tuning) < 0 || busy_poll_apply(sock) < 0) {
+        close(sock);
+        return 1;
     }
 
     // Configure receiver address
     receiver.sin_family = AF_INET;
-    inet_pton(AF_INET, DEST_IP, &receiver.sin_addr); 
+    receiver.sin_addr.s_addr = INADDR_ANY; // Accept senders on any interface, not only loopback
     receiver.sin_port = htons(port_number);
 
     // Bind the socket to the specified address
@@ -118,17 +332,36 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Listen for incoming connections on the bound port
-    if (listen(sock, 1) < 0) {
+    // Listen for incoming connections on the bound port, a latency run may open one per request in flight
+    if (listen(sock, streams > 1 ? streams : LATENCY_MAX_CONCURRENCY) < 0) {
         perror("listen");
         close(sock);
         return 1;
     }
 
+    // A sender on this host hands its ring over right after it connects
+    if (shm.enabled && streams == 0 && (shm_listener = shm_ring_listen("tcp", port_number)) < 0) {
+        close(sock);
+        return 1;
+    }
+
     printf("Starting Receiver...\n");
     printf("Waiting for TCP connection...\n");
     printf("Server is listening on port %d\n", port_number);
 
+    // Striped mode: one file over several connections, each range written at its own offset
+    if (streams > 0) {
+        StripeStreamStats stats[STRIPE_MAX_STREAMS];
+        transfer_sink_close(&sink);
+        int result = stripe_recv(sock, &tuning, &info, streams, path, stats);
+        if (result == 0) {
+            stripe_print_stats(stats, streams, stdout);
+        }
+        printf("Receiver end.\n");
+        close(sock);
+        return result < 0 ? 1 : 0;
+    }
+
     // Accept an incoming connection from a sender
     int sender_sock = accept(sock, (struct sockaddr *)&sender, &sender_len);
     if (sender_sock < 0){
@@ -137,82 +370,157 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     printf("Sender connected, beginning to receive file...\n");
+    tcp_tuning_print(sender_sock, &tuning, stdout);
+
+    // The socket is drained into blocks of the writer's pool, a slow disk only delays the writer thread
+    if (disk_writer_start(&writer, &sink, &writer_options) < 0) {
+        close(sender_sock);
+        close(sock);
+        return 1;
+    }
+
+    // Frames are decompressed on worker threads and handed back in order, on this thread
+    ChunkSink chunk_sink = {&writer, &stats};
+    ManifestChannel channel = {line_send, line_recv, NULL, &sender_sock};
 
     // Main loop for handling file transfers
     while (1) {
-        char buffer[BUFFER_SIZE] = {0}; // Buffer for receiving data
-        char reply[BUFFER_SIZE] = {0}; // Buffer for receiving sender's response
-        int flagOpen = 1; // Flag to indicate if the file has been opened for writing
+        char reply[4] = {0}; // Buffer for receiving sender's response
+        unsigned char header[TRANSFER_HEADER_SIZE]; // Announces the length of the run
+        uint64_t file_size = 0;
+        TransferMode mode = TRANSFER_PLAIN;
 
         // Initialize variables for the current file transfer
-        double total_transfer_time = 0.0; // Total transfer time for the current file (seconds)
-        double total_bytes = 0.0; // Total bytes received for the current file
+        uint64_t total_bytes = 0; // Total bytes received for the current file
 
-        // Receive data from the sender in a loop until the file size is reached
-        while (total_bytes < FILE_SIZE) {
-            struct timeval start_time, end_time; // Time structures for measuring transfer time
+        // Every run starts with its length
+        if (spin_recv(sender_sock, header, sizeof(header), MSG_WAITALL) != (ssize_t)sizeof(header) ||
+            transfer_decode_header(header, sizeof(header), &file_size, &mode) < 0) {
+            printf("Invalid run header\n");
+            break;
+        }
+        int framed = mode == TRANSFER_FRAMED;
+        int shared = mode == TRANSFER_SHARED;
+        if (mode != TRANSFER_MANIFEST) {
+            disk_writer_begin_run(&writer);
+        }
+        // The offer names the ring the bytes of the run go through
+        unsigned char offer[SHM_RING_OFFER_SIZE];
+        if (shared && (spin_recv(sender_sock, offer, sizeof(offer), MSG_WAITALL) != (ssize_t)sizeof(offer) ||
+                       shm_ring_accept(&ring, shm_listener, &sender, offer) < 0)) {
+            printf("Error attaching the shared memory ring\n");
+            disk_writer_finish_run(&writer);
+            break;
+        }
+        shared_runs += shared;
+
+        snprintf(label, sizeof(label), "receiver_run%d", run_count + 1);
+        tcp_info_sampler_start(&sampler, &info, sender_sock, label);
+
+        // The run's wall clock starts before the first recv and stops at the last byte
+        run_stats_begin_run(&stats);
 
-            // Get the start time before receiving data
-            gettimeofday(&start_time, NULL);
+        // A manifest run receives only the chunks missing from the output, the rest is checked on disk
+        if (mode == TRANSFER_MANIFEST) {
+            manifests = 1;
+            if (manifest_recv_run(&channel, file_size, &writer, state_path, &stats, &manifest_stats) < 0) {
+                printf("Error receiving file, progress kept in %s\n", state_path != NULL ? state_path : "memory only");
+                disk_writer_finish_run(&writer);
+                break;
+            }
+            total_bytes = file_size;
+        }
+        // A latency run answers requests of a fixed size, nothing reaches the output
+        if (mode == TRANSFER_LATENCY) {
+            uint64_t requests = 0;
+            if (serve_requests(sock, sender_sock, &tuning, &requests) < 0) {
+                printf("Error answering requests\n");
+                disk_writer_finish_run(&writer);
+                break;
+            }
+            printf("Answered %llu requests\n", (unsigned long long)requests);
+            total_bytes = file_size;
+        }
+        if (framed && !decompressing) {
+            if (decompressor_start(&decompressor, &compress, write_chunk, &chunk_sink) < 0) {
+                break;
+            }
+            decompressing = 1;
+        }
+        // A framed run counts the bytes the frames announce, the chunks reach the writer through the sink
+        while (framed && total_bytes < file_size) {
+            uint32_t original;
+            CompressJob *job = decompressor_acquire(&decompressor);
+            if (job == NULL || recv_frame(sender_sock, job, &original) < 0 ||
+                decompressor_submit(&decompressor, job) < 0) {
+                printf("Invalid compressed frame\n");
+                break;
+            }
+            total_bytes += original;
+        }
+        if (framed && decompressor_flush(&decompressor) < 0) {
+            printf("Error decompressing the run\n");
+        }
 
-            // Receive data from the sender
-            int bytes_received = recv(sender_sock, buffer, BUFFER_SIZE, 0);
+        // Receive data from the sender in a loop until the file size is reached
+        while (!framed && total_bytes < file_size) {
+            // Receive data from the sender straight into the writer's block, never past the end of the current file
+            size_t capacity;
+            char *buffer = disk_writer_reserve(&writer, 1, &capacity);
+            // The ring is read a whole block at a time, the socket a chunk
+            size_t bytes_to_read = shared || capacity < (size_t)tuning.chunk_size ? capacity : (size_t)tuning.chunk_size;
+            if (file_size - total_bytes < bytes_to_read) {
+                bytes_to_read = (size_t)(file_size - total_bytes);
+            }
+            ssize_t bytes_received;
+            if (shared) {
+                bytes_received = shm_ring_read(&ring, buffer, bytes_to_read);
+            } else {
+                bytes_received = spin_recv(sender_sock, buffer, bytes_to_read, 0);
+                tcp_tuning_after_recv(sender_sock, &tuning);
+            }
 
             // Check for connection errors
-            if (bytes_received == 0) {
+            if (bytes_received <= 0) {
                 printf("disconnect\n");
                 close(sender_sock);
                 break;
             }
 
-            // Handle the first data chunk by opening the file for writing
-            if (flagOpen == 0) {
-                flagOpen = 1;
-                fopen("test.bin", "wb"); // Open the file in write binary mode
-            }
+            // Record the chunk and the time since the previous one
+            run_stats_chunk(&stats, bytes_received);
 
-            // Write the received data to the file
-            fwrite(buffer, sizeof(char), bytes_received, fp);
+            // Hand the received data to the writer thread
+            disk_writer_commit(&writer, bytes_received);
 
             // Update the total bytes received
             total_bytes += bytes_received;
-
-            // Get the end time after receiving data
-            gettimeofday(&end_time, NULL);
-
-            // Calculate the transfer time for this chunk
-            double transfer_time_us = (double)(end_time.tv_sec - start_time.tv_sec) * 1000000.0 + (double)(end_time.tv_usec - start_time.tv_usec);
-            double transfer_time_s = transfer_time_us / 1000000.0; // Convert to seconds
-
-            // Update the total transfer time
-            total_transfer_time += transfer_time_s;
         }
 
-        // Calculate the average time and bandwidth for the current file transfer
-        run_time = total_transfer_time * 1000.0; // Convert to milliseconds
-                 run_bandwidth = total_bytes / total_transfer_time * 8.0 / (1024.0 * 1024.0); // Convert to MB/s
+        const RunRecord *record = run_stats_end_run(&stats);
+        tcp_info_sampler_stop(&sampler, &info_summary);
 
-        // Store the total bytes for this run
-        run_bytes = total_bytes;
-
-        // Accumulate total bytes for all runs
-        total_bytes_overall += run_bytes;
-
-        // Accumulate total time in seconds
-        total_time_sum += run_time / 1000.0;
+        // The run is complete once the writer has caught up (and synced, if asked to)
+        if (disk_writer_finish_run(&writer) < 0) {
+            printf("Error writing %s\n", path);
+        }
 
         // Increment the run count
         run_count++;
 
         // Print statistics for the current file transfer
         printf("File transfer completed.\n");
-        printRunData(run_count, run_time, run_bandwidth);
+        if (record != NULL) {
+            run_stats_print_run(record, stdout);
+        }
+        tcp_info_print_summary(&info_summary, stdout);
+        tcp_info_append_summary(&info, "receiver", run_count, &info_summary);
 
         // Send a message ("Hello, World!") to the sender
         send(sender_sock, message, sizeof(message), 0);
 
-        // Receive the sender's response
-        if (recv(sender_sock, reply, BUFFER_SIZE, 0) < 0) {
+        // Receive the sender's response, always exactly 3 bytes ("yes" or "no\0")
+        if (recv(sender_sock, reply, 3, MSG_WAITALL) <= 0) {
             perror("recv");
             close(sender_sock);
             return 1;
@@ -228,21 +536,33 @@ int main(int argc, char *argv[]) {
 
     // Close the sender socket
     close(sender_sock);
-
-    // Calculate overall statistics
-    double average_time_overall = total_time_sum * 1000.0; // Convert to milliseconds
-    double average_bandwidth_overall = total_bytes_overall / total_time_sum * 8.0 / (1024.0 * 1024.0); // Convert to MB/s
+    if (decompressing) {
+        decompressor_stop(&decompressor, &decompress_stats);
+    }
+    disk_writer_stop(&writer, &writer_stats);
+    transfer_sink_close(&sink);
 
     // Print overall statistics
     printf("\n----------------------------------\n");
     printf("- * Statistics * -\n");
-    for (int i = 0; i < run_count; i++) {
-        printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", i + 1, run_time, run_bandwidth);
+    run_stats_print(&stats, stdout);
+    disk_writer_print(&writer_stats, stdout);
+    if (decompressing) {
+        compress_print(&decompress_stats, "Decompression", stdout);
+    }
+    if (manifests) {
+        manifest_print(&manifest_stats, MANIFEST_RECEIVER, "Manifest", stdout);
+    }
+    busy_poll_print(stdout);
+    if (shared_runs > 0) {
+        shm_ring_print(&ring, stdout);
     }
-    printf("-\n");
-    printf("- Average time: %.2fms\n", average_time_overall);
-    printf("- Average bandwidth: %.6fMB/s\n", average_bandwidth_overall);
     printf("----------------------------------\n");
+    run_stats_free(&stats);
+    shm_ring_close(&ring);
+    if (shm_listener >= 0) {
+        close(shm_listener);
+    }
     printf("Receiver end.\n");
 
     // Close the main socket
@@ -14,30 +14,677 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <netinet/tcp.h>
+#include "Run_Stats.h"
+#include "TCP_Tuning.h"
+#include "TCP_Stripe.h"
+#include "TCP_Info.h"
+#include "Transfer.h"
+#include "Compress.h"
+#include "Manifest.h"
+#include "Latency.h"
+#include "Timestamp.h"
+#include "Shm_Ring.h"
 
 
-char *util_generate_random_data(unsigned int);
-
-#define DATA_SIZE 2*1024*1024
 #define DEST_IP "127.0.0.1"
 #define DEST_PORT 5678
-#define BUFFER_SIZE 2*1024*1024
+#define BUFFER_SIZE 1024 // the receiver's end-of-file message
+#define MAX_SWEEP_VALUES 16
+
+// Socket settings the sweep mode can toggle between runs
+enum { SWEEP_MODE_PLAIN, SWEEP_MODE_NODELAY, SWEEP_MODE_CORK, SWEEP_MODE_COUNT };
+static const char *sweep_mode_names[SWEEP_MODE_COUNT] = {"plain", "nodelay", "cork"};
+
+/**
+ * @brief Parses a comma separated list of sizes ("0,256K,1M") for the sweep grid.
+ * @return The number of values parsed, or -1 on a malformed list.
+ */
+static int parse_size_list(const char *text, int *values, int max_values)
+{
+    char copy[256];
+    int count = 0;
+    strncpy(copy, text, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+
+    for (char *token = strtok(copy, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        long long size = transfer_parse_size(token);
+        if (size < 0 || size > 1024LL * 1024 * 1024 || count == max_values)
+        {
+            return -1;
+        }
+        values[count++] = (int)size;
+    }
+    return count;
+}
+
+// Sorts a sweep list in ascending order, the lists are a few values long.
+static void sort_sizes(int *values, int count)
+{
+    for (int i = 1; i < count; i++)
+    {
+        int value = values[i];
+        int j = i;
+        for (; j > 0 && values[j - 1] > value; j--)
+        {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
+    }
+}
+
+/**
+ * @brief Sends length bytes, however many send() calls it takes.
+ * @return 0 on success, -1 on a socket error.
+ */
+static int send_all(int sock, const char *data, size_t length)
+{
+    size_t total_bytes_sent = 0;
+    while (total_bytes_sent < length)
+    {
+        ssize_t bytes = send(sock, data + total_bytes_sent, length - total_bytes_sent, 0);
+        if (bytes < 0)
+        {
+            perror("send");
+            return -1;
+        }
+        total_bytes_sent += bytes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one copy of the file in chunks of tuning->chunk_size bytes.
+ *
+ * The run starts with a header announcing its length, then the chunks are streamed from the
+ * source through a small prefetch ring, so memory does not depend on the size of the file.
+ * With a codec in `compress` the chunks are compress->chunk_size bytes instead and each one
+ * goes out as a compression frame.
+ *
+ * @return 0 on success, -1 on a socket or read error.
+ */
+static int send_file(int sock, TransferSource *source, const TCPTuning *tuning,
+                     const CompressOptions *compress, CompressStats *compress_stats)
+{
+    unsigned char header[TRANSFER_HEADER_SIZE];
+    TransferReader reader;
+    const char *chunk;
+    size_t chunk_length;
+    size_t chunk_size = tuning->chunk_size;
+    char *frame = NULL;
+    int result = 0;
+
+    if (compress != NULL && compress->codec != COMPRESS_NONE)
+    {
+        chunk_size = compress->chunk_size;
+        if ((frame = (char *)malloc(compress_frame_bound(chunk_size))) == NULL)
+        {
+            perror("malloc");
+            return -1;
+        }
+    }
+    transfer_encode_header(source->size, frame != NULL ? TRANSFER_FRAMED : TRANSFER_PLAIN, header);
+    if (tcp_tuning_begin_send(sock, tuning) < 0 ||
+        send(sock, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        transfer_reader_start(&reader, source, 0, source->size, chunk_size) < 0)
+    {
+        perror("send");
+        free(frame);
+        return -1;
+    }
+    while (result == 0 && (chunk = transfer_reader_next(&reader, &chunk_length)) != NULL)
+    {
+        if (frame != NULL)
+        {
+            result = send_all(sock, frame, compress_frame(compress, chunk, chunk_length, frame, compress_stats));
+        }
+        else
+        {
+            result = send_all(sock, chunk, chunk_length);
+        }
+    }
+    free(frame);
+    if (transfer_reader_stop(&reader) < 0 || result < 0)
+    {
+        return -1;
+    }
+    return tcp_tuning_end_send(sock, tuning);
+}
+
+/**
+ * @brief Sends one copy of the file through the shared memory ring: the run header and the
+ * ring's offer go on the connection, the bytes through the ring.
+ * @return 0 on success, -1 on a socket or read error or if the receiver went away.
+ */
+static int send_shared(int sock, TransferSource *source, ShmRing *ring)
+{
+    unsigned char header[TRANSFER_HEADER_SIZE + SHM_RING_OFFER_SIZE];
+
+    transfer_encode_header(source->size, TRANSFER_SHARED, header);
+    shm_ring_encode_offer(ring, header + TRANSFER_HEADER_SIZE);
+    if (send_all(sock, (const char *)header, sizeof(header)) < 0)
+    {
+        return -1;
+    }
+    return shm_ring_send(ring, source);
+}
+
+// The sender's end of a manifest exchange or of a latency connection, corked only while it sends a manifest
+typedef struct
+{
+    int sock;
+    const TCPTuning *tuning;
+    uint64_t received_ns; // kernel RX timestamp of the last response, latency connections with timestamps only
+} ManifestLine;
+
+static int line_send(void *context, const char *data, size_t length)
+{
+    return send_all(((ManifestLine *)context)->sock, data, length);
+}
+
+static int line_recv(void *context, char *data, size_t length)
+{
+    return recv(((ManifestLine *)context)->sock, data, length, MSG_WAITALL) == (ssize_t)length ? 0 : -1;
+}
+
+// A corked manifest would wait for more bytes while the receiver waits for the manifest.
+static int line_turn(void *context, int sending)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    return sending ? tcp_tuning_begin_send(line->sock, line->tuning) : tcp_tuning_end_send(line->sock, line->tuning);
+}
+
+/**
+ * @brief Sends one copy of the file as a manifest of chunk hashes, then only the chunks the receiver asks for.
+ * @return 0 once the receiver holds the whole file, -1 on a socket or read error.
+ */
+static int send_manifest(int sock, TransferSource *source, const TCPTuning *tuning,
+                         const ManifestOptions *manifest, ManifestStats *manifest_stats)
+{
+    unsigned char header[TRANSFER_HEADER_SIZE];
+    ManifestLine line = {sock, tuning, 0};
+    ManifestChannel channel = {line_send, line_recv, line_turn, &line};
+
+    transfer_encode_header(source->size, TRANSFER_MANIFEST, header);
+    if (tcp_tuning_begin_send(sock, tuning) < 0 || send_all(sock, (const char *)header, sizeof(header)) < 0 ||
+        manifest_send_run(manifest, &channel, source, manifest_stats) < 0)
+    {
+        return -1;
+    }
+    return tcp_tuning_end_send(sock, tuning);
+}
+
+// A response of a latency run, quick ACKs are re-armed for the next one
+static int request_recv(void *context, char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    int result = line_recv(context, data, length);
+    tcp_tuning_after_recv(line->sock, line->tuning);
+    return result;
+}
+
+// A response read with its kernel RX timestamp: the one of the segment that completed it
+static int request_recv_stamped(void *context, char *data, size_t length)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    union
+    {
+        char buffer[TIMESTAMP_CONTROL_SIZE];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {data, length};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t bytes = recvmsg(line->sock, &msg, MSG_WAITALL);
+    line->received_ns = bytes == (ssize_t)length ? timestamp_rx(&msg) : 0;
+    tcp_tuning_after_recv(line->sock, line->tuning);
+    return bytes == (ssize_t)length ? 0 : -1;
+}
+
+/**
+ * @brief The kernel's TX timestamp of the request's last byte and the RX timestamp of its response.
+ *
+ * Every send() of the connection queues one TX timestamp, a request is one send() in the usual
+ * case, the oldest one queued is taken and the rest dropped so they cannot pile up.
+ */
+static int request_stamps(void *context, uint64_t *sent_ns, uint64_t *received_ns)
+{
+    ManifestLine *line = (ManifestLine *)context;
+    uint64_t later_ns;
+    int result = timestamp_tx(line->sock, TIMESTAMP_ANY_KEY, sent_ns);
+
+    while (timestamp_tx(line->sock, TIMESTAMP_ANY_KEY, &later_ns) == 0)
+    {
+    }
+    *received_ns = line->received_ns;
+    return result == 0 && *received_ns != 0 ? 0 : -1;
+}
+
+/**
+ * @brief Runs the requests of one latency run instead of sending the file.
+ *
+ * The run header and the latency header go out on the main connection, every further request
+ * in flight gets a connection of its own for the length of the run. With `timestamps` the
+ * kernel timestamps every request and response, after the headers so those are not counted.
+ *
+ * @return 0 once every connection got its last response, -1 on a socket error.
+ */
+static int send_requests(int sock, const struct sockaddr_in *receiver, const TCPTuning *tuning,
+                         const LatencyOptions *latency, int timestamps, LatencyStats *latency_stats)
+{
+    unsigned char header[TRANSFER_HEADER_SIZE + LATENCY_HEADER_SIZE];
+    ManifestLine lines[LATENCY_MAX_CONCURRENCY];
+    LatencyChannel channels[LATENCY_MAX_CONCURRENCY];
+    int count = 1;
+    int result = -1;
+
+    transfer_encode_header(latency->requests * latency->size, TRANSFER_LATENCY, header);
+    latency_encode_header(latency, header + TRANSFER_HEADER_SIZE);
+    if (send_all(sock, (const char *)header, sizeof(header)) < 0)
+    {
+        return -1;
+    }
+    lines[0].sock = sock;
+    for (; count < latency->concurrency; count++)
+    {
+        lines[count].sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (lines[count].sock < 0)
+        {
+            perror("socket");
+            break;
+        }
+        if (tcp_tuning_apply(lines[count].sock, tuning) < 0)
+        {
+            close(lines[count].sock);
+            break;
+        }
+        if (connect(lines[count].sock, (const struct sockaddr *)receiver, sizeof(*receiver)) < 0)
+        {
+            perror("connect");
+            close(lines[count].sock);
+            break;
+        }
+    }
+    if (count == latency->concurrency)
+    {
+        result = 0;
+        for (int i = 0; i < count; i++)
+        {
+            lines[i].tuning = tuning;
+            lines[i].received_ns = 0;
+            channels[i].send = line_send;
+            channels[i].recv = timestamps ? request_recv_stamped : request_recv;
+            channels[i].context = &lines[i];
+            channels[i].stamps = timestamps ? request_stamps : NULL;
+            if (timestamps && timestamp_enable(lines[i].sock, TIMESTAMP_TX_ALL) < 0)
+            {
+                result = -1;
+            }
+        }
+        if (result == 0)
+        {
+            result = latency_run(latency, channels, count, latency_stats);
+        }
+    }
+    for (int i = 1; i < count; i++)
+    {
+        close(lines[i].sock);
+    }
+    return result;
+}
+
+/**
+ * @brief Waits for the receiver's end-of-file message.
+ * @return 0 on success, -1 if the receiver went away.
+ */
+static int wait_reply(int sock, char *buffer, int size)
+{
+    int bytes_received = recv(sock, buffer, size - 1, 0);
+    if (bytes_received <= 0)
+    {
+        perror("recv");
+        return -1;
+    }
+    buffer[bytes_received] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Tells the receiver whether another file follows.
+ *
+ * Both answers are 3 bytes long so the receiver can read exactly one answer and never
+ * mistake the start of the next file for part of it.
+ */
+static int send_choice(int sock, int again)
+{
+    return send(sock, again ? "yes" : "no", 3, 0) == 3 ? 0 : -1;
+}
+
+/**
+ * @brief Runs the file transfer over a grid of sender side socket settings and reports the best one.
+ *
+ * Every grid point (SO_SNDBUF x chunk size x plain/nodelay/cork) is measured `reps` times on the
+ * same connection, from the first byte sent until the receiver confirms the whole file arrived.
+ * Receiver side options (SO_RCVBUF, quick ACKs) are taken from the receiver's own command line.
+ *
+ * @return 0 on success, -1 on a socket error.
+ */
+static int run_sweep(int sock, TransferSource *source, char *buffer, const TCPTuning *base,
+                     const int *sndbufs, int sndbuf_count, const int *chunks, int chunk_count, int reps)
+{
+    int points = sndbuf_count * chunk_count * SWEEP_MODE_COUNT;
+    int point = 0;
+    double best_rate = 0.0;
+    TCPTuning best = *base;
+
+    printf("Sweeping %d configurations, %d runs each\n", points, reps);
+    printf("%10s %10s %8s %12s %12s\n", "sndbuf", "chunk", "mode", "avg ms", "MB/s");
+
+    for (int s = 0; s < sndbuf_count; s++)
+    {
+        for (int c = 0; c < chunk_count; c++)
+        {
+            for (int mode = 0; mode < SWEEP_MODE_COUNT; mode++)
+            {
+                TCPTuning tuning = *base;
+                int nodelay = (mode == SWEEP_MODE_NODELAY);
+                double total_ms = 0.0;
+
+                tuning.sndbuf = sndbufs[s];
+                tuning.chunk_size = chunks[c];
+                tuning.nodelay = nodelay;
+                tuning.cork = (mode == SWEEP_MODE_CORK);
+
+                // A zero size keeps the kernel's autotuned buffer, the grid is sorted so it comes before
+                // any SO_SNDBUF, which turns autotuning off for good on this socket
+                if (tuning.sndbuf > 0)
+                {
+                    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &tuning.sndbuf, sizeof(tuning.sndbuf));
+                }
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                for (int r = 0; r < reps; r++)
+                {
+                    double start = stats_ns_to_ms(stats_now_ns());
+                    if (send_file(sock, source, &tuning, NULL, NULL) < 0 || wait_reply(sock, buffer, BUFFER_SIZE) < 0)
+                    {
+                        return -1;
+                    }
+                    total_ms += stats_ns_to_ms(stats_now_ns()) - start;
+                    point++;
+                    if (send_choice(sock, point < points * reps) < 0)
+                    {
+                        perror("send");
+                        return -1;
+                    }
+                }
+
+                double avg_ms = total_ms / reps;
+                double rate = stats_speed_mb(source->size, (uint64_t)(avg_ms * 1000000.0));
+                printf("%10d %10d %8s %12.2f %12.2f\n", tuning.sndbuf, tuning.chunk_size, sweep_mode_names[mode], avg_ms, rate);
+                if (rate > best_rate)
+                {
+                    best_rate = rate;
+                    best = tuning;
+                }
+            }
+        }
+    }
+
+    printf("----------------------------------\n");
+    printf("Best configuration: %.2fMB/s\n", best_rate);
+    tcp_tuning_print(-1, &best, stdout);
+    printf("Flags: -algo %s -sndbuf %d -chunk %d%s%s\n", best.algo, best.sndbuf, best.chunk_size,
+           best.nodelay ? " -nodelay" : "", best.cork ? " -cork" : "");
+    printf("----------------------------------\n");
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s -ip <IP> -p <port> -algo <algo> [tuning options] [-sweep | -streams <n> | latency options]\n", prog);
+    printf("General options:\n");
+    printf("  -runs <n>                send the file n times without asking\n");
+    printf("  -streams <n>             send the file once, striped over n parallel connections\n");
+    printf("  -timestamps              time requests between the kernel's TX and RX timestamps as well\n");
+    tcp_tuning_usage(stdout);
+    tcp_info_usage(stdout);
+    transfer_usage(stdout);
+    compress_usage(stdout);
+    manifest_usage(stdout);
+    latency_usage(stdout);
+    shm_ring_usage(stdout);
+    printf("Sweep options:\n");
+    printf("  -sweep                   measure a grid of sender settings and report the best one\n");
+    printf("  -sweep-reps <n>          runs per grid point (default 3)\n");
+    printf("  -sweep-sndbuf <list>     SO_SNDBUF values, e.g. 0,256K,1M,4M, measured from the smallest up; 0 is the\n");
+    printf("                           kernel's autotuned buffer, not allowed with -sndbuf or a profile that sets one\n");
+    printf("  -sweep-chunk <list>      chunk sizes, e.g. 16K,64K,256K,2M\n");
+}
 
 int main(int argc, char *argv[])
 {
-      if (argc < 6) {
-        printf("Usage: %s <port_number>\n", argv[0]);
+    TCPTuning tuning;
+    TCPInfoOptions info;
+    TransferOptions transfer;
+    CompressOptions compress;
+    CompressStats compress_stats;
+    ManifestOptions manifest;
+    ManifestStats manifest_stats;
+    LatencyOptions latency;
+    LatencyStats latency_stats;
+    ShmRingOptions shm;
+    ShmRing ring;
+    int shared = 0;
+    TransferSource source;
+    TCPInfoSampler sampler;
+    TCPInfoSummary info_summary;
+    int run = 0;
+    char label[32];
+    char *dest_ip = DEST_IP;
+    int port_number = DEST_PORT;
+    int sweep = 0;
+    int streams = 0;
+    int runs = 0;
+    int timestamps = 0;
+    int sweep_reps = 3;
+    int sweep_sndbufs[MAX_SWEEP_VALUES] = {0, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    int sweep_sndbuf_count = 4;
+    int sweep_chunks[MAX_SWEEP_VALUES] = {16 * 1024, 64 * 1024, 256 * 1024, 2 * 1024 * 1024};
+    int sweep_chunk_count = 4;
+    int ret = 0;
+
+    tcp_tuning_defaults(&tuning);
+    tcp_info_options_defaults(&info);
+    transfer_options_defaults(&transfer);
+    compress_options_defaults(&compress);
+    memset(&compress_stats, 0, sizeof(compress_stats));
+    manifest_options_defaults(&manifest);
+    memset(&manifest_stats, 0, sizeof(manifest_stats));
+    latency_options_defaults(&latency);
+    shm_ring_options_defaults(&shm);
+    shm_ring_init(&ring);
+
+    if (argc < 6) {
+        usage(argv[0]);
         return 1;
     }
-	printf("sender\n");
-	char *random_data = util_generate_random_data(DATA_SIZE);
+    for (int i = 1; i < argc; i++)
+    {
+        int consumed = tcp_tuning_parse_arg(&tuning, argc, argv, &i);
+        if (consumed == 0)
+        {
+            consumed = tcp_info_parse_arg(&info, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = transfer_parse_arg(&transfer, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = compress_parse_arg(&compress, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = manifest_parse_arg(&manifest, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = latency_parse_arg(&latency, argc, argv, &i);
+        }
+        if (consumed == 0)
+        {
+            consumed = shm_ring_parse_arg(&shm, argc, argv, &i);
+        }
+        if (consumed < 0)
+        {
+            return 1;
+        }
+        if (consumed > 0)
+        {
+            continue;
+        }
+
+        if (strcmp(argv[i], "-sweep") == 0)
+        {
+            sweep = 1;
+        }
+        else if (strcmp(argv[i], "-timestamps") == 0)
+        {
+            timestamps = 1;
+        }
+        else if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else if (strcmp(argv[i], "-ip") == 0)
+        {
+            dest_ip = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            port_number = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-runs") == 0)
+        {
+            runs = atoi(argv[++i]);
+            if (runs < 1)
+            {
+                fprintf(stderr, "Number of runs must be positive\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-streams") == 0)
+        {
+            streams = atoi(argv[++i]);
+            if (streams < 1 || streams > STRIPE_MAX_STREAMS)
+            {
+                fprintf(stderr, "Number of streams must be between 1 and %d\n", STRIPE_MAX_STREAMS);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-sweep-reps") == 0)
+        {
+            sweep_reps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-sweep-sndbuf") == 0)
+        {
+            sweep_sndbuf_count = parse_size_list(argv[++i], sweep_sndbufs, MAX_SWEEP_VALUES);
+        }
+        else if (strcmp(argv[i], "-sweep-chunk") == 0)
+        {
+            sweep_chunk_count = parse_size_list(argv[++i], sweep_chunks, MAX_SWEEP_VALUES);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (sweep_reps < 1 || sweep_sndbuf_count <= 0 || sweep_chunk_count <= 0)
+    {
+        fprintf(stderr, "Invalid sweep grid\n");
+        return 1;
+    }
+    // All grid points share one connection: once SO_SNDBUF is set the kernel never autotunes
+    // the buffer again, so the autotuned point (0) has to be measured first
+    sort_sizes(sweep_sndbufs, sweep_sndbuf_count);
+    if (sweep && sweep_sndbufs[0] == 0 && tuning.sndbuf > 0)
+    {
+        fprintf(stderr, "-sweep-sndbuf 0 measures the autotuned buffer, which the SO_SNDBUF of %d bytes from -sndbuf or -profile turns off\n", tuning.sndbuf);
+        return 1;
+    }
+    for (int i = 0; i < sweep_chunk_count; i++)
+    {
+        if (sweep_chunks[i] <= 0 || sweep_chunks[i] > TCP_TUNING_MAX_CHUNK)
+        {
+            fprintf(stderr, "Sweep chunk sizes must be between 1 and %d bytes\n", TCP_TUNING_MAX_CHUNK);
+            return 1;
+        }
+    }
+    // The sweep measures the tuning grid alone and the stripes carry raw byte ranges
+    if ((compress.codec != COMPRESS_NONE || manifest.enabled) && (sweep || streams > 0))
+    {
+        fprintf(stderr, "-compress and -manifest cannot be combined with -sweep or -streams\n");
+        return 1;
+    }
+    if (compress.codec != COMPRESS_NONE && manifest.enabled)
+    {
+        fprintf(stderr, "-compress cannot be combined with -manifest\n");
+        return 1;
+    }
+    // A latency run sends requests instead of the file
+    if (latency.enabled && (sweep || streams > 0 || compress.codec != COMPRESS_NONE || manifest.enabled))
+    {
+        fprintf(stderr, "-latency cannot be combined with -sweep, -streams, -compress or -manifest\n");
+        return 1;
+    }
+    if (timestamps && !latency.enabled)
+    {
+        fprintf(stderr, "-timestamps needs -latency\n");
+        return 1;
+    }
+    if (latency.enabled)
+    {
+        tcp_tuning_request_response(&tuning);
+        if (latency_stats_init(&latency_stats) < 0)
+        {
+            perror("malloc");
+            return 1;
+        }
+    }
 
-    char buffer[BUFFER_SIZE] = {0};
+	printf("sender\n");
+    if (transfer_source_open(&source, &transfer) < 0)
+    {
+        return 1;
+    }
+    char *buffer = malloc(BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
 
-    int port_number = atoi(argv[4]);
-    char* dest_ip = argv[2];
-    char* algo = argv[6];
-    
+    if (streams > 0)
+    {
+        StripeStreamStats stats[STRIPE_MAX_STREAMS];
+        tcp_tuning_print(-1, &tuning, stdout);
+        ret = stripe_send(dest_ip, port_number, &tuning, &info, &source, streams, stats);
+        if (ret == 0)
+        {
+            stripe_print_stats(stats, streams, stdout);
+        }
+        transfer_source_close(&source);
+        free(buffer);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	struct sockaddr_in receiver;
@@ -48,87 +695,99 @@ int main(int argc, char *argv[])
 	inet_pton(AF_INET, dest_ip, &receiver.sin_addr);
 	receiver.sin_port = htons(port_number);
 
-    if(setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, algo, sizeof(algo)) < 0){
-        perror("setsockopt");
+    if (tcp_tuning_apply(sock, &tuning) < 0) {
         exit(1);
     }
 
-    int ret = connect(sock, (struct sockaddr *)&receiver, sizeof(receiver));
+    ret = connect(sock, (struct sockaddr *)&receiver, sizeof(receiver));
     if (ret < 0) {
         perror("connect error");
         exit(1);
     }
+    tcp_tuning_print(sock, &tuning, stdout);
+
+    // A receiver on this host takes the bytes of plain runs through a shared memory ring
+    if (shm.enabled && !sweep && !latency.enabled && !manifest.enabled && compress.codec == COMPRESS_NONE)
+    {
+        shared = shm_ring_offer(&ring, "tcp", &receiver, shm.size) == 0;
+        printf(shared ? "Shared memory ring handed to the receiver\n" : "The receiver is not sharing memory, using the network\n");
+    }
+
+    if (sweep)
+    {
+        ret = run_sweep(sock, &source, buffer, &tuning, sweep_sndbufs, sweep_sndbuf_count,
+                        sweep_chunks, sweep_chunk_count, sweep_reps);
+        close(sock);
+        transfer_source_close(&source);
+        free(buffer);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
-	
     char choice;
     do
-    {   int total_bytes_sent = 0;
-        while (total_bytes_sent < DATA_SIZE)
-        {
-            int bytes = send(sock, random_data, strlen(random_data), 0);
-        if(bytes < 0){
-            perror("send");
+    {
+        run++;
+        snprintf(label, sizeof(label), "sender_run%d", run);
+        tcp_info_sampler_start(&sampler, &info, sock, label);
+
+        int sent;
+        if (latency.enabled) {
+            sent = send_requests(sock, &receiver, &tuning, &latency, timestamps, &latency_stats);
+        } else {
+            sent = shared ? send_shared(sock, &source, &ring)
+                          : manifest.enabled ? send_manifest(sock, &source, &tuning, &manifest, &manifest_stats)
+                                             : send_file(sock, &source, &tuning, &compress, &compress_stats);
+        }
+        if (sent < 0) {
             exit(1);
         }
-        printf("Sent %d bytes\n", bytes);
-        total_bytes_sent += bytes;
+        if (latency.enabled) {
+            printf("Sent %llu requests\n", (unsigned long long)latency.requests);
+        } else {
+            printf("Sent %llu bytes\n", (unsigned long long)source.size);
         }
-        
-        
-        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
-        if(bytes_received < 0){
-            perror("recv");
+
+        if (wait_reply(sock, buffer, BUFFER_SIZE) < 0) {
             exit(1);
         }
-        if(buffer[BUFFER_SIZE-1] != '\0'){
-            buffer[BUFFER_SIZE-1] = '\0';
+        tcp_info_sampler_stop(&sampler, &info_summary);
+        printf("Received: %s\n", buffer);
+        tcp_info_print_summary(&info_summary, stdout);
+        tcp_info_append_summary(&info, "sender", run, &info_summary);
+
+        if (runs > 0) {
+            choice = run < runs ? 'y' : 'n';
+            send_choice(sock, choice == 'y');
+            continue;
         }
 
-        printf("Received: %s\n", buffer);
-    
         printf("Enter choice if send again: \n");
         scanf(" %c",&choice);
-        if(choice == 'n'){
-            send(sock, "no", 2, 0);
-            break;
-        }
-        else if(choice == 'y'){
-            send(sock, "yes", 3, 0);
-        }
-        else if(choice != 'y' && choice!= 'n'){
+        while (choice != 'y' && choice != 'n') {
             printf("Invalid choice, enter y or n\n");
             scanf(" %c",&choice);
         }
+        send_choice(sock, choice == 'y');
     } while ( choice == 'y');
-    
+    if (compress.codec != COMPRESS_NONE) {
+        compress_print(&compress_stats, "Compression", stdout);
+    }
+    if (manifest.enabled) {
+        manifest_print(&manifest_stats, MANIFEST_SENDER, "Manifest", stdout);
+    }
+    if (latency.enabled) {
+        latency_print(&latency_stats, &latency, stdout);
+        latency_stats_free(&latency_stats);
+    }
+    if (shared) {
+        shm_ring_print(&ring, stdout);
+    }
+    shm_ring_close(&ring);
+
 
 	close(sock);
+    transfer_source_close(&source);
+    free(buffer);
 
 	return EXIT_SUCCESS;
 }
-
-char *util_generate_random_data(unsigned int size)
-{
-	char *buffer = NULL;
-
-	if (size == 0)
-	{
-		return NULL;
-	}
-
-	buffer = (char *)calloc(size, sizeof(char));
-
-	if (buffer == NULL)
-	{
-		return NULL;
-	}
-
-	srand(time(NULL));
-
-	for (unsigned int i = 0; i < size; i++)
-	{
-		*(buffer + i) = ((unsigned int)rand() % 256);
-	}
-
-	return buffer;
-}
\ No newline at end of file
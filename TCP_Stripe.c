@@ -0,0 +1,442 @@
+#include "TCP_Stripe.h"
+#include "Run_Stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Work item of one striped connection
+typedef struct
+{
+    int sock;
+    int fd;
+    int streams;
+    const char *ip;
+    int port;
+    const TCPTuning *tuning;
+    const TCPInfoOptions *info;
+    TransferSource *source;
+    uint64_t total_size;
+    StripeStreamStats *stats;
+    int result;
+} StripeWorker;
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(value >> (24 - 8 * i));
+    }
+}
+
+static void put_u64(unsigned char *out, uint64_t value)
+{
+    put_u32(out, (uint32_t)(value >> 32));
+    put_u32(out + 4, (uint32_t)value);
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static uint64_t get_u64(const unsigned char *in)
+{
+    return ((uint64_t)get_u32(in) << 32) | get_u32(in + 4);
+}
+
+/**
+ * @brief Serializes a stripe header into STRIPE_HEADER_SIZE bytes in network byte order.
+ * @param header The header to encode.
+ * @param out The destination buffer, at least STRIPE_HEADER_SIZE bytes.
+ */
+void stripe_encode_header(const StripeHeader *header, unsigned char *out)
+{
+    put_u32(out, STRIPE_MAGIC);
+    put_u32(out + 4, header->stream_id);
+    put_u32(out + 8, header->stream_count);
+    put_u64(out + 12, header->offset);
+    put_u64(out + 20, header->length);
+    put_u64(out + 28, header->total_size);
+}
+
+/**
+ * @brief Parses and validates a stripe header.
+ * @param in The received STRIPE_HEADER_SIZE bytes.
+ * @param header The decoded header.
+ * @return 0 on success, -1 if the magic is wrong or the range does not fit in the file.
+ */
+int stripe_decode_header(const unsigned char *in, StripeHeader *header)
+{
+    if (get_u32(in) != STRIPE_MAGIC)
+    {
+        return -1;
+    }
+    header->stream_id = get_u32(in + 4);
+    header->stream_count = get_u32(in + 8);
+    header->offset = get_u64(in + 12);
+    header->length = get_u64(in + 20);
+    header->total_size = get_u64(in + 28);
+
+    if (header->stream_id >= header->stream_count || header->offset > header->total_size ||
+        header->length > header->total_size - header->offset)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Sends a range of the source, prefetched chunk by chunk so memory does not grow with the range.
+static int send_range(int sock, TransferSource *source, uint64_t offset, uint64_t length, int chunk_size)
+{
+    TransferReader reader;
+    const char *chunk;
+    size_t chunk_length;
+    int result = 0;
+
+    if (transfer_reader_start(&reader, source, offset, length, chunk_size) < 0)
+    {
+        return -1;
+    }
+    while (result == 0 && (chunk = transfer_reader_next(&reader, &chunk_length)) != NULL)
+    {
+        size_t sent = 0;
+        while (sent < chunk_length)
+        {
+            ssize_t bytes = send(sock, chunk + sent, chunk_length - sent, 0);
+            if (bytes < 0)
+            {
+                perror("send");
+                result = -1;
+                break;
+            }
+            sent += bytes;
+        }
+    }
+    return transfer_reader_stop(&reader) < 0 ? -1 : result;
+}
+
+// Sends one range: connect, header, data, then wait for the receiver's one byte confirmation.
+static void *stripe_send_worker(void *arg)
+{
+    StripeWorker *worker = (StripeWorker *)arg;
+    StripeStreamStats *stats = worker->stats;
+    unsigned char header_bytes[STRIPE_HEADER_SIZE];
+    struct sockaddr_in receiver;
+    StripeHeader header;
+    TCPInfoSampler sampler;
+    char label[32];
+    char ack = 0;
+
+    worker->result = -1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return NULL;
+    }
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.sin_family = AF_INET;
+    receiver.sin_port = htons(worker->port);
+    inet_pton(AF_INET, worker->ip, &receiver.sin_addr);
+
+    if (tcp_tuning_apply(sock, worker->tuning) < 0)
+    {
+        close(sock);
+        return NULL;
+    }
+    if (connect(sock, (struct sockaddr *)&receiver, sizeof(receiver)) < 0)
+    {
+        perror("connect");
+        close(sock);
+        return NULL;
+    }
+
+    header.stream_id = stats->stream_id;
+    header.stream_count = worker->streams;
+    header.offset = stats->offset;
+    header.length = stats->length;
+    header.total_size = worker->total_size;
+    stripe_encode_header(&header, header_bytes);
+
+    snprintf(label, sizeof(label), "sender_stream%d", stats->stream_id);
+    tcp_info_sampler_start(&sampler, worker->info, sock, label);
+
+    stats->start_ms = stats_ns_to_ms(stats_now_ns());
+    if (send(sock, header_bytes, sizeof(header_bytes), 0) != (ssize_t)sizeof(header_bytes) ||
+        tcp_tuning_begin_send(sock, worker->tuning) < 0 ||
+        send_range(sock, worker->source, stats->offset, stats->length, worker->tuning->chunk_size) < 0 ||
+        tcp_tuning_end_send(sock, worker->tuning) < 0 || recv(sock, &ack, 1, MSG_WAITALL) != 1)
+    {
+        fprintf(stderr, "Stream %d failed\n", stats->stream_id);
+        tcp_info_sampler_stop(&sampler, &stats->info);
+        close(sock);
+        return NULL;
+    }
+    stats->end_ms = stats_ns_to_ms(stats_now_ns());
+    stats->bytes = stats->length;
+    tcp_info_sampler_stop(&sampler, &stats->info);
+
+    close(sock);
+    worker->result = 0;
+    return NULL;
+}
+
+/**
+ * @brief Sends a run of a source over several parallel TCP connections, one contiguous range per connection.
+ *
+ * The run is split into `streams` ranges of equal size (the last one takes the remainder).
+ * Every connection starts with a StripeHeader so the receiver can place the range without
+ * any ordering between connections.
+ *
+ * @param ip The receiver's address.
+ * @param port The receiver's port.
+ * @param tuning Socket options applied to every connection.
+ * @param info TCP_INFO sampling settings, every connection gets its own time series.
+ * @param source The bytes to send, every connection reads its own range.
+ * @param streams The number of parallel connections (1..STRIPE_MAX_STREAMS).
+ * @param stats Array of `streams` entries filled with the per connection results.
+ * @return 0 on success, -1 if any connection failed.
+ */
+int stripe_send(const char *ip, int port, const TCPTuning *tuning, const TCPInfoOptions *info, TransferSource *source,
+                int streams, StripeStreamStats *stats)
+{
+    uint64_t size = source->size;
+    StripeWorker workers[STRIPE_MAX_STREAMS];
+    pthread_t threads[STRIPE_MAX_STREAMS];
+    uint64_t range = size / streams;
+    int result = 0;
+
+    for (int i = 0; i < streams; i++)
+    {
+        memset(&stats[i], 0, sizeof(stats[i]));
+        stats[i].stream_id = i;
+        stats[i].offset = range * i;
+        stats[i].length = (i == streams - 1) ? size - range * i : range;
+
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].streams = streams;
+        workers[i].ip = ip;
+        workers[i].port = port;
+        workers[i].tuning = tuning;
+        workers[i].info = info;
+        workers[i].source = source;
+        workers[i].total_size = size;
+        workers[i].stats = &stats[i];
+        if (pthread_create(&threads[i], NULL, stripe_send_worker, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            streams = i;
+            result = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < streams; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (workers[i].result < 0)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Receives one range and writes it at its offset in the output file.
+static void *stripe_recv_worker(void *arg)
+{
+    StripeWorker *worker = (StripeWorker *)arg;
+    StripeStreamStats *stats = worker->stats;
+    unsigned char header_bytes[STRIPE_HEADER_SIZE];
+    StripeHeader header;
+    TCPInfoSampler sampler;
+    char label[32];
+    char ack = 1;
+
+    worker->result = -1;
+    char *buffer = malloc(worker->tuning->chunk_size);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        close(worker->sock);
+        return NULL;
+    }
+
+    if (recv(worker->sock, header_bytes, sizeof(header_bytes), MSG_WAITALL) != (ssize_t)sizeof(header_bytes) ||
+        stripe_decode_header(header_bytes, &header) < 0 || header.stream_count != (uint32_t)worker->streams)
+    {
+        fprintf(stderr, "Invalid stripe header\n");
+        free(buffer);
+        close(worker->sock);
+        return NULL;
+    }
+
+    snprintf(label, sizeof(label), "receiver_stream%u", header.stream_id);
+    tcp_info_sampler_start(&sampler, worker->info, worker->sock, label);
+
+    stats->start_ms = stats_ns_to_ms(stats_now_ns());
+    stats->stream_id = header.stream_id;
+    stats->offset = header.offset;
+    stats->length = header.length;
+
+    // Every stream knows the final size, extending the file to it is idempotent
+    if (ftruncate(worker->fd, header.total_size) < 0)
+    {
+        perror("ftruncate");
+    }
+
+    while (stats->bytes < header.length)
+    {
+        uint64_t remaining = header.length - stats->bytes;
+        size_t bytes_to_read = remaining < (uint64_t)worker->tuning->chunk_size ? (size_t)remaining
+                                                                                 : (size_t)worker->tuning->chunk_size;
+        ssize_t bytes_received = recv(worker->sock, buffer, bytes_to_read, 0);
+        tcp_tuning_after_recv(worker->sock, worker->tuning);
+        if (bytes_received <= 0)
+        {
+            fprintf(stderr, "Stream %u disconnected after %llu bytes\n", header.stream_id, (unsigned long long)stats->bytes);
+            tcp_info_sampler_stop(&sampler, &stats->info);
+            free(buffer);
+            close(worker->sock);
+            return NULL;
+        }
+        if (pwrite(worker->fd, buffer, bytes_received, header.offset + stats->bytes) != bytes_received)
+        {
+            perror("pwrite");
+            tcp_info_sampler_stop(&sampler, &stats->info);
+            free(buffer);
+            close(worker->sock);
+            return NULL;
+        }
+        stats->bytes += bytes_received;
+    }
+    stats->end_ms = stats_ns_to_ms(stats_now_ns());
+    tcp_info_sampler_stop(&sampler, &stats->info);
+
+    send(worker->sock, &ack, 1, 0);
+    free(buffer);
+    close(worker->sock);
+    worker->result = 0;
+    return NULL;
+}
+
+/**
+ * @brief Accepts `streams` striped connections and reassembles them into a file.
+ *
+ * Each connection is served by its own thread which writes its range with pwrite(),
+ * so ranges complete in any order.
+ *
+ * @param listen_sock A listening TCP socket.
+ * @param tuning Options whose chunk size and quick ACK setting are used while receiving.
+ * @param info TCP_INFO sampling settings, every connection gets its own time series.
+ * @param streams The number of connections to expect.
+ * @param path The output file.
+ * @param stats Array of `streams` entries filled with the per connection results, indexed by stream id.
+ * @return 0 on success, -1 if any connection failed.
+ */
+int stripe_recv(int listen_sock, const TCPTuning *tuning, const TCPInfoOptions *info, int streams, const char *path,
+                StripeStreamStats *stats)
+{
+    StripeWorker workers[STRIPE_MAX_STREAMS];
+    StripeStreamStats received[STRIPE_MAX_STREAMS];
+    pthread_t threads[STRIPE_MAX_STREAMS];
+    int result = 0;
+    int started = 0;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("open");
+        return -1;
+    }
+
+    for (started = 0; started < streams; started++)
+    {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0)
+        {
+            perror("accept");
+            result = -1;
+            break;
+        }
+
+        memset(&received[started], 0, sizeof(received[started]));
+        memset(&workers[started], 0, sizeof(workers[started]));
+        workers[started].sock = sock;
+        workers[started].fd = fd;
+        workers[started].streams = streams;
+        workers[started].tuning = tuning;
+        workers[started].info = info;
+        workers[started].stats = &received[started];
+        if (pthread_create(&threads[started], NULL, stripe_recv_worker, &workers[started]) != 0)
+        {
+            perror("pthread_create");
+            close(sock);
+            result = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (workers[i].result < 0)
+        {
+            result = -1;
+            continue;
+        }
+        stats[received[i].stream_id] = received[i];
+    }
+
+    close(fd);
+    return result;
+}
+
+/**
+ * @brief Prints per stream and aggregate throughput of a striped transfer.
+ *
+ * The aggregate time runs from the first stream's start to the last stream's end.
+ *
+ * @param stats The per stream results.
+ * @param streams The number of streams.
+ * @param out The stream to print to.
+ */
+void stripe_print_stats(const StripeStreamStats *stats, int streams, FILE *out)
+{
+    double first_start = 0.0, last_end = 0.0;
+    uint64_t total_bytes = 0;
+
+    fprintf(out, "----------------------------------\n");
+    fprintf(out, "- * Striped transfer statistics * -\n");
+    for (int i = 0; i < streams; i++)
+    {
+        double time_ms = stats[i].end_ms - stats[i].start_ms;
+        double speed = stats_speed_mb(stats[i].bytes, (uint64_t)(time_ms * 1000000.0));
+        fprintf(out, "- Stream #%d: Offset=%llu; Bytes=%llu; Time=%.2fms; Speed=%.2fMB/s\n", stats[i].stream_id,
+                (unsigned long long)stats[i].offset, (unsigned long long)stats[i].bytes, time_ms, speed);
+        tcp_info_print_summary(&stats[i].info, out);
+
+        if (i == 0 || stats[i].start_ms < first_start)
+        {
+            first_start = stats[i].start_ms;
+        }
+        if (stats[i].end_ms > last_end)
+        {
+            last_end = stats[i].end_ms;
+        }
+        total_bytes += stats[i].bytes;
+    }
+
+    double total_ms = last_end - first_start;
+    fprintf(out, "- Aggregate: Streams=%d; Bytes=%llu; Time=%.2fms; Speed=%.2fMB/s\n", streams,
+            (unsigned long long)total_bytes, total_ms,
+            stats_speed_mb(total_bytes, (uint64_t)(total_ms * 1000000.0)));
+    fprintf(out, "----------------------------------\n");
+}
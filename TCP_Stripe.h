@@ -0,0 +1,44 @@
+#ifndef TCP_STRIPE_H
+#define TCP_STRIPE_H
+#include <stdint.h>
+#include <stdio.h>
+#include "TCP_Tuning.h"
+#include "TCP_Info.h"
+#include "Transfer.h"
+
+#define STRIPE_MAGIC 0x53545250 // "STRP"
+#define STRIPE_HEADER_SIZE 36
+#define STRIPE_MAX_STREAMS 64
+
+// Header sent at the start of every striped connection, describes the byte range it carries
+typedef struct
+{
+    uint32_t stream_id;
+    uint32_t stream_count;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t total_size;
+} StripeHeader;
+
+// Per connection results of a striped transfer
+typedef struct
+{
+    int stream_id;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t bytes;
+    double start_ms;
+    double end_ms;
+    TCPInfoSummary info;
+} StripeStreamStats;
+
+// Function declarations
+void stripe_encode_header(const StripeHeader *header, unsigned char *out);
+int stripe_decode_header(const unsigned char *in, StripeHeader *header);
+int stripe_send(const char *ip, int port, const TCPTuning *tuning, const TCPInfoOptions *info, TransferSource *source,
+                int streams, StripeStreamStats *stats);
+int stripe_recv(int listen_sock, const TCPTuning *tuning, const TCPInfoOptions *info, int streams, const char *path,
+                StripeStreamStats *stats);
+void stripe_print_stats(const StripeStreamStats *stats, int streams, FILE *out);
+
+#endif
@@ -0,0 +1,332 @@
+#include "TCP_Tuning.h"
+#include "Transfer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**
+ * @brief Resets a tuning structure to the kernel defaults.
+ *
+ * Only the congestion control algorithm and the application chunk size get a value,
+ * every socket option is left untouched by tcp_tuning_apply().
+ *
+ * @param tuning The structure to reset.
+ */
+void tcp_tuning_defaults(TCPTuning *tuning)
+{
+    memset(tuning, 0, sizeof(*tuning));
+    tuning->algo = TCP_TUNING_DEFAULT_ALGO;
+    tuning->chunk_size = TCP_TUNING_DEFAULT_CHUNK;
+}
+
+/**
+ * @brief Loads a named tuning profile on top of the current settings.
+ *
+ * Known profiles:
+ *  - "default":    kernel defaults.
+ *  - "throughput": large socket buffers, corked sends and 256KB chunks.
+ *  - "latency":    TCP_NODELAY, quick ACKs, a small unsent-bytes watermark and 16KB chunks.
+ *  - "bdp:<Mbit/s>:<rtt ms>": socket buffers sized to twice the bandwidth-delay product.
+ *
+ * @param tuning The structure to update.
+ * @param name The profile name.
+ * @return 0 on success, -1 if the profile is unknown or malformed.
+ */
+int tcp_tuning_load_profile(TCPTuning *tuning, const char *name)
+{
+    const char *algo = tuning->algo;
+
+    if (strcmp(name, "default") == 0)
+    {
+        tcp_tuning_defaults(tuning);
+    }
+    else if (strcmp(name, "throughput") == 0)
+    {
+        tcp_tuning_defaults(tuning);
+        tuning->sndbuf = 4 * 1024 * 1024;
+        tuning->rcvbuf = 4 * 1024 * 1024;
+        tuning->cork = 1;
+        tuning->chunk_size = 256 * 1024;
+    }
+    else if (strcmp(name, "latency") == 0)
+    {
+        tcp_tuning_defaults(tuning);
+        tuning->nodelay = 1;
+        tuning->quickack = 1;
+        tuning->notsent_lowat = 16 * 1024;
+        tuning->chunk_size = 16 * 1024;
+    }
+    else if (strncmp(name, "bdp:", 4) == 0)
+    {
+        double mbit = 0.0, rtt_ms = 0.0;
+        if (sscanf(name + 4, "%lf:%lf", &mbit, &rtt_ms) != 2 || mbit <= 0 || rtt_ms <= 0)
+        {
+            return -1;
+        }
+
+        // bytes in flight = rate * rtt, doubled because the kernel keeps half of the buffer for bookkeeping
+        double bdp = mbit * 1000.0 * 1000.0 / 8.0 * (rtt_ms / 1000.0);
+        double buffer = 2.0 * bdp;
+        if (buffer > 1024.0 * 1024 * 1024)
+        {
+            buffer = 1024.0 * 1024 * 1024;
+        }
+
+        tcp_tuning_defaults(tuning);
+        tuning->sndbuf = (int)buffer;
+        tuning->rcvbuf = (int)buffer;
+        tuning->chunk_size = 256 * 1024;
+    }
+    else
+    {
+        return -1;
+    }
+
+    tuning->algo = algo;
+    return 0;
+}
+
+/**
+ * @brief Consumes one tuning flag (and its value) from the command line.
+ *
+ * @param tuning The structure to update.
+ * @param argc The number of command line arguments.
+ * @param argv The array of command line arguments.
+ * @param index The index of the flag, advanced past its value when one is consumed.
+ * @return 1 if the flag was consumed, 0 if it is not a tuning flag, -1 on a bad value.
+ */
+int tcp_tuning_parse_arg(TCPTuning *tuning, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+    const char *value = (*index + 1 < argc) ? argv[*index + 1] : NULL;
+    long long size = 0;
+
+    // Flags without a value
+    if (strcmp(flag, "-nodelay") == 0)
+    {
+        tuning->nodelay = 1;
+        return 1;
+    }
+    if (strcmp(flag, "-cork") == 0)
+    {
+        tuning->cork = 1;
+        return 1;
+    }
+    if (strcmp(flag, "-quickack") == 0)
+    {
+        tuning->quickack = 1;
+        return 1;
+    }
+
+    if (strcmp(flag, "-algo") != 0 && strcmp(flag, "-profile") != 0 && strcmp(flag, "-sndbuf") != 0 &&
+        strcmp(flag, "-rcvbuf") != 0 && strcmp(flag, "-lowat") != 0 && strcmp(flag, "-chunk") != 0)
+    {
+        return 0;
+    }
+
+    if (value == NULL)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    (*index)++;
+
+    if (strcmp(flag, "-algo") == 0)
+    {
+        tuning->algo = value;
+        return 1;
+    }
+    if (strcmp(flag, "-profile") == 0)
+    {
+        if (tcp_tuning_load_profile(tuning, value) < 0)
+        {
+            fprintf(stderr, "Unknown tuning profile: %s\n", value);
+            return -1;
+        }
+        return 1;
+    }
+
+    size = transfer_parse_size(value);
+    if (size < 0 || size > 1024LL * 1024 * 1024)
+    {
+        fprintf(stderr, "Invalid size for %s: %s\n", flag, value);
+        return -1;
+    }
+
+    if (strcmp(flag, "-sndbuf") == 0)
+    {
+        tuning->sndbuf = (int)size;
+    }
+    else if (strcmp(flag, "-rcvbuf") == 0)
+    {
+        tuning->rcvbuf = (int)size;
+    }
+    else if (strcmp(flag, "-lowat") == 0)
+    {
+        tuning->notsent_lowat = (int)size;
+    }
+    else
+    {
+        if (size == 0 || size > TCP_TUNING_MAX_CHUNK)
+        {
+            fprintf(stderr, "Chunk size must be between 1 and %d bytes\n", TCP_TUNING_MAX_CHUNK);
+            return -1;
+        }
+        tuning->chunk_size = (int)size;
+    }
+    return 1;
+}
+
+/**
+ * @brief Applies the tuning to a socket.
+ *
+ * Call it before connect() or listen() so the buffer sizes are taken into account
+ * when the window scale is negotiated. Accepted sockets inherit the options of the
+ * listening socket.
+ *
+ * @param sock The TCP socket.
+ * @param tuning The options to apply.
+ * @return 0 on success, -1 if any option was rejected by the kernel.
+ */
+int tcp_tuning_apply(int sock, const TCPTuning *tuning)
+{
+    int on = 1;
+
+    if (tuning->algo != NULL && setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, tuning->algo, strlen(tuning->algo)) < 0)
+    {
+        perror("setsockopt(TCP_CONGESTION)");
+        return -1;
+    }
+    if (tuning->sndbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &tuning->sndbuf, sizeof(tuning->sndbuf)) < 0)
+    {
+        perror("setsockopt(SO_SNDBUF)");
+        return -1;
+    }
+    if (tuning->rcvbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &tuning->rcvbuf, sizeof(tuning->rcvbuf)) < 0)
+    {
+        perror("setsockopt(SO_RCVBUF)");
+        return -1;
+    }
+    if (tuning->nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    {
+        perror("setsockopt(TCP_NODELAY)");
+        return -1;
+    }
+    if (tuning->notsent_lowat > 0 &&
+        setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tuning->notsent_lowat, sizeof(tuning->notsent_lowat)) < 0)
+    {
+        perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        return -1;
+    }
+    if (tuning->quickack && setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) < 0)
+    {
+        perror("setsockopt(TCP_QUICKACK)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Corks the socket before a file is sent, if the tuning asks for it.
+ *
+ * @param sock The TCP socket.
+ * @param tuning The active tuning.
+ * @return 0 on success, -1 on error.
+ */
+int tcp_tuning_begin_send(int sock, const TCPTuning *tuning)
+{
+    int on = 1;
+    if (tuning->cork && setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0)
+    {
+        perror("setsockopt(TCP_CORK)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Uncorks the socket after a file was sent so the last partial segment leaves immediately.
+ *
+ * @param sock The TCP socket.
+ * @param tuning The active tuning.
+ * @return 0 on success, -1 on error.
+ */
+int tcp_tuning_end_send(int sock, const TCPTuning *tuning)
+{
+    int off = 0;
+    if (tuning->cork && setsockopt(sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) < 0)
+    {
+        perror("setsockopt(TCP_CORK)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adjusts a tuning for small requests and responses: no Nagle delay, no delayed ACKs, never corked.
+ * @param tuning The tuning to adjust, the other options are kept.
+ */
+void tcp_tuning_request_response(TCPTuning *tuning)
+{
+    tuning->nodelay = 1;
+    tuning->quickack = 1;
+    tuning->cork = 0;
+}
+
+// The kernel clears TCP_QUICKACK on its own, so it has to be re-armed after every read.
+void tcp_tuning_after_recv(int sock, const TCPTuning *tuning)
+{
+    int on = 1;
+    if (tuning->quickack)
+    {
+        setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+}
+
+/**
+ * @brief Prints the requested tuning next to the values the kernel actually uses.
+ *
+ * @param sock The TCP socket to query, or -1 to print only the requested values.
+ * @param tuning The active tuning.
+ * @param out The stream to print to.
+ */
+void tcp_tuning_print(int sock, const TCPTuning *tuning, FILE *out)
+{
+    int sndbuf = 0, rcvbuf = 0;
+    char algo[16] = {0};
+    socklen_t len = 0;
+
+    fprintf(out, "TCP tuning: algo=%s sndbuf=%d rcvbuf=%d nodelay=%d cork=%d lowat=%d quickack=%d chunk=%d\n",
+            tuning->algo != NULL ? tuning->algo : "(default)", tuning->sndbuf, tuning->rcvbuf, tuning->nodelay,
+            tuning->cork, tuning->notsent_lowat, tuning->quickack, tuning->chunk_size);
+    if (sock < 0)
+    {
+        return;
+    }
+
+    len = sizeof(sndbuf);
+    getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    len = sizeof(rcvbuf);
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    len = sizeof(algo) - 1;
+    getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, algo, &len);
+    fprintf(out, "Kernel values: algo=%s sndbuf=%d rcvbuf=%d\n", algo, sndbuf, rcvbuf);
+}
+
+// Prints the tuning flags shared by the sender and the receiver.
+void tcp_tuning_usage(FILE *out)
+{
+    fprintf(out, "Tuning options:\n");
+    fprintf(out, "  -algo <reno|cubic|...>   congestion control algorithm\n");
+    fprintf(out, "  -profile <name>          default, throughput, latency or bdp:<Mbit/s>:<rtt ms>\n");
+    fprintf(out, "  -sndbuf <size>           SO_SNDBUF (accepts K/M/G suffixes)\n");
+    fprintf(out, "  -rcvbuf <size>           SO_RCVBUF\n");
+    fprintf(out, "  -nodelay                 TCP_NODELAY\n");
+    fprintf(out, "  -cork                    TCP_CORK while sending a file\n");
+    fprintf(out, "  -lowat <size>            TCP_NOTSENT_LOWAT\n");
+    fprintf(out, "  -quickack                TCP_QUICKACK after every recv\n");
+    fprintf(out, "  -chunk <size>            bytes per send/recv call (max %d)\n", TCP_TUNING_MAX_CHUNK);
+}
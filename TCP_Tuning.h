@@ -0,0 +1,34 @@
+#ifndef TCP_TUNING_H
+#define TCP_TUNING_H
+#include <stdio.h>
+
+#define TCP_TUNING_DEFAULT_ALGO "reno"
+#define TCP_TUNING_DEFAULT_CHUNK (64 * 1024)
+#define TCP_TUNING_MAX_CHUNK (2 * 1024 * 1024)
+
+// Socket options applied to a TCP socket, 0 (or NULL) means "leave the kernel default"
+typedef struct
+{
+    const char *algo;  // congestion control algorithm (TCP_CONGESTION)
+    int sndbuf;        // SO_SNDBUF in bytes
+    int rcvbuf;        // SO_RCVBUF in bytes
+    int nodelay;       // TCP_NODELAY
+    int cork;          // TCP_CORK while a file is being sent
+    int notsent_lowat; // TCP_NOTSENT_LOWAT in bytes
+    int quickack;      // TCP_QUICKACK, re-armed after every recv()
+    int chunk_size;    // bytes handed to a single send()/recv() call
+} TCPTuning;
+
+// Function declarations
+void tcp_tuning_defaults(TCPTuning *tuning);
+int tcp_tuning_load_profile(TCPTuning *tuning, const char *name);
+int tcp_tuning_parse_arg(TCPTuning *tuning, int argc, char *argv[], int *index);
+int tcp_tuning_apply(int sock, const TCPTuning *tuning);
+int tcp_tuning_begin_send(int sock, const TCPTuning *tuning);
+int tcp_tuning_end_send(int sock, const TCPTuning *tuning);
+void tcp_tuning_request_response(TCPTuning *tuning);
+void tcp_tuning_after_recv(int sock, const TCPTuning *tuning);
+void tcp_tuning_print(int sock, const TCPTuning *tuning, FILE *out);
+void tcp_tuning_usage(FILE *out);
+
+#endif
@@ -0,0 +1,171 @@
+#include "Timestamp.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+// Kernel timestamps are taken on CLOCK_REALTIME, user space times compared with them must be too
+uint64_t timestamp_wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+/**
+ * @brief Asks the kernel to timestamp what the socket receives and, depending on `tx`, sends.
+ *
+ * RX timestamps come with every recvmsg() that passes a control buffer (SO_TIMESTAMPNS), TX
+ * timestamps are queued on the socket's error queue (SO_TIMESTAMPING) and read with
+ * timestamp_tx(). Both are software timestamps: taken when the packet passes the device
+ * layer, so they leave out how long the application took to get to it. Queued TX timestamps
+ * count against the receive buffer and must be read.
+ *
+ * @return 0 on success, -1 on an error.
+ */
+int timestamp_enable(int sockfd, TimestampTx tx)
+{
+    int on = 1;
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    {
+        perror("setsockopt(SO_TIMESTAMPNS)");
+        return -1;
+    }
+    if (tx == TIMESTAMP_TX_ALL)
+    {
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE;
+    }
+    if (tx != TIMESTAMP_TX_NONE && setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        perror("setsockopt(SO_TIMESTAMPING)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief The kernel's RX timestamp of a datagram read with recvmsg() into a control buffer of
+ * TIMESTAMP_CONTROL_SIZE bytes, 0 if it carries none.
+ */
+uint64_t timestamp_rx(const struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR((struct msghdr *)msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return timespec_ns(&ts);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief sendto() that asks for a TX timestamp of this one datagram, on a socket enabled with
+ * TIMESTAMP_TX_ASKED. The timestamps of a socket are keyed 0, 1, 2... in the order the
+ * datagrams were sent.
+ */
+ssize_t timestamp_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr,
+                         socklen_t addrlen)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr msg;
+    int tsflags = SOF_TIMESTAMPING_TX_SOFTWARE;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_name = (void *)dest_addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SO_TIMESTAMPING;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &tsflags, sizeof(tsflags));
+    return sendmsg(sockfd, &msg, flags);
+}
+
+/**
+ * @brief Takes the TX timestamp with `key` off the socket's error queue, without waiting.
+ *
+ * Older timestamps are dropped on the way, they were not asked for any more. TIMESTAMP_ANY_KEY
+ * takes the oldest one queued.
+ *
+ * @return 0 with *tx_ns set, -1 if the timestamp is not (or no longer) queued.
+ */
+int timestamp_tx(int sockfd, uint32_t key, uint64_t *tx_ns)
+{
+    while (1)
+    {
+        union
+        {
+            char buffer[TIMESTAMP_CONTROL_SIZE];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        uint64_t stamp = 0;
+        int have_key = 0;
+        uint32_t found = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+            {
+                struct scm_timestamping stamps;
+                memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                stamp = timespec_ns(&stamps.ts[0]);
+            }
+            else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                     (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                struct sock_extended_err error;
+                memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+                if (error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                {
+                    found = error.ee_data;
+                    have_key = 1;
+                }
+            }
+        }
+        if (stamp == 0 || !have_key)
+        {
+            continue;
+        }
+        if (key == TIMESTAMP_ANY_KEY || found == key)
+        {
+            *tx_ns = stamp;
+            return 0;
+        }
+        if ((int32_t)(found - key) > 0)
+        {
+            // Already past the one asked for, it was never timestamped
+            return -1;
+        }
+    }
+}
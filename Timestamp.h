@@ -0,0 +1,28 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Control buffer of a read that carries the kernel's RX timestamp
+#define TIMESTAMP_CONTROL_SIZE 256
+// timestamp_tx() key that takes the oldest TX timestamp queued, whatever its key
+#define TIMESTAMP_ANY_KEY UINT32_MAX
+
+// Which transmissions of a socket get a kernel TX timestamp
+typedef enum
+{
+    TIMESTAMP_TX_NONE,    // none, only received datagrams are timestamped
+    TIMESTAMP_TX_ASKED,   // the datagrams sent with timestamp_sendto()
+    TIMESTAMP_TX_ALL      // every send (TCP: the last byte of every send() call)
+} TimestampTx;
+
+// Function declarations
+int timestamp_enable(int sockfd, TimestampTx tx);
+uint64_t timestamp_wall_ns(void);
+uint64_t timestamp_rx(const struct msghdr *msg);
+ssize_t timestamp_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr,
+                         socklen_t addrlen);
+int timestamp_tx(int sockfd, uint32_t key, uint64_t *tx_ns);
+
+#endif
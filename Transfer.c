@@ -0,0 +1,448 @@
+#include "Transfer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Parses a size such as "65536", "64K", "4M", "1G" or "2T" into bytes.
+ *
+ * @param text The text to parse.
+ * @return The size in bytes, or -1 if the text is not a valid size.
+ */
+long long transfer_parse_size(const char *text)
+{
+    char *end = NULL;
+    long long multiplier = 1;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+    case '\0':
+        return value;
+    case 'k':
+    case 'K':
+        multiplier = 1024LL;
+        break;
+    case 'm':
+    case 'M':
+        multiplier = 1024LL * 1024;
+        break;
+    case 'g':
+    case 'G':
+        multiplier = 1024LL * 1024 * 1024;
+        break;
+    case 't':
+    case 'T':
+        multiplier = 1024LL * 1024 * 1024 * 1024;
+        break;
+    default:
+        return -1;
+    }
+    if (end[1] != '\0' || value > INT64_MAX / multiplier)
+    {
+        return -1;
+    }
+    return value * multiplier;
+}
+
+void transfer_options_defaults(TransferOptions *options)
+{
+    options->size = 0;
+    options->path = NULL;
+    payload_options_defaults(&options->payload);
+}
+
+/**
+ * @brief Parses one transfer option: -size <bytes>, -file <path> or a payload option.
+ * @return 1 if the flag was consumed (with its value), 0 if it is not a transfer flag, -1 on error.
+ */
+int transfer_parse_arg(TransferOptions *options, int argc, char *argv[], int *index)
+{
+    const char *flag = argv[*index];
+
+    if (strcmp(flag, "-size") != 0 && strcmp(flag, "-file") != 0)
+    {
+        return payload_parse_arg(&options->payload, argc, argv, index);
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Missing value for %s\n", flag);
+        return -1;
+    }
+    (*index)++;
+
+    if (strcmp(flag, "-file") == 0)
+    {
+        options->path = argv[*index];
+        return 1;
+    }
+    long long size = transfer_parse_size(argv[*index]);
+    if (size <= 0)
+    {
+        fprintf(stderr, "Invalid transfer size: %s\n", argv[*index]);
+        return -1;
+    }
+    options->size = (uint64_t)size;
+    return 1;
+}
+
+void transfer_usage(FILE *out)
+{
+    fprintf(out, "Transfer options:\n");
+    fprintf(out, "  -size <bytes>            bytes per run, with an optional K/M/G/T suffix (default 2M)\n");
+    fprintf(out, "  -file <path>             send a file instead of generated data (default size: the whole file)\n");
+    payload_usage(out);
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(value >> (24 - 8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static const uint32_t mode_magics[] = {TRANSFER_MAGIC, TRANSFER_MAGIC_FRAMED, TRANSFER_MAGIC_MANIFEST, TRANSFER_MAGIC_LATENCY,
+                                       TRANSFER_MAGIC_SHARED};
+
+/**
+ * @brief Serializes the run header announcing the transfer length, TRANSFER_HEADER_SIZE bytes in network byte order.
+ * @param mode How the run is sent, `size` always counts the bytes of the file.
+ */
+void transfer_encode_header(uint64_t size, TransferMode mode, unsigned char *out)
+{
+    put_u32(out, mode_magics[mode]);
+    put_u32(out + 4, (uint32_t)(size >> 32));
+    put_u32(out + 8, (uint32_t)size);
+}
+
+/**
+ * @brief Parses a run header.
+ * @return 0 on success, -1 if the message is not a run header.
+ */
+int transfer_decode_header(const unsigned char *in, size_t length, uint64_t *size, TransferMode *mode)
+{
+    if (length < TRANSFER_HEADER_SIZE)
+    {
+        return -1;
+    }
+    for (int i = 0; i < (int)(sizeof(mode_magics) / sizeof(mode_magics[0])); i++)
+    {
+        if (get_u32(in) == mode_magics[i])
+        {
+            *mode = (TransferMode)i;
+            *size = ((uint64_t)get_u32(in + 4) << 32) | get_u32(in + 8);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Opens the input of a sender.
+ *
+ * A file input sends the whole file unless -size asks for a shorter prefix. Generated
+ * input sends -size bytes, TRANSFER_DEFAULT_SIZE by default.
+ *
+ * @return 0 on success, -1 if the file cannot be used.
+ */
+int transfer_source_open(TransferSource *source, const TransferOptions *options)
+{
+    struct stat st;
+
+    source->fd = -1;
+    source->payload = options->payload;
+    source->size = options->size > 0 ? options->size : TRANSFER_DEFAULT_SIZE;
+    if (options->path == NULL)
+    {
+        return 0;
+    }
+
+    source->fd = open(options->path, O_RDONLY);
+    if (source->fd < 0 || fstat(source->fd, &st) < 0)
+    {
+        perror(options->path);
+        transfer_source_close(source);
+        return -1;
+    }
+    if (options->size == 0)
+    {
+        source->size = (uint64_t)st.st_size;
+    }
+    else if (options->size > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "%s holds only %lld bytes\n", options->path, (long long)st.st_size);
+        transfer_source_close(source);
+        return -1;
+    }
+    posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+/**
+ * @brief Reads bytes [offset, offset + length) of the run, the range must lie inside the run.
+ * @return 0 on success, -1 on a read error.
+ */
+int transfer_source_read(TransferSource *source, uint64_t offset, char *buffer, size_t length)
+{
+    if (source->fd < 0)
+    {
+        payload_fill(&source->payload, offset, buffer, length);
+        return 0;
+    }
+
+    while (length > 0)
+    {
+        ssize_t bytes = pread(source->fd, buffer, length, (off_t)offset);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            perror("pread");
+            return -1;
+        }
+        buffer += bytes;
+        offset += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+void transfer_source_close(TransferSource *source)
+{
+    if (source->fd >= 0)
+    {
+        close(source->fd);
+    }
+    source->fd = -1;
+}
+
+// Producer: fills free slots in order until the run is complete or the reader is stopped.
+static void *transfer_reader_thread(void *arg)
+{
+    TransferReader *reader = (TransferReader *)arg;
+
+    for (uint64_t chunk = 0; chunk < reader->chunks; chunk++)
+    {
+        pthread_mutex_lock(&reader->lock);
+        while (chunk - reader->consumed == TRANSFER_RING_SLOTS && !reader->stop)
+        {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        int stop = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        int slot = (int)(chunk % TRANSFER_RING_SLOTS);
+        uint64_t done = chunk * reader->chunk_size;
+        size_t length = reader->length - done < reader->chunk_size ? (size_t)(reader->length - done) : reader->chunk_size;
+        int result = transfer_source_read(reader->source, reader->offset + done, reader->slots[slot], length);
+
+        pthread_mutex_lock(&reader->lock);
+        reader->lengths[slot] = length;
+        if (result < 0)
+        {
+            reader->error = 1;
+        }
+        else
+        {
+            reader->produced++;
+        }
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        if (result < 0)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts prefetching bytes [offset, offset + length) of a source in chunks of `chunk_size` bytes.
+ *
+ * Memory stays at TRANSFER_RING_SLOTS chunk buffers whatever the size of the range.
+ *
+ * @return 0 on success, -1 if the buffers or the thread could not be created.
+ */
+int transfer_reader_start(TransferReader *reader, TransferSource *source, uint64_t offset, uint64_t length,
+                          size_t chunk_size)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->source = source;
+    reader->offset = offset;
+    reader->length = length;
+    reader->chunk_size = chunk_size;
+    reader->chunks = (length + chunk_size - 1) / chunk_size;
+    for (int i = 0; i < TRANSFER_RING_SLOTS; i++)
+    {
+        reader->slots[i] = (char *)malloc(chunk_size);
+        if (reader->slots[i] == NULL)
+        {
+            perror("malloc");
+            for (int j = 0; j < i; j++)
+            {
+                free(reader->slots[j]);
+            }
+            return -1;
+        }
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    if (pthread_create(&reader->thread, NULL, transfer_reader_thread, reader) != 0)
+    {
+        perror("pthread_create");
+        reader->thread = pthread_self();
+        transfer_reader_stop(reader);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Hands out the next chunk of the run, giving the previous one back to the producer.
+ * @param length The length of the chunk.
+ * @return The chunk, valid until the next call, or NULL at the end of the range or after a read error.
+ */
+const char *transfer_reader_next(TransferReader *reader, size_t *length)
+{
+    const char *chunk = NULL;
+
+    pthread_mutex_lock(&reader->lock);
+    if (reader->holding)
+    {
+        reader->consumed++;
+        reader->holding = 0;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    while (reader->consumed == reader->produced && reader->consumed < reader->chunks && !reader->error)
+    {
+        pthread_cond_wait(&reader->changed, &reader->lock);
+    }
+    if (reader->consumed < reader->produced)
+    {
+        int slot = (int)(reader->consumed % TRANSFER_RING_SLOTS);
+        chunk = reader->slots[slot];
+        *length = reader->lengths[slot];
+        reader->holding = 1;
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return chunk;
+}
+
+/**
+ * @brief Stops the producer and frees the ring.
+ * @return 0 if no read failed, -1 after a read error.
+ */
+int transfer_reader_stop(TransferReader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    if (!pthread_equal(reader->thread, pthread_self()))
+    {
+        pthread_join(reader->thread, NULL);
+    }
+
+    for (int i = 0; i < TRANSFER_RING_SLOTS; i++)
+    {
+        free(reader->slots[i]);
+        reader->slots[i] = NULL;
+    }
+    pthread_cond_destroy(&reader->changed);
+    pthread_mutex_destroy(&reader->lock);
+    return reader->error ? -1 : 0;
+}
+
+/**
+ * @brief Opens the output of a receiver, e.g. a file or /dev/null.
+ *
+ * The bytes already there are kept until a run starts: a manifest run may find most of its
+ * chunks in them, a plain run truncates the output.
+ *
+ * @return 0 on success, -1 if the path cannot be opened.
+ */
+int transfer_sink_open(TransferSink *sink, const char *path)
+{
+    sink->offset = 0;
+    sink->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (sink->fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Starts a new run, every run overwrites the output from its beginning.
+void transfer_sink_begin(TransferSink *sink)
+{
+    sink->offset = 0;
+    // Character devices such as /dev/null cannot be truncated, and need not be
+    if (ftruncate(sink->fd, 0) < 0 && errno != EINVAL)
+    {
+        perror("ftruncate");
+    }
+}
+
+// Starts a run that keeps the bytes already in the output, which is cut or extended to `size` bytes.
+void transfer_sink_resize(TransferSink *sink, uint64_t size)
+{
+    sink->offset = 0;
+    if (ftruncate(sink->fd, (off_t)size) < 0 && errno != EINVAL)
+    {
+        perror("ftruncate");
+    }
+}
+
+/**
+ * @brief Appends bytes to the current run.
+ * @return 0 on success, -1 on a write error.
+ */
+int transfer_sink_write(TransferSink *sink, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t bytes = pwrite(sink->fd, buffer, length, (off_t)sink->offset);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes < 0)
+        {
+            perror("pwrite");
+            return -1;
+        }
+        buffer += bytes;
+        sink->offset += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+void transfer_sink_close(TransferSink *sink)
+{
+    if (sink->fd >= 0)
+    {
+        close(sink->fd);
+    }
+    sink->fd = -1;
+}
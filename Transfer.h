@@ -0,0 +1,92 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "Payload.h"
+
+#define TRANSFER_DEFAULT_SIZE (2 * 1024 * 1024)
+#define TRANSFER_MAGIC 0x53495A45 // "SIZE"
+#define TRANSFER_MAGIC_FRAMED 0x5A53495A // "ZSIZ": the run is a sequence of compression frames (see Compress.h)
+#define TRANSFER_MAGIC_MANIFEST 0x4D53495A // "MSIZ": the run starts with chunk hashes, the receiver asks for chunks (see Manifest.h)
+#define TRANSFER_MAGIC_LATENCY 0x4C53495A // "LSIZ": the run is requests the receiver answers (see Latency.h)
+#define TRANSFER_MAGIC_SHARED 0x4853495A // "HSIZ": the bytes of the file go through a shared memory ring (see Shm_Ring.h)
+#define TRANSFER_HEADER_SIZE 12
+// Chunks a sender prefetches ahead of the network, peak memory is this many chunk buffers
+#define TRANSFER_RING_SLOTS 4
+
+// How the bytes of a run travel after its header
+typedef enum
+{
+    TRANSFER_PLAIN,       // the bytes of the file, in order
+    TRANSFER_FRAMED,      // compression frames
+    TRANSFER_MANIFEST,    // a manifest, then the chunks the receiver asks for
+    TRANSFER_LATENCY,     // a latency header, then requests and responses of a fixed size
+    TRANSFER_SHARED       // a ring offer, then the bytes of the file in order through the ring
+} TransferMode;
+
+// Sender side: what to send in every run
+typedef struct
+{
+    uint64_t size;        // bytes per run, 0 for the whole input file (or TRANSFER_DEFAULT_SIZE)
+    const char *path;     // input file, NULL to send generated payload
+    PayloadOptions payload;
+} TransferOptions;
+
+// Produces the bytes of a run at any offset, safe to read from several threads
+typedef struct
+{
+    int fd;               // input file, -1 for the payload generator
+    uint64_t size;
+    PayloadOptions payload;
+} TransferSource;
+
+// Prefetches the chunks of one run into a fixed ring of buffers on a producer thread
+typedef struct
+{
+    TransferSource *source;
+    uint64_t offset;      // the range of the source being read
+    uint64_t length;
+    size_t chunk_size;
+    char *slots[TRANSFER_RING_SLOTS];
+    size_t lengths[TRANSFER_RING_SLOTS];
+    uint64_t chunks;      // chunks in the run
+    uint64_t produced;    // chunks filled by the producer
+    uint64_t consumed;    // chunks handed back by the consumer
+    int holding;          // the consumer holds slot `consumed`
+    int stop;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} TransferReader;
+
+// Receiver side: where the bytes of every run go
+typedef struct
+{
+    int fd;
+    uint64_t offset;
+} TransferSink;
+
+// Function declarations
+long long transfer_parse_size(const char *text);
+void transfer_options_defaults(TransferOptions *options);
+int transfer_parse_arg(TransferOptions *options, int argc, char *argv[], int *index);
+void transfer_usage(FILE *out);
+void transfer_encode_header(uint64_t size, TransferMode mode, unsigned char *out);
+int transfer_decode_header(const unsigned char *in, size_t length, uint64_t *size, TransferMode *mode);
+int transfer_source_open(TransferSource *source, const TransferOptions *options);
+int transfer_source_read(TransferSource *source, uint64_t offset, char *buffer, size_t length);
+void transfer_source_close(TransferSource *source);
+int transfer_reader_start(TransferReader *reader, TransferSource *source, uint64_t offset, uint64_t length,
+                          size_t chunk_size);
+const char *transfer_reader_next(TransferReader *reader, size_t *length);
+int transfer_reader_stop(TransferReader *reader);
+int transfer_sink_open(TransferSink *sink, const char *path);
+void transfer_sink_begin(TransferSink *sink);
+void transfer_sink_resize(TransferSink *sink, uint64_t size);
+int transfer_sink_write(TransferSink *sink, const char *buffer, size_t length);
+void transfer_sink_close(TransferSink *sink);
+
+#endif
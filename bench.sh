@@ -0,0 +1,158 @@
+#!/usr/bin/env bash
+#
+# Non-interactive benchmark driver for TCP reno, TCP cubic and RUDP.
+#
+# Every (transport, size, impairment) cell launches one receiver/sender pair, the sender
+# sends the file REPS times with -runs and the per run results are parsed from the
+# receiver's statistics block. Results go to:
+#   $OUT/runs.csv      one line per run
+#   $OUT/summary.csv   mean, standard deviation and 95% confidence interval per cell
+#   $OUT/summary.json  the same as JSON
+#
+# Impairments other than "none" run the pair in two private network namespaces joined by a
+# veth pair with a netem qdisc on both ends, which needs root and the sch_netem module.
+# Cells that cannot be set up are skipped with a warning.
+#
+# Settings (environment variables):
+#   TRANSPORTS   default "reno cubic rudp"
+#   SIZES        default "2M", bytes per run passed to the senders as -size, e.g. "64K 2M 1G"
+#   REPS         runs per cell, default 5
+#   IMPAIRMENTS  netem arguments separated by ';', default "none"
+#                e.g. "none;delay 10ms;loss 1%;delay 10ms reorder 25% 50%"
+#   OUT          output directory, default bench_results
+#   PORT         first port to use, default 6000
+#   TIMEOUT      seconds before a pair is killed, default 120
+#   RUDP_IMPAIR  passed through to the rudp tools, in-process impairments that need no netem (see RUDP_Impair.h)
+
+set -u
+
+TRANSPORTS=${TRANSPORTS:-"reno cubic rudp"}
+SIZES=${SIZES:-"2M"}
+REPS=${REPS:-5}
+IMPAIRMENTS=${IMPAIRMENTS:-"none"}
+OUT=${OUT:-bench_results}
+PORT=${PORT:-6000}
+TIMEOUT=${TIMEOUT:-120}
+
+NS_SND=rudpbench_snd
+NS_RCV=rudpbench_rcv
+ADDR_SND=10.213.0.1
+ADDR_RCV=10.213.0.2
+
+cd "$(dirname "$0")" || exit 1
+mkdir -p "$OUT/logs"
+echo "transport,size,impairment,run,time_ms,speed_mbs" > "$OUT/runs.csv"
+
+cleanup_netns() {
+    ip netns del "$NS_SND" 2>/dev/null
+    ip netns del "$NS_RCV" 2>/dev/null
+}
+trap cleanup_netns EXIT
+
+# Creates the namespace pair with the given netem arguments, returns non-zero if impossible.
+setup_netns() {
+    local netem=$1
+    cleanup_netns
+    [ "$(id -u)" -eq 0 ] || { echo "warning: impairments need root" >&2; return 1; }
+    ip netns add "$NS_SND" && ip netns add "$NS_RCV" &&
+        ip link add rb_snd type veth peer name rb_rcv &&
+        ip link set rb_snd netns "$NS_SND" && ip link set rb_rcv netns "$NS_RCV" &&
+        ip -n "$NS_SND" addr add "$ADDR_SND/24" dev rb_snd && ip -n "$NS_RCV" addr add "$ADDR_RCV/24" dev rb_rcv &&
+        ip -n "$NS_SND" link set rb_snd up && ip -n "$NS_RCV" link set rb_rcv up &&
+        ip -n "$NS_SND" link set lo up && ip -n "$NS_RCV" link set lo up || return 1
+    # shellcheck disable=SC2086
+    if ! ip netns exec "$NS_SND" tc qdisc add dev rb_snd root netem $netem ||
+        ! ip netns exec "$NS_RCV" tc qdisc add dev rb_rcv root netem $netem; then
+        echo "warning: netem '$netem' is not available" >&2
+        return 1
+    fi
+    return 0
+}
+
+# Runs one receiver/sender pair and appends the receiver's per run results to runs.csv.
+run_cell() {
+    local transport=$1 size=$2 impairment=$3 label=$4
+    local ns_snd="" ns_rcv="" ip=127.0.0.1 log="$OUT/logs/${transport}_${size}_${label}"
+    local receiver sender
+
+    if [ "$impairment" != "none" ]; then
+        ns_snd="ip netns exec $NS_SND"
+        ns_rcv="ip netns exec $NS_RCV"
+        ip=$ADDR_RCV
+    fi
+    if [ "$transport" = rudp ]; then
+        receiver="./RUDP_Receiver -p $PORT"
+        sender="./RUDP_Sender -ip $ip -p $PORT -runs $REPS -size $size"
+    else
+        receiver="./TCP_Reciver -p $PORT -algo $transport"
+        sender="./TCP_Sender -ip $ip -p $PORT -algo $transport -runs $REPS -size $size"
+    fi
+
+    # shellcheck disable=SC2086
+    timeout "$TIMEOUT" $ns_rcv $receiver > "$log.receiver.txt" 2>&1 &
+    local receiver_pid=$!
+    sleep 0.3
+    # shellcheck disable=SC2086
+    timeout "$TIMEOUT" $ns_snd $sender > "$log.sender.txt" 2>&1 < /dev/null
+    wait "$receiver_pid"
+    local status=$?
+    PORT=$((PORT + 1))
+
+    if [ "$status" -ne 0 ]; then
+        echo "warning: $transport/$size/$label failed (status $status), see $log.*.txt" >&2
+    fi
+    # "- Run #1 Data: Time=3.43ms; Speed=582.39MB/s; ..." from the final statistics block
+    sed -n '/\* Statistics \*/,$p' "$log.receiver.txt" |
+        sed -n 's/^- Run #\([0-9]*\) Data: Time=\([0-9.]*\)ms; Speed=\([0-9.]*\)MB\/s.*/\1,\2,\3/p' |
+        while IFS=, read -r run time speed; do
+            echo "$transport,$size,\"$impairment\",$run,$time,$speed" >> "$OUT/runs.csv"
+        done
+}
+
+IFS=';' read -r -a impairment_list <<< "$IMPAIRMENTS"
+for impairment in "${impairment_list[@]}"; do
+    impairment=$(echo "$impairment" | xargs)
+    label=$(echo "$impairment" | tr -c 'a-zA-Z0-9.%\n' '_')
+    if [ "$impairment" != "none" ] && ! setup_netns "$impairment"; then
+        echo "warning: skipping impairment '$impairment'" >&2
+        continue
+    fi
+    for size in $SIZES; do
+        for transport in $TRANSPORTS; do
+            echo "== $transport size=$size impairment='$impairment' reps=$REPS"
+            run_cell "$transport" "$size" "$impairment" "$label"
+        done
+    done
+    cleanup_netns
+done
+
+# Mean, sample standard deviation and a Student-t 95% confidence interval per cell.
+awk -F, -v csv="$OUT/summary.csv" -v json="$OUT/summary.json" '
+function t95(df) {
+    split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 2.093 2.086 2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042", t, " ")
+    return df < 1 ? 0 : (df <= 30 ? t[df] : 1.96)
+}
+NR > 1 {
+    key = $1 "," $2 "," $3
+    if (!(key in n)) order[++cells] = key
+    n[key]++; speed[key] += $6; speed2[key] += $6 * $6; time[key] += $5
+}
+END {
+    print "transport,size,impairment,runs,mean_time_ms,mean_speed_mbs,stddev_speed,ci95_low,ci95_high" > csv
+    printf "[" > json
+    for (i = 1; i <= cells; i++) {
+        key = order[i]; count = n[key]
+        mean = speed[key] / count
+        var = count > 1 ? (speed2[key] - count * mean * mean) / (count - 1) : 0
+        sd = var > 0 ? sqrt(var) : 0
+        half = count > 1 ? t95(count - 1) * sd / sqrt(count) : 0
+        printf "%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n", key, count, time[key] / count, mean, sd, mean - half, mean + half > csv
+        split(key, f, ",")
+        gsub(/"/, "", f[3])
+        printf "%s\n  {\"transport\": \"%s\", \"size\": \"%s\", \"impairment\": \"%s\", \"runs\": %d, \"mean_time_ms\": %.3f, \"mean_speed_mbs\": %.3f, \"stddev_speed\": %.3f, \"ci95\": [%.3f, %.3f]}", (i > 1 ? "," : ""), f[1], f[2], f[3], count, time[key] / count, mean, sd, mean - half, mean + half > json
+    }
+    print "\n]" > json
+}' "$OUT/runs.csv"
+
+echo "Results: $OUT/runs.csv $OUT/summary.csv $OUT/summary.json"
+cat "$OUT/summary.csv"